@@ -38,6 +38,230 @@ class WriteRequest(object):
     def write(self):
         return struct.pack(WriteRequest.FORMAT, self.request, self.data)
 
+class ClockRequest(object):
+    """
+    Request to set the SWD clock frequency
+    """
+    FORMAT = "I"
+    def __init__(self, hz):
+        #frequencies are decimal unless prefixed, unlike addresses and data
+        if isinstance(hz, str):
+            hz = int(hz, 0)
+        self.hz = hz
+    def write(self):
+        return struct.pack(ClockRequest.FORMAT, self.hz)
+
+class ClockResult(object):
+    """
+    SWD clock frequency achieved by the adapter
+    """
+    FORMAT = "I"
+    @staticmethod
+    def read(arr):
+        data = struct.unpack(ClockResult.FORMAT, arr)
+        return ClockResult(data[0])
+    def __init__(self, hz):
+        self.hz = hz
+    def __str__(self):
+        return "Clock: {0}Hz".format(self.hz)
+
+class MemRequest(object):
+    """
+    Request for a MEM-AP block read or write
+    """
+    FORMAT = "II"
+    def __init__(self, addr, count):
+        #counts are decimal unless prefixed, unlike addresses
+        if isinstance(count, str):
+            count = int(count, 0)
+        self.addr = to_number(addr)
+        self.count = count
+    def write(self):
+        return struct.pack(MemRequest.FORMAT, self.addr, self.count)
+
+class TuneRequest(object):
+    """
+    Request to tune the SWD clock
+    """
+    FORMAT = "IIII"
+    ON_CONNECT = 0x01
+    def __init__(self, min_hz, max_hz, ram_addr=0, on_connect=False):
+        #frequencies are decimal unless prefixed, unlike addresses
+        if isinstance(min_hz, str):
+            min_hz = int(min_hz, 0)
+        if isinstance(max_hz, str):
+            max_hz = int(max_hz, 0)
+        self.min_hz = min_hz
+        self.max_hz = max_hz
+        self.ram_addr = to_number(ram_addr)
+        self.flags = TuneRequest.ON_CONNECT if on_connect else 0
+    def write(self):
+        return struct.pack(TuneRequest.FORMAT, self.min_hz, self.max_hz,
+            self.ram_addr, self.flags)
+
+class BusStats(object):
+    """
+    Bus error and transaction counters
+    """
+    FORMAT = "IIIIIIIII"
+    @staticmethod
+    def read(arr):
+        return BusStats(*struct.unpack(BusStats.FORMAT, arr))
+    def __init__(self, transactions, wait, fault, protocol, parity, retries,
+            isr_calls, isr_cycles, isr_cycles_max):
+        self.transactions = transactions
+        self.wait = wait
+        self.fault = fault
+        self.protocol = protocol
+        self.parity = parity
+        self.retries = retries
+        self.isr_calls = isr_calls
+        self.isr_cycles = isr_cycles
+        self.isr_cycles_max = isr_cycles_max
+    def __str__(self):
+        return "Stats:\nTransactions: {0}\nWait: {1}\nFault: {2}\n"\
+            "Protocol: {3}\nParity: {4}\nRetries: {5}\n"\
+            "ISR cycles: {6} avg, {7} max"\
+            .format(self.transactions, self.wait, self.fault, self.protocol,
+            self.parity, self.retries, self.isr_cycles // max(self.isr_calls, 1),
+            self.isr_cycles_max)
+
+class ProgramRequest(object):
+    """
+    Request to run the program in the adapter's program buffer, with the
+    values for r0 to r3 and the number of instructions uploaded
+    """
+    FORMAT = "<5I"
+    def __init__(self, length, args=()):
+        args = [to_number(a) for a in args][:4]
+        self.args = args + [0] * (4 - len(args))
+        self.length = length
+    def write(self):
+        return struct.pack(ProgramRequest.FORMAT, *(self.args + [self.length]))
+
+class BusConfig(object):
+    """
+    Bus behaviour which can be changed at runtime
+    """
+    FORMAT = "BxHHH"
+    @staticmethod
+    def read(arr):
+        return BusConfig(*struct.unpack(BusConfig.FORMAT, arr))
+    def __init__(self, parity_retries, wait_retries, wait_idle, wait_idle_max):
+        self.parity_retries = parity_retries
+        self.wait_retries = wait_retries
+        self.wait_idle = wait_idle
+        self.wait_idle_max = wait_idle_max
+    def write(self):
+        return struct.pack(BusConfig.FORMAT, self.parity_retries,
+            self.wait_retries, self.wait_idle, self.wait_idle_max)
+    def __str__(self):
+        return "Config:\nParity retries: {0}\nWait retries: {1}\n"\
+            "Wait idle cycles: {2} to {3}".format(self.parity_retries,
+            self.wait_retries, self.wait_idle, self.wait_idle_max)
+
+class Batch(object):
+    """
+    Batch of ops for the bulk OUT endpoint
+    """
+    VERSION = 1
+    HEADER = "<BBHHH"
+    MAX = 1024
+    MAX_OPS = 128
+    OP_READ = 0x01
+    OP_WRITE = 0x02
+    OP_READ_BLOCK = 0x03
+    OP_WRITE_BLOCK = 0x04
+    OP_DELAY = 0x05
+    OP_POLL = 0x06
+    OP_CONNECT = 0x07
+    def __init__(self, tag=0):
+        self.tag = tag
+        self.ops = [] #(op, data words returned)
+        self.__body = b""
+    def __add(self, op, data, words=0):
+        self.ops.append((op, words))
+        self.__body += struct.pack("<B", op) + data
+        return self
+    def read(self, request):
+        return self.__add(Batch.OP_READ, struct.pack("<B", to_number(request)), 1)
+    def write(self, request, data):
+        return self.__add(Batch.OP_WRITE, struct.pack("<BI",
+            to_number(request), to_number(data)))
+    def read_block(self, addr, count):
+        return self.__add(Batch.OP_READ_BLOCK, struct.pack("<IH",
+            to_number(addr), count), count)
+    def write_block(self, addr, words):
+        data = struct.pack("<IH", to_number(addr), len(words))
+        #the words start on a word boundary from the start of the batch
+        pad = -(struct.calcsize(Batch.HEADER) + len(self.__body) + 1 + len(data)) % 4
+        data += b"\0" * pad + struct.pack("<{0}I".format(len(words)),
+            *[to_number(w) for w in words])
+        return self.__add(Batch.OP_WRITE_BLOCK, data)
+    def delay(self, us):
+        return self.__add(Batch.OP_DELAY, struct.pack("<H", us))
+    def poll(self, addr, mask, expect, attempts, timeout_ms=0):
+        return self.__add(Batch.OP_POLL, struct.pack("<IIIHH", to_number(addr),
+            to_number(mask), to_number(expect), attempts, timeout_ms), 2)
+    def connect(self):
+        return self.__add(Batch.OP_CONNECT, b"")
+    def pack(self):
+        return struct.pack(Batch.HEADER, Batch.VERSION, self.tag & 0xff,
+            struct.calcsize(Batch.HEADER) + len(self.__body), len(self.ops),
+            0) + self.__body
+
+class BatchResult(object):
+    """
+    Result of a batch from the bulk IN endpoint. Each op has a result and the
+    data words it returned.
+    """
+    HEADER = "<BBHHH"
+    SKIPPED = 1
+    NO_FAILURE = 0xffff
+    @staticmethod
+    def read(arr, batch):
+        arr = bytes(arr)
+        version, tag, length, count, failed = struct.unpack_from(
+            BatchResult.HEADER, arr)
+        size = struct.calcsize(BatchResult.HEADER)
+        acks = struct.unpack_from("<{0}b".format(count), arr, size)
+        pos = (size + count + 3) & ~0x3
+        words = struct.unpack_from("<{0}I".format((length - pos) // 4), arr, pos)
+        ops = []
+        i = 0
+        for j, ack in enumerate(acks):
+            #a batch which was refused returns no data at all
+            n = batch.ops[j][1] if words else 0
+            ops.append((ack, list(words[i:i + n])))
+            i += n
+        return BatchResult(tag, failed, ops)
+    def __init__(self, tag, failed, ops):
+        self.tag = tag
+        self.failed = None if failed == BatchResult.NO_FAILURE else failed
+        self.ops = ops
+    def __str__(self):
+        return "Tag: {0} Failed: {1}\n".format(self.tag, self.failed) +\
+            "\n".join("{0}: Result: {1} Data: {2}".format(i, ack,
+            " ".join("{0:08x}".format(w) for w in words))
+            for i, (ack, words) in enumerate(self.ops))
+
+class Completion(object):
+    """
+    Record for a finished command, from the notification endpoint or the read
+    completions request
+    """
+    FORMAT = "<HBbI"
+    SIZE = struct.calcsize(FORMAT)
+    @staticmethod
+    def read_all(arr):
+        return [Completion(*struct.unpack_from(Completion.FORMAT, arr, i))
+            for i in range(0, len(arr) - Completion.SIZE + 1, Completion.SIZE)]
+    def __init__(self, sequence, tag, result, data):
+        self.sequence = sequence
+        self.tag = tag
+        self.result = result
+        self.data = data
+
 class CommandResult(object):
     """
     Result of an SWD command
@@ -0,0 +1,90 @@
+"""
+Transport to the virtual adapter run by the simulator's daemon (see
+sim/sim_daemon.c), which stands in for the pyusb device
+
+The daemon is reached through a Unix domain socket and takes the same
+control, bulk and interrupt transfers the adapter takes over USB. A
+SocketDevice has the methods of a pyusb device which SWDAdapter uses and
+raises the same errors, so the rest of the host doesn't know the
+difference.
+"""
+
+import array, errno, socket, struct
+import usb.core
+
+CONTROL = 0
+IN = 1
+OUT = 2
+
+NAK = -1
+STALL = -2
+
+class SocketDevice(object):
+    """
+    Virtual adapter on the daemon's socket
+    """
+    PATH = "/tmp/teensy-swd.sock"
+    MSG_FORMAT = "<BBBxHHH"
+    RESULT_FORMAT = "<h"
+    MAX = 4096
+    manufacturer = "kevincuzner.com"
+    product = "SWD Adaptor"
+    def __init__(self, path=PATH):
+        """
+        Connects to the daemon
+        """
+        self.__sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.__sock.connect(path)
+    def close(self):
+        self.__sock.close()
+    def __recv(self, length):
+        """
+        Receives exactly length bytes
+        """
+        buf = b""
+        while len(buf) < length:
+            chunk = self.__sock.recv(length - len(buf))
+            if not chunk:
+                raise usb.core.USBError("Daemon went away", errno=errno.EIO)
+            buf += chunk
+        return buf
+    def __transfer(self, kind, type, request, value, index, length, data=b"", read=False):
+        """
+        Runs a transfer through the daemon, returning the data of an IN
+        transfer or the bytes sent
+        """
+        if length > SocketDevice.MAX:
+            raise ValueError("Transfers are at most {0} bytes".format(SocketDevice.MAX))
+        self.__sock.sendall(struct.pack(SocketDevice.MSG_FORMAT,
+            kind, type, request, value, index, length) + data)
+        result, = struct.unpack(SocketDevice.RESULT_FORMAT, self.__recv(2))
+        if result == STALL:
+            raise usb.core.USBError("Pipe error", errno=errno.EPIPE)
+        if result == NAK:
+            raise usb.core.USBTimeoutError("Operation timed out", errno=errno.ETIMEDOUT)
+        if read:
+            return array.array("B", self.__recv(result))
+        return result
+    @staticmethod
+    def __timeout(timeout):
+        return min(int(timeout if timeout is not None else 1000), 0xffff)
+    def set_configuration(self):
+        """
+        Sets the configuration, which starts the adapter's records over
+        """
+        self.ctrl_transfer(0x00, 9, wValue=1)
+    def ctrl_transfer(self, bmRequestType, bRequest, wValue=0, wIndex=0,
+            data_or_wLength=None, timeout=None):
+        if bmRequestType & 0x80:
+            return self.__transfer(CONTROL, bmRequestType, bRequest, wValue,
+                wIndex, data_or_wLength or 0, read=True)
+        data = bytes(bytearray(data_or_wLength or b""))
+        return self.__transfer(CONTROL, bmRequestType, bRequest, wValue,
+            wIndex, len(data), data)
+    def read(self, endpoint, size_or_buffer, timeout=None):
+        return self.__transfer(IN, endpoint, 0, self.__timeout(timeout), 0,
+            size_or_buffer, read=True)
+    def write(self, endpoint, data, timeout=None):
+        data = bytes(bytearray(data))
+        return self.__transfer(OUT, endpoint, 0, self.__timeout(timeout), 0,
+            len(data), data)
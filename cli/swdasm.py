@@ -0,0 +1,497 @@
+#!/usr/bin/env python3
+"""
+Assembler for the adapter's program interpreter, and a simulator which runs
+programs against a simulated DAP so they can be tried without an adapter
+
+The instruction set is described in include/swd_vm.h. Source looks like:
+
+    .equ FLAG, 0x20000ffc
+    start:
+        li r1, FLAG         ; li loads any 32-bit value
+        ldi r2, 1
+        li r3, 1000 | 50 << 16
+        poll r1, r2, r2, r3 ; 1000 attempts or 50ms
+        jnz status, fail
+        halt
+    fail:
+        exit status
+
+Registers are r0 to r15. status is r15 and data is r14. Immediates are
+numbers, labels, names defined with .equ, or request names for read and
+write: idcode, abort, ctrlstat, select, resend, rdbuff, csw, tar, drw, or
+dp0-dp3 and ap0-ap3 for any register by its address / 4.
+"""
+
+import sys, struct, argparse
+
+HALT = 0x00
+EXIT = 0x01
+JMP = 0x02
+JZ = 0x03
+JNZ = 0x04
+JEQ = 0x05
+JNE = 0x06
+JLO = 0x07
+DJNZ = 0x08
+CALL = 0x09
+RET = 0x0a
+LDI = 0x10
+LDIH = 0x11
+MOV = 0x12
+ADDI = 0x13
+ADD = 0x14
+SUB = 0x15
+AND = 0x16
+OR = 0x17
+XOR = 0x18
+SHL = 0x19
+SHR = 0x1a
+LDW = 0x1b
+STW = 0x1c
+READ = 0x20
+WRITE = 0x21
+MREAD = 0x22
+MWRITE = 0x23
+POLL = 0x24
+CONNECT = 0x25
+DELAY = 0x26
+
+REGISTERS = 16
+STATUS = 15
+DATA = 14
+CALL_DEPTH = 8
+PROGRAM_WORDS = 256
+
+SWD_OK = 0
+SWD_ERR = -1
+SWD_ERR_FAULT = -4
+SWD_ERR_TIMEOUT = -7
+
+#operand kinds of each mnemonic: r is a register, i an immediate
+OPERANDS = {
+    "halt": (HALT, ""),
+    "exit": (EXIT, "r"),
+    "jmp": (JMP, "i"),
+    "jz": (JZ, "ri"),
+    "jnz": (JNZ, "ri"),
+    "jeq": (JEQ, "rri"),
+    "jne": (JNE, "rri"),
+    "jlo": (JLO, "rri"),
+    "djnz": (DJNZ, "ri"),
+    "call": (CALL, "i"),
+    "ret": (RET, ""),
+    "ldi": (LDI, "ri"),
+    "ldih": (LDIH, "ri"),
+    "mov": (MOV, "rr"),
+    "addi": (ADDI, "rri"),
+    "add": (ADD, "rrr"),
+    "sub": (SUB, "rrr"),
+    "and": (AND, "rrr"),
+    "or": (OR, "rrr"),
+    "xor": (XOR, "rrr"),
+    "shl": (SHL, "rrr"),
+    "shr": (SHR, "rrr"),
+    "ldw": (LDW, "rri"),
+    "stw": (STW, "rri"),
+    "read": (READ, "ri"),
+    "write": (WRITE, "ri"),
+    "mread": (MREAD, "rrr"),
+    "mwrite": (MWRITE, "rrr"),
+    "poll": (POLL, "rrrr"),
+    "connect": (CONNECT, ""),
+    "delay": (DELAY, "i"),
+}
+
+def request(ap, read, addr):
+    """
+    Builds a request byte as SWD_REQUEST does
+    """
+    r = (0x02 if ap else 0) | (0x04 if read else 0) | ((addr & 0x3) << 3)
+    parity = ((r >> 1) ^ (r >> 2) ^ (r >> 3) ^ (r >> 4)) & 1
+    return r | 0x01 | 0x80 | (0x20 if parity else 0)
+
+#register addresses / 4 of the request names
+DP_NAMES = {"idcode": 0, "abort": 0, "ctrlstat": 1, "select": 2, "resend": 2, "rdbuff": 3}
+AP_NAMES = {"csw": 0, "tar": 1, "drw": 3}
+
+def encode(op, a=0, b=0, imm=0):
+    return op | (a << 8) | (b << 12) | ((imm & 0xffff) << 16)
+
+class AsmError(Exception):
+    def __init__(self, line, msg):
+        Exception.__init__(self, "line {0}: {1}".format(line, msg))
+
+class Assembler(object):
+    """
+    Two pass assembler. The first pass finds the labels and the second one
+    emits the instructions.
+    """
+    def __init__(self):
+        self.symbols = {}
+    def assemble(self, source):
+        lines = []
+        for n, line in enumerate(source.splitlines(), 1):
+            line = line.split(";")[0].split("#")[0].strip()
+            while ":" in line:
+                label, line = line.split(":", 1)
+                lines.append((n, label.strip() + ":"))
+                line = line.strip()
+            if line:
+                lines.append((n, line))
+        #first pass: lay out the labels
+        pc = 0
+        sizes = []
+        for n, line in lines:
+            if line.endswith(":"):
+                self.__define(n, line[:-1], pc)
+            elif line.startswith(".equ"):
+                name, value = [s.strip() for s in line[4:].split(",", 1)]
+                self.__define(n, name, self.__value(n, value))
+            else:
+                sizes.append(self.__size(n, line))
+                pc += sizes[-1]
+        #second pass: emit, keeping the sizes the labels were laid out with
+        words = []
+        for n, line in lines:
+            if line.endswith(":") or line.startswith(".equ"):
+                continue
+            words += self.__emit(n, line, sizes.pop(0))
+        if len(words) > PROGRAM_WORDS:
+            raise AsmError(lines[-1][0], "program is longer than {0} words".format(PROGRAM_WORDS))
+        return words
+    def __define(self, n, name, value):
+        if name in self.symbols or name.lower() in OPERANDS:
+            raise AsmError(n, "{0} is already defined".format(name))
+        self.symbols[name] = value
+    def __split(self, line):
+        parts = line.split(None, 1)
+        args = [a.strip() for a in parts[1].split(",")] if len(parts) > 1 else []
+        return parts[0].lower(), args
+    def __size(self, n, line):
+        mnemonic, args = self.__split(line)
+        if mnemonic == "li":
+            #a forward reference might need the upper half
+            try:
+                return 1 if self.__value(n, args[1]) <= 0xffff else 2
+            except AsmError:
+                return 2
+        if mnemonic == ".word":
+            return len(args)
+        return 1
+    def __register(self, n, arg):
+        arg = arg.lower()
+        if arg == "status":
+            return STATUS
+        if arg == "data":
+            return DATA
+        if arg.startswith("r") and arg[1:].isdigit() and int(arg[1:]) < REGISTERS:
+            return int(arg[1:])
+        raise AsmError(n, "{0} is not a register".format(arg))
+    def __value(self, n, arg, mnemonic=None):
+        name = arg.lower()
+        if mnemonic in ("read", "write"):
+            if name in DP_NAMES:
+                return request(False, mnemonic == "read", DP_NAMES[name])
+            if name in AP_NAMES:
+                return request(True, mnemonic == "read", AP_NAMES[name])
+            if name[:2] in ("dp", "ap") and name[2:].isdigit():
+                return request(name[:2] == "ap", mnemonic == "read", int(name[2:]))
+        try:
+            #expressions of numbers and symbols, such as FLAG + 4
+            return eval(arg, {"__builtins__": {}}, self.symbols) & 0xffffffff
+        except Exception:
+            raise AsmError(n, "can't evaluate {0}".format(arg))
+    def __emit(self, n, line, size):
+        mnemonic, args = self.__split(line)
+        if mnemonic == ".word":
+            return [self.__value(n, a) for a in args]
+        if mnemonic == "li":
+            if len(args) != 2:
+                raise AsmError(n, "li takes a register and a value")
+            a = self.__register(n, args[0])
+            value = self.__value(n, args[1])
+            words = [encode(LDI, a, imm=value & 0xffff)]
+            if size == 2:
+                words.append(encode(LDIH, a, imm=value >> 16))
+            return words
+        if mnemonic not in OPERANDS:
+            raise AsmError(n, "unknown instruction {0}".format(mnemonic))
+        op, kinds = OPERANDS[mnemonic]
+        if len(args) != len(kinds):
+            raise AsmError(n, "{0} takes {1} operands".format(mnemonic, len(kinds)))
+        regs = [self.__register(n, a) for a, k in zip(args, kinds) if k == "r"]
+        imm = [self.__value(n, a, mnemonic) for a, k in zip(args, kinds) if k == "i"]
+        if imm:
+            value = imm[0]
+            if mnemonic == "addi" and not (value <= 0x7fff or value >= 0xffff8000):
+                raise AsmError(n, "addi takes a 16-bit signed value")
+            if mnemonic != "addi" and value > 0xffff:
+                raise AsmError(n, "{0} takes a 16-bit value".format(mnemonic))
+            imm = value
+        else:
+            #the third and fourth registers go in the immediate
+            imm = 0
+            for i, r in enumerate(regs[2:]):
+                imm |= r << (i * 4)
+        regs += [0] * (2 - min(len(regs), 2))
+        return [encode(op, regs[0], regs[1], imm)]
+
+def assemble(source):
+    """
+    Assembles source text into a list of instruction words
+    """
+    return Assembler().assemble(source)
+
+def pack(words):
+    """
+    Packs instruction words for the program buffer
+    """
+    return struct.pack("<{0}I".format(len(words)), *words)
+
+class SimDap(object):
+    """
+    Simulated debug port with one MEM-AP in front of a sparse memory. AP reads
+    are posted and come back through RDBUFF as they do on a real target.
+    Writes to an address in hooks call hooks[addr](dap, value) afterwards, so
+    a flash stub can be faked.
+    """
+    IDCODE = 0x2ba01477
+    def __init__(self):
+        self.mem = {}
+        self.hooks = {}
+        self.faults = set() #addresses which FAULT
+        self.ctrlstat = 0
+        self.select = 0
+        self.rdbuff = 0
+        self.csw = 0x00000042
+        self.tar = 0
+        self.reads = 0
+    def read_mem(self, addr):
+        self.reads += 1
+        return self.mem.get(addr & ~0x3, 0)
+    def write_mem(self, addr, value):
+        self.mem[addr & ~0x3] = value & 0xffffffff
+        if addr in self.hooks:
+            self.hooks[addr](self, value)
+    def __increment(self):
+        if (self.csw >> 4) & 0x3 == 1:
+            self.tar = (self.tar & ~0x3ff) | ((self.tar + 4) & 0x3ff)
+    def transfer(self, req, data=0):
+        """
+        Performs a transaction, returning (result, data)
+        """
+        ap, read, addr = req & 0x02, req & 0x04, (req >> 3) & 0x3
+        if not ap:
+            if read:
+                return SWD_OK, [SimDap.IDCODE, self.ctrlstat, self.rdbuff, self.rdbuff][addr]
+            if addr == 1:
+                #power up requests are acknowledged straight away
+                self.ctrlstat = data | ((data & 0x50000000) << 1)
+            elif addr == 2:
+                self.select = data
+            return SWD_OK, 0
+        if addr == 0:
+            if read:
+                return SWD_OK, self.__post(self.csw)
+            self.csw = data
+            return SWD_OK, 0
+        if addr == 1:
+            if read:
+                return SWD_OK, self.__post(self.tar)
+            self.tar = data
+            return SWD_OK, 0
+        if addr == 3:
+            if self.tar & ~0x3 in self.faults:
+                return SWD_ERR_FAULT, 0
+            if read:
+                value = self.read_mem(self.tar)
+                self.__increment()
+                return SWD_OK, self.__post(value)
+            self.write_mem(self.tar, data)
+            self.__increment()
+            return SWD_OK, 0
+        return SWD_OK, self.__post(0) if read else 0
+    def __post(self, value):
+        previous, self.rdbuff = self.rdbuff, value
+        return previous
+
+class Simulator(object):
+    """
+    Runs programs the way swd_vm.c does, with the commands going to a SimDap
+    """
+    def __init__(self, dap=None, buffer_words=256):
+        self.dap = dap if dap is not None else SimDap()
+        self.buffer = [0] * buffer_words
+        self.r = [0] * REGISTERS
+        self.steps = 0
+    def run(self, words, entry=0, args=(), max_steps=1000000):
+        """
+        Runs a program, returning (result, data) as the adapter would report
+        them
+        """
+        self.r = [0] * REGISTERS
+        for i, a in enumerate(args[:4]):
+            self.r[i] = a & 0xffffffff
+        stack = []
+        pc = entry
+        while True:
+            if pc >= len(words) or self.steps >= max_steps:
+                self.r[0] = pc
+                return SWD_ERR, pc
+            inst = words[pc]
+            here, pc = pc, pc + 1
+            self.steps += 1
+            op, a, b = inst & 0xff, (inst >> 8) & 0xf, (inst >> 12) & 0xf
+            imm = inst >> 16
+            c, d = imm & 0xf, (imm >> 4) & 0xf
+            r = self.r
+            try:
+                if op == HALT:
+                    return SWD_OK, r[0]
+                elif op == EXIT:
+                    result = r[a] & 0xff
+                    return result - 0x100 if result & 0x80 else result, r[0]
+                elif op == JMP:
+                    pc = imm
+                elif op in (JZ, JNZ):
+                    if (r[a] == 0) == (op == JZ):
+                        pc = imm
+                elif op in (JEQ, JNE):
+                    if (r[a] == r[b]) == (op == JEQ):
+                        pc = imm
+                elif op == JLO:
+                    if r[a] < r[b]:
+                        pc = imm
+                elif op == DJNZ:
+                    r[a] = (r[a] - 1) & 0xffffffff
+                    if r[a]:
+                        pc = imm
+                elif op == CALL:
+                    if len(stack) >= CALL_DEPTH:
+                        raise IndexError
+                    stack.append(pc)
+                    pc = imm
+                elif op == RET:
+                    pc = stack.pop()
+                elif op == LDI:
+                    r[a] = imm
+                elif op == LDIH:
+                    r[a] = (r[a] & 0xffff) | (imm << 16)
+                elif op == MOV:
+                    r[a] = r[b]
+                elif op == ADDI:
+                    r[a] = (r[b] + (imm - 0x10000 if imm & 0x8000 else imm)) & 0xffffffff
+                elif op in (ADD, SUB, AND, OR, XOR, SHL, SHR):
+                    x, y = r[b], r[c]
+                    r[a] = {ADD: x + y, SUB: x - y, AND: x & y, OR: x | y, XOR: x ^ y,
+                        SHL: x << y if y < 32 else 0, SHR: x >> y if y < 32 else 0}[op] & 0xffffffff
+                elif op == LDW:
+                    r[a] = self.__buffer_word(r[b] + imm)
+                elif op == STW:
+                    self.__buffer_word(r[b] + imm)
+                    self.buffer[r[b] + imm] = r[a]
+                elif op == READ:
+                    self.__status(*self.dap.transfer(imm))
+                    r[a] = r[DATA]
+                elif op == WRITE:
+                    self.__status(*self.dap.transfer(imm, r[a]))
+                elif op in (MREAD, MWRITE):
+                    if r[c] >= len(self.buffer) or r[b] > len(self.buffer) - r[c]:
+                        raise IndexError
+                    self.__status(*self.__block(op == MREAD, r[a], r[b], r[c]))
+                elif op == POLL:
+                    self.__status(*self.__poll(r[a], r[b], r[c], r[d] & 0xffff))
+                elif op == CONNECT:
+                    self.__status(SWD_OK, 0)
+                elif op == DELAY:
+                    pass
+                else:
+                    raise IndexError
+            except IndexError:
+                self.r[0] = here
+                return SWD_ERR, here
+    def __buffer_word(self, index):
+        if index >= len(self.buffer):
+            raise IndexError
+        return self.buffer[index]
+    def __status(self, result, data):
+        self.r[STATUS] = result & 0xffffffff
+        self.r[DATA] = data & 0xffffffff
+    def __block(self, read, addr, count, index):
+        """
+        Moves a block with 32-bit auto-incrementing accesses
+        """
+        if not count:
+            return SWD_ERR, 0
+        self.dap.csw = 0x23000012
+        for i in range(count):
+            self.dap.tar = (addr & ~0x3) + i * 4
+            if read:
+                result, self.buffer[index + i] = self.__word(self.dap.tar)
+            else:
+                result, _ = self.dap.transfer(request(True, False, 3), self.buffer[index + i])
+            if result != SWD_OK:
+                return result, i
+        return SWD_OK, count
+    def __poll(self, addr, mask, expect, attempts):
+        if not attempts:
+            return SWD_ERR, 0
+        self.dap.csw = 0x23000002
+        value = 0
+        for i in range(attempts):
+            result, value = self.__word(addr & ~0x3)
+            if result != SWD_OK:
+                return result, 0
+            if value & mask == expect:
+                return SWD_OK, value
+        #the simulator doesn't keep time, so only the attempts run out
+        return SWD_ERR_TIMEOUT, value
+    def __word(self, addr):
+        self.dap.tar = addr
+        result, _ = self.dap.transfer(request(True, True, 3))
+        if result != SWD_OK:
+            return result, 0
+        return self.dap.transfer(request(False, True, 3))
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("source", help="program source")
+    parser.add_argument("-o", "--output", help="write the assembled program here")
+    parser.add_argument("-s", "--simulate", action="store_true",
+        help="run the program against a simulated DAP")
+    parser.add_argument("-e", "--entry", default="0", help="label or index to start at")
+    parser.add_argument("-a", "--arg", action="append", default=[],
+        help="value for the next of r0 to r3")
+    parser.add_argument("-m", "--mem", action="append", default=[],
+        help="addr=value to put in simulated memory")
+    args = parser.parse_args()
+
+    asm = Assembler()
+    with open(args.source) as f:
+        try:
+            words = asm.assemble(f.read())
+        except AsmError as err:
+            print("{0}: {1}".format(args.source, err), file=sys.stderr)
+            sys.exit(1)
+    if args.output:
+        with open(args.output, "wb") as f:
+            f.write(pack(words))
+    else:
+        for i, w in enumerate(words):
+            print("{0:3}: {1:08x}".format(i, w))
+    if args.simulate:
+        sim = Simulator()
+        for m in args.mem:
+            addr, value = m.split("=")
+            sim.dap.mem[int(addr, 0) & ~0x3] = int(value, 0)
+        entry = asm.symbols.get(args.entry, None)
+        entry = int(args.entry, 0) if entry is None else entry
+        result, data = sim.run(words, entry, [int(a, 0) for a in args.arg])
+        print("Result: {0} Data: {1:08x} Steps: {2}".format(result, data, sim.steps))
+        for i in range(0, REGISTERS, 4):
+            print(" ".join("r{0:<2} {1:08x}".format(j, sim.r[j]) for j in range(i, i + 4)))
+        for addr in sorted(sim.dap.mem):
+            print("{0:08x}: {1:08x}".format(addr, sim.dap.mem[addr]))
+
+if __name__ == "__main__":
+    main()
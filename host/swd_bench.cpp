@@ -0,0 +1,56 @@
+/**
+ * Reads the DP IDCODE over and over to measure how many commands the
+ * adapter gets through with the host library keeping it busy
+ *
+ * Usage: swdbench [reads]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "swd_host.h"
+
+#define IDCODE_REQUEST 0xa5 //DP read of address 0
+
+int main(int argc, char** argv)
+{
+    std::atomic<unsigned> failed(0);
+    std::atomic<uint32_t> idcode(0);
+    unsigned reads = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000;
+    unsigned i;
+
+    std::unique_ptr<swd::Adapter> adapter = swd::Adapter::open();
+    if (!adapter)
+    {
+        fprintf(stderr, "No adapter found\n");
+        return 1;
+    }
+
+    swd::Result res = adapter->connect().get();
+    if (res.result != swd::OK)
+    {
+        fprintf(stderr, "Connect failed: %d\n", res.result);
+        return 1;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (i = 0; i < reads; i++)
+    {
+        adapter->read(IDCODE_REQUEST, [&failed, &idcode](const swd::Result& res)
+            {
+                if (res.result != swd::OK)
+                    failed++;
+                else
+                    idcode = res.data;
+            });
+    }
+    adapter->flush();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("IDCODE %08x\n", (unsigned)idcode);
+    printf("%u reads, %u failed, in %.3f s (%.0f reads/s)\n", reads, (unsigned)failed, elapsed.count(),
+        reads / elapsed.count());
+    return failed ? 1 : 0;
+}
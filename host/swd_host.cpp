@@ -0,0 +1,854 @@
+/**
+ * Native host library for the SWD adapter
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <libusb.h>
+
+#include "swd_host.h"
+#include "usb_types.h"
+
+namespace swd
+{
+
+#define ID_VENDOR 0x16c0
+#define ID_PRODUCT 0x05dc
+#define MANUFACTURER "kevincuzner.com"
+#define PRODUCT "SWD Adaptor"
+
+#define CONTROL_TIMEOUT 1000 //ms
+#define PACKET_WORDS 16 //words in one control request
+#define NOTIFY_TRANSFERS 2 //transfers kept waiting on the notification endpoint
+#define REGISTERS 16
+
+/**
+ * One operation, from being issued until it is called back
+ */
+struct Adapter::Op
+{
+    enum Kind
+    {
+        COMMAND, //begin request with a single record
+        PIPELINED,
+        MEM_READ,
+        MEM_WRITE,
+        PROGRAM,
+        CLOCK //set and get clock requests, which take no tag
+    };
+
+    Op(Kind kind, uint16_t request) :
+        kind(kind), request(request), value(0), count(1), invalid(false), tag(-1), credit(0), serial(0),
+        begun(false), failed(false), finished(false), waiting(0), read_back(0)
+    {
+    }
+
+    /**
+     * Returns true if the op takes a tag and ring entries
+     */
+    bool tagged() const
+    {
+        return kind != CLOCK;
+    }
+
+    /**
+     * Returns true if the op needs the block buffer to itself
+     */
+    bool block() const
+    {
+        return kind == MEM_READ || kind == MEM_WRITE || kind == PROGRAM;
+    }
+
+    Kind kind;
+    uint16_t request; //wRequestAndType of the begin request
+    uint16_t value; //wValue of the begin request
+    std::vector<uint8_t> data; //data stage of the begin request
+    uint16_t count; //records the command produces
+    bool invalid; //true if the op can't be begun at all
+
+    int tag;
+    uint16_t credit; //ring entries charged to the op
+    uint64_t serial; //order the op was begun in
+    bool begun; //true once the adapter accepted the begin request
+    bool failed; //true if a transfer for the op failed
+    bool finished;
+    unsigned waiting; //transfers the op is waiting on
+
+    std::vector<uint32_t> program; //uploaded before the begin request
+    std::vector<uint32_t> buffer; //written to the block buffer before the begin request
+    uint16_t read_back; //words read back from the block buffer afterwards
+
+    std::vector<Result> results;
+    std::vector<uint32_t> registers;
+    std::vector<uint32_t> words;
+
+    std::function<void(const Op&)> done;
+};
+
+/**
+ * A control transfer and what to do once it is done
+ */
+struct Adapter::Transfer
+{
+    Adapter* adapter;
+    std::function<void(int, const uint8_t*, int)> done;
+};
+
+/**
+ * Returns the failed result of an op
+ */
+static Result failure(int8_t result)
+{
+    Result res = { result, 0 };
+    return res;
+}
+
+/**
+ * Appends words to a byte vector, little endian
+ */
+static void append_words(std::vector<uint8_t>& bytes, const uint32_t* words, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        bytes.push_back(words[i] & 0xff);
+        bytes.push_back((words[i] >> 8) & 0xff);
+        bytes.push_back((words[i] >> 16) & 0xff);
+        bytes.push_back(words[i] >> 24);
+    }
+}
+
+/**
+ * Reads a little endian word
+ */
+static uint32_t read_word(const uint8_t* bytes)
+{
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+/**
+ * Returns true if a string descriptor of a device matches
+ */
+static bool string_matches(libusb_device_handle* handle, uint8_t index, const char* expected)
+{
+    unsigned char str[128];
+    int length;
+
+    if (!index)
+        return false;
+    length = libusb_get_string_descriptor_ascii(handle, index, str, sizeof(str));
+    return length >= 0 && (size_t)length == strlen(expected) && !memcmp(str, expected, length);
+}
+
+std::unique_ptr<Adapter> Adapter::open(libusb_context* ctx)
+{
+    libusb_context* own_ctx = NULL;
+    libusb_device** devs;
+    libusb_device_handle* handle = NULL;
+    libusb_device_descriptor desc;
+    ssize_t count, i;
+
+    if (!ctx)
+    {
+        if (libusb_init(&own_ctx))
+            return std::unique_ptr<Adapter>();
+        ctx = own_ctx;
+    }
+
+    count = libusb_get_device_list(ctx, &devs);
+    for (i = 0; i < count && !handle; i++)
+    {
+        if (libusb_get_device_descriptor(devs[i], &desc) ||
+            desc.idVendor != ID_VENDOR || desc.idProduct != ID_PRODUCT)
+            continue;
+        if (libusb_open(devs[i], &handle))
+            continue;
+        if (!string_matches(handle, desc.iManufacturer, MANUFACTURER) ||
+            !string_matches(handle, desc.iProduct, PRODUCT))
+        {
+            libusb_close(handle);
+            handle = NULL;
+        }
+    }
+    if (count >= 0)
+        libusb_free_device_list(devs, 1);
+
+    //setting the configuration also starts the completion records over
+    if (!handle || libusb_set_configuration(handle, 1) || libusb_claim_interface(handle, 0))
+    {
+        if (handle)
+            libusb_close(handle);
+        if (own_ctx)
+            libusb_exit(own_ctx);
+        return std::unique_ptr<Adapter>();
+    }
+
+    std::unique_ptr<Adapter> adapter(new Adapter(ctx, own_ctx != NULL, handle));
+    if (adapter->notify.size() != NOTIFY_TRANSFERS)
+        adapter.reset(); //the firmware has no notification endpoint
+    return adapter;
+}
+
+Adapter::Adapter(libusb_context* ctx, bool own_ctx, libusb_device_handle* handle) :
+    ctx(ctx), own_ctx(own_ctx), handle(handle), tags(256), next_tag(0), next_serial(0), newest_reported(0),
+    sequence(0), ring_used(0), block_busy(false), uploading(false), program_length(0), outstanding(0), calling(false),
+    transfers(0), stopping(false)
+{
+    libusb_transfer* transfer;
+    int i;
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (i = 0; i < NOTIFY_TRANSFERS; i++)
+    {
+        transfer = libusb_alloc_transfer(0);
+        if (!transfer)
+            break;
+        libusb_fill_interrupt_transfer(transfer, handle, 0x80 | USB_NOTIFY_ENDPOINT,
+            new unsigned char[USB_NOTIFY_SIZE], USB_NOTIFY_SIZE, notify_done, this, 0);
+        if (libusb_submit_transfer(transfer))
+        {
+            delete[] transfer->buffer;
+            libusb_free_transfer(transfer);
+            break;
+        }
+        transfers++;
+        notify.push_back(transfer);
+    }
+    events = std::thread(&Adapter::run_events, this);
+}
+
+Adapter::~Adapter()
+{
+    size_t i;
+
+    flush();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        for (i = 0; i < notify.size(); i++)
+        {
+            libusb_cancel_transfer(notify[i]);
+        }
+    }
+    events.join();
+
+    libusb_release_interface(handle, 0);
+    libusb_close(handle);
+    if (own_ctx)
+        libusb_exit(ctx);
+}
+
+void Adapter::read(uint8_t request, ResultCallback done)
+{
+    std::shared_ptr<Op> op(new Op(Op::COMMAND, USB_SWD_BEGIN_READ));
+
+    read_req_t req = { request };
+    op->data.assign((const uint8_t*)&req, (const uint8_t*)&req + sizeof(req));
+    op->done = [done](const Op& op) { done(op.results[0]); };
+    issue(op);
+}
+
+std::future<Result> Adapter::read(uint8_t request)
+{
+    std::shared_ptr<std::promise<Result> > promise(new std::promise<Result>());
+
+    read(request, [promise](const Result& res) { promise->set_value(res); });
+    return promise->get_future();
+}
+
+void Adapter::write(uint8_t request, uint32_t data, ResultCallback done)
+{
+    std::shared_ptr<Op> op(new Op(Op::COMMAND, USB_SWD_BEGIN_WRITE));
+
+    write_req_t req;
+    memset(&req, 0, sizeof(req));
+    req.request = request;
+    req.data = data;
+    op->data.assign((const uint8_t*)&req, (const uint8_t*)&req + sizeof(req));
+    op->done = [done](const Op& op) { done(op.results[0]); };
+    issue(op);
+}
+
+std::future<Result> Adapter::write(uint8_t request, uint32_t data)
+{
+    std::shared_ptr<std::promise<Result> > promise(new std::promise<Result>());
+
+    write(request, data, [promise](const Result& res) { promise->set_value(res); });
+    return promise->get_future();
+}
+
+void Adapter::read_pipelined(uint8_t request, uint16_t count, ResultsCallback done)
+{
+    std::shared_ptr<Op> op(new Op(Op::PIPELINED, USB_SWD_BEGIN_READ_PIPELINED));
+
+    read_req_t req = { request };
+    op->data.assign((const uint8_t*)&req, (const uint8_t*)&req + sizeof(req));
+    op->value = count;
+    op->count = count;
+    op->invalid = !count || count > USB_RING_LENGTH;
+    op->done = [done](const Op& op) { done(op.results); };
+    issue(op);
+}
+
+std::future<std::vector<Result> > Adapter::read_pipelined(uint8_t request, uint16_t count)
+{
+    std::shared_ptr<std::promise<std::vector<Result> > > promise(new std::promise<std::vector<Result> >());
+
+    read_pipelined(request, count, [promise](const std::vector<Result>& res) { promise->set_value(res); });
+    return promise->get_future();
+}
+
+void Adapter::connect(ResultCallback done)
+{
+    std::shared_ptr<Op> op(new Op(Op::COMMAND, USB_SWD_CONNECT));
+
+    op->done = [done](const Op& op) { done(op.results[0]); };
+    issue(op);
+}
+
+std::future<Result> Adapter::connect()
+{
+    std::shared_ptr<std::promise<Result> > promise(new std::promise<Result>());
+
+    connect([promise](const Result& res) { promise->set_value(res); });
+    return promise->get_future();
+}
+
+void Adapter::mem_read(uint32_t addr, uint16_t count, BlockCallback done)
+{
+    std::shared_ptr<Op> op(new Op(Op::MEM_READ, USB_SWD_BEGIN_MEM_READ));
+
+    mem_req_t req = { addr, count };
+    op->data.assign((const uint8_t*)&req, (const uint8_t*)&req + sizeof(req));
+    op->read_back = count;
+    op->invalid = !count || count > USB_BLOCK_WORDS;
+    op->done = [done](const Op& op)
+    {
+        BlockResult res = { op.results[0], op.words };
+        done(res);
+    };
+    issue(op);
+}
+
+std::future<BlockResult> Adapter::mem_read(uint32_t addr, uint16_t count)
+{
+    std::shared_ptr<std::promise<BlockResult> > promise(new std::promise<BlockResult>());
+
+    mem_read(addr, count, [promise](const BlockResult& res) { promise->set_value(res); });
+    return promise->get_future();
+}
+
+void Adapter::mem_write(uint32_t addr, const std::vector<uint32_t>& words, ResultCallback done)
+{
+    std::shared_ptr<Op> op(new Op(Op::MEM_WRITE, USB_SWD_BEGIN_MEM_WRITE));
+
+    mem_req_t req = { addr, (uint32_t)words.size() };
+    op->data.assign((const uint8_t*)&req, (const uint8_t*)&req + sizeof(req));
+    op->buffer = words;
+    op->invalid = words.empty() || words.size() > USB_BLOCK_WORDS;
+    op->done = [done](const Op& op) { done(op.results[0]); };
+    issue(op);
+}
+
+std::future<Result> Adapter::mem_write(uint32_t addr, const std::vector<uint32_t>& words)
+{
+    std::shared_ptr<std::promise<Result> > promise(new std::promise<Result>());
+
+    mem_write(addr, words, [promise](const Result& res) { promise->set_value(res); });
+    return promise->get_future();
+}
+
+void Adapter::run_program(const std::vector<uint32_t>& program, uint16_t entry, const std::vector<uint32_t>& args,
+    const std::vector<uint32_t>& buffer, uint16_t read_back, ProgramCallback done)
+{
+    std::shared_ptr<Op> op(new Op(Op::PROGRAM, USB_SWD_BEGIN_PROGRAM));
+
+    program_req_t req;
+    memset(&req, 0, sizeof(req));
+    std::copy(args.begin(), args.begin() + std::min<size_t>(args.size(), USB_PROGRAM_ARGUMENTS), req.args);
+    {
+        //ops go out in the order they are issued, so this is the program the begin request runs
+        std::lock_guard<std::mutex> guard(lock);
+        if (!program.empty())
+            program_length = program.size();
+        req.length = program_length;
+    }
+    op->data.assign((const uint8_t*)&req, (const uint8_t*)&req + sizeof(req));
+    op->value = entry;
+    op->program = program;
+    op->buffer = buffer;
+    op->read_back = read_back;
+    op->invalid = entry >= USB_PROGRAM_WORDS || args.size() > USB_PROGRAM_ARGUMENTS ||
+        program.size() > USB_PROGRAM_WORDS || buffer.size() > USB_BLOCK_WORDS || read_back > USB_BLOCK_WORDS;
+    op->done = [done](const Op& op)
+    {
+        ProgramResult res = { op.results[0], op.registers, op.words };
+        done(res);
+    };
+    issue(op);
+}
+
+std::future<ProgramResult> Adapter::run_program(const std::vector<uint32_t>& program, uint16_t entry,
+    const std::vector<uint32_t>& args, const std::vector<uint32_t>& buffer, uint16_t read_back)
+{
+    std::shared_ptr<std::promise<ProgramResult> > promise(new std::promise<ProgramResult>());
+
+    run_program(program, entry, args, buffer, read_back,
+        [promise](const ProgramResult& res) { promise->set_value(res); });
+    return promise->get_future();
+}
+
+std::future<uint32_t> Adapter::set_clock(uint32_t hz)
+{
+    std::shared_ptr<std::promise<uint32_t> > promise(new std::promise<uint32_t>());
+    std::shared_ptr<Op> op(new Op(Op::CLOCK, USB_SWD_SET_CLOCK));
+
+    clock_req_t req = { hz };
+    op->data.assign((const uint8_t*)&req, (const uint8_t*)&req + sizeof(req));
+    op->done = [promise](const Op& op) { promise->set_value(op.results[0].result == OK ? op.results[0].data : 0); };
+    issue(op);
+    return promise->get_future();
+}
+
+void Adapter::flush()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    idle.wait(guard, [this]() { return !outstanding; });
+}
+
+void Adapter::issue(const std::shared_ptr<Op>& op)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        outstanding++;
+        held.push_back(op);
+        pump();
+    }
+    call_back();
+}
+
+void Adapter::pump()
+{
+    std::shared_ptr<Op> op;
+    uint16_t credit;
+    int tag;
+    size_t i;
+
+    while (!held.empty() && !uploading)
+    {
+        op = held.front();
+        if (op->invalid || stopping)
+        {
+            held.pop_front();
+            fail(op, stopping ? ERR_BUS : ERR);
+            continue;
+        }
+
+        if (op->block() && block_busy)
+            break;
+
+        if (op->tagged())
+        {
+            //the adapter may have to skip to the start of its ring to fit the
+            //records in one run, which wastes up to count - 1 entries
+            credit = ring_used ? 2 * op->count - 1 : op->count;
+            if (ring_used + credit > USB_RING_LENGTH)
+                break;
+
+            //find a tag which isn't waiting for records
+            for (i = 0; i < tags.size() && tags[(next_tag + i) % tags.size()]; i++);
+            if (i == tags.size())
+                break;
+            tag = (next_tag + i) % tags.size();
+            next_tag = tag + 1;
+
+            op->tag = tag;
+            op->credit = credit;
+            op->serial = ++next_serial;
+            tags[tag] = op;
+            ring_used += credit;
+            begun_ops.push_back(op);
+        }
+        held.pop_front();
+        if (op->block())
+            block_busy = true;
+
+        //the begin request has to come after the uploads, and everything
+        //after it after the begin request
+        if (!op->program.empty())
+            upload(op, USB_SWD_WRITE_PROGRAM, op->program);
+        if (!op->buffer.empty())
+            upload(op, USB_SWD_WRITE_BLOCK, op->buffer);
+        if (op->waiting)
+            uploading = true;
+        else
+            submit(op);
+    }
+}
+
+void Adapter::upload(const std::shared_ptr<Op>& op, uint16_t request, const std::vector<uint32_t>& words)
+{
+    std::vector<uint8_t> bytes;
+    size_t i, count;
+
+    for (i = 0; i < words.size(); i += PACKET_WORDS)
+    {
+        count = std::min<size_t>(words.size() - i, PACKET_WORDS);
+        bytes.clear();
+        append_words(bytes, &words[i], count);
+        if (!control(request, i, 0, bytes.data(), bytes.size(), [this, op](int status, const uint8_t*, int)
+            {
+                uploaded(op, status);
+            }))
+        {
+            op->failed = true;
+            break;
+        }
+        op->waiting++;
+    }
+}
+
+void Adapter::uploaded(const std::shared_ptr<Op>& op, int status)
+{
+    if (status != LIBUSB_TRANSFER_COMPLETED)
+        op->failed = true;
+    if (--op->waiting)
+        return;
+
+    uploading = false;
+    if (op->failed)
+        fail(op, ERR);
+    else
+        submit(op);
+}
+
+void Adapter::submit(const std::shared_ptr<Op>& op)
+{
+    bool submitted;
+
+    if (op->failed)
+    {
+        fail(op, ERR);
+        return;
+    }
+
+    if (op->kind == Op::CLOCK)
+    {
+        //the clock is read back once it has been set
+        submitted = control(USB_SWD_SET_CLOCK, 0, 0, op->data.data(), op->data.size(), [this, op](int status, const uint8_t*, int)
+            {
+                if (status != LIBUSB_TRANSFER_COMPLETED)
+                    op->failed = true;
+            });
+        submitted = submitted && control(USB_SWD_GET_CLOCK, 0, 0, NULL, 4, [this, op](int status, const uint8_t* data, int length)
+            {
+                Result res = { OK, 0 };
+                if (op->failed || status != LIBUSB_TRANSFER_COMPLETED || length < 4)
+                    res.result = ERR;
+                else
+                    res.data = read_word(data);
+                op->results.push_back(res);
+                finish(op);
+            });
+        if (!submitted)
+            fail(op, ERR);
+        return;
+    }
+
+    if (!control(op->request, op->value, op->tag, op->data.data(), op->data.size(), [this, op](int status, const uint8_t*, int)
+        {
+            begun(op, status);
+        }))
+        fail(op, ERR);
+}
+
+bool Adapter::control(uint16_t request, uint16_t value, uint16_t index, const void* data, uint16_t length,
+    std::function<void(int, const uint8_t*, int)> done)
+{
+    libusb_transfer* transfer = libusb_alloc_transfer(0);
+    unsigned char* buffer;
+    Transfer* context;
+    uint8_t type = request & 0xff;
+
+    if (!transfer)
+        return false;
+
+    buffer = new unsigned char[LIBUSB_CONTROL_SETUP_SIZE + length];
+    libusb_fill_control_setup(buffer, type, request >> 8, value, index, length);
+    if (!(type & LIBUSB_ENDPOINT_IN) && length)
+        memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+
+    context = new Transfer();
+    context->adapter = this;
+    context->done = done;
+    libusb_fill_control_transfer(transfer, handle, buffer, transfer_done, context, CONTROL_TIMEOUT);
+    if (libusb_submit_transfer(transfer))
+    {
+        delete context;
+        delete[] buffer;
+        libusb_free_transfer(transfer);
+        return false;
+    }
+
+    transfers++;
+    return true;
+}
+
+void Adapter::transfer_done(libusb_transfer* transfer)
+{
+    Transfer* context = (Transfer*)transfer->user_data;
+    Adapter* adapter = context->adapter;
+
+    {
+        std::lock_guard<std::mutex> guard(adapter->lock);
+        context->done(transfer->status, libusb_control_transfer_get_data(transfer), transfer->actual_length);
+        adapter->transfers--;
+        adapter->pump();
+    }
+    adapter->call_back();
+
+    delete context;
+    delete[] transfer->buffer;
+    libusb_free_transfer(transfer);
+}
+
+void Adapter::begun(const std::shared_ptr<Op>& op, int status)
+{
+    if (status != LIBUSB_TRANSFER_COMPLETED)
+    {
+        //a STALL means the adapter refused the command, anything else means
+        //we can't tell whether it went through
+        fail(op, status == LIBUSB_TRANSFER_STALL ? ERR_BUSY : ERR_BUS);
+        return;
+    }
+
+    op->begun = true;
+    //records come back in order, so if later ones are in already, this
+    //one's were lost
+    if (newest_reported > op->serial)
+        fail(op, ERR_BUS);
+}
+
+void Adapter::notified(const uint8_t* data, int length)
+{
+    std::shared_ptr<Op> op, earlier;
+    const uint8_t* end = data + length - length % sizeof(completion_t);
+    Result res;
+    uint16_t missed;
+
+    for (; data < end; data += sizeof(completion_t))
+    {
+        missed = (uint16_t)(data[0] | (data[1] << 8)) - sequence;
+        sequence += missed + 1;
+
+        op = tags[data[2]];
+        if (!op)
+            continue;
+
+        //records missed in the middle of an op's run were its own, the rest
+        //were for ops before it
+        if (!op->results.empty())
+            op->results.resize(std::min<size_t>(op->results.size() + missed, op->count - 1), failure(ERR_BUS));
+
+        res.result = (int8_t)data[3];
+        res.data = read_word(data + 4);
+        op->results.push_back(res);
+        newest_reported = std::max(newest_reported, op->serial);
+
+        //anything begun before it should have had its records by now
+        while (!begun_ops.empty() && begun_ops.front() != op)
+        {
+            earlier = begun_ops.front();
+            if (!earlier->begun)
+                break;
+            fail(earlier, ERR_BUS);
+        }
+
+        if (op->results.size() < op->count)
+            continue;
+
+        release(op);
+        collect(op);
+    }
+}
+
+void Adapter::collect(const std::shared_ptr<Op>& op)
+{
+    uint16_t count = 0;
+    uint16_t i, n;
+    bool submitted = true;
+
+    if (op->kind == Op::MEM_READ && op->results[0].data)
+        count = std::min<uint32_t>(op->results[0].data, op->read_back);
+    else if (op->kind == Op::PROGRAM)
+        count = op->read_back;
+
+    if (op->kind == Op::PROGRAM)
+    {
+        submitted = control(USB_SWD_READ_REGISTERS, 0, 0, NULL, REGISTERS * 4, [this, op](int status, const uint8_t* data, int length)
+            {
+                int i;
+                if (status != LIBUSB_TRANSFER_COMPLETED || length < REGISTERS * 4)
+                    op->failed = true;
+                else
+                    for (i = 0; i < REGISTERS; i++)
+                    {
+                        op->registers.push_back(read_word(data + i * 4));
+                    }
+                collected(op);
+            });
+        if (submitted)
+            op->waiting++;
+    }
+
+    //the words come back in order, since control requests run one at a time
+    op->words.reserve(count);
+    for (i = 0; i < count && submitted; i += PACKET_WORDS)
+    {
+        n = std::min<uint16_t>(count - i, PACKET_WORDS);
+        submitted = control(USB_SWD_READ_BLOCK, i, 0, NULL, n * 4, [this, op, n](int status, const uint8_t* data, int length)
+            {
+                int i;
+                if (status != LIBUSB_TRANSFER_COMPLETED || length < n * 4)
+                    op->failed = true;
+                else
+                    for (i = 0; i < n; i++)
+                    {
+                        op->words.push_back(read_word(data + i * 4));
+                    }
+                collected(op);
+            });
+        if (submitted)
+            op->waiting++;
+    }
+
+    if (!submitted)
+        op->failed = true;
+    if (!op->waiting)
+        collected(op);
+}
+
+void Adapter::collected(const std::shared_ptr<Op>& op)
+{
+    if (op->waiting && --op->waiting)
+        return;
+
+    if (op->failed && op->results[0].result == OK)
+        op->results[0].result = ERR_BUS;
+    finish(op);
+}
+
+void Adapter::release(const std::shared_ptr<Op>& op)
+{
+    size_t i;
+
+    if (op->tag < 0)
+        return;
+
+    for (i = 0; i < begun_ops.size(); i++)
+    {
+        if (begun_ops[i] == op)
+        {
+            begun_ops.erase(begun_ops.begin() + i);
+            break;
+        }
+    }
+    tags[op->tag].reset();
+    op->tag = -1;
+    ring_used -= op->credit;
+}
+
+void Adapter::fail(const std::shared_ptr<Op>& op, int8_t result)
+{
+    release(op);
+    op->results.resize(op->count, failure(result));
+    finish(op);
+}
+
+void Adapter::finish(const std::shared_ptr<Op>& op)
+{
+    if (op->finished)
+        return;
+
+    op->finished = true;
+    if (op->block())
+        block_busy = false;
+    finished.push_back(op);
+}
+
+void Adapter::call_back()
+{
+    std::shared_ptr<Op> op;
+    std::unique_lock<std::mutex> guard(lock);
+
+    //only one thread calls back at a time, so callbacks stay in order
+    if (calling)
+        return;
+
+    calling = true;
+    while (!finished.empty())
+    {
+        op = finished.front();
+        finished.pop_front();
+        guard.unlock();
+        op->done(*op);
+        guard.lock();
+        outstanding--;
+        idle.notify_all();
+    }
+    calling = false;
+}
+
+void Adapter::notify_done(libusb_transfer* transfer)
+{
+    Adapter* adapter = (Adapter*)transfer->user_data;
+    bool resubmit;
+
+    {
+        std::lock_guard<std::mutex> guard(adapter->lock);
+        if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+            adapter->notified(transfer->buffer, transfer->actual_length);
+
+        if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+        {
+            //nothing more will come back, so everything fails
+            adapter->stopping = true;
+            while (!adapter->begun_ops.empty())
+            {
+                adapter->fail(adapter->begun_ops.front(), ERR_BUS);
+            }
+        }
+
+        resubmit = !adapter->stopping && transfer->status != LIBUSB_TRANSFER_CANCELLED &&
+            !libusb_submit_transfer(transfer);
+        if (!resubmit)
+            adapter->transfers--;
+        adapter->pump();
+    }
+    adapter->call_back();
+}
+
+void Adapter::run_events()
+{
+    struct timeval tv = { 0, 100000 };
+    std::unique_lock<std::mutex> guard(lock);
+    size_t i;
+
+    while (!stopping || transfers)
+    {
+        guard.unlock();
+        libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+        guard.lock();
+    }
+
+    for (i = 0; i < notify.size(); i++)
+    {
+        delete[] notify[i]->buffer;
+        libusb_free_transfer(notify[i]);
+    }
+    notify.clear();
+}
+
+} // namespace swd
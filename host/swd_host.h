@@ -0,0 +1,323 @@
+/**
+ * Native host library for the SWD adapter
+ *
+ * This talks to the adapter through libusb's asynchronous API, so many
+ * commands can be in flight at once. Each operation takes a callback, or
+ * returns a future, which is completed once the adapter has reported the
+ * result of the command.
+ *
+ * Commands are begun with control requests in the order they are issued, as
+ * described in usb_types.h. The library keeps the adapter's completion ring
+ * from filling up on its own: it counts the ring entries every command
+ * takes, holds back commands which wouldn't fit and begins them as the
+ * completion records for earlier ones come back on the notification
+ * endpoint. Tags are handed out from the 256 the protocol allows and reused
+ * once a command's records are in. Block requests and programs share the
+ * adapter's block buffer, so each of them waits for the one before it to
+ * finish, including reading the buffer back. Commands issued after one that
+ * waits wait behind it, so the order is always kept.
+ *
+ * The library assumes it is the only user of the adapter. If records go
+ * missing anyway, for example because another program set the
+ * configuration, the commands they belonged to complete with SWD_ERR_BUS.
+ * A command the adapter refuses to begin completes with SWD_ERR_BUSY.
+ *
+ * Callbacks are called from the library's event thread, which is started
+ * when the adapter is opened, in the order the ops finish. An op which
+ * can't be sent at all may be called back from the call that issued it.
+ * Callbacks must not block on futures or flush the same adapter. Operations
+ * may be issued from any thread, including from callbacks.
+ *
+ * The library needs the notification endpoint, so it doesn't work with
+ * firmware built with USB_CMSIS_DAP.
+ */
+
+#ifndef _SWD_HOST_H_
+#define _SWD_HOST_H_
+
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct libusb_context;
+struct libusb_device_handle;
+struct libusb_transfer;
+
+namespace swd
+{
+
+//results of a command, as in swd.h
+const int8_t OK = 0;
+const int8_t ERR = -1;
+const int8_t ERR_BUSY = -2;
+const int8_t ERR_WAIT = -3;
+const int8_t ERR_FAULT = -4;
+const int8_t ERR_BUS = -5;
+const int8_t ERR_PARITY = -6;
+const int8_t ERR_TIMEOUT = -7;
+
+/**
+ * Result of one command
+ */
+struct Result
+{
+    int8_t result;
+    uint32_t data;
+};
+
+/**
+ * Result of a block read, or of a program with the words it left in the
+ * block buffer
+ */
+struct BlockResult
+{
+    Result result;
+    std::vector<uint32_t> words;
+};
+
+/**
+ * Result of a program
+ */
+struct ProgramResult
+{
+    Result result; //the data is r0
+    std::vector<uint32_t> registers;
+    std::vector<uint32_t> words; //words read back from the block buffer
+};
+
+typedef std::function<void(const Result&)> ResultCallback;
+typedef std::function<void(const std::vector<Result>&)> ResultsCallback;
+typedef std::function<void(const BlockResult&)> BlockCallback;
+typedef std::function<void(const ProgramResult&)> ProgramCallback;
+
+class Adapter
+{
+public:
+    /**
+     * Opens the first adapter found and starts the event thread. Setting
+     * the configuration starts the adapter's completion records over.
+     * @param ctx libusb context to use, or NULL for the default one
+     * @return The adapter, or NULL if none could be opened
+     */
+    static std::unique_ptr<Adapter> open(libusb_context* ctx = NULL);
+
+    /**
+     * Waits for every command to finish, then stops the event thread and
+     * closes the adapter
+     */
+    ~Adapter();
+
+    /**
+     * Begins a read
+     * @param request Request byte
+     */
+    void read(uint8_t request, ResultCallback done);
+    std::future<Result> read(uint8_t request);
+
+    /**
+     * Begins a write
+     * @param request Request byte
+     * @param data Data to write
+     */
+    void write(uint8_t request, uint32_t data, ResultCallback done);
+    std::future<Result> write(uint8_t request, uint32_t data);
+
+    /**
+     * Begins a pipelined run of AP reads, see swd_begin_read_pipelined. Each
+     * read has its own result, in order.
+     * @param request Request byte of an AP read
+     * @param count Number of reads, at most USB_RING_LENGTH
+     */
+    void read_pipelined(uint8_t request, uint16_t count, ResultsCallback done);
+    std::future<std::vector<Result> > read_pipelined(uint8_t request, uint16_t count);
+
+    /**
+     * Begins a line reset and JTAG-to-SWD switch
+     */
+    void connect(ResultCallback done);
+    std::future<Result> connect();
+
+    /**
+     * Begins a MEM-AP block read. The MEM-AP must already be selected.
+     * @param addr Word aligned address
+     * @param count Number of words, at most USB_BLOCK_WORDS
+     * @param done Gets the result, whose data is the number of words read,
+     * and the words
+     */
+    void mem_read(uint32_t addr, uint16_t count, BlockCallback done);
+    std::future<BlockResult> mem_read(uint32_t addr, uint16_t count);
+
+    /**
+     * Begins a MEM-AP block write. The MEM-AP must already be selected.
+     * @param addr Word aligned address
+     * @param words Words to write, at most USB_BLOCK_WORDS
+     * @param done Gets the result, whose data is the number of words written
+     */
+    void mem_write(uint32_t addr, const std::vector<uint32_t>& words, ResultCallback done);
+    std::future<Result> mem_write(uint32_t addr, const std::vector<uint32_t>& words);
+
+    /**
+     * Runs a program on the adapter, see swd_vm.h
+     * @param program Instructions to upload first, or empty to run the ones
+     * uploaded last
+     * @param entry Index of the first instruction
+     * @param args Values for r0 to r3
+     * @param buffer Words to put at the start of the block buffer first
+     * @param read_back Number of words to read back from the block buffer
+     * once the program is done
+     * @param done Gets the result, the registers and the words read back
+     */
+    void run_program(const std::vector<uint32_t>& program, uint16_t entry, const std::vector<uint32_t>& args,
+        const std::vector<uint32_t>& buffer, uint16_t read_back, ProgramCallback done);
+    std::future<ProgramResult> run_program(const std::vector<uint32_t>& program, uint16_t entry,
+        const std::vector<uint32_t>& args, const std::vector<uint32_t>& buffer = std::vector<uint32_t>(),
+        uint16_t read_back = 0);
+
+    /**
+     * Sets the SWD clock
+     * @param hz Requested frequency
+     * @return The frequency achieved, or 0 if the requests failed
+     */
+    std::future<uint32_t> set_clock(uint32_t hz);
+
+    /**
+     * Waits until every command issued so far has finished
+     */
+    void flush();
+
+private:
+    struct Op;
+    struct Transfer;
+
+    Adapter(libusb_context* ctx, bool own_ctx, libusb_device_handle* handle);
+
+    //everything below is called with the lock held unless noted
+
+    /**
+     * Queues an op and begins whatever fits. The lock must not be held.
+     */
+    void issue(const std::shared_ptr<Op>& op);
+
+    /**
+     * Begins held back ops, in order, while they fit
+     */
+    void pump();
+
+    /**
+     * Fills the start of one of the adapter's buffers for an op, one packet
+     * per control request
+     * @param request Write request for the buffer
+     */
+    void upload(const std::shared_ptr<Op>& op, uint16_t request, const std::vector<uint32_t>& words);
+
+    /**
+     * Handles the end of an upload request
+     */
+    void uploaded(const std::shared_ptr<Op>& op, int status);
+
+    /**
+     * Sends the requests which begin an op
+     */
+    void submit(const std::shared_ptr<Op>& op);
+
+    /**
+     * Submits a control transfer
+     * @param request wRequestAndType, as in usb_types.h
+     * @param value wValue
+     * @param index wIndex
+     * @param data Data stage of an OUT request
+     * @param length Length of the data stage
+     * @param done Called with the lock held once the transfer is done, with
+     * its status and the data received
+     * @return True if it was submitted
+     */
+    bool control(uint16_t request, uint16_t value, uint16_t index, const void* data, uint16_t length,
+        std::function<void(int, const uint8_t*, int)> done);
+
+    /**
+     * Handles the end of a begin request
+     */
+    void begun(const std::shared_ptr<Op>& op, int status);
+
+    /**
+     * Handles a packet of completion records
+     */
+    void notified(const uint8_t* data, int length);
+
+    /**
+     * Reads back whatever an op needs once its records are in, then
+     * finishes it
+     */
+    void collect(const std::shared_ptr<Op>& op);
+
+    /**
+     * Handles the end of a read back request, finishing the op after the
+     * last one
+     */
+    void collected(const std::shared_ptr<Op>& op);
+
+    /**
+     * Gives back an op's tag and ring entries
+     */
+    void release(const std::shared_ptr<Op>& op);
+
+    /**
+     * Finishes an op with a result for each of its missing records
+     */
+    void fail(const std::shared_ptr<Op>& op, int8_t result);
+
+    /**
+     * Gives back the block buffer if the op had it and hands the op to be
+     * called back
+     */
+    void finish(const std::shared_ptr<Op>& op);
+
+    /**
+     * Calls back the finished ops. The lock must not be held.
+     */
+    void call_back();
+
+    static void transfer_done(libusb_transfer* transfer);
+    static void notify_done(libusb_transfer* transfer);
+
+    /**
+     * Event thread. The lock must not be held.
+     */
+    void run_events();
+
+    libusb_context* ctx;
+    bool own_ctx; //true if the context was made by open
+    libusb_device_handle* handle;
+
+    std::mutex lock;
+    std::condition_variable idle; //signalled whenever an op has been called back
+    std::deque<std::shared_ptr<Op> > held; //ops which haven't been begun yet
+    std::deque<std::shared_ptr<Op> > begun_ops; //begun ops waiting for records, in order
+    std::vector<std::shared_ptr<Op> > tags; //op for each tag that is in use
+    std::deque<std::shared_ptr<Op> > finished; //ops waiting to be called back
+    int next_tag;
+    uint64_t next_serial;
+    uint64_t newest_reported; //serial of the newest op a record came back for
+    uint16_t sequence; //sequence number of the next record
+    uint16_t ring_used; //ring entries the begun ops may take up
+    bool block_busy; //true while an op owns the block buffer
+    bool uploading; //true while an op's buffers are being filled
+    uint32_t program_length; //instructions in the last program issued
+    unsigned outstanding; //ops issued but not called back
+    bool calling; //true while a thread is calling back
+    unsigned transfers; //transfers submitted but not done
+
+    std::vector<libusb_transfer*> notify;
+    bool stopping;
+    std::thread events;
+};
+
+} // namespace swd
+
+#endif // _SWD_HOST_H_
@@ -35,6 +35,9 @@ void set_irq_priority (int, int);
 
   /*!< Macro to disable all interrupts. */
 #define DisableInterrupts asm(" CPSID i");
+
+  /*!< Macro to complete all memory accesses before any which follow. */
+#define DataMemoryBarrier asm volatile(" DMB" ::: "memory");
 /***********************************************************************/
 
 
@@ -8,9 +8,36 @@
  * executed at the next possible opportunity. If the queue is full, an
  * SWD_ERR_BUSY will be returned.
  *
+ * The queue is lock-free: the bus interrupt takes commands out without ever
+ * masking interrupts, and neither do the swd_begin_* methods. They may be
+ * called from the main loop and from an interrupt. A producer claims the
+ * queue with an atomic test-and-set for the whole of the call, so one which
+ * interrupts another swd_begin_* call gets SWD_ERR_BUSY as if the queue were
+ * full.
+ *
  * Each swd_begin_* command takes in a pointer to a swd_result_t struct. This
  * struct will be written by the SWD module to indicate the individual command
  * completion status and result.
+ *
+ * AP reads are posted: the data returned by an AP read is the result of the
+ * previous AP read, and the last one is collected from the DP RDBUFF
+ * register. swd_begin_read_pipelined queues a run of AP reads followed by the
+ * RDBUFF read and hands each value to the result of the read it belongs to.
+ *
+ * swd_begin_mem_read and swd_begin_mem_write move a block of words through
+ * the MEM-AP on the adapter. CSW is written once for 32-bit auto-incrementing
+ * accesses. TAR is written at the start and again at every 1KB boundary,
+ * since the auto-increment is only guaranteed within 1KB. Then DRW is
+ * streamed. Reads are pipelined as above.
+ *
+ * swd_begin_mem_poll reads one word over and over in the same way, with the
+ * address increment turned off, until it matches or the poll gives up. A
+ * flag the target sets when it is done can be waited for without the host
+ * asking for every read.
+ *
+ * The SWD module keeps a session with the target between commands. The line
+ * reset and JTAG-to-SWD switch sequence is only sent before the first command,
+ * after a protocol error, or when explicitly requested with swd_connect.
  */
 
 #ifndef _SWD_H_
@@ -24,26 +51,74 @@
 #define SWD_CLK_PIN 7 //pin 5
 #define SWD_DIO_PIN 3 //pin 8
 
-#define SWD_START_MASK  0x80
-#define SWD_APnDP_MASK  0x40
-#define SWD_RnW_MASK    0x20
+//request byte fields, in the order they are sent (lsb first)
+#define SWD_START_MASK  0x01
+#define SWD_APnDP_MASK  0x02
+#define SWD_RnW_MASK    0x04
 #define SWD_ADDR_SHIFT  3
 #define SWD_ADDR_MASK   (0x3 << SWD_ADDR_SHIFT)
-#define SWD_ADDR(N)     ((N << SWD_ADDR_SHIFT) & SWD_ADDR_MASK)
-#define SWD_PARITY_MASK 0x04
-#define SWD_STOP_MASK   0x02
-#define SWD_PARK_MASK   0x01
+#define SWD_ADDR(N)     (((N) << SWD_ADDR_SHIFT) & SWD_ADDR_MASK) //N is A[3:2], the register address / 4
+#define SWD_PARITY_MASK 0x20
+#define SWD_STOP_MASK   0x40
+#define SWD_PARK_MASK   0x80
+
+//builds a complete request byte from the APnDP, RnW and address fields
+#define SWD_PARITY(R)   ((((R) >> 1) ^ ((R) >> 2) ^ ((R) >> 3) ^ ((R) >> 4)) & 1)
+#define SWD_REQUEST(R)  ((R) | SWD_START_MASK | SWD_PARK_MASK | (SWD_PARITY(R) ? SWD_PARITY_MASK : 0))
+
+#define SWD_RESP_OK    0b001
+#define SWD_RESP_WAIT  0b010
+#define SWD_RESP_FAULT 0b100
+
+#define MASK_SET(D,M) D|=M
+#define MASK_CLR(D,M) D&=~M
+
+#define SWD_DP_READ_IDCODE    SWD_REQUEST(SWD_RnW_MASK | SWD_ADDR(0))
+#define SWD_DP_WRITE_ABORT    SWD_REQUEST(SWD_ADDR(0))
+#define SWD_DP_READ_CTRLSTAT  SWD_REQUEST(SWD_RnW_MASK | SWD_ADDR(1))
+#define SWD_DP_WRITE_CTRLSTAT SWD_REQUEST(SWD_ADDR(1))
+#define SWD_DP_WRITE_SELECT   SWD_REQUEST(SWD_ADDR(2))
+#define SWD_DP_READ_RESEND    SWD_REQUEST(SWD_RnW_MASK | SWD_ADDR(2))
+#define SWD_DP_READ_RDBUFF    SWD_REQUEST(SWD_RnW_MASK | SWD_ADDR(3))
+
+//MEM-AP registers in bank 0
+#define SWD_AP_WRITE_CSW      SWD_REQUEST(SWD_APnDP_MASK | SWD_ADDR(0))
+#define SWD_AP_WRITE_TAR      SWD_REQUEST(SWD_APnDP_MASK | SWD_ADDR(1))
+#define SWD_AP_WRITE_DRW      SWD_REQUEST(SWD_APnDP_MASK | SWD_ADDR(3))
+#define SWD_AP_READ_DRW       SWD_REQUEST(SWD_APnDP_MASK | SWD_RnW_MASK | SWD_ADDR(3))
 
-#define SWD_DP_READ_IDCODE (SWD_START_MASK | SWD_RnW_MASK | SWD_ADDR(0) | SWD_PARK_MASK)
+#define SWD_ABORT_CLEAR_ALL       0x1e //clears all of the sticky error flags
+#define SWD_CTRLSTAT_CSYSPWRUPREQ (1 << 30)
+#define SWD_CTRLSTAT_CSYSPWRUPACK (1 << 31)
+#define SWD_CTRLSTAT_CDBGPWRUPREQ (1 << 28)
+#define SWD_CTRLSTAT_CDBGPWRUPACK (1 << 29)
+#define SWD_CSW_SIZE_32           0x00000002
+#define SWD_CSW_ADDRINC_SINGLE    0x00000010
+#define SWD_CSW_DEFAULT           0x23000000 //HPROT and master type bits used by most hosts
 
-#define SWD_QUEUE_LENGTH 64
+#define SWD_QUEUE_LENGTH 384 //entries in the command queue. Block commands and sequences take two, polls take three.
+#define SWD_MEM_WRAP 1024 //TAR auto-increment is only guaranteed within a block of this many bytes
+#define SWD_PIPELINE_LENGTH (SWD_QUEUE_LENGTH - 2) //most AP reads in a pipelined read, leaving room for the RDBUFF read
+#define SWD_SEQUENCE_MAX_BITS 256 //longest raw bit sequence
+
+//DWT cycle counter ticks, which come at the core clock (the MCG clock divided by OUTDIV1)
+#define SWD_DWT_PER_MS ((uint32_t)core_clk_khz)
+#define SWD_DWT_PER_US ((uint32_t)core_clk_khz / 1000)
+
+#define SWD_DEFAULT_CLOCK 1000000 //Hz, limited to the fastest clock the engine can do
+#define SWD_DEFAULT_PARITY_RETRIES 3
+#define SWD_DEFAULT_WAIT_RETRIES 100
+#define SWD_DEFAULT_WAIT_IDLE 2
+#define SWD_DEFAULT_WAIT_IDLE_MAX 64
 
 #define SWD_OK        0  //request/response ok
 #define SWD_ERR       -1
 #define SWD_ERR_BUSY  -2 //bus busy
-#define SWD_ERR_WAIT  -3 //client WAIT response
+#define SWD_ERR_WAIT  -3 //client WAIT response, still there after retrying
 #define SWD_ERR_FAULT -4 //client FAULT response
 #define SWD_ERR_BUS   -5 //internal error while running
+#define SWD_ERR_PARITY -6 //read data did not match its parity bit, even after retrying. The data is still returned.
+#define SWD_ERR_TIMEOUT -7 //a poll ran out of attempts or time before the value matched. The data is still returned.
 
 #define SWD_DONE 1
 
@@ -59,16 +134,115 @@ typedef struct {
      * Written by the SWD module to the result of the command once it is completed, before done is written
      */
     int8_t result;
+    /*
+     * Written by the SWD module to the number of values a poll read, before done is written
+     */
+    uint16_t attempts;
     /*
      * Written by the SWD module to the read data for this command once it is completed, before done is written
      */
     uint32_t data;
 } swd_result_t;
 
+/**
+ * Error and transaction counters for the bus, kept since the last
+ * swd_clear_stats
+ */
+typedef struct {
+    uint32_t transactions; //reads and writes which have finished
+    uint32_t wait;         //WAIT acknowledgements, including ones which were retried
+    uint32_t fault;        //FAULT acknowledgements
+    uint32_t protocol;     //invalid acknowledgements
+    uint32_t parity;       //reads which still had a parity mismatch after retrying
+    uint32_t retries;      //reads retried because of a parity mismatch
+    uint32_t isr_calls;    //bus interrupts taken
+    uint32_t isr_cycles;   //core cycles spent in the bus interrupt
+    uint32_t isr_cycles_max; //longest bus interrupt, in core cycles
+} swd_stats_t;
+
+/**
+ * Bus behaviour which can be changed at runtime
+ */
+typedef struct {
+    /*
+     * Number of times a read with a parity mismatch is retried before it
+     * completes with SWD_ERR_PARITY. DP reads are simply repeated. AP reads are
+     * retried by reading the DP RESEND register, since repeating them would
+     * perform another AP access. The DMA engine doesn't retry.
+     */
+    uint8_t parity_retries;
+    /*
+     * Number of times a command which gets a WAIT acknowledgement is retried
+     * before it completes with SWD_ERR_WAIT. The DMA engine doesn't retry.
+     */
+    uint16_t wait_retries;
+    /*
+     * Idle cycles clocked before the first WAIT retry. This doubles with each
+     * retry, up to wait_idle_max.
+     */
+    uint16_t wait_idle;
+    uint16_t wait_idle_max;
+} swd_config_t;
+
+/**
+ * Bit engines which can drive the bus
+ * SWD_ENGINE_FTM: Every half bit is clocked by the FTM0 interrupt (SWCLK on PTD7, SWDIO on PTD3)
+ * SWD_ENGINE_SPI: Requests and data are clocked through SPI0, see swd_spi.h for wiring
+ * SWD_ENGINE_DMA: Batches of commands are clocked out by the eDMA, see swd_dma.h (same pins as FTM)
+ */
+typedef enum { SWD_ENGINE_FTM, SWD_ENGINE_SPI, SWD_ENGINE_DMA } swd_engine_t;
+
 /**
  * Initializes the Serial Wire Debug driver using FTM0
+ * @param engine Bit engine to drive the bus with
+ */
+void swd_init(swd_engine_t engine);
+
+/**
+ * Sets the SWD clock frequency. The engine uses the fastest clock it can
+ * generate which is not faster than the requested frequency, unless the
+ * request is below the slowest clock it can generate.
+ * @param hz Requested clock frequency in Hz
+ * @return The clock frequency actually achieved in Hz
  */
-void swd_init(void);
+uint32_t swd_set_clock(uint32_t hz);
+
+/**
+ * Returns the SWD clock frequency achieved by the last swd_set_clock call, in
+ * Hz
+ */
+uint32_t swd_get_clock(void);
+
+/**
+ * Changes the bus behaviour. Commands which are already running keep the old
+ * behaviour.
+ * @param config New configuration
+ */
+void swd_set_config(const swd_config_t* config);
+
+/**
+ * Copies the current bus configuration
+ * @param dest Destination for the configuration
+ */
+void swd_get_config(swd_config_t* dest);
+
+/**
+ * Copies the bus error and transaction counters
+ * @param dest Destination for the counters
+ */
+void swd_get_stats(swd_stats_t* dest);
+
+/**
+ * Resets the bus error and transaction counters
+ */
+void swd_clear_stats(void);
+
+/**
+ * Returns the parity bit for a word of data
+ * @param data Data to compute the parity for
+ * @return 1 if there are an odd number of 1 bits in data
+ */
+uint8_t swd_parity(uint32_t data);
 
 /**
  * Begins a write sequence
@@ -85,4 +259,83 @@ int8_t swd_begin_write(uint8_t req, uint32_t data, swd_result_t* res);
  */
 int8_t swd_begin_read(uint8_t req, swd_result_t* res);
 
+/**
+ * Begins a pipelined run of AP reads. The AP read is performed count times
+ * back to back and followed by a DP RDBUFF read, so count + 1 transactions
+ * are made in all. The data and result of the nth AP read are written to
+ * res[n]. If an AP read fails, its error is reported in its own result.
+ * @param req Request byte for an AP read
+ * @param count Number of AP reads, at most SWD_PIPELINE_LENGTH
+ * @param res Array of count results
+ * @return SWD_OK or an error code. Nothing is queued unless all of the
+ * transactions fit in the queue.
+ */
+int8_t swd_begin_read_pipelined(uint8_t req, uint32_t count, swd_result_t* res);
+
+/**
+ * Begins a MEM-AP block read. The MEM-AP must already be selected with bank
+ * 0 in the DP SELECT register. Its CSW is left set up for 32-bit
+ * auto-incrementing accesses.
+ * @param addr Address of the first word in target memory, word aligned
+ * @param count Number of words to read
+ * @param buffer Destination for the words. Must stay valid until the command
+ * is done.
+ * @param res The data is the number of words that were read. On an error,
+ * the words before that one are valid.
+ * @return SWD_OK or an error code
+ */
+int8_t swd_begin_mem_read(uint32_t addr, uint32_t count, uint32_t* buffer, swd_result_t* res);
+
+/**
+ * Begins a MEM-AP block write. The MEM-AP must already be selected as for
+ * swd_begin_mem_read.
+ * @param addr Address of the first word in target memory, word aligned
+ * @param count Number of words to write
+ * @param buffer Words to write. Must stay valid until the command is done.
+ * @param res The data is the number of words that were accepted by the
+ * target
+ * @return SWD_OK or an error code
+ */
+int8_t swd_begin_mem_write(uint32_t addr, uint32_t count, const uint32_t* buffer, swd_result_t* res);
+
+/**
+ * Begins a MEM-AP poll. A word is read until (value & mask) == expect, the
+ * attempts are used up or the timeout passes. The MEM-AP must already be
+ * selected as for swd_begin_mem_read. Its CSW is left set up for 32-bit
+ * accesses without auto-increment. Reads are pipelined, so the target may
+ * see a few more reads than were counted.
+ * @param addr Address of the word in target memory, word aligned
+ * @param mask Bits of the value to compare
+ * @param expect Value the masked bits must have
+ * @param attempts Most values to read, at least 1
+ * @param timeout_ms Longest time to poll for in milliseconds, or 0 for no
+ * limit. Timeouts longer than the core cycle counter can measure (about a
+ * minute at 72MHz) are cut down to that.
+ * @param res The data is the last value read and attempts is the number of
+ * values read. The result is SWD_ERR_TIMEOUT if the value never matched.
+ * @return SWD_OK or an error code
+ */
+int8_t swd_begin_mem_poll(uint32_t addr, uint32_t mask, uint32_t expect, uint16_t attempts,
+    uint16_t timeout_ms, swd_result_t* res);
+
+/**
+ * Queues a line reset and JTAG-to-SWD switch sequence, starting a new session
+ * with the target. The target expects an IDCODE read after this completes.
+ * @return SWD_OK or an error code
+ */
+int8_t swd_connect(swd_result_t* res);
+
+/**
+ * Queues a raw bit sequence driven by the host, such as a line reset or a
+ * protocol switch built by the host. No line reset is sent ahead of it, and
+ * the session is assumed to be up once it has been sent. Exactly the given
+ * number of clocks go out, with no idle cycles after them, so a sequence can
+ * be split across several commands.
+ * @param seq Bits to send, 0th index first, lsb first. Must stay valid until
+ * the command is done.
+ * @param bits Number of bits, at most SWD_SEQUENCE_MAX_BITS
+ * @return SWD_OK or an error code
+ */
+int8_t swd_begin_sequence(const uint8_t* seq, uint32_t bits, swd_result_t* res);
+
 #endif // _SWD_H_
@@ -0,0 +1,46 @@
+/**
+ * SWD batch interpreter
+ *
+ * Runs batches in the format described in usb_types.h on the swd module. The
+ * whole batch is checked before any of it runs. The ops are then handed to
+ * the swd queue as it has room, so a batch can hold many more ops than the
+ * queue. Only one batch runs at a time.
+ *
+ * A delay op waits for the ops before it to finish and is then timed with the
+ * DWT cycle counter, which swd_init starts. The bus is idle while it waits.
+ */
+
+#ifndef _SWD_BATCH_H_
+#define _SWD_BATCH_H_
+
+#include "arm_cm4.h"
+
+/**
+ * Begins running a batch
+ * @param batch Batch to run. It is read while the batch runs, so it must
+ * stay valid until the result has been released.
+ * @param length Number of bytes received for the batch
+ * @return SWD_OK or SWD_ERR_BUSY if the last batch is still running or its
+ * result hasn't been released
+ */
+int8_t swd_batch_begin(const uint32_t* batch, uint16_t length);
+
+/**
+ * Hands more ops of the running batch to the swd queue and collects the
+ * results of finished ones. Call this from the main loop.
+ */
+void swd_batch_task(void);
+
+/**
+ * Returns the result of the last batch once it has finished
+ * @param length Written with the length of the result in bytes
+ * @return The result, or NULL if there is no finished batch
+ */
+const uint32_t* swd_batch_result(uint16_t* length);
+
+/**
+ * Releases the result of the last batch so the next one can begin
+ */
+void swd_batch_release(void);
+
+#endif // _SWD_BATCH_H_
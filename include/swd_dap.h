@@ -0,0 +1,44 @@
+/**
+ * CMSIS-DAP command processor
+ *
+ * When the firmware is built with USB_CMSIS_DAP, the bulk endpoints carry
+ * CMSIS-DAP v2 commands instead of batches, so hosts such as OpenOCD and
+ * pyOCD can use the adapter as a standard probe. Each bulk OUT packet is one
+ * command and gets one response packet on the bulk IN endpoint.
+ *
+ * Only SWD is supported. The commands implemented are DAP_Info,
+ * DAP_HostStatus, DAP_Connect, DAP_Disconnect, DAP_TransferConfigure,
+ * DAP_Transfer, DAP_TransferBlock, DAP_TransferAbort, DAP_WriteABORT,
+ * DAP_Delay, DAP_ResetTarget, DAP_SWJ_Clock, DAP_SWJ_Sequence and
+ * DAP_SWD_Configure. Anything else is answered with DAP_Invalid.
+ *
+ * The transfers of a command are handed to the swd queue without waiting for
+ * each other, and AP reads are pipelined through RDBUFF, so a command costs
+ * about one bus transaction per transfer. Once a transfer fails, the rest
+ * of the command is not started, but transfers which were already queued
+ * still run.
+ *
+ * Commands are processed by swd_dap_process, which blocks while transfers go
+ * through the swd queue and so must be called from the main loop rather than
+ * from an interrupt.
+ */
+
+#ifndef _SWD_DAP_H_
+#define _SWD_DAP_H_
+
+#include "arm_cm4.h"
+
+#define SWD_DAP_PACKET_SIZE 64 //bytes in a command or a response
+#define SWD_DAP_PACKET_COUNT 2 //commands the host may send before reading a response
+
+/**
+ * Processes a command and builds its response
+ * @param request Command received from the host
+ * @param length Number of bytes received
+ * @param response Destination for the response, SWD_DAP_PACKET_SIZE bytes
+ * @return Length of the response in bytes. This is 0 for DAP_TransferAbort,
+ * which has no response.
+ */
+uint16_t swd_dap_process(const uint8_t* request, uint16_t length, uint8_t* response);
+
+#endif // _SWD_DAP_H_
@@ -0,0 +1,102 @@
+/**
+ * DMA waveform bit engine for the Serial Wire Debug interface
+ *
+ * This expands a batch of transactions into a buffer of port D data direction
+ * and output values, two steps per bit (falling edge, rising edge). The eDMA
+ * pushes the buffer out to the port on a PIT trigger while a second channel,
+ * triggered by another PIT running in lockstep, captures the port input after
+ * every step. Once the batch has finished, each transaction is decoded from
+ * the captured samples.
+ *
+ * The CPU only touches each transaction twice: once to build its waveform and
+ * once to decode it. The bus runs with no jitter from other interrupts.
+ *
+ * Since the whole batch is committed before any ACK is seen, a transaction
+ * that gets a WAIT or FAULT is still followed by a full data phase. The target
+ * only expects this when overrun detection (ORUNDETECT in the DP CTRL/STAT
+ * register) is enabled, so the host should enable it before using this
+ * engine for anything other than single commands.
+ *
+ * Uses the same pins as the FTM engine. The low byte of PTD (PTD0-PTD7) is
+ * owned by this engine while it is running. DMA channels 2 and 3 and PIT
+ * channels 2 and 3 are used.
+ */
+
+#ifndef _SWD_DMA_H_
+#define _SWD_DMA_H_
+
+#include "arm_cm4.h"
+
+//maximum number of bits in a batch, including sequences
+#define SWD_DMA_MAX_BITS 1024
+
+//number of bits in a read or write transaction
+#define SWD_DMA_TRANSACTION_BITS 46
+
+/**
+ * Initializes the eDMA, DMA mux and PIT channels for use as a SWD bit engine
+ */
+void swd_dma_init(void);
+
+/**
+ * Sets the PIT period used for batches started after this call
+ * @param hz Requested clock frequency in Hz
+ * @return The clock frequency achieved in Hz
+ */
+uint32_t swd_dma_set_clock(uint32_t hz);
+
+/**
+ * Starts building a new batch. The previous batch must have finished.
+ */
+void swd_dma_begin(void);
+
+/**
+ * Returns the number of bits left in the batch being built
+ */
+uint32_t swd_dma_space(void);
+
+/**
+ * Adds a bit sequence to the batch being built
+ * @param seq Sequence to transmit, 0th index first, lsb first
+ * @param bits Number of bits to transmit
+ * @return SWD_OK or an error code if there is no room
+ */
+int8_t swd_dma_add_seq(const uint8_t* seq, uint32_t bits);
+
+/**
+ * Adds a read transaction to the batch being built
+ * @param req Request byte
+ * @return Handle for decoding the transaction, or a negative number if there
+ * is no room
+ */
+int16_t swd_dma_add_read(uint8_t req);
+
+/**
+ * Adds a write transaction to the batch being built
+ * @param req Request byte
+ * @param data Data to write
+ * @return Handle for decoding the transaction, or a negative number if there
+ * is no room
+ */
+int16_t swd_dma_add_write(uint8_t req, uint32_t data);
+
+/**
+ * Starts clocking out the batch that was built
+ */
+void swd_dma_start(void);
+
+/**
+ * Returns true while a batch is being clocked out
+ */
+uint8_t swd_dma_busy(void);
+
+/**
+ * Decodes a transaction from a finished batch
+ * @param handle Handle returned when the transaction was added
+ * @param read True if the transaction was a read
+ * @param data Destination for the data read. Only written for reads.
+ * @return SWD_OK or an error code
+ */
+int8_t swd_dma_decode(int16_t handle, uint8_t read, uint32_t* data);
+
+#endif // _SWD_DMA_H_
@@ -0,0 +1,66 @@
+/**
+ * SPI bit engine for the Serial Wire Debug interface
+ *
+ * This clocks the request and data phases of each transaction through SPI0 in
+ * 8 and 16 bit frames. Only the turnaround and acknowledge bits (and the read
+ * parity bit, which has no frame to itself) are bit-banged. A transaction is
+ * run from start to finish in a single call, so this is meant to be called
+ * from the swd module's bus state machine once per transaction rather than
+ * once per bit.
+ *
+ * Wiring for the Teensy 3.1:
+ *   SWCLK: PTD1 (pin 14), SPI0_SCK
+ *   SWDIO: PTD3 (pin 8), SPI0_SIN, tied directly to PTD2 (pin 7), SPI0_SOUT
+ *
+ * SPI0_SOUT is switched to a GPIO input whenever the target owns the line, so
+ * the two data pins never drive against each other.
+ */
+
+#ifndef _SWD_SPI_H_
+#define _SWD_SPI_H_
+
+#include "arm_cm4.h"
+
+/**
+ * Initializes SPI0 and its pins for use as a SWD bit engine
+ */
+void swd_spi_init(void);
+
+/**
+ * Sets the SPI baud rate and the bit-banged clock rate
+ * @param hz Requested clock frequency in Hz
+ * @return The clock frequency achieved in Hz
+ */
+uint32_t swd_spi_set_clock(uint32_t hz);
+
+/**
+ * Clocks a bit sequence onto the bus
+ * @param seq Sequence to transmit, 0th index first, lsb first
+ * @param bits Number of bits to transmit. Whole bytes go out as SPI frames
+ * and any bits after them are bit-banged.
+ */
+void swd_spi_send_seq(const uint8_t* seq, uint32_t bits);
+
+/**
+ * Clocks idle cycles (data low) onto the bus
+ * @param cycles Number of idle cycles. This is rounded up to a multiple of 8.
+ */
+void swd_spi_idle(uint32_t cycles);
+
+/**
+ * Performs a complete read transaction
+ * @param req Request byte
+ * @param data Destination for the data read
+ * @return SWD_OK or an error code
+ */
+int8_t swd_spi_read(uint8_t req, uint32_t* data);
+
+/**
+ * Performs a complete write transaction
+ * @param req Request byte
+ * @param data Data to write
+ * @return SWD_OK or an error code
+ */
+int8_t swd_spi_write(uint8_t req, uint32_t data);
+
+#endif // _SWD_SPI_H_
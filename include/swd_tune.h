@@ -0,0 +1,83 @@
+/**
+ * SWD clock auto-tuning
+ *
+ * A tuning run looks for the fastest SWD clock which the target and the
+ * wiring can handle. The clock is binary searched between a minimum, which
+ * must work, and a maximum. At each candidate clock the target is connected
+ * and its IDCODE is read several times and compared against the IDCODE read
+ * at the minimum clock. If a RAM address is given, a set of patterns is also
+ * written to that word through the MEM-AP and read back. A candidate passes
+ * only if every command succeeds with no invalid acknowledgements and no
+ * parity errors, not even ones which were fixed by a retry. The clock is
+ * locked in at the fastest passing candidate less a margin.
+ *
+ * Once a clock is locked in, the bus counters are watched while the adapter is
+ * in use. If the error rate over a window of transactions gets too high, the
+ * clock is stepped down, but never below the minimum of the last run.
+ *
+ * A run may ask for the search to be run again on each connect begun with
+ * swd_tune_begin_connect, over the same range but without the RAM test, as
+ * whatever is on the other end of the wire may have changed since. Otherwise
+ * connects are plain line resets.
+ *
+ * swd_tune_stop cancels a pending or running search, which then completes
+ * with SWD_ERR, and turns the watch and the connect runs off, so a clock set
+ * right after it is kept.
+ *
+ * Runs are performed by swd_tune_task, which blocks while commands go through
+ * the swd queue and so must be called from the main loop rather than from an
+ * interrupt. Other commands must not be queued while a run is pending, see
+ * swd_tune_busy.
+ */
+
+#ifndef _SWD_TUNE_H_
+#define _SWD_TUNE_H_
+
+#include "arm_cm4.h"
+#include "swd.h"
+
+/**
+ * Begins a tuning run. This may be called from an interrupt.
+ * @param min_hz Slowest clock to try. The target must work at this clock.
+ * @param max_hz Fastest clock to try
+ * @param ram_addr Word aligned address of a word in target RAM to test
+ * with. The word is restored after the run. Zero skips the RAM test.
+ * @param on_connect True if later connects begun with swd_tune_begin_connect
+ * run the search again, until the next run or swd_tune_stop
+ * @param res Written once the run is complete. The data is the clock that was
+ * locked in, in Hz.
+ * @return SWD_OK or SWD_ERR_BUSY if a run is already in progress
+ */
+int8_t swd_tune_begin(uint32_t min_hz, uint32_t max_hz, uint32_t ram_addr, uint8_t on_connect, swd_result_t* res);
+
+/**
+ * Begins a connect. If the last tuning run was begun with on_connect, this
+ * begins another with the same clocks and no RAM test, which ends connected
+ * at the clock it locks in. Otherwise it queues a line reset as swd_connect
+ * does. This may be called from an interrupt.
+ * @param res Written once the connect is complete. After a tuning run the
+ * data is the clock that was locked in, in Hz.
+ * @return SWD_OK or SWD_ERR_BUSY if the run or the line reset can't be begun
+ */
+int8_t swd_tune_begin_connect(swd_result_t* res);
+
+/**
+ * Stops tuning: a pending or running search is cancelled, connects no longer
+ * run the search and the bus counters are no longer watched, so a clock set
+ * afterwards is kept. This may be called from an interrupt.
+ */
+void swd_tune_stop(void);
+
+/**
+ * Returns true from when a run is begun until it is complete. The run needs
+ * the bus to itself meanwhile.
+ */
+uint8_t swd_tune_busy(void);
+
+/**
+ * Performs a pending tuning run and steps the clock down if the bus error
+ * rate is too high. Call this from the main loop.
+ */
+void swd_tune_task(void);
+
+#endif // _SWD_TUNE_H_
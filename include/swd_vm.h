@@ -0,0 +1,142 @@
+/**
+ * SWD program interpreter
+ *
+ * The host can upload a small program which drives the bus on its own, such
+ * as "for each page: write the page, start the flash stub, poll for done",
+ * and run it without a USB round trip between steps.
+ *
+ * A program is an array of 32-bit instructions. Each one is laid out as:
+ * bits 0-7   opcode
+ * bits 8-11  register a
+ * bits 12-15 register b
+ * bits 16-31 immediate, or register c in bits 16-19 and d in bits 20-23
+ *
+ * There are SWD_VM_REGISTERS 32-bit registers. Every bus op writes its result
+ * (SWD_OK or an error code, sign extended) to SWD_VM_STATUS and its data to
+ * SWD_VM_DATA, so the program can branch on the acknowledgement or the value.
+ * Bus ops don't stop the program when they fail. Jump targets are word
+ * indexes into the program. The data buffer is addressed in words as well.
+ *
+ * SWD_VM_HALT                   ends the program with SWD_OK
+ * SWD_VM_EXIT   a               ends the program with the low byte of a as the result
+ * SWD_VM_JMP    imm             jumps to imm
+ * SWD_VM_JZ     a, imm          jumps to imm if a is zero
+ * SWD_VM_JNZ    a, imm          jumps to imm if a is not zero
+ * SWD_VM_JEQ    a, b, imm       jumps to imm if a == b
+ * SWD_VM_JNE    a, b, imm       jumps to imm if a != b
+ * SWD_VM_JLO    a, b, imm       jumps to imm if a < b, unsigned
+ * SWD_VM_DJNZ   a, imm          decrements a, then jumps to imm if it is not zero
+ * SWD_VM_CALL   imm             pushes the next instruction and jumps to imm
+ * SWD_VM_RET                    pops the instruction to continue at
+ * SWD_VM_LDI    a, imm          a = imm
+ * SWD_VM_LDIH   a, imm          sets the upper 16 bits of a to imm
+ * SWD_VM_MOV    a, b            a = b
+ * SWD_VM_ADDI   a, b, imm       a = b + imm, where imm is signed
+ * SWD_VM_ADD    a, b, c         a = b + c, and likewise for SUB, AND, OR, XOR,
+ *                               SHL and SHR
+ * SWD_VM_LDW    a, b, imm       a = buffer[b + imm]
+ * SWD_VM_STW    a, b, imm       buffer[b + imm] = a
+ * SWD_VM_READ   a, imm          reads with request byte imm into a and the data register
+ * SWD_VM_WRITE  a, imm          writes a with request byte imm
+ * SWD_VM_MREAD  a, b, c         reads b words from address a to buffer[c]
+ * SWD_VM_MWRITE a, b, c         writes b words from buffer[c] to address a
+ * SWD_VM_POLL   a, b, c, d      polls address a until (value & b) == c, with
+ *                               the attempts in the lower half of d and the
+ *                               timeout in ms in the upper half
+ * SWD_VM_CONNECT                line reset and JTAG-to-SWD switch
+ * SWD_VM_DELAY  imm             waits imm microseconds
+ *
+ * MREAD, MWRITE and POLL go through the MEM-AP as swd_begin_mem_read and
+ * swd_begin_mem_poll do. The data register gets the number of words moved,
+ * or the last value polled.
+ *
+ * A program which does something invalid, such as an unknown opcode, a jump
+ * out of the program, a buffer access out of range or more than
+ * SWD_VM_CALL_DEPTH nested calls, ends with SWD_ERR and the data is the index
+ * of the offending instruction. Otherwise the data is r0.
+ *
+ * Programs are run by swd_vm_task, which blocks while commands go through the
+ * swd queue and so must be called from the main loop rather than from an
+ * interrupt. The host should not queue other commands while a program runs.
+ */
+
+#ifndef _SWD_VM_H_
+#define _SWD_VM_H_
+
+#include "arm_cm4.h"
+#include "swd.h"
+
+#define SWD_VM_PROGRAM_WORDS 256 //longest program, in instructions
+#define SWD_VM_REGISTERS 16
+#define SWD_VM_ARGUMENTS 4 //registers set by swd_vm_begin, starting at r0
+#define SWD_VM_STATUS 15 //register written with the result of each bus op
+#define SWD_VM_DATA 14 //register written with the data of each bus op
+#define SWD_VM_CALL_DEPTH 8
+
+#define SWD_VM_HALT   0x00
+#define SWD_VM_EXIT   0x01
+#define SWD_VM_JMP    0x02
+#define SWD_VM_JZ     0x03
+#define SWD_VM_JNZ    0x04
+#define SWD_VM_JEQ    0x05
+#define SWD_VM_JNE    0x06
+#define SWD_VM_JLO    0x07
+#define SWD_VM_DJNZ   0x08
+#define SWD_VM_CALL   0x09
+#define SWD_VM_RET    0x0a
+#define SWD_VM_LDI    0x10
+#define SWD_VM_LDIH   0x11
+#define SWD_VM_MOV    0x12
+#define SWD_VM_ADDI   0x13
+#define SWD_VM_ADD    0x14
+#define SWD_VM_SUB    0x15
+#define SWD_VM_AND    0x16
+#define SWD_VM_OR     0x17
+#define SWD_VM_XOR    0x18
+#define SWD_VM_SHL    0x19
+#define SWD_VM_SHR    0x1a
+#define SWD_VM_LDW    0x1b
+#define SWD_VM_STW    0x1c
+#define SWD_VM_READ   0x20
+#define SWD_VM_WRITE  0x21
+#define SWD_VM_MREAD  0x22
+#define SWD_VM_MWRITE 0x23
+#define SWD_VM_POLL   0x24
+#define SWD_VM_CONNECT 0x25
+#define SWD_VM_DELAY  0x26
+
+/**
+ * Begins running a program. This may be called from an interrupt. The
+ * program and buffer must stay valid and unchanged until it is done.
+ * @param program Instructions
+ * @param length Number of instructions, at most SWD_VM_PROGRAM_WORDS
+ * @param entry Index of the first instruction to run
+ * @param args Values for the first SWD_VM_ARGUMENTS registers. The rest start
+ * at zero.
+ * @param buffer Data buffer for the program
+ * @param words Number of words in the buffer
+ * @param res Written once the program is done
+ * @return SWD_OK or SWD_ERR_BUSY if a program is already running
+ */
+int8_t swd_vm_begin(const uint32_t* program, uint16_t length, uint16_t entry, const uint32_t* args,
+    uint32_t* buffer, uint16_t words, swd_result_t* res);
+
+/**
+ * Stops the running program before its next instruction. It ends with
+ * SWD_ERR. Commands it already queued still run. This may be called from an
+ * interrupt.
+ */
+void swd_vm_abort(void);
+
+/**
+ * Returns the registers of the last program, which are only meaningful once
+ * it is done
+ */
+const uint32_t* swd_vm_registers(void);
+
+/**
+ * Runs a pending program. Call this from the main loop.
+ */
+void swd_vm_task(void);
+
+#endif // _SWD_VM_H_
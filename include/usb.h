@@ -12,6 +12,13 @@
  */
 void usb_init(void);
 
+/**
+ * Runs batches received on the bulk OUT endpoint, sends their results back
+ * on the bulk IN endpoint and reports finished commands on the notification
+ * endpoint. Call this from the main loop.
+ */
+void usb_task(void);
+
 void usb_endp0_handler(uint8_t);
 void usb_endp1_handler(uint8_t);
 void usb_endp2_handler(uint8_t);
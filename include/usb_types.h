@@ -7,30 +7,199 @@
 
 /**
  * How this thing is going to work:
- * This USB code is based on mine from previously...we haven't yet used it with
- * endpoints and stuff and I want to keep this simple, so this only uses the
- * control endpoint.
+ * This USB code is based on mine from previously. Single commands and
+ * settings go through the control endpoint. Streams of commands go through
+ * a pair of bulk endpoints (see below). Commands begun through the control
+ * endpoint are reported on an interrupt endpoint as they finish.
  *
- * There are three control requests:
+ * There are nineteen control requests:
  * 0x2000 - Begin write request
  * 0x2100 - Begin read request
- * 0x2280 - Read request status
- *
- * Each request uses the wIndex field to send an 8-bit command index which will
- * be used to track the command. Commands are queued in the order received. The
- * indexes are shared between read and write. An attempt to begin a request
- * using an index whose swd_request_t.done is FALSE will result in a STALL since
- * the swd module still has control over that request. wIndex values greater
- * than 255 will result in a STALL.
- *
- * Any request can be read by issuing the read request status command with the
- * wIndex set to the index to be read. An index greater than 255 results in a
- * STALL.
+ * 0x2280 - Read completions
+ * 0x2300 - Begin connect request (no data stage)
+ * 0x2400 - Set SWD clock frequency
+ * 0x2480 - Get SWD clock frequency
+ * 0x2500 - Begin clock tuning request
+ * 0x2600 - Clear bus statistics (no data stage)
+ * 0x2680 - Read bus statistics
+ * 0x2700 - Set bus configuration
+ * 0x2780 - Get bus configuration
+ * 0x2800 - Begin pipelined AP read request
+ * 0x2900 - Begin MEM-AP block read request
+ * 0x2a00 - Begin MEM-AP block write request
+ * 0x2b00 - Write block buffer
+ * 0x2b80 - Read block buffer
+ * 0x2c00 - Write program buffer
+ * 0x2d00 - Begin program request
+ * 0x2d80 - Read program registers
+ *
+ * Each begin request uses the wIndex field to send an 8-bit tag, chosen by
+ * the host, which comes back with the result of the command. Commands are
+ * queued in the order received. wIndex values greater than 255 will result
+ * in a STALL.
+ *
+ * Begun commands go into a completion ring of USB_RING_LENGTH entries on the
+ * adapter. Once a command is done, it is taken out of the ring as a
+ * completion_t record with its tag, result and data. Records come out in the
+ * order the commands were begun, and each one carries a sequence number
+ * counting the records handed out since the configuration was last set, so
+ * the host can tell if it missed one. A begin request will STALL while the
+ * ring is full, which happens when the host doesn't read the records, so it
+ * should read them before retrying. Tags may be reused once a record for
+ * the earlier command has been read.
+ *
+ * The host reads records from endpoint 3 IN, an interrupt endpoint polled
+ * every frame, which sends them as soon as commands are done. Up to
+ * USB_NOTIFY_SIZE / sizeof(completion_t) records go in a packet. Hosts which
+ * can't use the interrupt endpoint can take records with the read
+ * completions request instead, which returns as many as are done and fit in
+ * wLength, possibly none. Each record is handed out once, through whichever
+ * of the two is read first.
+ *
+ * The clock requests don't use wIndex. Setting the clock takes a clock_req_t
+ * with the requested frequency in Hz. Getting the clock returns a uint32_t
+ * with the frequency in Hz that was actually achieved, which may be lower than
+ * the one requested. The new clock applies to commands which are started after
+ * the set request completes.
+ *
+ * A clock tuning request takes a tune_req_t and uses wIndex like the other
+ * begin requests. Its result data is the clock that was locked in, in Hz.
+ * Other begin requests will STALL until it is done. If its flags have
+ * USB_TUNE_ON_CONNECT, each connect request after it runs the search again
+ * over the same range, without the RAM test, and returns the clock like a
+ * tuning request does, until the next tuning request or the clock is set.
+ * Setting the clock also cancels a search in progress. See swd_tune.h.
+ *
+ * Reading the bus statistics returns a swd_stats_t with the bus error and
+ * transaction counters and the bus interrupt timing. Clearing them starts a
+ * new measurement.
+ *
+ * The configuration requests send and return a swd_config_t and don't use
+ * wIndex either.
+ *
+ * A pipelined AP read request takes a read_req_t with an AP read request byte
+ * and the number of reads in wValue. Each read gets its own record, in order
+ * and with the tag from wIndex, so the ring must have room for all of them or
+ * the request will STALL. The adapter collects the last value from RDBUFF, and
+ * each record gets the data of its own read. See swd_begin_read_pipelined.
+ *
+ * The MEM-AP block requests take a mem_req_t and use wIndex like the other
+ * begin requests. They move words between target memory and a block buffer
+ * of USB_BLOCK_WORDS words on the adapter, starting at word 0 of the buffer.
+ * The result data is the number of words that were moved. The block buffer
+ * is written and read with wValue set to the first word, up to one 64 byte
+ * packet at a time. While a block request is running, the buffer requests
+ * and other block requests will STALL. See swd_begin_mem_read.
+ *
+ * A program for the adapter's interpreter is uploaded to a program buffer of
+ * USB_PROGRAM_WORDS instructions in the same way as the block buffer. The
+ * begin program request takes a program_req_t with the first registers and the
+ * length of the program, the index of the instruction to start at in wValue,
+ * and uses wIndex like the other begin requests. Running past the length ends
+ * the program with SWD_ERR. The program uses the block buffer as its data, so
+ * it can move blocks without the host in between. The result is the result of
+ * the program and the data is its r0. Once it is done, all of its registers
+ * can be read with the read program registers request. While a program is
+ * running, the block and program buffer requests, block requests and other
+ * programs will STALL, and setting the configuration stops it. The host should
+ * not begin other requests until it is done. See swd_vm.h.
+ *
+ * Bulk endpoints:
+ * Endpoint 1 OUT takes batches and endpoint 2 IN returns one batch result for
+ * each of them, in order. A batch is a batch_header_t followed by ops, packed
+ * with no padding except where noted. It is sent as one bulk transfer of up
+ * to USB_BATCH_MAX bytes, and so is its result. The host should read the
+ * result with a buffer of USB_BATCH_MAX bytes. The adapter only runs one
+ * batch at a time and NAKs the next one until the result has been read.
+ * Batches share the bus with control requests.
+ *
+ * Each op is an opcode byte followed by its operands, all little endian:
+ * USB_BATCH_READ        request (1)
+ * USB_BATCH_WRITE       request (1), data (4)
+ * USB_BATCH_READ_BLOCK  addr (4), count (2)
+ * USB_BATCH_WRITE_BLOCK addr (4), count (2), 0-3 zero bytes so the words
+ *                       start at a multiple of 4 from the start of the batch,
+ *                       words (4 * count)
+ * USB_BATCH_DELAY       microseconds (2), waits after the ops before it are done
+ * USB_BATCH_POLL        addr (4), mask (4), expect (4), attempts (2),
+ *                       timeout milliseconds (2), 0 for no limit
+ * USB_BATCH_CONNECT     no operands
+ * The block and poll ops go through the MEM-AP as swd_begin_mem_read and
+ * swd_begin_mem_poll do, so the MEM-AP must already be selected. A poll
+ * which never matches fails with SWD_ERR_TIMEOUT.
+ *
+ * The result is a batch_result_header_t, then an int8_t result for each op in
+ * the batch, then zero bytes up to a multiple of 4, then uint32_t data words.
+ * READ ops have one data word each and READ_BLOCK ops have count words.
+ * POLL ops have two: the last value read and the number of values read. Ops
+ * which return no data have none. The layout depends only on the batch, so
+ * the host can find every word without looking at the results.
+ *
+ * Ops are handed to the swd queue as it has room. Once an op fails, no more
+ * ops are started and the rest are reported as USB_BATCH_SKIPPED, but ops
+ * which were already queued still run. If the batch can't be parsed, none of
+ * it runs and failed points at the op that was bad.
+ *
+ * When the firmware is built with USB_CMSIS_DAP, the bulk endpoints carry
+ * CMSIS-DAP v2 commands instead of batches and the interface is named so
+ * that CMSIS-DAP hosts find it. The control requests work the same in both
+ * modes. See swd_dap.h.
+ *
+ * The adapter keeps its SWD session between requests, so the line reset is
+ * only sent before the first request, after a protocol error (SWD_ERR_BUS), or
+ * when a connect request is issued.
  */
 
 #define USB_SWD_BEGIN_READ 0x2000
 #define USB_SWD_BEGIN_WRITE 0x2100
-#define USB_SWD_READ_STATUS 0x2280
+#define USB_SWD_READ_COMPLETIONS 0x2280
+#define USB_SWD_CONNECT 0x2300
+#define USB_SWD_SET_CLOCK 0x2400
+#define USB_SWD_GET_CLOCK 0x2480
+#define USB_SWD_TUNE 0x2500
+#define USB_SWD_CLEAR_STATS 0x2600
+#define USB_SWD_READ_STATS 0x2680
+#define USB_SWD_SET_CONFIG 0x2700
+#define USB_SWD_GET_CONFIG 0x2780
+#define USB_SWD_BEGIN_READ_PIPELINED 0x2800
+#define USB_SWD_BEGIN_MEM_READ 0x2900
+#define USB_SWD_BEGIN_MEM_WRITE 0x2a00
+#define USB_SWD_WRITE_BLOCK 0x2b00
+#define USB_SWD_READ_BLOCK 0x2b80
+
+#define USB_SWD_WRITE_PROGRAM 0x2c00
+#define USB_SWD_BEGIN_PROGRAM 0x2d00
+#define USB_SWD_READ_REGISTERS 0x2d80
+
+#define USB_TUNE_ON_CONNECT 0x01 //tune_req_t flag: connect requests run the search again
+
+#define USB_BLOCK_WORDS 256 //words in the block buffer
+#define USB_PROGRAM_WORDS 256 //instructions in the program buffer
+#define USB_PROGRAM_ARGUMENTS 4 //registers set by a begin program request, from r0
+
+#define USB_BULK_OUT_ENDPOINT 1
+#define USB_BULK_IN_ENDPOINT 2
+#define USB_BULK_SIZE 64 //max packet size of the bulk endpoints
+
+#define USB_NOTIFY_ENDPOINT 3
+#define USB_NOTIFY_SIZE 64 //max packet size of the notification endpoint
+
+#define USB_RING_LENGTH 64 //commands which can be begun before their records are read, a power of two
+
+#define USB_BATCH_VERSION 1
+#define USB_BATCH_MAX 1024 //bytes in a batch or a batch result, header included
+#define USB_BATCH_MAX_OPS 128
+
+#define USB_BATCH_READ        0x01
+#define USB_BATCH_WRITE       0x02
+#define USB_BATCH_READ_BLOCK  0x03
+#define USB_BATCH_WRITE_BLOCK 0x04
+#define USB_BATCH_DELAY       0x05
+#define USB_BATCH_POLL        0x06
+#define USB_BATCH_CONNECT     0x07
+
+#define USB_BATCH_SKIPPED     1      //op result for ops that weren't run
+#define USB_BATCH_NO_FAILURE  0xffff //failed index when every op succeeded
 
 #ifdef __cplusplus
 extern "C"
@@ -46,6 +215,50 @@ typedef struct {
     uint32_t data;
 } write_req_t;
 
+typedef struct {
+    uint32_t hz;
+} clock_req_t;
+
+typedef struct {
+    uint32_t min_hz;
+    uint32_t max_hz;
+    uint32_t ram_addr; //zero to skip the RAM test
+    uint32_t flags; //USB_TUNE_ON_CONNECT or zero
+} tune_req_t;
+
+typedef struct {
+    uint32_t addr; //word aligned
+    uint32_t count; //words, at most USB_BLOCK_WORDS
+} mem_req_t;
+
+typedef struct {
+    uint32_t args[USB_PROGRAM_ARGUMENTS];
+    uint32_t length; //instructions uploaded, at most USB_PROGRAM_WORDS
+} program_req_t;
+
+typedef struct {
+    uint8_t version; //USB_BATCH_VERSION
+    uint8_t tag; //copied into the result
+    uint16_t length; //bytes in the batch, header included
+    uint16_t count; //ops in the batch
+    uint16_t reserved;
+} batch_header_t;
+
+typedef struct {
+    uint8_t version; //USB_BATCH_VERSION
+    uint8_t tag; //tag of the batch
+    uint16_t length; //bytes in the result, header included
+    uint16_t count; //ops in the batch, and so results
+    uint16_t failed; //index of the first op that failed, or USB_BATCH_NO_FAILURE
+} batch_result_header_t;
+
+typedef struct {
+    uint16_t sequence; //records handed out before this one, see above
+    uint8_t tag; //wIndex the command was begun with
+    int8_t result;
+    uint32_t data;
+} completion_t;
+
 #ifdef __cplusplus
 }
 #endif
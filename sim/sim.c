@@ -0,0 +1,550 @@
+/**
+ * Software-in-the-loop driver for the adapter firmware, see sim.h
+ */
+
+#include "sim_regs.h"
+#include "sim.h"
+#include "usb.h"
+#include "swd.h"
+#include "swd_tune.h"
+#include "swd_vm.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#define SIM_IRQS 128 //entries for the vector numbers given to enable_irq
+
+#define SIM_CLK_MASK (1<<SWD_CLK_PIN)
+#define SIM_DIO_MASK (1<<SWD_DIO_PIN)
+#define SIM_LED_MASK (1<<5)
+
+#define SIM_USB_PACKET 64 //max packet size of every endpoint
+
+#define SIM_PASS_YIELDS 1000 //times to yield waiting for the main loop before going on without it
+#define SIM_IDLE_NS 1000000 //time between passes of the main loop while idle
+
+//token pids, as the usb module writes them into a buffer descriptor
+#define SIM_PID_OUT   0x1
+#define SIM_PID_IN    0x9
+#define SIM_PID_SETUP 0xd
+
+#define SIM_BDT_OWN_MASK   0x80
+#define SIM_BDT_DATA1_MASK 0x40
+
+/**
+ * Buffer descriptor, laid out as the firmware declares it in usb.c
+ */
+typedef struct {
+    uint32_t desc;
+    void* addr;
+} sim_bdt_t;
+
+void FTM0_IRQHandler(void);
+void USBOTG_IRQHandler(void);
+
+/**
+ * Held while an interrupt runs or is being masked, so the main loop never
+ * sees an interrupt half done. It is recursive since interrupts mask others.
+ */
+static pthread_mutex_t sim_cpu;
+
+static volatile uint8_t sim_masked[SIM_IRQS];
+
+static pthread_t sim_main_thread;
+static volatile uint8_t sim_stopping;
+static volatile uint32_t sim_passes; //passes of the main loop made
+static volatile uint8_t sim_idling; //true to slow the main loop down while nothing drives the bus
+static void (*volatile sim_preempt_fn)(void); //run on the main loop's thread, see sim_preempt
+
+static sim_target_t sim_target_clock;
+static void* sim_target;
+static int sim_target_drive = -1; //level the target drives, or -1
+
+static uint64_t sim_cycle_count;
+static uint64_t sim_edges;
+
+//dma engine batch being run
+static uint8_t sim_dma_running;
+static uint64_t sim_dma_end; //cycle the batch finishes at
+
+//ping-pong buffer the usb module uses next for each endpoint and direction
+static uint8_t sim_usb_odd[16][2];
+
+void enable_irq(int irq)
+{
+    pthread_mutex_lock(&sim_cpu);
+    sim_masked[irq % SIM_IRQS] = 0;
+    pthread_mutex_unlock(&sim_cpu);
+}
+
+void disable_irq(int irq)
+{
+    pthread_mutex_lock(&sim_cpu);
+    sim_masked[irq % SIM_IRQS] = 1;
+    pthread_mutex_unlock(&sim_cpu);
+}
+
+/**
+ * Takes the cpu once an interrupt is unmasked. The main loop is left to run
+ * until it unmasks the interrupt.
+ * @param irq Interrupt, as given to enable_irq
+ */
+static void sim_enter(int irq)
+{
+    pthread_mutex_lock(&sim_cpu);
+    while (sim_masked[irq % SIM_IRQS])
+    {
+        pthread_mutex_unlock(&sim_cpu);
+        sched_yield();
+        pthread_mutex_lock(&sim_cpu);
+    }
+}
+
+static void sim_leave(void)
+{
+    pthread_mutex_unlock(&sim_cpu);
+}
+
+/**
+ * Applies writes to the set, clear and toggle registers of a port
+ */
+static void sim_gpio_apply(volatile struct GPIO_MemMap* gpio)
+{
+    gpio->PDOR |= gpio->PSOR;
+    gpio->PDOR &= ~gpio->PCOR;
+    gpio->PDOR ^= gpio->PTOR;
+    gpio->PSOR = 0;
+    gpio->PCOR = 0;
+    gpio->PTOR = 0;
+}
+
+/**
+ * Returns the level of SWDIO
+ */
+static int sim_dio(void)
+{
+    if (sim_ptd.PDDR & SIM_DIO_MASK)
+        return (sim_ptd.PDOR & SIM_DIO_MASK) ? 1 : 0;
+    return sim_target_drive >= 0 ? sim_target_drive : 1;
+}
+
+/**
+ * Clocks the target on a rising edge of SWCLK
+ */
+static void sim_rising_edge(void)
+{
+    sim_edges++;
+    if (sim_target_clock)
+        sim_target_drive = sim_target_clock(sim_target, sim_dio());
+}
+
+/**
+ * Returns what the port reads back, with SWDIO as the line is
+ */
+static uint32_t sim_pdir(void)
+{
+    return (sim_ptd.PDOR & ~SIM_DIO_MASK) | (sim_dio() << SWD_DIO_PIN);
+}
+
+/**
+ * Notes a dma engine batch once swd_dma_start has set it going, and works out
+ * when it finishes: channel 2 and 3 step once per pit period each.
+ */
+static void sim_dma_check(void)
+{
+    uint32_t steps;
+
+    if (sim_dma_running || !(PIT_TCTRL3 & PIT_TCTRL_TEN_MASK) || (DMA_TCD3_CSR & DMA_CSR_DONE_MASK))
+        return;
+
+    steps = DMA_TCD3_CITER_ELINKNO & DMA_CITER_ELINKNO_CITER_MASK;
+    sim_dma_running = 1;
+    sim_dma_end = sim_cycle_count + (uint64_t)steps * (PIT_LDVAL3 + 1) * core_clk_khz / periph_clk_khz;
+}
+
+/**
+ * Replays a dma engine batch against the target once the time it takes has
+ * passed. Each step writes a byte to PDDR and one to PDOR, then PDIR is
+ * sampled.
+ */
+static void sim_dma_run(void)
+{
+    const uint8_t* out;
+    uint8_t* in;
+    uint32_t i, steps;
+    uint8_t low;
+
+    if (!sim_dma_running || sim_cycle_count < sim_dma_end)
+        return;
+
+    steps = DMA_TCD3_CITER_ELINKNO & DMA_CITER_ELINKNO_CITER_MASK;
+    out = (const uint8_t*)(uintptr_t)DMA_TCD2_SADDR;
+    in = (uint8_t*)(uintptr_t)DMA_TCD3_DADDR;
+    for (i = 0; i < steps; i++)
+    {
+        low = !(sim_ptd.PDOR & SIM_CLK_MASK);
+        sim_ptd.PDDR = (sim_ptd.PDDR & ~0xff) | out[i * 2];
+        sim_ptd.PDOR = (sim_ptd.PDOR & ~0xff) | out[i * 2 + 1];
+        if (low && (sim_ptd.PDOR & SIM_CLK_MASK))
+            sim_rising_edge();
+        in[i] = (uint8_t)sim_pdir();
+    }
+
+    DMA_TCD2_CSR |= DMA_CSR_DONE_MASK;
+    DMA_TCD3_CSR |= DMA_CSR_DONE_MASK;
+    sim_dma_running = 0;
+}
+
+/**
+ * Lets the main loop make a full pass, unless it is waiting on the bus
+ */
+static void sim_wait_pass(void)
+{
+    static uint32_t stalled_at = 0xffffffff; //pass the main loop was stuck in when the last wait gave up
+    uint32_t start = sim_passes;
+    uint32_t i;
+
+    //a main loop still stuck on the bus would only hold the bus up, and on one
+    //cpu each yield to it would cost a whole time slice
+    if (start == stalled_at)
+        return;
+
+    for (i = 0; i < SIM_PASS_YIELDS && sim_passes - start < 2; i++)
+    {
+        sched_yield();
+    }
+    stalled_at = sim_passes - start < 2 ? sim_passes : 0xffffffff;
+}
+
+/**
+ * Runs the main loop as main.c does
+ */
+static void* sim_main(void* arg)
+{
+    struct timespec idle = { 0, SIM_IDLE_NS };
+
+    while (!sim_stopping)
+    {
+        swd_tune_task();
+        swd_vm_task();
+        usb_task();
+        sim_passes++;
+        if (sim_idling)
+            nanosleep(&idle, NULL);
+        else
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+void sim_init(int engine)
+{
+    pthread_mutexattr_t attr;
+    uint32_t i;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&sim_cpu, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    //interrupts start out disabled, as in the nvic
+    for (i = 0; i < SIM_IRQS; i++)
+    {
+        sim_masked[i] = 1;
+    }
+
+    //the led is set up by main
+    GPIOC_PDDR = SIM_LED_MASK;
+
+    usb_init();
+    swd_init(engine);
+    sim_gpio_apply(&sim_ptc);
+    sim_gpio_apply(&sim_ptd);
+
+    sim_stopping = 0;
+    pthread_create(&sim_main_thread, NULL, sim_main, NULL);
+
+    sim_usb_reset();
+}
+
+void sim_stop(void)
+{
+    sim_stopping = 1;
+    pthread_join(sim_main_thread, NULL);
+}
+
+void sim_idle(uint8_t idle)
+{
+    sim_idling = idle;
+}
+
+void sim_settle(void)
+{
+    sim_wait_pass();
+}
+
+void sim_preempt(void (*preempt)(void))
+{
+    sim_preempt_fn = preempt;
+}
+
+//called on entry to and return from every function in swd.c
+void __cyg_profile_func_enter(void* fn, void* site)
+{
+}
+
+void __cyg_profile_func_exit(void* fn, void* site)
+{
+    void (*preempt)(void) = sim_preempt_fn;
+
+    if (!preempt || !pthread_equal(pthread_self(), sim_main_thread) || sim_masked[IRQ(INT_USB0) % SIM_IRQS])
+        return;
+
+    sim_preempt_fn = NULL;
+    preempt();
+}
+
+void sim_set_target(sim_target_t clock, void* target)
+{
+    pthread_mutex_lock(&sim_cpu);
+    sim_target_clock = clock;
+    sim_target = target;
+    sim_target_drive = -1;
+    pthread_mutex_unlock(&sim_cpu);
+}
+
+void sim_cycle(void)
+{
+    uint32_t ticks;
+
+    sim_enter(IRQ(INT_FTM0));
+
+    sim_dma_run();
+    DWT_CYCCNT = (uint32_t)sim_cycle_count;
+
+    //overflow: the ftm engine raises the clock here, so the target sees the edge first
+    if (!(sim_ptd.PDOR & SIM_CLK_MASK))
+        sim_rising_edge();
+    sim_ptd.PDIR = sim_pdir();
+    if (FTM0_SC & FTM_SC_TOIE_MASK)
+    {
+        FTM0_SC |= FTM_SC_TOF_MASK;
+        FTM0_IRQHandler();
+        sim_gpio_apply(&sim_ptd);
+    }
+    sim_dma_check();
+
+    //channel match, half a period later
+    if (FTM0_C0SC & FTM_CnSC_CHIE_MASK)
+    {
+        FTM0_C0SC |= FTM_CnSC_CHF_MASK;
+        FTM0_IRQHandler();
+        sim_gpio_apply(&sim_ptd);
+    }
+
+    ticks = (FTM0_MOD - FTM0_CNTIN + 1) << (FTM0_SC & FTM_SC_PS_MASK);
+    sim_cycle_count += (uint64_t)ticks * core_clk_khz / periph_clk_khz;
+    DWT_CYCCNT = (uint32_t)sim_cycle_count;
+
+    sim_leave();
+    sim_wait_pass();
+}
+
+void sim_run(uint32_t periods)
+{
+    while (periods--)
+    {
+        sim_cycle();
+    }
+}
+
+uint64_t sim_cycles(void)
+{
+    return sim_cycle_count;
+}
+
+uint32_t sim_clock_hz(void)
+{
+    return (uint32_t)core_clk_khz * 1000;
+}
+
+uint64_t sim_swclk(void)
+{
+    return sim_edges;
+}
+
+uint8_t sim_led(void)
+{
+    return (sim_ptc.PDOR & SIM_LED_MASK) ? 1 : 0;
+}
+
+/**
+ * Raises the usb interrupt for the flags in ISTAT and applies what the
+ * firmware did to the port and the ping-pong buffers. Called with the cpu
+ * taken.
+ */
+static void sim_usb_interrupt(void)
+{
+    uint8_t i;
+
+    USBOTG_IRQHandler();
+    USB0_ISTAT = 0;
+    sim_gpio_apply(&sim_ptc);
+
+    if (USB0_CTL & USB_CTL_ODDRST_MASK)
+    {
+        for (i = 0; i < 16; i++)
+        {
+            sim_usb_odd[i][0] = 0;
+            sim_usb_odd[i][1] = 0;
+        }
+        USB0_CTL &= ~USB_CTL_ODDRST_MASK;
+    }
+}
+
+void sim_usb_reset(void)
+{
+    sim_enter(IRQ(INT_USB0));
+    memset(sim_usb_odd, 0, sizeof(sim_usb_odd));
+    USB0_ISTAT = USB_ISTAT_USBRST_MASK;
+    sim_usb_interrupt();
+    sim_leave();
+}
+
+/**
+ * Runs a token through the buffer descriptor the usb module would use next
+ * @param endpoint Endpoint number
+ * @param pid SIM_PID_SETUP, SIM_PID_OUT or SIM_PID_IN
+ * @param data Packet to send, or a buffer for the packet received
+ * @param length Bytes in the packet sent
+ * @return Bytes sent or received, SIM_USB_NAK or SIM_USB_STALL
+ */
+static int sim_usb_token(uint8_t endpoint, uint8_t pid, void* data, uint16_t length)
+{
+    volatile sim_bdt_t* table;
+    volatile sim_bdt_t* bdt;
+    uint8_t tx = pid == SIM_PID_IN;
+    uint8_t odd;
+    uint32_t count;
+
+    endpoint &= 0xf;
+    sim_enter(IRQ(INT_USB0));
+
+    //a setup always gets through, and clears a stall
+    if (pid == SIM_PID_SETUP)
+    {
+        USB0_ENDPT(endpoint) &= ~USB_ENDPT_EPSTALL_MASK;
+    }
+    else if (USB0_ENDPT(endpoint) & USB_ENDPT_EPSTALL_MASK)
+    {
+        sim_leave();
+        return SIM_USB_STALL;
+    }
+
+    table = (volatile sim_bdt_t*)(uintptr_t)(((uint32_t)USB0_BDTPAGE3 << 24) |
+        ((uint32_t)USB0_BDTPAGE2 << 16) | ((uint32_t)(USB0_BDTPAGE1 & 0xfe) << 8));
+    odd = sim_usb_odd[endpoint][tx];
+    bdt = &table[(endpoint << 2) | (tx << 1) | odd];
+    if (!(bdt->desc & SIM_BDT_OWN_MASK))
+    {
+        sim_leave();
+        return SIM_USB_NAK;
+    }
+
+    count = (bdt->desc >> 16) & 0x3ff;
+    if (tx)
+    {
+        if (count > SIM_USB_PACKET)
+            count = SIM_USB_PACKET;
+        memcpy(data, bdt->addr, count);
+    }
+    else
+    {
+        if (count > length)
+            count = length;
+        memcpy(bdt->addr, data, count);
+    }
+
+    //the usb module hands the buffer back with the token pid
+    bdt->desc = (count << 16) | (pid << 2) | (bdt->desc & SIM_BDT_DATA1_MASK);
+    sim_usb_odd[endpoint][tx] ^= 1;
+
+    USB0_STAT = (endpoint << 4) | (tx << 3) | (odd << 2);
+    if (pid == SIM_PID_SETUP)
+        USB0_CTL |= USB_CTL_TXSUSPENDTOKENBUSY_MASK;
+    USB0_ISTAT = USB_ISTAT_TOKDNE_MASK;
+    sim_usb_interrupt();
+
+    sim_leave();
+    return count;
+}
+
+int sim_usb_control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, void* data, uint16_t length)
+{
+    uint8_t setup[8];
+    uint8_t packet[SIM_USB_PACKET];
+    uint16_t done = 0;
+    int n;
+
+    setup[0] = type;
+    setup[1] = request;
+    setup[2] = value & 0xff;
+    setup[3] = value >> 8;
+    setup[4] = index & 0xff;
+    setup[5] = index >> 8;
+    setup[6] = length & 0xff;
+    setup[7] = length >> 8;
+    n = sim_usb_token(0, SIM_PID_SETUP, setup, sizeof(setup));
+    if (n < 0)
+        return n;
+
+    if (type & 0x80)
+    {
+        //data stage in, until a short packet
+        while (done < length)
+        {
+            n = sim_usb_token(0, SIM_PID_IN, packet, 0);
+            if (n == SIM_USB_STALL)
+                return n;
+            if (n < 0)
+                break;
+            if (n > length - done)
+                n = length - done;
+            memcpy((uint8_t*)data + done, packet, n);
+            done += n;
+            if (n < SIM_USB_PACKET)
+                break;
+        }
+        n = sim_usb_token(0, SIM_PID_OUT, packet, 0);
+    }
+    else
+    {
+        //data stage out, a packet at a time
+        while (done < length)
+        {
+            n = length - done;
+            if (n > SIM_USB_PACKET)
+                n = SIM_USB_PACKET;
+            n = sim_usb_token(0, SIM_PID_OUT, (uint8_t*)data + done, n);
+            if (n < 0)
+                return n;
+            done += n;
+        }
+        n = sim_usb_token(0, SIM_PID_IN, packet, 0);
+    }
+
+    return n == SIM_USB_STALL ? n : done;
+}
+
+int sim_usb_in(uint8_t endpoint, void* data)
+{
+    return sim_usb_token(endpoint, SIM_PID_IN, data, 0);
+}
+
+int sim_usb_out(uint8_t endpoint, const void* data, uint16_t length)
+{
+    return sim_usb_token(endpoint, SIM_PID_OUT, (void*)data, length);
+}
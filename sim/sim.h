@@ -0,0 +1,164 @@
+/**
+ * Software-in-the-loop driver for the adapter firmware
+ *
+ * "make sim" builds the firmware sources for the host against the mock
+ * register file in sim_regs.h and links them with this driver, which plays
+ * the part of the hardware:
+ *
+ * - The main loop (swd_tune_task, swd_vm_task and usb_task) runs on a thread
+ *   of its own, started by sim_init.
+ * - sim_cycle steps FTM0 by one period and calls FTM0_IRQHandler for the
+ *   overflow and, with the FTM engine, for the channel match. A DMA engine
+ *   batch is replayed step by step once it has been started.
+ * - The sim_usb_* functions act as the USB module. They put a token from the
+ *   host into the buffer descriptors, or take a packet out of them, and call
+ *   USBOTG_IRQHandler.
+ *
+ * Interrupts are called from whichever thread calls the driver, one at a
+ * time, while the main loop keeps running. disable_irq holds an interrupt
+ * off until enable_irq, as it does on the hardware.
+ *
+ * Time is counted in core clock cycles from the FTM0 periods and DMA steps.
+ * After each period the main loop is given a full pass before the bus goes
+ * on, as if it took no time, so a run of commands takes the same number of
+ * cycles every time. The DWT cycle counter follows the count. Only while the
+ * main loop waits on the bus itself, as clock tuning and programs do, does
+ * the bus go on without it.
+ *
+ * The target is clocked on every rising edge of SWCLK. It is given the level
+ * the adapter drives on SWDIO, or the level of the line if the adapter isn't
+ * driving it, and returns the level it drives until the next rising edge, or
+ * -1 to leave the line to the pull-up. With no target the line floats high.
+ *
+ * Only the FTM and DMA engines can be simulated. The SPI engine waits on the
+ * SPI module from its interrupt, which isn't modelled.
+ */
+
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <stdint.h>
+
+//engines, as in swd_engine_t
+#define SIM_ENGINE_FTM 0
+#define SIM_ENGINE_DMA 2
+
+//token results
+#define SIM_USB_NAK   -1 //the endpoint had no buffer ready
+#define SIM_USB_STALL -2 //the endpoint is stalled
+
+/**
+ * Target clocked by the bus
+ * @param target Target given to sim_set_target
+ * @param swdio Level of SWDIO
+ * @return Level the target drives, or -1 if it doesn't
+ */
+typedef int (*sim_target_t)(void* target, int swdio);
+
+/**
+ * Initializes the firmware as main does and starts the main loop
+ * @param engine SIM_ENGINE_FTM or SIM_ENGINE_DMA
+ */
+void sim_init(int engine);
+
+/**
+ * Stops the main loop
+ */
+void sim_stop(void);
+
+/**
+ * Slows the main loop down to a pass a millisecond, so it doesn't take a
+ * whole host cpu while nothing drives the bus
+ * @param idle True to slow it down, false to let it run flat out again
+ */
+void sim_idle(uint8_t idle);
+
+/**
+ * Lets the main loop make a full pass without stepping the bus
+ */
+void sim_settle(void);
+
+/**
+ * Preempts the main loop: the function is run once, on the main loop's
+ * thread, when the main loop next returns from a function in swd.c with the
+ * USB interrupt enabled. It can call the sim_usb_* functions, so the USB
+ * interrupt runs right in the middle of whatever the main loop was queueing,
+ * which the host's timing could only hit by luck. The sim build compiles
+ * swd.c with -finstrument-functions for this.
+ * @param preempt Function to run, or NULL for none
+ */
+void sim_preempt(void (*preempt)(void));
+
+/**
+ * Connects a target to the bus
+ * @param clock Called on every rising edge of SWCLK, or NULL for no target
+ * @param target Passed to clock
+ */
+void sim_set_target(sim_target_t clock, void* target);
+
+/**
+ * Steps the bus by one FTM0 period
+ */
+void sim_cycle(void);
+
+/**
+ * Steps the bus by a number of FTM0 periods
+ */
+void sim_run(uint32_t periods);
+
+/**
+ * Returns the core clock cycles simulated since sim_init
+ */
+uint64_t sim_cycles(void);
+
+/**
+ * Returns the core clock frequency the cycles are counted at
+ */
+uint32_t sim_clock_hz(void);
+
+/**
+ * Returns the rising edges of SWCLK since sim_init
+ */
+uint64_t sim_swclk(void);
+
+/**
+ * Returns true while the LED on PTC5 is lit
+ */
+uint8_t sim_led(void);
+
+/**
+ * Resets the USB bus, as the host does before enumerating
+ */
+void sim_usb_reset(void);
+
+/**
+ * Runs a control transfer on endpoint 0: the setup, the data stage and the
+ * status stage
+ * @param type bmRequestType, whose top bit gives the direction of the data
+ * @param request bRequest
+ * @param value wValue
+ * @param index wIndex
+ * @param data Data to send, or a buffer for the data received
+ * @param length wLength
+ * @return Bytes sent or received, or SIM_USB_STALL
+ */
+int sim_usb_control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, void* data, uint16_t length);
+
+/**
+ * Sends an IN token
+ * @param endpoint Endpoint number
+ * @param data Buffer for the packet, of at least the max packet size
+ * @return Bytes received, SIM_USB_NAK or SIM_USB_STALL
+ */
+int sim_usb_in(uint8_t endpoint, void* data);
+
+/**
+ * Sends an OUT token with a packet
+ * @param endpoint Endpoint number
+ * @param data Packet
+ * @param length Bytes in the packet, at most the max packet size
+ * @return Bytes accepted, SIM_USB_NAK or SIM_USB_STALL
+ */
+int sim_usb_out(uint8_t endpoint, const void* data, uint16_t length);
+
+#endif // _SIM_H_
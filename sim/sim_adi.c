@@ -0,0 +1,493 @@
+/**
+ * Simulated ADIv5 debug port and MEM-AP, see sim_adi.h
+ */
+
+#include "sim_adi.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_ADI_ACK_OK    0x1
+#define SIM_ADI_ACK_WAIT  0x2
+#define SIM_ADI_ACK_FAULT 0x4
+
+#define SIM_ADI_JTAG_TO_SWD 0xe79e
+
+//request fields
+#define SIM_ADI_APnDP_MASK  0x02
+#define SIM_ADI_RnW_MASK    0x04
+#define SIM_ADI_ADDR(req)   (((req) >> 1) & 0xc)
+#define SIM_ADI_PARITY_MASK 0x20
+#define SIM_ADI_STOP_MASK   0x40
+#define SIM_ADI_PARK_MASK   0x80
+#define SIM_ADI_READ_IDCODE 0xa5
+
+//ABORT
+#define SIM_ADI_DAPABORT   (1u << 0)
+#define SIM_ADI_STKCMPCLR  (1u << 1)
+#define SIM_ADI_STKERRCLR  (1u << 2)
+#define SIM_ADI_WDERRCLR   (1u << 3)
+#define SIM_ADI_ORUNERRCLR (1u << 4)
+
+//CTRL/STAT
+#define SIM_ADI_ORUNDETECT   (1u << 0)
+#define SIM_ADI_STICKYORUN   (1u << 1)
+#define SIM_ADI_STICKYCMP    (1u << 4)
+#define SIM_ADI_STICKYERR    (1u << 5)
+#define SIM_ADI_WDATAERR     (1u << 7)
+#define SIM_ADI_CDBGPWRUPREQ (1u << 28)
+#define SIM_ADI_CSYSPWRUPREQ (1u << 30)
+#define SIM_ADI_STICKY_MASK  (SIM_ADI_STICKYORUN | SIM_ADI_STICKYCMP | SIM_ADI_STICKYERR | SIM_ADI_WDATAERR)
+#define SIM_ADI_ERROR_MASK   (SIM_ADI_STICKYORUN | SIM_ADI_STICKYERR | SIM_ADI_WDATAERR)
+#define SIM_ADI_ACK_MASK     ((SIM_ADI_CDBGPWRUPREQ | SIM_ADI_CSYSPWRUPREQ) << 1)
+
+//CSW
+#define SIM_ADI_CSW_SIZE_MASK    0x07
+#define SIM_ADI_CSW_ADDRINC_MASK 0x30
+#define SIM_ADI_CSW_ADDRINC_OFF  0x00
+#define SIM_ADI_CSW_DEVICEEN     0x40
+#define SIM_ADI_CSW_TRINPROG     0x80
+
+#define SIM_ADI_BASE 0xe00ff003 //ROM table of a Cortex-M4
+
+static uint8_t sim_adi_parity(uint32_t data)
+{
+    data ^= data >> 16;
+    data ^= data >> 8;
+    data ^= data >> 4;
+    data &= 0xf;
+    return (0x6996 >> data) & 1;
+}
+
+/**
+ * Finds the word of target memory at an address
+ * @param create True to add a page for the word if there isn't one
+ * @return The word, or NULL if it has never been written
+ */
+static uint32_t* sim_adi_word(sim_adi_t* t, uint32_t addr, uint8_t create)
+{
+    uint32_t base = addr & ~0x3ffu;
+    uint32_t i;
+
+    for (i = 0; i < t->n_pages; i++)
+    {
+        if (t->pages[i].base == base)
+            return &t->pages[i].words[(addr & 0x3ff) >> 2];
+    }
+
+    if (!create)
+        return NULL;
+
+    if (t->n_pages == t->max_pages)
+    {
+        t->max_pages = t->max_pages ? t->max_pages * 2 : 16;
+        t->pages = realloc(t->pages, t->max_pages * sizeof(sim_adi_page_t));
+    }
+    t->pages[t->n_pages].base = base;
+    memset(t->pages[t->n_pages].words, 0, sizeof(t->pages[t->n_pages].words));
+    return &t->pages[t->n_pages++].words[(addr & 0x3ff) >> 2];
+}
+
+uint32_t sim_adi_read_mem(sim_adi_t* t, uint32_t addr)
+{
+    uint32_t* word = sim_adi_word(t, addr, 0);
+
+    return word ? *word : 0;
+}
+
+void sim_adi_write_mem(sim_adi_t* t, uint32_t addr, uint32_t value)
+{
+    *sim_adi_word(t, addr, 1) = value;
+}
+
+void sim_adi_init(sim_adi_t* t)
+{
+    memset(t, 0, sizeof(*t));
+    t->idcode = SIM_ADI_IDCODE;
+    t->phase = SIM_ADI_JTAG;
+    t->csw = SIM_ADI_CSW_DEVICEEN;
+}
+
+void sim_adi_free(sim_adi_t* t)
+{
+    free(t->pages);
+    t->pages = NULL;
+    t->n_pages = 0;
+    t->max_pages = 0;
+}
+
+/**
+ * Returns the bytes a DRW access moves, from the CSW size
+ */
+static uint32_t sim_adi_size(sim_adi_t* t)
+{
+    switch (t->csw & SIM_ADI_CSW_SIZE_MASK)
+    {
+    case 0:
+        return 1;
+    case 1:
+        return 2;
+    default:
+        return 4;
+    }
+}
+
+/**
+ * Moves TAR on after a DRW access, within its 1KB block
+ */
+static void sim_adi_increment(sim_adi_t* t)
+{
+    if ((t->csw & SIM_ADI_CSW_ADDRINC_MASK) == SIM_ADI_CSW_ADDRINC_OFF)
+        return;
+
+    t->tar = (t->tar & ~0x3ffu) | ((t->tar + sim_adi_size(t)) & 0x3ff);
+}
+
+static uint32_t sim_adi_ap_read(sim_adi_t* t, uint8_t addr)
+{
+    uint32_t value;
+
+    //only AP 0 is there
+    if (t->select >> 24)
+        return 0;
+
+    switch ((t->select & 0xf0) | addr)
+    {
+    case 0x00:
+        return t->csw;
+    case 0x04:
+        return t->tar;
+    case 0x0c:
+        value = sim_adi_read_mem(t, t->tar & ~0x3u);
+        t->stats.bytes += sim_adi_size(t);
+        sim_adi_increment(t);
+        return value;
+    case 0x10:
+    case 0x14:
+    case 0x18:
+    case 0x1c:
+        t->stats.bytes += 4;
+        return sim_adi_read_mem(t, (t->tar & ~0xfu) | (addr & 0xc));
+    case 0xf8:
+        return SIM_ADI_BASE;
+    case 0xfc:
+        return SIM_ADI_MEM_AP_IDR;
+    default:
+        return 0;
+    }
+}
+
+static void sim_adi_ap_write(sim_adi_t* t, uint8_t addr, uint32_t value)
+{
+    uint32_t size, mask, old;
+
+    if (t->select >> 24)
+        return;
+
+    switch ((t->select & 0xf0) | addr)
+    {
+    case 0x00:
+        t->csw = (value & ~SIM_ADI_CSW_TRINPROG) | SIM_ADI_CSW_DEVICEEN;
+        break;
+    case 0x04:
+        t->tar = value;
+        break;
+    case 0x0c:
+        //narrow writes only change their byte lanes
+        size = sim_adi_size(t);
+        mask = size == 4 ? 0xffffffff : ((1u << (size * 8)) - 1) << ((t->tar & 0x3) * 8);
+        old = sim_adi_read_mem(t, t->tar & ~0x3u);
+        sim_adi_write_mem(t, t->tar & ~0x3u, (old & ~mask) | (value & mask));
+        t->stats.bytes += size;
+        sim_adi_increment(t);
+        break;
+    case 0x10:
+    case 0x14:
+    case 0x18:
+    case 0x1c:
+        sim_adi_write_mem(t, (t->tar & ~0xfu) | (addr & 0xc), value);
+        t->stats.bytes += 4;
+        break;
+    }
+}
+
+static void sim_adi_dp_write(sim_adi_t* t, uint8_t addr, uint32_t value)
+{
+    switch (addr)
+    {
+    case 0x0:
+        if (value & SIM_ADI_DAPABORT)
+            t->busy_until = t->stats.clocks;
+        if (value & SIM_ADI_STKCMPCLR)
+            t->ctrl_stat &= ~SIM_ADI_STICKYCMP;
+        if (value & SIM_ADI_STKERRCLR)
+            t->ctrl_stat &= ~SIM_ADI_STICKYERR;
+        if (value & SIM_ADI_WDERRCLR)
+            t->ctrl_stat &= ~SIM_ADI_WDATAERR;
+        if (value & SIM_ADI_ORUNERRCLR)
+            t->ctrl_stat &= ~SIM_ADI_STICKYORUN;
+        break;
+    case 0x4:
+        //the sticky flags are only cleared through ABORT
+        t->ctrl_stat = (t->ctrl_stat & SIM_ADI_STICKY_MASK) | (value & ~(SIM_ADI_STICKY_MASK | SIM_ADI_ACK_MASK));
+        break;
+    case 0x8:
+        t->select = value;
+        break;
+    }
+}
+
+/**
+ * Returns true while the last AP access is still going
+ */
+static uint8_t sim_adi_busy(sim_adi_t* t)
+{
+    return (int32_t)(t->busy_until - t->stats.clocks) > 0;
+}
+
+/**
+ * Answers the request which was just received. Reads are done here, so the
+ * data is ready for the data phase.
+ * @return ACK to send
+ */
+static uint8_t sim_adi_respond(sim_adi_t* t)
+{
+    uint8_t addr = SIM_ADI_ADDR(t->request);
+    uint8_t rnw = (t->request & SIM_ADI_RnW_MASK) ? 1 : 0;
+    uint8_t error = (t->ctrl_stat & SIM_ADI_ERROR_MASK) ? 1 : 0;
+
+    t->rdata = 0;
+
+    if (!(t->request & SIM_ADI_APnDP_MASK))
+    {
+        //IDCODE, CTRL/STAT and ABORT still work with an error flag set
+        if (error && !(rnw && addr <= 0x4) && !(!rnw && addr == 0x0))
+            return SIM_ADI_ACK_FAULT;
+        if (rnw && addr == 0xc && sim_adi_busy(t))
+            return SIM_ADI_ACK_WAIT;
+        if (!rnw)
+            return SIM_ADI_ACK_OK;
+
+        switch (addr)
+        {
+        case 0x0:
+            t->rdata = t->idcode;
+            break;
+        case 0x4:
+            t->rdata = t->ctrl_stat | ((t->ctrl_stat & (SIM_ADI_CDBGPWRUPREQ | SIM_ADI_CSYSPWRUPREQ)) << 1);
+            break;
+        case 0x8:
+            t->rdata = t->resend;
+            break;
+        case 0xc:
+            t->rdata = t->rdbuff;
+            t->resend = t->rdata;
+            break;
+        }
+        return SIM_ADI_ACK_OK;
+    }
+
+    if (error)
+        return SIM_ADI_ACK_FAULT;
+    if (sim_adi_busy(t))
+        return SIM_ADI_ACK_WAIT;
+    if (t->wait_every && !t->waited && !((t->stats.ap_accesses + 1) % t->wait_every))
+    {
+        t->waited = 1;
+        return SIM_ADI_ACK_WAIT;
+    }
+    t->waited = 0;
+
+    t->stats.ap_accesses++;
+    if (t->fault_every && !(t->stats.ap_accesses % t->fault_every))
+    {
+        t->ctrl_stat |= SIM_ADI_STICKYERR;
+        return SIM_ADI_ACK_FAULT;
+    }
+
+    t->busy_until = t->stats.clocks + t->latency;
+    if (rnw)
+    {
+        //posted: this returns the last read and starts the next one
+        t->rdata = t->rdbuff;
+        t->resend = t->rdata;
+        t->rdbuff = sim_adi_ap_read(t, addr);
+    }
+    return SIM_ADI_ACK_OK;
+}
+
+/**
+ * Checks a request once its eight bits are in
+ * @return True if the target answers it
+ */
+static uint8_t sim_adi_valid(sim_adi_t* t)
+{
+    if (((t->request & SIM_ADI_PARITY_MASK) ? 1 : 0) != sim_adi_parity((t->request >> 1) & 0xf) ||
+        (t->request & SIM_ADI_STOP_MASK) || !(t->request & SIM_ADI_PARK_MASK))
+        return 0;
+
+    //the first request after a line reset must read IDCODE
+    if (t->need_idcode && t->request != SIM_ADI_READ_IDCODE)
+        return 0;
+
+    t->need_idcode = 0;
+    return 1;
+}
+
+int sim_adi_clock(void* target, int swdio)
+{
+    sim_adi_t* t = target;
+    uint32_t ones = t->ones;
+    uint8_t data;
+
+    t->stats.clocks++;
+
+    //line resets can't be seen while the target drives the line
+    if (t->phase != SIM_ADI_ACK && t->phase != SIM_ADI_RDATA)
+    {
+        t->ones = swdio ? t->ones + 1 : 0;
+        if (t->swd && t->ones >= 50 && t->phase != SIM_ADI_RESET)
+        {
+            t->phase = SIM_ADI_RESET;
+            t->need_idcode = 1;
+            t->stats.resets++;
+            return -1;
+        }
+    }
+
+    switch (t->phase)
+    {
+    case SIM_ADI_JTAG:
+        //the JTAG-to-SWD sequence follows a line reset, lsb first
+        if (t->bit)
+        {
+            t->shift |= (uint32_t)swdio << t->bit;
+            if (++t->bit < 16)
+                return -1;
+            if (t->shift == SIM_ADI_JTAG_TO_SWD)
+            {
+                t->swd = 1;
+                t->phase = SIM_ADI_LOCKOUT;
+            }
+            t->bit = 0;
+        }
+        else if (!swdio && ones >= 50)
+        {
+            t->shift = 0;
+            t->bit = 1;
+        }
+        return -1;
+    case SIM_ADI_LOCKOUT:
+        return -1;
+    case SIM_ADI_RESET:
+        if (!swdio)
+            t->phase = SIM_ADI_IDLE;
+        return -1;
+    case SIM_ADI_IDLE:
+        if (swdio)
+        {
+            t->request = 1;
+            t->bit = 1;
+            t->phase = SIM_ADI_REQUEST;
+        }
+        return -1;
+    case SIM_ADI_REQUEST:
+        t->request |= swdio << t->bit;
+        if (++t->bit < 8)
+            return -1;
+        if (!sim_adi_valid(t))
+        {
+            t->stats.protocol++;
+            t->phase = SIM_ADI_LOCKOUT;
+            return -1;
+        }
+        t->phase = SIM_ADI_TURN;
+        return -1;
+    case SIM_ADI_TURN:
+        t->stats.requests++;
+        t->ack = sim_adi_respond(t);
+        switch (t->ack)
+        {
+        case SIM_ADI_ACK_OK:
+            t->stats.ok++;
+            break;
+        case SIM_ADI_ACK_WAIT:
+            t->stats.wait++;
+            break;
+        default:
+            t->stats.fault++;
+            break;
+        }
+        if (t->ack != SIM_ADI_ACK_OK && (t->ctrl_stat & SIM_ADI_ORUNDETECT))
+            t->ctrl_stat |= SIM_ADI_STICKYORUN;
+        t->phase = SIM_ADI_ACK;
+        t->bit = 1;
+        return t->ack & 1;
+    case SIM_ADI_ACK:
+        if (t->bit < 3)
+            return (t->ack >> t->bit++) & 1;
+
+        //with ORUNDETECT, WAIT and FAULT keep the data phase
+        t->bit = 0;
+        if (t->ack != SIM_ADI_ACK_OK && !(t->ctrl_stat & SIM_ADI_ORUNDETECT))
+        {
+            t->phase = SIM_ADI_RTURN;
+            return -1;
+        }
+        if (t->request & SIM_ADI_RnW_MASK)
+        {
+            t->stats.reads++;
+            t->phase = SIM_ADI_RDATA;
+            return t->rdata & 1;
+        }
+        //the first cycle of the write is the turnaround
+        t->wdata = 0;
+        t->bit = 0xffffffff;
+        t->phase = SIM_ADI_WDATA;
+        return -1;
+    case SIM_ADI_RDATA:
+        if (++t->bit < 32)
+            return (t->rdata >> t->bit) & 1;
+        if (t->bit == 32)
+        {
+            data = sim_adi_parity(t->rdata);
+            if (t->parity_every && !(t->stats.reads % t->parity_every))
+                data ^= 1;
+            return data;
+        }
+        t->phase = SIM_ADI_RTURN;
+        return -1;
+    case SIM_ADI_RTURN:
+        t->phase = SIM_ADI_IDLE;
+        return -1;
+    case SIM_ADI_WDATA:
+        if (t->bit == 0xffffffff)
+        {
+            t->bit = 0;
+            return -1;
+        }
+        if (t->bit < 32)
+        {
+            t->wdata |= (uint32_t)swdio << t->bit++;
+            return -1;
+        }
+
+        t->stats.writes++;
+        t->phase = SIM_ADI_IDLE;
+        if ((uint32_t)swdio != sim_adi_parity(t->wdata))
+        {
+            t->stats.protocol++;
+            t->ctrl_stat |= SIM_ADI_WDATAERR;
+        }
+        else if (t->ack == SIM_ADI_ACK_OK)
+        {
+            if (t->request & SIM_ADI_APnDP_MASK)
+                sim_adi_ap_write(t, SIM_ADI_ADDR(t->request), t->wdata);
+            else
+                sim_adi_dp_write(t, SIM_ADI_ADDR(t->request), t->wdata);
+        }
+        return -1;
+    }
+
+    return -1;
+}
@@ -0,0 +1,138 @@
+/**
+ * Simulated ADIv5 debug port and MEM-AP
+ *
+ * This is a target for the simulator in sim.h, clocked one SWCLK rising edge
+ * at a time with sim_adi_clock. It follows the wire protocol as a target
+ * does: it only talks SWD after a line reset, the JTAG-to-SWD sequence and
+ * another line reset, and after each line reset the first request must read
+ * IDCODE. A request with a bad parity, stop or park bit locks it out until
+ * the next line reset.
+ *
+ * The DP has IDCODE, ABORT, CTRL/STAT, SELECT, RESEND and RDBUFF. While a
+ * sticky error flag is set, every access but an IDCODE or CTRL/STAT read and
+ * an ABORT write gets FAULT. Setting ORUNDETECT makes every WAIT or FAULT
+ * set STICKYORUN and keeps the data phase.
+ *
+ * AP 0 is a MEM-AP with CSW, TAR, DRW, BD0-3 and IDR. Reads are posted: an AP
+ * read returns the result of the previous one and its own result is read
+ * from RDBUFF. DRW accesses of 8, 16 and 32 bits increment TAR when CSW asks
+ * for it, wrapping within 1KB as the ADIv5 spec allows. Target memory is
+ * sparse: it reads as zero until written. Any other AP reads as zero and
+ * ignores writes.
+ *
+ * The target can be made slower or less reliable:
+ * - latency: SWCLK cycles an AP access takes. An AP access or RDBUFF read
+ *   before the last one is done gets WAIT. An ABORT with DAPABORT ends it.
+ * - wait_every: every nth AP access gets WAIT once before it is taken.
+ * - fault_every: every nth AP access gets FAULT and sets STICKYERR.
+ * - parity_every: every nth read is sent with the wrong parity.
+ *
+ * The counters show what crossed the wire. Bytes counts the bytes of target
+ * memory read or written through DRW and BD0-3, so clocks divided by bytes
+ * gives the SWCLK cycles spent per useful byte.
+ */
+
+#ifndef _SIM_ADI_H_
+#define _SIM_ADI_H_
+
+#include <stdint.h>
+
+#define SIM_ADI_IDCODE 0x2ba01477 //Cortex-M4 SW-DP
+#define SIM_ADI_MEM_AP_IDR 0x24770011 //AHB-AP
+
+typedef enum { SIM_ADI_JTAG, SIM_ADI_LOCKOUT, SIM_ADI_RESET, SIM_ADI_IDLE, SIM_ADI_REQUEST, SIM_ADI_TURN,
+    SIM_ADI_ACK, SIM_ADI_RDATA, SIM_ADI_RTURN, SIM_ADI_WDATA } sim_adi_phase_t;
+
+/**
+ * 1KB of target memory
+ */
+typedef struct {
+    uint32_t base;
+    uint32_t words[256];
+} sim_adi_page_t;
+
+typedef struct {
+    uint32_t clocks; //SWCLK rising edges
+    uint32_t resets; //line resets while in SWD
+    uint32_t requests; //requests answered
+    uint32_t ok;
+    uint32_t wait;
+    uint32_t fault;
+    uint32_t protocol; //bad requests and write parity errors
+    uint32_t reads; //read data phases sent
+    uint32_t writes; //write data phases received
+    uint32_t ap_accesses; //AP accesses taken
+    uint32_t bytes; //bytes of target memory moved
+} sim_adi_stats_t;
+
+typedef struct {
+    //configuration, set after sim_adi_init
+    uint32_t idcode;
+    uint32_t latency;
+    uint32_t wait_every;
+    uint32_t fault_every;
+    uint32_t parity_every;
+
+    sim_adi_stats_t stats;
+
+    //wire
+    sim_adi_phase_t phase;
+    uint32_t ones; //high bits in a row, for line resets
+    uint32_t bit;
+    uint32_t shift;
+    uint8_t swd; //true once the JTAG-to-SWD sequence has been seen
+    uint8_t need_idcode; //true after a line reset until IDCODE is read
+    uint8_t request;
+    uint8_t ack;
+    uint32_t rdata;
+    uint32_t wdata;
+
+    //dp
+    uint32_t ctrl_stat;
+    uint32_t select;
+    uint32_t rdbuff;
+    uint32_t resend;
+    uint32_t busy_until; //clock the last AP access is done at
+    uint8_t waited; //true if the current AP access already got its WAIT
+
+    //mem-ap
+    uint32_t csw;
+    uint32_t tar;
+
+    //target memory
+    sim_adi_page_t* pages;
+    uint32_t n_pages;
+    uint32_t max_pages;
+} sim_adi_t;
+
+/**
+ * Resets a target to power on, with empty memory
+ */
+void sim_adi_init(sim_adi_t* t);
+
+/**
+ * Frees a target's memory
+ */
+void sim_adi_free(sim_adi_t* t);
+
+/**
+ * Clocks a target, as a sim_target_t
+ * @param target sim_adi_t to clock
+ * @param swdio Level of SWDIO at the rising edge
+ * @return Level the target drives, or -1 if it doesn't
+ */
+int sim_adi_clock(void* target, int swdio);
+
+/**
+ * Reads a word of target memory, without going through the wire
+ * @param addr Word aligned address
+ */
+uint32_t sim_adi_read_mem(sim_adi_t* t, uint32_t addr);
+
+/**
+ * Writes a word of target memory, without going through the wire
+ * @param addr Word aligned address
+ */
+void sim_adi_write_mem(sim_adi_t* t, uint32_t addr, uint32_t value);
+
+#endif // _SIM_ADI_H_
@@ -0,0 +1,715 @@
+/**
+ * Runs the adapter firmware in the simulator against the ADIv5 target in
+ * sim_adi.h, through the USB requests a host would send, and measures how
+ * the bus is used:
+ *
+ * - IDCODE: reads the DP IDCODE over and over, a window of reads at a time
+ * - Single: reads it one at a time, so the queue runs dry after each read,
+ *   and checks each takes only the clocks of the transfer and of the idle
+ *   cycles the bus stops with, never a line reset. It only runs with no
+ *   errors injected.
+ * - Write: writes a pattern to target memory with MEM-AP block writes
+ * - Read: reads it back with MEM-AP block reads
+ * - Race: fills the swd queue to one entry short of full and has a USB
+ *   interrupt preempt a program's read from inside its claim on the queue.
+ *   The interrupt's read must be refused with SWD_ERR_BUSY and every command
+ *   already queued must still run. It only runs with no errors injected.
+ *
+ * For each it reports the SWCLK cycles taken, the cycles per useful byte and
+ * the simulated time. Every value is checked, against the target's memory
+ * too. Block requests which fail with WAIT, FAULT or a parity error are
+ * picked up from the word they stopped at, after clearing the error, so the
+ * data must still come out right with errors injected.
+ *
+ * Usage: teensy-swd-sim [-e ftm|dma] [-c hz] [-n reads] [-w words] [-l latency]
+ *     [-W wait_every] [-F fault_every] [-P parity_every]
+ *
+ * The exit status is nonzero if anything came out wrong.
+ */
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "sim_adi.h"
+#include "usb_types.h"
+
+#define BENCH_WINDOW 16 //reads begun before their records are in
+#define BENCH_TIMEOUT 1000000 //ftm periods to wait for a record
+#define BENCH_RETRIES 100 //times the block requests are picked up again
+#define BENCH_ADDR 0x20000f00 //start of the memory blocks, so TAR crosses a 1KB boundary
+#define BENCH_SETTLE 16 //ftm periods run before looking at target memory
+#define BENCH_YIELDS 10000 //times to yield waiting for the main loop
+#define BENCH_SINGLE_READS 16
+
+//SWCLK cycles of a transaction: request 8, turnaround, ack 3, data 32, parity, turnaround
+#define BENCH_TRANSFER_CLOCKS 46
+#define BENCH_STOP_CLOCKS 8 //idle cycles clocked once the queue runs dry
+
+//the race's commands leave the queue of SWD_QUEUE_LENGTH (swd.h) entries, which
+//holds one less than that, with room for just the program's read
+#define BENCH_RACE_READS 61 //pipelined reads of one, two entries each
+#define BENCH_RACE_BLOCKS 124 //block read ops of one word, two entries each
+#define BENCH_RACE_POLLS 4 //poll ops, three entries each
+
+//results, as in swd.h
+#define BENCH_OK         0
+#define BENCH_ERR_BUSY   -2
+#define BENCH_ERR_WAIT   -3
+#define BENCH_ERR_FAULT  -4
+#define BENCH_ERR_PARITY -6
+
+#define BENCH_ABORT_CLEAR_ALL 0x1e
+#define BENCH_CTRLSTAT_POWERUP 0x50000000 //CSYSPWRUPREQ and CDBGPWRUPREQ
+
+//instructions, as in swd_vm.h
+#define BENCH_VM_HALT 0x00
+#define BENCH_VM_READ(a, imm) (0x20 | ((a) << 8) | ((uint32_t)(imm) << 16))
+
+//bmRequestType and bRequest of a wRequestAndType from usb_types.h
+#define BENCH_TYPE(request) ((request) & 0xff)
+#define BENCH_REQUEST(request) ((request) >> 8)
+
+/**
+ * Completion records received but not looked at yet
+ */
+static struct {
+    completion_t records[USB_NOTIFY_SIZE / sizeof(completion_t)];
+    uint8_t count;
+    uint8_t next;
+    uint16_t sequence; //sequence number of the next record
+    uint8_t tag; //tag for the next command
+} bench;
+
+static sim_adi_t target;
+static uint32_t failures;
+
+//read begun by the usb interrupt which preempts the race's program
+static volatile uint8_t race_preempted;
+static uint8_t race_begun;
+
+/**
+ * Returns the request byte for a register
+ * @param ap True for an AP register
+ * @param read True for a read
+ * @param addr Register address
+ */
+static uint8_t bench_request(uint8_t ap, uint8_t read, uint8_t addr)
+{
+    uint8_t bits = (ap ? 0x2 : 0) | (read ? 0x4 : 0) | ((addr & 0xc) << 1);
+    uint8_t parity = ((bits >> 1) ^ (bits >> 2) ^ (bits >> 3) ^ (bits >> 4)) & 1;
+
+    return 0x81 | bits | (parity << 5);
+}
+
+/**
+ * Runs a control request
+ * @param request wRequestAndType, as in usb_types.h
+ * @return Bytes moved, or a negative value if it stalled
+ */
+static int bench_control(uint16_t request, uint16_t value, uint16_t index, void* data, uint16_t length)
+{
+    return sim_usb_control(BENCH_TYPE(request), BENCH_REQUEST(request), value, index, data, length);
+}
+
+/**
+ * Begins a command with the next tag
+ * @return True if it was begun
+ */
+static uint8_t bench_begin(uint16_t request, uint16_t value, void* data, uint16_t length)
+{
+    if (bench_control(request, value, bench.tag, data, length) < 0)
+        return 0;
+
+    bench.tag++;
+    return 1;
+}
+
+/**
+ * Waits for the next completion record, running the bus meanwhile. Exits if
+ * none comes or it isn't the one expected.
+ */
+static void bench_next(completion_t* record)
+{
+    uint32_t idle = 0;
+    int n;
+
+    while (bench.next == bench.count)
+    {
+        if (idle++ == BENCH_TIMEOUT)
+        {
+            fprintf(stderr, "No completion record came\n");
+            exit(1);
+        }
+
+        n = sim_usb_in(USB_NOTIFY_ENDPOINT, bench.records);
+        if (n > 0)
+        {
+            bench.count = n / sizeof(completion_t);
+            bench.next = 0;
+        }
+        else
+        {
+            sim_cycle();
+        }
+    }
+
+    *record = bench.records[bench.next++];
+    if (record->sequence != bench.sequence)
+    {
+        fprintf(stderr, "Record %u came as %u\n", bench.sequence, record->sequence);
+        exit(1);
+    }
+    bench.sequence++;
+}
+
+/**
+ * Runs a command to the end
+ * @param data Gets the data of its result, or NULL
+ * @return Its result
+ */
+static int8_t bench_run(uint16_t request, uint16_t value, void* req, uint16_t length, uint32_t* data)
+{
+    completion_t record;
+
+    if (!bench_begin(request, value, req, length))
+    {
+        fprintf(stderr, "Request %04x stalled\n", request);
+        exit(1);
+    }
+    bench_next(&record);
+
+    if (data)
+        *data = record.data;
+    return record.result;
+}
+
+static int8_t bench_write(uint8_t request, uint32_t data)
+{
+    write_req_t req;
+
+    memset(&req, 0, sizeof(req));
+    req.request = request;
+    req.data = data;
+    return bench_run(USB_SWD_BEGIN_WRITE, 0, &req, sizeof(req), NULL);
+}
+
+/**
+ * Returns true for the errors the target was set up to make
+ */
+static uint8_t bench_injected(int8_t result)
+{
+    return (result == BENCH_ERR_WAIT && (target.latency || target.wait_every)) ||
+        (result == BENCH_ERR_FAULT && target.fault_every) ||
+        (result == BENCH_ERR_PARITY && target.parity_every);
+}
+
+/**
+ * Returns true if the target was set up to make no errors at all
+ */
+static uint8_t bench_clean(void)
+{
+    return !target.latency && !target.wait_every && !target.fault_every && !target.parity_every;
+}
+
+/**
+ * Clears the target's error flags after an injected error, or counts a
+ * failure if it wasn't one
+ * @param what Command which got the error
+ */
+static void bench_recover(int8_t result, const char* what)
+{
+    if (!bench_injected(result))
+    {
+        fprintf(stderr, "%s failed: %d\n", what, result);
+        failures++;
+        return;
+    }
+
+    if (result == BENCH_ERR_FAULT && bench_write(bench_request(0, 0, 0x0), BENCH_ABORT_CLEAR_ALL) != BENCH_OK)
+    {
+        fprintf(stderr, "Abort failed\n");
+        failures++;
+    }
+}
+
+/**
+ * Reports a part of the benchmark
+ * @param cycles Core clock cycles it took
+ * @param swclk SWCLK cycles it took
+ * @param bytes Useful bytes moved
+ * @param errors Injected errors it got through
+ */
+static void bench_report(const char* name, uint64_t cycles, uint64_t swclk, uint32_t bytes, uint32_t errors)
+{
+    double seconds = (double)cycles / sim_clock_hz();
+
+    printf("%-6s %6u bytes, %8llu swclk, %5.2f per byte, %8.3f ms, %7.1f KB/s",
+        name, bytes, (unsigned long long)swclk, bytes ? (double)swclk / bytes : 0.0,
+        seconds * 1000, seconds > 0 ? bytes / seconds / 1024 : 0.0);
+    if (errors)
+        printf(", %u errors", errors);
+    printf("\n");
+}
+
+/**
+ * Reads the DP IDCODE over and over, keeping a window of reads going so the
+ * bus never waits for the host
+ */
+static void bench_idcode(uint32_t reads)
+{
+    read_req_t req = { bench_request(0, 1, 0x0) };
+    completion_t record;
+    uint32_t begun = 0, done = 0, errors = 0;
+    uint64_t cycles = sim_cycles(), swclk = sim_swclk();
+
+    while (done < reads)
+    {
+        while (begun < reads && begun - done < BENCH_WINDOW && bench_begin(USB_SWD_BEGIN_READ, 0, &req, sizeof(req)))
+        {
+            begun++;
+        }
+
+        bench_next(&record);
+        done++;
+
+        if (record.result != BENCH_OK)
+        {
+            errors++;
+            bench_recover(record.result, "IDCODE read");
+        }
+        else if (record.data != target.idcode)
+        {
+            fprintf(stderr, "Read IDCODE %08x\n", record.data);
+            failures++;
+        }
+    }
+
+    bench_report("IDCODE", sim_cycles() - cycles, sim_swclk() - swclk, reads * 4, errors);
+}
+
+/**
+ * Reads the DP IDCODE with the queue empty before each read, as a host
+ * reading one register at a time does, and checks the session with the
+ * target is kept between them
+ */
+static void bench_single(uint32_t reads)
+{
+    uint32_t i, data, clocks, max = 0, resets = target.stats.resets;
+    uint64_t cycles = sim_cycles(), swclk = sim_swclk(), start;
+    read_req_t req = { bench_request(0, 1, 0x0) };
+
+    for (i = 0; i < reads; i++)
+    {
+        start = sim_swclk();
+        if (bench_run(USB_SWD_BEGIN_READ, 0, &req, sizeof(req), &data) != BENCH_OK || data != target.idcode)
+        {
+            fprintf(stderr, "Single IDCODE read failed\n");
+            failures++;
+        }
+
+        clocks = sim_swclk() - start;
+        if (clocks > max)
+            max = clocks;
+    }
+
+    bench_report("Single", sim_cycles() - cycles, sim_swclk() - swclk, reads * 4, 0);
+    if (max > BENCH_TRANSFER_CLOCKS + BENCH_STOP_CLOCKS || target.stats.resets != resets)
+    {
+        fprintf(stderr, "A single read took up to %u swclk and %u line resets\n", max, target.stats.resets - resets);
+        failures++;
+    }
+}
+
+/**
+ * Writes words to target memory with block writes and checks the target got
+ * them
+ */
+static void bench_mem_write(const uint32_t* words, uint32_t count)
+{
+    mem_req_t req;
+    uint32_t done = 0, n, i, written, retries = 0;
+    uint64_t cycles = sim_cycles(), swclk = sim_swclk();
+    int8_t result;
+
+    while (done < count && retries <= BENCH_RETRIES)
+    {
+        n = count - done > USB_BLOCK_WORDS ? USB_BLOCK_WORDS : count - done;
+
+        //the block buffer is filled a packet at a time
+        for (i = 0; i < n; i += 16)
+        {
+            bench_control(USB_SWD_WRITE_BLOCK, i, 0, (void*)&words[done + i], (n - i > 16 ? 16 : n - i) * 4);
+        }
+
+        req.addr = BENCH_ADDR + done * 4;
+        req.count = n;
+        result = bench_run(USB_SWD_BEGIN_MEM_WRITE, 0, &req, sizeof(req), &written);
+        done += written;
+        if (result != BENCH_OK)
+        {
+            retries++;
+            bench_recover(result, "Block write");
+        }
+    }
+
+    //the target takes the last write on the rising edge after its parity bit,
+    //which the bus only gives once it clocks on
+    sim_run(BENCH_SETTLE);
+
+    for (i = 0; i < count; i++)
+    {
+        if (sim_adi_read_mem(&target, BENCH_ADDR + i * 4) != words[i])
+        {
+            fprintf(stderr, "Target has %08x at %08x, not %08x\n",
+                sim_adi_read_mem(&target, BENCH_ADDR + i * 4), BENCH_ADDR + i * 4, words[i]);
+            failures++;
+            break;
+        }
+    }
+
+    bench_report("Write", sim_cycles() - cycles, sim_swclk() - swclk, count * 4, retries);
+}
+
+/**
+ * Reads words back from target memory with block reads and checks them
+ */
+static void bench_mem_read(const uint32_t* words, uint32_t count)
+{
+    mem_req_t req;
+    uint32_t* read = calloc(count, sizeof(uint32_t));
+    uint32_t done = 0, n, i, got, retries = 0;
+    uint64_t cycles = sim_cycles(), swclk = sim_swclk();
+    int8_t result;
+
+    while (done < count && retries <= BENCH_RETRIES)
+    {
+        n = count - done > USB_BLOCK_WORDS ? USB_BLOCK_WORDS : count - done;
+        req.addr = BENCH_ADDR + done * 4;
+        req.count = n;
+        result = bench_run(USB_SWD_BEGIN_MEM_READ, 0, &req, sizeof(req), &got);
+
+        //the words before an error are good
+        for (i = 0; i < got; i += 16)
+        {
+            bench_control(USB_SWD_READ_BLOCK, i, 0, &read[done + i], (got - i > 16 ? 16 : got - i) * 4);
+        }
+        done += got;
+        if (result != BENCH_OK)
+        {
+            retries++;
+            bench_recover(result, "Block read");
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (read[i] != words[i])
+        {
+            fprintf(stderr, "Read %08x at %08x, not %08x\n", read[i], BENCH_ADDR + i * 4, words[i]);
+            failures++;
+            break;
+        }
+    }
+    free(read);
+
+    bench_report("Read", sim_cycles() - cycles, sim_swclk() - swclk, count * 4, retries);
+}
+
+/**
+ * Puts a little endian value into a batch
+ * @return Where the next one goes
+ */
+static uint8_t* bench_put(uint8_t* p, uint32_t value, uint8_t bytes)
+{
+    while (bytes--)
+    {
+        *p++ = value;
+        value >>= 8;
+    }
+    return p;
+}
+
+/**
+ * Begins a read from the usb interrupt, on the main loop's thread
+ */
+static void bench_race_preempt(void)
+{
+    read_req_t req = { bench_request(0, 1, 0x0) };
+
+    race_begun = bench_begin(USB_SWD_BEGIN_READ, 0, &req, sizeof(req));
+    race_preempted = 1;
+}
+
+/**
+ * Races the usb interrupt against a program for the last entry of the swd
+ * queue. The bus is held still until both have had their go, so the queue
+ * can't drain in between. Needs the words from bench_mem_write in target
+ * memory.
+ */
+static void bench_race(const uint32_t* words)
+{
+    static uint8_t batch[USB_BATCH_MAX];
+    static uint8_t result[USB_BATCH_MAX];
+    uint32_t program[] = { BENCH_VM_READ(0, bench_request(0, 1, 0x0)), BENCH_VM_HALT };
+    read_req_t req = { bench_request(1, 1, 0x0) };
+    program_req_t program_req;
+    batch_header_t* header = (batch_header_t*)batch;
+    batch_result_header_t* result_header = (batch_result_header_t*)result;
+    const int8_t* acks = (const int8_t*)&result[sizeof(batch_result_header_t)];
+    const uint32_t* data;
+    completion_t record;
+    uint32_t i, ops = BENCH_RACE_BLOCKS + BENCH_RACE_POLLS, yields;
+    uint32_t csw = target.csw; //the batch's ops may set it up differently once they run
+    uint16_t length;
+    uint8_t* p;
+    int n;
+
+    bench_control(USB_SWD_WRITE_PROGRAM, 0, 0, program, sizeof(program));
+
+    //the host's reads and the batch fill the queue while the bus stands still
+    for (i = 0; i < BENCH_RACE_READS; i++)
+    {
+        if (!bench_begin(USB_SWD_BEGIN_READ_PIPELINED, 1, &req, sizeof(req)))
+        {
+            fprintf(stderr, "Pipelined read stalled\n");
+            exit(1);
+        }
+    }
+
+    p = batch + sizeof(batch_header_t);
+    for (i = 0; i < ops; i++)
+    {
+        if (i < BENCH_RACE_BLOCKS)
+        {
+            *p++ = USB_BATCH_READ_BLOCK;
+            p = bench_put(p, BENCH_ADDR + i * 4, 4);
+            p = bench_put(p, 1, 2);
+        }
+        else
+        {
+            //a mask of 0 matches the first value read
+            *p++ = USB_BATCH_POLL;
+            p = bench_put(p, BENCH_ADDR, 4);
+            p = bench_put(p, 0, 4);
+            p = bench_put(p, 0, 4);
+            p = bench_put(p, 1, 2);
+            p = bench_put(p, 0, 2);
+        }
+    }
+    memset(header, 0, sizeof(*header));
+    header->version = USB_BATCH_VERSION;
+    header->length = p - batch;
+    header->count = ops;
+    for (i = 0; i < header->length; i += USB_BULK_SIZE)
+    {
+        length = header->length - i > USB_BULK_SIZE ? USB_BULK_SIZE : header->length - i;
+        if (sim_usb_out(USB_BULK_OUT_ENDPOINT, &batch[i], length) != length)
+        {
+            fprintf(stderr, "Batch wasn't taken\n");
+            exit(1);
+        }
+    }
+    sim_settle();
+
+    //the program's read is interrupted on its way into the queue
+    memset(&program_req, 0, sizeof(program_req));
+    program_req.length = sizeof(program) / sizeof(program[0]);
+    race_preempted = 0;
+    sim_preempt(bench_race_preempt);
+    if (!bench_begin(USB_SWD_BEGIN_PROGRAM, 0, &program_req, sizeof(program_req)))
+    {
+        fprintf(stderr, "Program stalled\n");
+        exit(1);
+    }
+    for (yields = 0; !race_preempted && yields < BENCH_YIELDS; yields++)
+    {
+        sched_yield();
+    }
+    if (!race_preempted || !race_begun)
+    {
+        fprintf(stderr, "The program was never preempted\n");
+        exit(1);
+    }
+
+    for (i = 0; i < BENCH_RACE_READS; i++)
+    {
+        bench_next(&record);
+        if (record.result != BENCH_OK || record.data != csw)
+        {
+            fprintf(stderr, "Pipelined read %u got %d, %08x\n", i, record.result, record.data);
+            failures++;
+        }
+    }
+
+    bench_next(&record);
+    if (record.result != BENCH_OK || record.data != target.idcode)
+    {
+        fprintf(stderr, "Preempted program got %d, %08x\n", record.result, record.data);
+        failures++;
+    }
+
+    //the interrupt came in while the program had the queue
+    bench_next(&record);
+    if (record.result != BENCH_ERR_BUSY)
+    {
+        fprintf(stderr, "Preempting read got %d, not %d\n", record.result, BENCH_ERR_BUSY);
+        failures++;
+    }
+
+    for (i = 0; i < BENCH_TIMEOUT && (n = sim_usb_in(USB_BULK_IN_ENDPOINT, result)) == SIM_USB_NAK; i++)
+    {
+        sim_cycle();
+    }
+    for (length = n > 0 ? n : 0; n == USB_BULK_SIZE && length < sizeof(result); length += n > 0 ? n : 0)
+    {
+        n = sim_usb_in(USB_BULK_IN_ENDPOINT, &result[length]);
+    }
+    if (length < sizeof(*result_header) || length != result_header->length)
+    {
+        fprintf(stderr, "Batch result came as %u bytes\n", length);
+        exit(1);
+    }
+
+    data = (const uint32_t*)&result[(sizeof(batch_result_header_t) + ops + 3) & ~0x3];
+    if (result_header->failed != USB_BATCH_NO_FAILURE)
+    {
+        fprintf(stderr, "Batch op %u failed: %d\n", result_header->failed, acks[result_header->failed]);
+        failures++;
+    }
+    for (i = 0; i < BENCH_RACE_BLOCKS; i++)
+    {
+        if (data[i] != words[i])
+        {
+            fprintf(stderr, "Batch read %08x at %08x, not %08x\n", data[i], BENCH_ADDR + i * 4, words[i]);
+            failures++;
+            break;
+        }
+    }
+
+    printf("Race   %u queue entries, preempting read refused\n",
+        BENCH_RACE_READS * 2 + BENCH_RACE_BLOCKS * 2 + BENCH_RACE_POLLS * 3 + 1);
+}
+
+static void bench_usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-e ftm|dma] [-c hz] [-n reads] [-w words] [-l latency]\n"
+        "    [-W wait_every] [-F fault_every] [-P parity_every]\n", name);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t descriptor[18];
+    clock_req_t clock_req = { 1000000 };
+    uint32_t clock_hz = 0;
+    uint32_t reads = 1000, count = 1024, i;
+    uint32_t* words;
+    int engine = SIM_ENGINE_FTM;
+    int opt;
+
+    sim_adi_init(&target);
+    while ((opt = getopt(argc, argv, "e:c:n:w:l:W:F:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            if (!strcmp(optarg, "dma"))
+                engine = SIM_ENGINE_DMA;
+            else if (strcmp(optarg, "ftm"))
+                bench_usage(argv[0]);
+            break;
+        case 'c':
+            clock_req.hz = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            reads = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            target.latency = strtoul(optarg, NULL, 0);
+            break;
+        case 'W':
+            target.wait_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'F':
+            target.fault_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            target.parity_every = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            bench_usage(argv[0]);
+        }
+    }
+
+    sim_init(engine);
+    sim_set_target(sim_adi_clock, &target);
+
+    //enumerate as a host would
+    if (sim_usb_control(0x80, 6, 0x0100, 0, descriptor, sizeof(descriptor)) != sizeof(descriptor) ||
+        descriptor[8] != 0xc0 || descriptor[9] != 0x16 || descriptor[10] != 0xdc || descriptor[11] != 0x05)
+    {
+        fprintf(stderr, "Bad device descriptor\n");
+        return 1;
+    }
+    sim_usb_control(0x00, 5, 1, 0, NULL, 0);
+    sim_usb_control(0x00, 9, 1, 0, NULL, 0);
+
+    bench_control(USB_SWD_SET_CLOCK, 0, 0, &clock_req, sizeof(clock_req));
+    bench_control(USB_SWD_GET_CLOCK, 0, 0, &clock_hz, sizeof(clock_hz));
+    printf("engine %s, clock %u Hz, latency %u, wait every %u, fault every %u, parity every %u\n",
+        engine == SIM_ENGINE_DMA ? "dma" : "ftm", clock_hz, target.latency, target.wait_every,
+        target.fault_every, target.parity_every);
+
+    if (bench_run(USB_SWD_CONNECT, 0, NULL, 0, NULL) != BENCH_OK || !target.swd)
+    {
+        fprintf(stderr, "Connect failed\n");
+        return 1;
+    }
+    bench_idcode(reads);
+    //waits and retries would add clocks of their own
+    if (bench_clean())
+        bench_single(BENCH_SINGLE_READS);
+
+    //power up the debug domain and select bank 0 of the MEM-AP
+    if (bench_write(bench_request(0, 0, 0x0), BENCH_ABORT_CLEAR_ALL) != BENCH_OK ||
+        bench_write(bench_request(0, 0, 0x4), BENCH_CTRLSTAT_POWERUP) != BENCH_OK ||
+        bench_write(bench_request(0, 0, 0x8), 0) != BENCH_OK)
+    {
+        fprintf(stderr, "Setting up the MEM-AP failed\n");
+        return 1;
+    }
+
+    words = malloc(count * sizeof(uint32_t));
+    for (i = 0; i < count; i++)
+    {
+        words[i] = i * 0x9e3779b9 + 0x01234567;
+    }
+    bench_mem_write(words, count);
+    bench_mem_read(words, count);
+    //the race needs every command to go through the first time
+    if (count >= BENCH_RACE_BLOCKS && bench_clean())
+        bench_race(words);
+    free(words);
+
+    printf("target: %u requests, %u ok, %u wait, %u fault, %u protocol errors, %u line resets\n",
+        target.stats.requests, target.stats.ok, target.stats.wait, target.stats.fault,
+        target.stats.protocol, target.stats.resets);
+    if (target.stats.protocol)
+    {
+        fprintf(stderr, "The target saw protocol errors\n");
+        failures++;
+    }
+
+    sim_stop();
+    sim_adi_free(&target);
+    if (failures)
+        printf("%u failures\n", failures);
+    return failures ? 1 : 0;
+}
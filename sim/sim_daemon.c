@@ -0,0 +1,350 @@
+/**
+ * Runs the adapter firmware in the simulator against the ADIv5 target in
+ * sim_adi.h as a virtual adapter, which host tools reach through a Unix
+ * domain socket instead of USB.
+ *
+ * The bus runs on a thread of its own while a host is connected, as fast as
+ * it can be simulated. The host's transfers are passed to the firmware's USB
+ * module as they would come over the wire, so the firmware handles them
+ * exactly as it does on the Teensy: control requests go through endpoint 0,
+ * batches through the bulk endpoints and completion records come back on the
+ * notification endpoint.
+ *
+ * Each transfer is a message of a sim_daemon_msg_t, little endian, followed
+ * by the data of a control or bulk OUT transfer:
+ *
+ * - SIM_DAEMON_CONTROL: a control transfer, with the setup in type, request,
+ *   value, index and length.
+ * - SIM_DAEMON_IN: a bulk or interrupt IN transfer of up to length bytes. It
+ *   ends with a short packet or when length bytes are in.
+ * - SIM_DAEMON_OUT: a bulk OUT transfer of length bytes.
+ *
+ * IN and OUT transfers wait for the endpoint for value milliseconds. The
+ * reply is an int16_t with the bytes moved, SIM_USB_NAK if the endpoint
+ * never became ready or SIM_USB_STALL, followed by the data of an IN
+ * transfer.
+ *
+ * One host is served at a time. The adapter and target keep their state
+ * between hosts, as an adapter does when a program closes it. With no host
+ * the bus stops and the main loop idles.
+ *
+ * Usage: teensy-swd-simd [-s socket] [-e ftm|dma] [-l latency]
+ *     [-W wait_every] [-F fault_every] [-P parity_every]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "sim_adi.h"
+
+#define SIM_DAEMON_SOCKET "/tmp/teensy-swd.sock"
+#define SIM_DAEMON_MAX 4096 //largest transfer, more than a batch or its result
+#define SIM_DAEMON_PACKET 64 //max packet size of the endpoints
+#define SIM_DAEMON_POLL_NS 50000 //time between tries of an endpoint which isn't ready
+
+#define SIM_DAEMON_CONTROL 0
+#define SIM_DAEMON_IN      1
+#define SIM_DAEMON_OUT     2
+
+/**
+ * Transfer from the host
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t kind; //SIM_DAEMON_CONTROL, SIM_DAEMON_IN or SIM_DAEMON_OUT
+    uint8_t type; //bmRequestType, or the endpoint of an IN or OUT transfer
+    uint8_t request; //bRequest
+    uint8_t reserved;
+    uint16_t value; //wValue, or the timeout in ms of an IN or OUT transfer
+    uint16_t index; //wIndex
+    uint16_t length; //wLength, or the bytes of an IN or OUT transfer
+} sim_daemon_msg_t;
+
+static sim_adi_t target;
+
+/**
+ * The bus thread and whether it should be running
+ */
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t connected;
+} bus = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/**
+ * Steps the bus while a host is connected
+ */
+static void* sim_daemon_bus(void* arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&bus.lock);
+        while (!bus.connected)
+        {
+            pthread_cond_wait(&bus.cond, &bus.lock);
+        }
+        pthread_mutex_unlock(&bus.lock);
+
+        sim_run(64);
+    }
+
+    return NULL;
+}
+
+static void sim_daemon_connected(uint8_t connected)
+{
+    sim_idle(!connected);
+    pthread_mutex_lock(&bus.lock);
+    bus.connected = connected;
+    pthread_cond_signal(&bus.cond);
+    pthread_mutex_unlock(&bus.lock);
+}
+
+/**
+ * Returns the milliseconds since some fixed point
+ */
+static uint64_t sim_daemon_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void sim_daemon_sleep(void)
+{
+    struct timespec delay = { 0, SIM_DAEMON_POLL_NS };
+
+    nanosleep(&delay, NULL);
+}
+
+/**
+ * Runs a bulk or interrupt IN transfer
+ * @param data Buffer for length bytes
+ * @return Bytes received, SIM_USB_NAK or SIM_USB_STALL
+ */
+static int sim_daemon_in(uint8_t endpoint, uint8_t* data, uint16_t length, uint16_t timeout_ms)
+{
+    uint8_t packet[SIM_DAEMON_PACKET];
+    uint64_t deadline = sim_daemon_ms() + timeout_ms;
+    int done = 0, n;
+
+    while (done < length)
+    {
+        n = sim_usb_in(endpoint, packet);
+        if (n == SIM_USB_STALL)
+            return n;
+        if (n == SIM_USB_NAK)
+        {
+            if (sim_daemon_ms() >= deadline)
+                break;
+            sim_daemon_sleep();
+            continue;
+        }
+
+        if (n > length - done)
+            n = length - done;
+        memcpy(data + done, packet, n);
+        done += n;
+        if (n < SIM_DAEMON_PACKET)
+            return done;
+    }
+
+    return done ? done : SIM_USB_NAK;
+}
+
+/**
+ * Runs a bulk OUT transfer a packet at a time
+ * @return Bytes sent, SIM_USB_NAK or SIM_USB_STALL
+ */
+static int sim_daemon_out(uint8_t endpoint, const uint8_t* data, uint16_t length, uint16_t timeout_ms)
+{
+    uint64_t deadline = sim_daemon_ms() + timeout_ms;
+    int done = 0, n;
+
+    while (done < length)
+    {
+        n = length - done > SIM_DAEMON_PACKET ? SIM_DAEMON_PACKET : length - done;
+        n = sim_usb_out(endpoint, data + done, n);
+        if (n == SIM_USB_STALL)
+            return n;
+        if (n == SIM_USB_NAK)
+        {
+            if (sim_daemon_ms() >= deadline)
+                return done ? done : SIM_USB_NAK;
+            sim_daemon_sleep();
+            continue;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+/**
+ * Reads or writes all of a buffer on a socket
+ * @return True if it all got through
+ */
+static uint8_t sim_daemon_io(int fd, void* data, size_t length, uint8_t write)
+{
+    ssize_t n;
+
+    while (length)
+    {
+        n = write ? send(fd, data, length, MSG_NOSIGNAL) : recv(fd, data, length, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        data = (uint8_t*)data + n;
+        length -= n;
+    }
+
+    return 1;
+}
+
+/**
+ * Runs transfers for a host until it goes away
+ */
+static void sim_daemon_serve(int fd)
+{
+    static uint8_t data[SIM_DAEMON_MAX];
+    sim_daemon_msg_t msg;
+    int16_t result;
+    uint8_t in;
+
+    while (sim_daemon_io(fd, &msg, sizeof(msg), 0))
+    {
+        if (msg.length > sizeof(data))
+        {
+            fprintf(stderr, "Transfer of %u bytes is too long\n", msg.length);
+            return;
+        }
+
+        in = msg.kind == SIM_DAEMON_IN || (msg.kind == SIM_DAEMON_CONTROL && (msg.type & 0x80));
+        if (!in && !sim_daemon_io(fd, data, msg.length, 0))
+            return;
+
+        switch (msg.kind)
+        {
+        case SIM_DAEMON_CONTROL:
+            result = sim_usb_control(msg.type, msg.request, msg.value, msg.index, data, msg.length);
+            break;
+        case SIM_DAEMON_IN:
+            result = sim_daemon_in(msg.type, data, msg.length, msg.value);
+            break;
+        case SIM_DAEMON_OUT:
+            result = sim_daemon_out(msg.type, data, msg.length, msg.value);
+            break;
+        default:
+            fprintf(stderr, "Unknown transfer %u\n", msg.kind);
+            return;
+        }
+
+        if (!sim_daemon_io(fd, &result, sizeof(result), 1))
+            return;
+        if (in && result > 0 && !sim_daemon_io(fd, data, result, 1))
+            return;
+    }
+}
+
+static void sim_daemon_usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-s socket] [-e ftm|dma] [-l latency]\n"
+        "    [-W wait_every] [-F fault_every] [-P parity_every]\n", name);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    struct sockaddr_un addr;
+    const char* path = SIM_DAEMON_SOCKET;
+    int engine = SIM_ENGINE_FTM;
+    int opt, server, fd;
+
+    sim_adi_init(&target);
+    while ((opt = getopt(argc, argv, "s:e:l:W:F:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            path = optarg;
+            break;
+        case 'e':
+            if (!strcmp(optarg, "dma"))
+                engine = SIM_ENGINE_DMA;
+            else if (strcmp(optarg, "ftm"))
+                sim_daemon_usage(argv[0]);
+            break;
+        case 'l':
+            target.latency = strtoul(optarg, NULL, 0);
+            break;
+        case 'W':
+            target.wait_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'F':
+            target.fault_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            target.parity_every = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            sim_daemon_usage(argv[0]);
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (server < 0 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server, 1) < 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    sim_init(engine);
+    sim_set_target(sim_adi_clock, &target);
+    //the address is set as the host's usb stack would; the host sets the configuration
+    sim_usb_control(0x00, 5, 1, 0, NULL, 0);
+    sim_idle(1);
+    pthread_create(&bus.thread, NULL, sim_daemon_bus, NULL);
+    printf("engine %s, latency %u, wait every %u, fault every %u, parity every %u, listening on %s\n",
+        engine == SIM_ENGINE_DMA ? "dma" : "ftm", target.latency, target.wait_every,
+        target.fault_every, target.parity_every, path);
+    fflush(stdout);
+
+    while (1)
+    {
+        fd = accept(server, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            return 1;
+        }
+
+        sim_daemon_connected(1);
+        sim_daemon_serve(fd);
+        sim_daemon_connected(0);
+        close(fd);
+    }
+
+    return 0;
+}
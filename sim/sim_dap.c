@@ -0,0 +1,518 @@
+/**
+ * Checks the firmware's CMSIS-DAP mode against the ADIv5 target in sim_adi.h,
+ * through the bulk endpoints as a CMSIS-DAP v2 host would use them:
+ *
+ * - DAP_Info: the protocol version, capabilities, packet count and size
+ * - DAP_Connect: the SWD port, and no JTAG port
+ * - DAP_SWJ_Clock and DAP_SWJ_Sequence: the line reset and JTAG-to-SWD
+ *   sequence a host sends before its first transfer, in parts which aren't
+ *   whole bytes, each taking exactly as many clocks as it has bits
+ * - DAP_Transfer: IDCODE, powering up the debug domain, a value match read
+ *   of CTRL/STAT, MEM-AP set up and pipelined DRW reads
+ * - DAP_TransferBlock: block writes and reads of target memory
+ * - Errors: a FAULT stops a transfer with the count of the ones before it,
+ *   and DAP_WriteABORT clears it. Unknown commands get DAP_Invalid.
+ *
+ * Every response is checked byte for byte against what the CMSIS-DAP spec
+ * says it holds, and target memory against what was written.
+ *
+ * Usage: teensy-swd-sim-dap [-e ftm|dma]
+ *
+ * The exit status is nonzero if anything came out wrong. The firmware must be
+ * built with USB_CMSIS_DAP, as "make sim-dap" does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "sim_adi.h"
+#include "usb_types.h"
+
+#define DAP_TIMEOUT 1000000 //ftm periods to wait for a response
+#define DAP_ADDR 0x20000000 //start of the memory blocks
+#define DAP_BLOCK_WORDS 14 //words in a block write, as many as fit in a packet
+
+//commands and status, as in swd_dap.c
+#define DAP_INFO               0x00
+#define DAP_CONNECT            0x02
+#define DAP_TRANSFER           0x05
+#define DAP_TRANSFER_BLOCK     0x06
+#define DAP_WRITE_ABORT        0x08
+#define DAP_SWJ_CLOCK          0x11
+#define DAP_SWJ_SEQUENCE       0x12
+#define DAP_INVALID            0xff
+#define DAP_OK                 0x00
+
+#define DAP_ID_PROTOCOL_VERSION 0x04
+#define DAP_ID_CAPABILITIES     0xf0
+#define DAP_ID_PACKET_COUNT     0xfe
+#define DAP_ID_PACKET_SIZE      0xff
+
+#define DAP_PORT_DISABLED 0
+#define DAP_PORT_SWD      1
+#define DAP_PORT_JTAG     2
+
+//transfer requests: APnDP, RnW and A[3:2]
+#define DAP_AP          0x01
+#define DAP_READ        0x02
+#define DAP_A(addr)     ((addr) & 0xc)
+#define DAP_MATCH_VALUE 0x10
+#define DAP_MATCH_MASK  0x20
+
+#define DAP_ACK_OK    0x01
+#define DAP_ACK_FAULT 0x04
+
+#define DAP_ABORT_CLEAR_ALL 0x1e
+#define DAP_CTRLSTAT_POWERUP 0x50000000 //CSYSPWRUPREQ and CDBGPWRUPREQ
+#define DAP_CTRLSTAT_POWERUP_ACK 0xa0000000 //CSYSPWRUPACK and CDBGPWRUPACK
+#define DAP_CTRLSTAT_ORUNDETECT 0x00000001
+#define DAP_CSW_32_INC 0x23000012 //32-bit accesses, TAR incremented
+
+static sim_adi_t target;
+static uint32_t failures;
+static uint32_t ctrlstat = DAP_CTRLSTAT_POWERUP; //with ORUNDETECT for the dma engine, see swd_dma.h
+
+/**
+ * Command being built
+ */
+static struct {
+    uint8_t data[USB_BULK_SIZE];
+    uint8_t length;
+} cmd;
+
+/**
+ * Starts a command
+ */
+static void dap_begin(uint8_t id)
+{
+    cmd.data[0] = id;
+    cmd.length = 1;
+}
+
+static void dap_u8(uint8_t value)
+{
+    cmd.data[cmd.length++] = value;
+}
+
+static void dap_u16(uint16_t value)
+{
+    dap_u8(value);
+    dap_u8(value >> 8);
+}
+
+static void dap_u32(uint32_t value)
+{
+    dap_u16(value);
+    dap_u16(value >> 16);
+}
+
+/**
+ * Sends the command and waits for its response, running the bus meanwhile.
+ * Exits if the command isn't taken or no response comes.
+ * @param response Buffer for the response, USB_BULK_SIZE bytes
+ * @return Length of the response
+ */
+static int dap_send(uint8_t* response)
+{
+    uint32_t idle;
+    int n;
+
+    if (sim_usb_out(USB_BULK_OUT_ENDPOINT, cmd.data, cmd.length) != cmd.length)
+    {
+        fprintf(stderr, "Command %02x wasn't taken\n", cmd.data[0]);
+        exit(1);
+    }
+
+    for (idle = 0; (n = sim_usb_in(USB_BULK_IN_ENDPOINT, response)) == SIM_USB_NAK; idle++)
+    {
+        if (idle == DAP_TIMEOUT)
+        {
+            fprintf(stderr, "No response to command %02x\n", cmd.data[0]);
+            exit(1);
+        }
+        sim_cycle();
+    }
+    if (n < 0)
+    {
+        fprintf(stderr, "Response to command %02x stalled\n", cmd.data[0]);
+        exit(1);
+    }
+
+    return n;
+}
+
+/**
+ * Sends the command and checks its response
+ * @param expect Response expected
+ * @param length Length of the response expected
+ * @param what Name of the check
+ */
+static void dap_expect(const uint8_t* expect, int length, const char* what)
+{
+    uint8_t response[USB_BULK_SIZE];
+    int n, i;
+
+    n = dap_send(response);
+    if (n != length || memcmp(response, expect, length))
+    {
+        fprintf(stderr, "%s: got", what);
+        for (i = 0; i < n; i++)
+        {
+            fprintf(stderr, " %02x", response[i]);
+        }
+        fprintf(stderr, ", expected");
+        for (i = 0; i < length; i++)
+        {
+            fprintf(stderr, " %02x", expect[i]);
+        }
+        fprintf(stderr, "\n");
+        failures++;
+        return;
+    }
+
+    printf("%-20s ok\n", what);
+}
+
+/**
+ * Builds the response to a DAP_Transfer which returns words
+ */
+static int dap_transfer_response(uint8_t* expect, uint8_t count, uint8_t ack, const uint32_t* words, uint8_t n)
+{
+    uint8_t i;
+
+    expect[0] = DAP_TRANSFER;
+    expect[1] = count;
+    expect[2] = ack;
+    for (i = 0; i < n; i++)
+    {
+        expect[3 + i * 4] = words[i];
+        expect[4 + i * 4] = words[i] >> 8;
+        expect[5 + i * 4] = words[i] >> 16;
+        expect[6 + i * 4] = words[i] >> 24;
+    }
+    return 3 + n * 4;
+}
+
+static void dap_info(void)
+{
+    const uint8_t version[] = { DAP_INFO, 6, '2', '.', '0', '.', '0', 0 };
+    const uint8_t capabilities[] = { DAP_INFO, 1, 0x01 };
+    const uint8_t count[] = { DAP_INFO, 1, 2 };
+    const uint8_t size[] = { DAP_INFO, 2, USB_BULK_SIZE, 0 };
+
+    dap_begin(DAP_INFO);
+    dap_u8(DAP_ID_PROTOCOL_VERSION);
+    dap_expect(version, sizeof(version), "DAP_Info version");
+
+    dap_begin(DAP_INFO);
+    dap_u8(DAP_ID_CAPABILITIES);
+    dap_expect(capabilities, sizeof(capabilities), "DAP_Info capabilities");
+
+    dap_begin(DAP_INFO);
+    dap_u8(DAP_ID_PACKET_COUNT);
+    dap_expect(count, sizeof(count), "DAP_Info packet count");
+
+    dap_begin(DAP_INFO);
+    dap_u8(DAP_ID_PACKET_SIZE);
+    dap_expect(size, sizeof(size), "DAP_Info packet size");
+}
+
+/**
+ * Sends part of a bit sequence with DAP_SWJ_Sequence and checks that exactly
+ * that many clocks went out
+ * @param seq Whole sequence, lsb first
+ * @param first Index of the first bit to send
+ * @param bits Number of bits to send, 1 to 255
+ * @param what Name of the check
+ */
+static void dap_sequence(const uint8_t* seq, uint32_t first, uint8_t bits, const char* what)
+{
+    const uint8_t ok[] = { DAP_SWJ_SEQUENCE, DAP_OK };
+    uint32_t clocks = target.stats.clocks;
+    uint8_t byte = 0;
+    uint32_t i;
+
+    dap_begin(DAP_SWJ_SEQUENCE);
+    dap_u8(bits);
+    for (i = 0; i < bits; i++)
+    {
+        if (seq[(first + i) >> 3] & (1 << ((first + i) & 0x7)))
+            byte |= 1 << (i & 0x7);
+        if ((i & 0x7) == 0x7 || i == bits - 1u)
+        {
+            dap_u8(byte);
+            byte = 0;
+        }
+    }
+    dap_expect(ok, sizeof(ok), what);
+
+    if (target.stats.clocks - clocks != bits)
+    {
+        fprintf(stderr, "%s: %u clocks went out\n", what, target.stats.clocks - clocks);
+        failures++;
+    }
+}
+
+/**
+ * Connects and starts an SWD session the way a host does, up to the IDCODE
+ * read the target needs after a line reset
+ */
+static void dap_connect(void)
+{
+    const uint8_t swd[] = { DAP_CONNECT, DAP_PORT_SWD };
+    const uint8_t jtag[] = { DAP_CONNECT, DAP_PORT_DISABLED };
+    const uint8_t clock[] = { DAP_SWJ_CLOCK, DAP_OK };
+    uint8_t expect[USB_BULK_SIZE];
+    uint8_t line[17];
+    uint32_t idcode = target.idcode;
+    uint8_t i;
+
+    dap_begin(DAP_CONNECT);
+    dap_u8(DAP_PORT_JTAG);
+    dap_expect(jtag, sizeof(jtag), "DAP_Connect JTAG");
+
+    dap_begin(DAP_CONNECT);
+    dap_u8(0);
+    dap_expect(swd, sizeof(swd), "DAP_Connect default");
+
+    dap_begin(DAP_SWJ_CLOCK);
+    dap_u32(1000000);
+    dap_expect(clock, sizeof(clock), "DAP_SWJ_Clock");
+
+    //line reset, JTAG-to-SWD, line reset and idle cycles: 56 + 16 + 56 + 8 bits
+    for (i = 0; i < 7; i++)
+    {
+        line[i] = 0xff;
+        line[9 + i] = 0xff;
+    }
+    line[7] = 0x9e;
+    line[8] = 0xe7;
+    line[16] = 0x00;
+
+    //split up so the counts aren't whole bytes, as hosts do
+    dap_sequence(line, 0, 51, "DAP_SWJ_Sequence 51");
+    dap_sequence(line, 51, 12, "DAP_SWJ_Sequence 12");
+    dap_sequence(line, 63, 73, "DAP_SWJ_Sequence 73");
+    if (!target.swd)
+    {
+        fprintf(stderr, "The target didn't switch to SWD\n");
+        failures++;
+    }
+
+    dap_begin(DAP_TRANSFER);
+    dap_u8(0);
+    dap_u8(1);
+    dap_u8(DAP_READ | DAP_A(0x0));
+    dap_expect(expect, dap_transfer_response(expect, 1, DAP_ACK_OK, &idcode, 1), "DAP_Transfer IDCODE");
+}
+
+/**
+ * Powers up the debug domain and sets up the MEM-AP for 32-bit accesses
+ */
+static void dap_power_up(void)
+{
+    uint8_t expect[USB_BULK_SIZE];
+
+    //the value match read waits for the acknowledgements
+    dap_begin(DAP_TRANSFER);
+    dap_u8(0);
+    dap_u8(6);
+    dap_u8(DAP_A(0x0));
+    dap_u32(DAP_ABORT_CLEAR_ALL);
+    dap_u8(DAP_A(0x4));
+    dap_u32(ctrlstat);
+    dap_u8(DAP_MATCH_MASK);
+    dap_u32(DAP_CTRLSTAT_POWERUP_ACK);
+    dap_u8(DAP_READ | DAP_A(0x4) | DAP_MATCH_VALUE);
+    dap_u32(DAP_CTRLSTAT_POWERUP_ACK);
+    dap_u8(DAP_A(0x8));
+    dap_u32(0);
+    dap_u8(DAP_AP | DAP_A(0x0));
+    dap_u32(DAP_CSW_32_INC);
+    dap_expect(expect, dap_transfer_response(expect, 6, DAP_ACK_OK, NULL, 0), "DAP_Transfer power up");
+}
+
+/**
+ * Writes a block of words with DAP_TransferBlock and reads it back, both with
+ * DAP_TransferBlock and with pipelined DRW reads in a DAP_Transfer
+ */
+static void dap_blocks(void)
+{
+    uint8_t expect[USB_BULK_SIZE];
+    uint32_t words[DAP_BLOCK_WORDS];
+    uint8_t i;
+
+    for (i = 0; i < DAP_BLOCK_WORDS; i++)
+    {
+        words[i] = i * 0x9e3779b9 + 0x01234567;
+    }
+
+    dap_begin(DAP_TRANSFER);
+    dap_u8(0);
+    dap_u8(1);
+    dap_u8(DAP_AP | DAP_A(0x4));
+    dap_u32(DAP_ADDR);
+    dap_expect(expect, dap_transfer_response(expect, 1, DAP_ACK_OK, NULL, 0), "DAP_Transfer TAR");
+
+    dap_begin(DAP_TRANSFER_BLOCK);
+    dap_u8(0);
+    dap_u16(DAP_BLOCK_WORDS);
+    dap_u8(DAP_AP | DAP_A(0xc));
+    for (i = 0; i < DAP_BLOCK_WORDS; i++)
+    {
+        dap_u32(words[i]);
+    }
+    expect[0] = DAP_TRANSFER_BLOCK;
+    expect[1] = DAP_BLOCK_WORDS;
+    expect[2] = 0;
+    expect[3] = DAP_ACK_OK;
+    dap_expect(expect, 4, "DAP_TransferBlock write");
+
+    for (i = 0; i < DAP_BLOCK_WORDS; i++)
+    {
+        if (sim_adi_read_mem(&target, DAP_ADDR + i * 4) != words[i])
+        {
+            fprintf(stderr, "Target has %08x at %08x, not %08x\n",
+                sim_adi_read_mem(&target, DAP_ADDR + i * 4), DAP_ADDR + i * 4, words[i]);
+            failures++;
+            break;
+        }
+    }
+
+    dap_begin(DAP_TRANSFER);
+    dap_u8(0);
+    dap_u8(1);
+    dap_u8(DAP_AP | DAP_A(0x4));
+    dap_u32(DAP_ADDR);
+    dap_send(expect);
+
+    dap_begin(DAP_TRANSFER_BLOCK);
+    dap_u8(0);
+    dap_u16(DAP_BLOCK_WORDS);
+    dap_u8(DAP_AP | DAP_READ | DAP_A(0xc));
+    expect[0] = DAP_TRANSFER_BLOCK;
+    expect[1] = DAP_BLOCK_WORDS;
+    expect[2] = 0;
+    expect[3] = DAP_ACK_OK;
+    for (i = 0; i < DAP_BLOCK_WORDS; i++)
+    {
+        expect[4 + i * 4] = words[i];
+        expect[5 + i * 4] = words[i] >> 8;
+        expect[6 + i * 4] = words[i] >> 16;
+        expect[7 + i * 4] = words[i] >> 24;
+    }
+    dap_expect(expect, 4 + DAP_BLOCK_WORDS * 4, "DAP_TransferBlock read");
+
+    //the reads of the same register are pipelined through RDBUFF
+    dap_begin(DAP_TRANSFER);
+    dap_u8(0);
+    dap_u8(5);
+    dap_u8(DAP_AP | DAP_A(0x4));
+    dap_u32(DAP_ADDR);
+    for (i = 0; i < 4; i++)
+    {
+        dap_u8(DAP_AP | DAP_READ | DAP_A(0xc));
+    }
+    dap_expect(expect, dap_transfer_response(expect, 5, DAP_ACK_OK, words, 4), "DAP_Transfer DRW reads");
+}
+
+/**
+ * Has the target FAULT an access and checks the transfer stops there
+ */
+static void dap_errors(void)
+{
+    const uint8_t invalid[] = { DAP_INVALID };
+    const uint8_t abort[] = { DAP_WRITE_ABORT, DAP_OK };
+    uint8_t expect[USB_BULK_SIZE];
+    uint32_t idcode = target.idcode;
+
+    //the DP read goes through and the first AP access faults. The bus is
+    //standing still between commands, so the target can be changed here.
+    target.fault_every = 1;
+    dap_begin(DAP_TRANSFER);
+    dap_u8(0);
+    dap_u8(3);
+    dap_u8(DAP_READ | DAP_A(0x0));
+    dap_u8(DAP_AP | DAP_A(0x4));
+    dap_u32(DAP_ADDR);
+    dap_u8(DAP_AP | DAP_READ | DAP_A(0xc));
+    dap_expect(expect, dap_transfer_response(expect, 1, DAP_ACK_FAULT, &idcode, 1), "DAP_Transfer FAULT");
+    target.fault_every = 0;
+
+    dap_begin(DAP_WRITE_ABORT);
+    dap_u8(0);
+    dap_u32(DAP_ABORT_CLEAR_ALL);
+    dap_expect(abort, sizeof(abort), "DAP_WriteABORT");
+
+    dap_begin(0x7f);
+    dap_expect(invalid, sizeof(invalid), "DAP_Invalid");
+}
+
+static void dap_usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-e ftm|dma]\n", name);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t descriptor[18];
+    int engine = SIM_ENGINE_FTM;
+    int opt;
+
+    sim_adi_init(&target);
+    while ((opt = getopt(argc, argv, "e:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            if (!strcmp(optarg, "dma"))
+            {
+                engine = SIM_ENGINE_DMA;
+                ctrlstat |= DAP_CTRLSTAT_ORUNDETECT;
+            }
+            else if (strcmp(optarg, "ftm"))
+                dap_usage(argv[0]);
+            break;
+        default:
+            dap_usage(argv[0]);
+        }
+    }
+
+    sim_init(engine);
+    sim_set_target(sim_adi_clock, &target);
+
+    //enumerate as a host would
+    if (sim_usb_control(0x80, 6, 0x0100, 0, descriptor, sizeof(descriptor)) != sizeof(descriptor))
+    {
+        fprintf(stderr, "Bad device descriptor\n");
+        return 1;
+    }
+    sim_usb_control(0x00, 5, 1, 0, NULL, 0);
+    sim_usb_control(0x00, 9, 1, 0, NULL, 0);
+    printf("engine %s\n", engine == SIM_ENGINE_DMA ? "dma" : "ftm");
+
+    dap_info();
+    dap_connect();
+    dap_power_up();
+    dap_blocks();
+    dap_errors();
+
+    printf("target: %u requests, %u ok, %u wait, %u fault, %u protocol errors, %u line resets\n",
+        target.stats.requests, target.stats.ok, target.stats.wait, target.stats.fault,
+        target.stats.protocol, target.stats.resets);
+    if (target.stats.protocol)
+    {
+        fprintf(stderr, "The target saw protocol errors\n");
+        failures++;
+    }
+
+    sim_stop();
+    sim_adi_free(&target);
+    if (failures)
+        printf("%u failures\n", failures);
+    return failures ? 1 : 0;
+}
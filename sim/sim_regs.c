@@ -0,0 +1,29 @@
+/**
+ * Mock register file for the software-in-the-loop build
+ */
+
+#include "sim_regs.h"
+
+volatile struct FTM_MemMap sim_ftm0;
+volatile struct GPIO_MemMap sim_ptc, sim_ptd;
+volatile struct PORT_MemMap sim_portc, sim_portd;
+volatile struct SIM_MemMap sim_sim;
+volatile struct DMA_MemMap sim_dma;
+volatile struct DMAMUX_MemMap sim_dmamux;
+volatile struct PIT_MemMap sim_pit;
+volatile struct SPI_MemMap sim_spi0;
+volatile struct USB_MemMap sim_usb0;
+volatile struct DWT_MemMap sim_dwt;
+volatile struct CoreDebug_MemMap sim_coredebug;
+
+//clocks set up by sysinit on the hardware
+int32_t mcg_clk_hz = 96000000;
+int32_t mcg_clk_khz = 96000;
+int32_t core_clk_khz = 96000;
+int32_t periph_clk_khz = 48000;
+
+volatile uint8_t* sim_usbtrc0(void)
+{
+    sim_usb0.USBTRC0 &= ~USB_USBTRC0_USBRESET_MASK;
+    return &sim_usb0.USBTRC0;
+}
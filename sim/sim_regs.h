@@ -0,0 +1,75 @@
+/**
+ * Mock register file for the software-in-the-loop build
+ *
+ * The sim target in the Makefile includes this ahead of every firmware source
+ * it builds for the host. The peripherals the firmware uses are pointed at
+ * plain structures in memory instead of their addresses on the MK20D7, so
+ * the register macros from MK20D7.h work unchanged. The driver in sim.c
+ * plays the part of the hardware behind them.
+ *
+ * Every pointer the firmware hands to a peripheral must fit in 32 bits, as it
+ * does on the MK20D7, so the sim is linked without PIE.
+ */
+
+#ifndef _SIM_REGS_H_
+#define _SIM_REGS_H_
+
+#include "arm_cm4.h"
+
+extern volatile struct FTM_MemMap sim_ftm0;
+extern volatile struct GPIO_MemMap sim_ptc, sim_ptd;
+extern volatile struct PORT_MemMap sim_portc, sim_portd;
+extern volatile struct SIM_MemMap sim_sim;
+extern volatile struct DMA_MemMap sim_dma;
+extern volatile struct DMAMUX_MemMap sim_dmamux;
+extern volatile struct PIT_MemMap sim_pit;
+extern volatile struct SPI_MemMap sim_spi0;
+extern volatile struct USB_MemMap sim_usb0;
+extern volatile struct DWT_MemMap sim_dwt;
+extern volatile struct CoreDebug_MemMap sim_coredebug;
+
+#undef FTM0_BASE_PTR
+#define FTM0_BASE_PTR (&sim_ftm0)
+#undef PTC_BASE_PTR
+#define PTC_BASE_PTR (&sim_ptc)
+#undef PTD_BASE_PTR
+#define PTD_BASE_PTR (&sim_ptd)
+#undef PORTC_BASE_PTR
+#define PORTC_BASE_PTR (&sim_portc)
+#undef PORTD_BASE_PTR
+#define PORTD_BASE_PTR (&sim_portd)
+#undef SIM_BASE_PTR
+#define SIM_BASE_PTR (&sim_sim)
+#undef DMA_BASE_PTR
+#define DMA_BASE_PTR (&sim_dma)
+#undef DMAMUX_BASE_PTR
+#define DMAMUX_BASE_PTR (&sim_dmamux)
+#undef PIT_BASE_PTR
+#define PIT_BASE_PTR (&sim_pit)
+#undef SPI0_BASE_PTR
+#define SPI0_BASE_PTR (&sim_spi0)
+#undef USB0_BASE_PTR
+#define USB0_BASE_PTR (&sim_usb0)
+#undef DWT_BASE_PTR
+#define DWT_BASE_PTR (&sim_dwt)
+#undef CoreDebug_BASE_PTR
+#define CoreDebug_BASE_PTR (&sim_coredebug)
+
+/**
+ * Returns the USB transceiver control register. The USB module finishes its
+ * software reset right away, so the reset bit reads back as clear.
+ */
+volatile uint8_t* sim_usbtrc0(void);
+
+#undef USB0_USBTRC0
+#define USB0_USBTRC0 (*sim_usbtrc0())
+
+//interrupts are masked one at a time with disable_irq, see sim.c
+#undef EnableInterrupts
+#define EnableInterrupts
+#undef DisableInterrupts
+#define DisableInterrupts
+#undef DataMemoryBarrier
+#define DataMemoryBarrier __sync_synchronize();
+
+#endif // _SIM_REGS_H_
@@ -0,0 +1,492 @@
+/**
+ * Checks the firmware's program interpreter against the ADIv5 target in
+ * sim_adi.h, uploading programs with the write program request and running
+ * them with the begin program request as a host would:
+ *
+ * - Connect: a program which connects, reads the IDCODE and powers up the
+ *   debug domain on its own, and the registers it leaves behind
+ * - Branches: loops and every conditional jump, with the arithmetic ops
+ * - Blocks: MWRITE and MREAD of target memory through the block buffer, with
+ *   LDW and STW, checked against the target and the read block request
+ * - Poll: a flag in target memory which matches, and one which never does
+ * - Calls: as many nested calls as there is room for, and one more
+ * - Invalid: unknown opcodes, returns with nothing to return to and buffer
+ *   accesses out of range, each reported with the index of the instruction
+ * - Length: running or jumping past the end of a program, including one
+ *   uploaded over a longer one, and starting past its end
+ *
+ * Every result and data word is checked against what swd_vm.h says it holds.
+ *
+ * Usage: teensy-swd-sim-vm [-e ftm|dma]
+ *
+ * The exit status is nonzero if anything came out wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "sim_adi.h"
+#include "usb_types.h"
+
+#define VM_TIMEOUT 1000000 //ftm periods to wait for a record
+#define VM_ADDR 0x20000000 //start of the memory blocks
+#define VM_FLAG 0x20000400 //word polled for
+#define VM_BLOCK_WORDS 16 //words moved by the block program
+
+#define VM_OK          0
+#define VM_ERR        -1
+#define VM_ERR_TIMEOUT -7
+
+//instructions, as in swd_vm.h
+#define VM_HALT    0x00
+#define VM_EXIT    0x01
+#define VM_JMP     0x02
+#define VM_JZ      0x03
+#define VM_JNZ     0x04
+#define VM_JEQ     0x05
+#define VM_JNE     0x06
+#define VM_JLO     0x07
+#define VM_DJNZ    0x08
+#define VM_CALL    0x09
+#define VM_RET     0x0a
+#define VM_LDI     0x10
+#define VM_LDIH    0x11
+#define VM_MOV     0x12
+#define VM_ADDI    0x13
+#define VM_ADD     0x14
+#define VM_SUB     0x15
+#define VM_AND     0x16
+#define VM_OR      0x17
+#define VM_XOR     0x18
+#define VM_SHL     0x19
+#define VM_SHR     0x1a
+#define VM_LDW     0x1b
+#define VM_STW     0x1c
+#define VM_READ    0x20
+#define VM_WRITE   0x21
+#define VM_MREAD   0x22
+#define VM_MWRITE  0x23
+#define VM_POLL    0x24
+#define VM_CONNECT 0x25
+
+#define VM_STATUS 15
+#define VM_DATA 14
+#define VM_CALL_DEPTH 8
+
+//an instruction with an immediate, and one with four registers
+#define VM(op, a, b, imm) ((op) | ((a) << 8) | ((b) << 12) | ((uint32_t)(uint16_t)(imm) << 16))
+#define VM_R(op, a, b, c, d) VM(op, a, b, (c) | ((d) << 4))
+
+//request bytes
+#define VM_DP_READ_IDCODE    0xa5
+#define VM_DP_WRITE_ABORT    0x81
+#define VM_DP_READ_CTRLSTAT  0x8d
+#define VM_DP_WRITE_CTRLSTAT 0xa9
+#define VM_DP_WRITE_SELECT   0xb1
+
+#define VM_ABORT_CLEAR_ALL 0x1e
+#define VM_CTRLSTAT_POWERUP 0x50000000 //CSYSPWRUPREQ and CDBGPWRUPREQ
+#define VM_CTRLSTAT_ORUNDETECT 0x00000001
+
+#define VM_TYPE(request) ((request) & 0xff)
+#define VM_REQUEST(request) ((request) >> 8)
+
+static sim_adi_t target;
+static uint32_t failures;
+static uint8_t tag;
+static uint32_t ctrlstat = VM_CTRLSTAT_POWERUP; //with ORUNDETECT for the dma engine, see swd_dma.h
+
+/**
+ * Runs a control request
+ * @param request wRequestAndType, as in usb_types.h
+ * @return Bytes moved, or a negative value if it stalled
+ */
+static int vm_control(uint16_t request, uint16_t value, uint16_t index, void* data, uint16_t length)
+{
+    return sim_usb_control(VM_TYPE(request), VM_REQUEST(request), value, index, data, length);
+}
+
+/**
+ * Uploads a program and runs it to the end, running the bus meanwhile.
+ * Exits if a request stalls or no record comes.
+ * @param program Instructions, uploaded to the start of the program buffer
+ * @param length Number of instructions
+ * @param entry Index of the first instruction to run
+ * @param args First registers, or NULL for zeros
+ * @param data Gets r0 or the index of the instruction which ended it
+ * @return Result of the program
+ */
+static int8_t vm_run(const uint32_t* program, uint16_t length, uint16_t entry, const uint32_t* args,
+    uint32_t* data)
+{
+    program_req_t req;
+    completion_t records[USB_NOTIFY_SIZE / sizeof(completion_t)];
+    uint32_t idle;
+    uint16_t i, n;
+    int got;
+
+    for (i = 0; i < length; i += n)
+    {
+        n = length - i > 16 ? 16 : length - i;
+        if (vm_control(USB_SWD_WRITE_PROGRAM, i, 0, (void*)&program[i], n * 4) != n * 4)
+        {
+            fprintf(stderr, "Writing the program stalled\n");
+            exit(1);
+        }
+    }
+
+    memset(&req, 0, sizeof(req));
+    if (args)
+        memcpy(req.args, args, sizeof(req.args));
+    req.length = length;
+    if (vm_control(USB_SWD_BEGIN_PROGRAM, entry, tag, &req, sizeof(req)) < 0)
+    {
+        fprintf(stderr, "Beginning the program stalled\n");
+        exit(1);
+    }
+
+    for (idle = 0; (got = sim_usb_in(USB_NOTIFY_ENDPOINT, records)) <= 0; idle++)
+    {
+        if (idle == VM_TIMEOUT)
+        {
+            fprintf(stderr, "The program never ended\n");
+            exit(1);
+        }
+        sim_cycle();
+    }
+    if (got != sizeof(completion_t) || records[0].tag != tag)
+    {
+        fprintf(stderr, "Got %d bytes of records for tag %u\n", got, tag);
+        exit(1);
+    }
+    tag++;
+
+    *data = records[0].data;
+    return records[0].result;
+}
+
+/**
+ * Runs a program and checks how it ended
+ * @param expect Result expected
+ * @param expect_data Data expected
+ * @param what Name of the check
+ */
+static void vm_expect(const uint32_t* program, uint16_t length, uint16_t entry, const uint32_t* args,
+    int8_t expect, uint32_t expect_data, const char* what)
+{
+    uint32_t data;
+    int8_t result;
+
+    result = vm_run(program, length, entry, args, &data);
+    if (result != expect || data != expect_data)
+    {
+        fprintf(stderr, "%s: ended with %d, %08x, expected %d, %08x\n", what, result, data,
+            expect, expect_data);
+        failures++;
+        return;
+    }
+
+    printf("%-20s ok\n", what);
+}
+
+/**
+ * Connects, reads the IDCODE and powers up the debug domain from a program,
+ * then checks the registers it left
+ */
+static void vm_connect(void)
+{
+    const uint32_t program[] = {
+        /* 0 */ VM(VM_CONNECT, 0, 0, 0),
+        /* 1 */ VM(VM_READ, 1, 0, VM_DP_READ_IDCODE),
+        /* 2 */ VM(VM_JNZ, VM_STATUS, 0, 15),
+        /* 3 */ VM(VM_LDI, 2, 0, VM_ABORT_CLEAR_ALL),
+        /* 4 */ VM(VM_WRITE, 2, 0, VM_DP_WRITE_ABORT),
+        /* 5 */ VM(VM_WRITE, 0, 0, VM_DP_WRITE_CTRLSTAT),
+        //r3 is the acknowledgements, r5 the attempts at reading them
+        /* 6 */ VM(VM_LDI, 3, 0, 0),
+        /* 7 */ VM(VM_LDIH, 3, 0, 0xa000),
+        /* 8 */ VM(VM_LDI, 5, 0, 100),
+        /* 9 */ VM(VM_READ, 2, 0, VM_DP_READ_CTRLSTAT),
+        /* 10 */ VM_R(VM_AND, 4, 2, 3, 0),
+        /* 11 */ VM(VM_JEQ, 4, 3, 13),
+        /* 12 */ VM(VM_DJNZ, 5, 0, 9),
+        /* 13 */ VM(VM_WRITE, 6, 0, VM_DP_WRITE_SELECT),
+        /* 14 */ VM(VM_MOV, 0, 1, 0),
+        /* 15 */ VM(VM_EXIT, VM_STATUS, 0, 0),
+    };
+    uint32_t args[USB_PROGRAM_ARGUMENTS] = { ctrlstat };
+    uint32_t r[16];
+
+    vm_expect(program, sizeof(program) / 4, 0, args, VM_OK, target.idcode, "connect");
+    if (!target.swd)
+    {
+        fprintf(stderr, "The target didn't switch to SWD\n");
+        failures++;
+    }
+
+    if (vm_control(USB_SWD_READ_REGISTERS, 0, 0, r, sizeof(r)) != sizeof(r))
+    {
+        fprintf(stderr, "Reading the registers stalled\n");
+        exit(1);
+    }
+    if (r[0] != target.idcode || r[1] != target.idcode || r[3] != 0xa0000000 ||
+        r[4] != r[3] || r[5] == 0 || r[VM_STATUS] != VM_OK || (r[2] & ctrlstat) != ctrlstat)
+    {
+        fprintf(stderr, "Registers: r0 %08x, r1 %08x, r2 %08x, r3 %08x, r4 %08x, r5 %08x, status %08x\n",
+            r[0], r[1], r[2], r[3], r[4], r[5], r[VM_STATUS]);
+        failures++;
+        return;
+    }
+    printf("%-20s ok\n", "registers");
+}
+
+/**
+ * Takes every branch one way and the other, with the arithmetic ops between.
+ * Any wrong turn exits with 0x55.
+ */
+static void vm_branches(void)
+{
+    const uint32_t program[] = {
+        //r0 = 1 + ... + r1, so 55 for 10
+        /* 0 */ VM(VM_LDI, 0, 0, 0),
+        /* 1 */ VM_R(VM_ADD, 0, 0, 1, 0),
+        /* 2 */ VM(VM_DJNZ, 1, 0, 1),
+        /* 3 */ VM(VM_JNZ, 1, 0, 29),
+        /* 4 */ VM(VM_JZ, 1, 0, 6),
+        /* 5 */ VM(VM_JMP, 0, 0, 29),
+        /* 6 */ VM(VM_LDI, 2, 0, 5),
+        /* 7 */ VM(VM_LDI, 3, 0, 7),
+        /* 8 */ VM(VM_JLO, 3, 2, 29),
+        /* 9 */ VM(VM_JLO, 2, 3, 11),
+        /* 10 */ VM(VM_JMP, 0, 0, 29),
+        /* 11 */ VM(VM_JEQ, 2, 3, 29),
+        /* 12 */ VM(VM_JNE, 2, 2, 29),
+        /* 13 */ VM(VM_JEQ, 2, 2, 15),
+        /* 14 */ VM(VM_JMP, 0, 0, 29),
+        /* 15 */ VM(VM_JNE, 2, 3, 17),
+        /* 16 */ VM(VM_JMP, 0, 0, 29),
+        //r4 = ((5 << 7) | 7) ^ 5 = 0x282, then 0x282 >> 5 - 7 = 13
+        /* 17 */ VM_R(VM_SHL, 4, 2, 3, 0),
+        /* 18 */ VM_R(VM_OR, 4, 4, 3, 0),
+        /* 19 */ VM_R(VM_XOR, 4, 4, 2, 0),
+        /* 20 */ VM(VM_LDI, 5, 0, 0x282),
+        /* 21 */ VM(VM_JNE, 4, 5, 29),
+        /* 22 */ VM(VM_LDI, 5, 0, 5),
+        /* 23 */ VM_R(VM_SHR, 4, 4, 5, 0),
+        /* 24 */ VM_R(VM_SUB, 4, 4, 3, 0),
+        /* 25 */ VM(VM_ADDI, 4, 4, -13),
+        /* 26 */ VM(VM_JNZ, 4, 0, 29),
+        /* 27 */ VM(VM_ADDI, 0, 0, -5),
+        /* 28 */ VM(VM_HALT, 0, 0, 0),
+        /* 29 */ VM(VM_LDI, 0, 0, 0x55),
+        /* 30 */ VM(VM_EXIT, 0, 0, 0),
+    };
+    uint32_t args[USB_PROGRAM_ARGUMENTS] = { 0, 10 };
+
+    vm_expect(program, sizeof(program) / 4, 0, args, VM_OK, 50, "branches");
+}
+
+/**
+ * Fills the buffer with a pattern, writes it to target memory, reads it back
+ * into the next part of the buffer and compares the two
+ */
+static void vm_blocks(void)
+{
+    const uint32_t program[] = {
+        //r0 is the address and r1 the count. buffer[r2] = (r2 << 24) ^ r3
+        /* 0 */ VM(VM_LDI, 2, 0, 0),
+        /* 1 */ VM(VM_LDI, 3, 0, 0x4567),
+        /* 2 */ VM(VM_LDIH, 3, 0, 0x0123),
+        /* 3 */ VM(VM_LDI, 4, 0, 24),
+        /* 4 */ VM_R(VM_SHL, 5, 2, 4, 0),
+        /* 5 */ VM_R(VM_XOR, 5, 5, 3, 0),
+        /* 6 */ VM(VM_STW, 5, 2, 0),
+        /* 7 */ VM(VM_ADDI, 2, 2, 1),
+        /* 8 */ VM(VM_JLO, 2, 1, 4),
+        /* 9 */ VM(VM_LDI, 4, 0, 0),
+        /* 10 */ VM_R(VM_MWRITE, 0, 1, 4, 0),
+        /* 11 */ VM(VM_JNZ, VM_STATUS, 0, 23),
+        /* 12 */ VM(VM_LDI, 4, 0, VM_BLOCK_WORDS),
+        /* 13 */ VM_R(VM_MREAD, 0, 1, 4, 0),
+        /* 14 */ VM(VM_JNZ, VM_STATUS, 0, 23),
+        /* 15 */ VM(VM_LDI, 2, 0, 0),
+        /* 16 */ VM(VM_LDW, 5, 2, 0),
+        /* 17 */ VM(VM_LDW, 6, 2, VM_BLOCK_WORDS),
+        /* 18 */ VM(VM_JNE, 5, 6, 24),
+        /* 19 */ VM(VM_ADDI, 2, 2, 1),
+        /* 20 */ VM(VM_JLO, 2, 1, 16),
+        /* 21 */ VM(VM_MOV, 0, VM_DATA, 0),
+        /* 22 */ VM(VM_HALT, 0, 0, 0),
+        /* 23 */ VM(VM_EXIT, VM_STATUS, 0, 0),
+        /* 24 */ VM(VM_LDI, 0, 0, 0x55),
+        /* 25 */ VM(VM_EXIT, 0, 0, 0),
+    };
+    uint32_t args[USB_PROGRAM_ARGUMENTS] = { VM_ADDR, VM_BLOCK_WORDS };
+    uint32_t read[VM_BLOCK_WORDS];
+    uint32_t i, word;
+
+    vm_expect(program, sizeof(program) / 4, 0, args, VM_OK, VM_BLOCK_WORDS, "blocks");
+
+    if (vm_control(USB_SWD_READ_BLOCK, VM_BLOCK_WORDS, 0, read, sizeof(read)) != sizeof(read))
+    {
+        fprintf(stderr, "Reading the block buffer stalled\n");
+        exit(1);
+    }
+    for (i = 0; i < VM_BLOCK_WORDS; i++)
+    {
+        word = (i << 24) ^ 0x01234567;
+        if (sim_adi_read_mem(&target, VM_ADDR + i * 4) != word || read[i] != word)
+        {
+            fprintf(stderr, "Word %u is %08x in the target and %08x in the buffer, not %08x\n", i,
+                sim_adi_read_mem(&target, VM_ADDR + i * 4), read[i], word);
+            failures++;
+            return;
+        }
+    }
+    printf("%-20s ok\n", "block memory");
+}
+
+/**
+ * Polls a flag which is set, then one which never is
+ */
+static void vm_poll(void)
+{
+    const uint32_t program[] = {
+        //r0 is the address, r1 the mask, r2 the value and r3 the attempts
+        /* 0 */ VM_R(VM_POLL, 0, 1, 2, 3),
+        /* 1 */ VM(VM_JNZ, VM_STATUS, 0, 4),
+        /* 2 */ VM(VM_MOV, 0, VM_DATA, 0),
+        /* 3 */ VM(VM_HALT, 0, 0, 0),
+        /* 4 */ VM(VM_EXIT, VM_STATUS, 0, 0),
+    };
+    uint32_t args[USB_PROGRAM_ARGUMENTS] = { VM_FLAG, 0xff, 0x5a, 5 };
+
+    sim_adi_write_mem(&target, VM_FLAG, 0x1234005a);
+    vm_expect(program, sizeof(program) / 4, 0, args, VM_OK, 0x1234005a, "poll match");
+
+    sim_adi_write_mem(&target, VM_FLAG, 0);
+    vm_expect(program, sizeof(program) / 4, 0, args, VM_ERR_TIMEOUT, VM_FLAG, "poll timeout");
+}
+
+/**
+ * Recurses r1 calls deep
+ */
+static void vm_calls(void)
+{
+    const uint32_t program[] = {
+        /* 0 */ VM(VM_CALL, 0, 0, 2),
+        /* 1 */ VM(VM_HALT, 0, 0, 0),
+        /* 2 */ VM(VM_DJNZ, 1, 0, 4),
+        /* 3 */ VM(VM_RET, 0, 0, 0),
+        /* 4 */ VM(VM_CALL, 0, 0, 2),
+        /* 5 */ VM(VM_RET, 0, 0, 0),
+    };
+    uint32_t deepest[USB_PROGRAM_ARGUMENTS] = { 0, VM_CALL_DEPTH };
+    uint32_t deeper[USB_PROGRAM_ARGUMENTS] = { 0, VM_CALL_DEPTH + 1 };
+
+    vm_expect(program, sizeof(program) / 4, 0, deepest, VM_OK, 0, "call depth");
+    vm_expect(program, sizeof(program) / 4, 0, deeper, VM_ERR, 4, "call too deep");
+}
+
+static void vm_invalid(void)
+{
+    const uint32_t opcode[] = { VM(VM_LDI, 0, 0, 1), VM(VM_LDI, 1, 0, 2), 0x7f, VM(VM_HALT, 0, 0, 0) };
+    const uint32_t ret[] = { VM(VM_RET, 0, 0, 0), VM(VM_HALT, 0, 0, 0) };
+    const uint32_t load[] = { VM(VM_LDI, 1, 0, USB_BLOCK_WORDS - 1), VM(VM_LDW, 0, 1, 0),
+        VM(VM_LDW, 0, 1, 1), VM(VM_HALT, 0, 0, 0) };
+    const uint32_t block[] = { VM(VM_LDI, 1, 0, 2), VM(VM_LDI, 2, 0, USB_BLOCK_WORDS - 1),
+        VM_R(VM_MREAD, 0, 1, 2, 0), VM(VM_HALT, 0, 0, 0) };
+
+    vm_expect(opcode, sizeof(opcode) / 4, 0, NULL, VM_ERR, 2, "invalid opcode");
+    vm_expect(ret, sizeof(ret) / 4, 0, NULL, VM_ERR, 0, "invalid return");
+    vm_expect(load, sizeof(load) / 4, 0, NULL, VM_ERR, 2, "invalid load");
+    vm_expect(block, sizeof(block) / 4, 0, NULL, VM_ERR, 2, "invalid block");
+}
+
+/**
+ * Runs past the end of programs. The short program is uploaded over the long
+ * one, whose words after it must not be run.
+ */
+static void vm_length(void)
+{
+    const uint32_t longer[] = { VM(VM_LDI, 0, 0, 1), VM(VM_LDI, 1, 0, 2), VM(VM_LDI, 0, 0, 0x77),
+        VM(VM_HALT, 0, 0, 0) };
+    const uint32_t shorter[] = { VM(VM_LDI, 0, 0, 1), VM(VM_LDI, 1, 0, 2) };
+    const uint32_t jump[] = { VM(VM_JMP, 0, 0, 3), VM(VM_HALT, 0, 0, 0) };
+
+    vm_expect(longer, sizeof(longer) / 4, 0, NULL, VM_OK, 0x77, "long program");
+    vm_expect(shorter, sizeof(shorter) / 4, 0, NULL, VM_ERR, 2, "past the end");
+    vm_expect(jump, sizeof(jump) / 4, 0, NULL, VM_ERR, 3, "jump past the end");
+    vm_expect(jump, sizeof(jump) / 4, 5, NULL, VM_ERR, 5, "entry past the end");
+}
+
+static void vm_usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-e ftm|dma]\n", name);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t descriptor[18];
+    int engine = SIM_ENGINE_FTM;
+    int opt;
+
+    sim_adi_init(&target);
+    while ((opt = getopt(argc, argv, "e:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            if (!strcmp(optarg, "dma"))
+            {
+                engine = SIM_ENGINE_DMA;
+                ctrlstat |= VM_CTRLSTAT_ORUNDETECT;
+            }
+            else if (strcmp(optarg, "ftm"))
+                vm_usage(argv[0]);
+            break;
+        default:
+            vm_usage(argv[0]);
+        }
+    }
+
+    sim_init(engine);
+    sim_set_target(sim_adi_clock, &target);
+
+    //enumerate as a host would
+    if (sim_usb_control(0x80, 6, 0x0100, 0, descriptor, sizeof(descriptor)) != sizeof(descriptor))
+    {
+        fprintf(stderr, "Bad device descriptor\n");
+        return 1;
+    }
+    sim_usb_control(0x00, 5, 1, 0, NULL, 0);
+    sim_usb_control(0x00, 9, 1, 0, NULL, 0);
+    printf("engine %s\n", engine == SIM_ENGINE_DMA ? "dma" : "ftm");
+
+    vm_connect();
+    vm_branches();
+    vm_blocks();
+    vm_poll();
+    vm_calls();
+    vm_invalid();
+    vm_length();
+
+    printf("target: %u requests, %u ok, %u wait, %u fault, %u protocol errors, %u line resets\n",
+        target.stats.requests, target.stats.ok, target.stats.wait, target.stats.fault,
+        target.stats.protocol, target.stats.resets);
+    if (target.stats.protocol)
+    {
+        fprintf(stderr, "The target saw protocol errors\n");
+        failures++;
+    }
+
+    sim_stop();
+    sim_adi_free(&target);
+    if (failures)
+        printf("%u failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -2,6 +2,8 @@
 #include "arm_cm4.h"
 #include "usb.h"
 #include "swd.h"
+#include "swd_tune.h"
+#include "swd_vm.h"
 
 #define LED_ON  GPIOC_PSOR=(1<<5)
 #define LED_OFF GPIOC_PCOR=(1<<5)
@@ -39,17 +41,32 @@ int main(void)
     PIT_TCTRL1 |= PIT_TCTRL_TEN_MASK; // start Timer 1
 
     usb_init();
-    swd_init();
+    swd_init(SWD_ENGINE_FTM);
 
     enable_irq(IRQ(INT_PIT1));
     EnableInterrupts
 
+    n = 0;
     while(1)
     {
-        LED2_ON;
-        for (n = 0; n < s; n++);
-        LED2_OFF;
-        for (n = 0; n < s; n++);
+        //clock tuning blocks on the swd interrupt, so it runs here
+        swd_tune_task();
+
+        //so do programs uploaded by the host
+        swd_vm_task();
+
+        //feed bulk commands to the swd queue and send back their results
+        usb_task();
+
+        if (++n == s)
+        {
+            LED2_ON;
+        }
+        else if (n >= 2 * s)
+        {
+            LED2_OFF;
+            n = 0;
+        }
     }
 
     return  0;                        // should never get here!
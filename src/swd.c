@@ -18,51 +18,118 @@
  *
  * The handle_queue function operates the bus state machine.
  *
+ * Commands wait in the queue as compact records of a few words. Only the
+ * command being run is unpacked into a cmd_t with its execution state, so
+ * the queue can be several hundred commands deep. Reads and writes are packed
+ * into 64-bit shift words as they are dequeued: the bits to drive, a mask of
+ * which bits the host drives, and the parity of the write data. While a
+ * transfer is running, each overflow interrupt just shifts one bit in and one
+ * bit out. The only decision made along the way is on the acknowledge.
+ *
+ * Every bus interrupt is timed with the DWT cycle counter. The counts are
+ * kept with the bus statistics so the cost per bit can be measured.
+ *
+ * When the SPI engine is selected, the channel match interrupt is not used
+ * and the overflow interrupt only ticks the bus state machine. Each tick runs
+ * a whole transaction or bit sequence through the swd_spi module instead of
+ * a single bit.
+ *
+ * When the DMA engine is selected, the overflow interrupt ticks swd_do_dma
+ * instead. Once the swd_dma module has finished a batch, it decodes the
+ * results of that batch and builds the next one from the queue.
+ *
+ * A pipelined read is queued as a run of ordinary reads. Each one carries the
+ * result of the AP read before it, since that is where its data belongs, and
+ * flags which tell swd_complete to pass errors along the run.
+ *
+ * A MEM-AP block command is run as a sequence of transfers made up by
+ * swd_mem_next, whose results are collected by swd_mem_collect. The FTM and
+ * SPI engines run the transfers one at a time. The DMA engine puts as many as
+ * will fit into each batch and starts nothing else until the block is done.
+ *
+ * A poll is run as a block read of the same word, with CSW set up not to
+ * increment TAR. swd_mem_collect compares each value as it comes in and ends
+ * the poll on a match, when the attempts run out or when the timeout has
+ * passed on the cycle counter. Reads the engine started ahead of that are
+ * left to finish and ignored.
+ *
  * All transmissions are LSB first
  */
 
 #include "arm_cm4.h"
 #include "swd.h"
+#include "swd_spi.h"
+#include "swd_dma.h"
 
-#define SWD_RESP_OK    0b001
-#define SWD_RESP_WAIT  0b010
-#define SWD_RESP_FAULT 0b100
-
-#define SWD_READ_STATE_REQ    8
-#define SWD_READ_STATE_TM0    (SWD_READ_STATE_REQ + 1)
-#define SWD_READ_STATE_RESP   (SWD_READ_STATE_TM0 + 3)
-#define SWD_READ_STATE_READ   (SWD_READ_STATE_RESP + 32)
-#define SWD_READ_STATE_PARITY (SWD_READ_STATE_READ + 1)
-#define SWD_READ_STATE_TM1    (SWD_READ_STATE_PARITY + 1)
+//a read is request (8), trn, ack (3), data (32), parity, trn
+//a write is request (8), trn, ack (3), trn, data (32), parity
+#define SWD_TRANSFER_BITS    46
+#define SWD_TRANSFER_ACK_BIT 9
+#define SWD_READ_DATA_BIT    12
+#define SWD_READ_PARITY_BIT  44
+#define SWD_WRITE_DATA_BIT   13
+#define SWD_WRITE_PARITY_BIT 45
 
-#define SWD_WRITE_STATE_REQ    8
-#define SWD_WRITE_STATE_TM0    (SWD_WRITE_STATE_REQ + 1)
-#define SWD_WRITE_STATE_RESP   (SWD_WRITE_STATE_TM0 + 3)
-#define SWD_WRITE_STATE_TM1    (SWD_WRITE_STATE_RESP + 1)
-#define SWD_WRITE_STATE_DATA   (SWD_WRITE_STATE_TM1 + 32)
-#define SWD_WRITE_STATE_PARITY (SWD_WRITE_STATE_DATA + 1)
-#define SWD_WRITE_STATE_FINISH (SWD_WRITE_STATE_PARITY + 8)
+//bits driven by the host: the request, then the trailing trn of a read or the data and parity of a write
+#define SWD_READ_OE  (0xffULL | (1ULL << (SWD_TRANSFER_BITS - 1)))
+#define SWD_WRITE_OE (0xffULL | (0x1ffffffffULL << SWD_WRITE_DATA_BIT))
 
-#define MASK_SET(D,M) D|=M
-#define MASK_CLR(D,M) D&=~M
+//bits are sampled into the top of the input word, so this is where bit 0 ends up once a transfer is done
+#define SWD_IN_SHIFT (64 - SWD_TRANSFER_BITS)
 
 #define SWD_CLK_MASK (1<<SWD_CLK_PIN)
 #define SWD_DIO_MASK (1<<SWD_DIO_PIN)
 
 #define SWD_DIO_VALUE ((SWD_GPIO->PDIR & SWD_DIO_MASK) >> SWD_DIO_PIN)
 
+//ftm0 period when it is only used to tick the bus state machine for the SPI and DMA engines (10uS)
+#define SWD_TICK_MOD 480
+
+//shortest ftm0 period for the FTM engine. Both interrupts have to finish within half of this.
+#define SWD_FTM_MIN_TICKS 256
+
+//most commands that can go into one DMA engine batch
+#define SWD_DMA_BATCH_LENGTH (SWD_DMA_MAX_BITS / SWD_DMA_TRANSACTION_BITS)
+
+//cycle counter enable bits, which the device header doesn't define
+#define SWD_DEMCR_TRCENA_MASK     (1 << 24)
+#define SWD_DWT_CTRL_CYCCNTENA_MASK 0x1
+
 #define NEXT(I) (I + 1)
 #define PREV(I) (I - 1)
 #define NEXT_INDEX(S, I) (I >= (S) ? 0 : NEXT(I))
 
-typedef enum { SWD_READ, SWD_WRITE } cmd_type_t;
+typedef enum { SWD_READ, SWD_WRITE, SWD_CONNECT, SWD_SEQUENCE, SWD_MEM_READ, SWD_MEM_WRITE, SWD_MEM_POLL } cmd_type_t;
+
+/**
+ * Steps of a MEM-AP block command
+ * SWD_MEM_CSW: Set up CSW for auto-incrementing 32-bit accesses
+ * SWD_MEM_TAR: Write TAR at the start of the block and at each 1KB boundary
+ * SWD_MEM_FIRST: First DRW access after TAR
+ * SWD_MEM_DRW: Further DRW accesses
+ * SWD_MEM_RDBUFF: Collect the last posted read before TAR is written again
+ * SWD_MEM_END: Nothing is left to start
+ */
+typedef enum { SWD_MEM_CSW, SWD_MEM_TAR, SWD_MEM_FIRST, SWD_MEM_DRW, SWD_MEM_RDBUFF, SWD_MEM_END } mem_step_t;
+
+//command flags for pipelined reads
+#define SWD_CMD_POSTED_DATA 0x01 //the data read belongs to the AP read before this one
+#define SWD_CMD_POSTED_READ 0x02 //this is an AP read whose data is returned by the next command
+//command flags for the transfers of a block command
+#define SWD_CMD_BLOCK 0x04 //the transfer belongs to the block command being run
+#define SWD_CMD_WORD  0x08 //the transfer moves one of the block's words
 
 /**
  * Bus state type
  * SWD_BUS_IDLE: The bus is idle, clock should be held high, data should be released
- * SWD_BUS_INIT: The bus is being initialized to SWD mode (>50 pulses, swd sequence, another 50 pulses, read idcode)
+ * SWD_BUS_INIT: The bus is being initialized to SWD mode (>50 pulses, swd sequence, another 50 pulses, idle cycles)
  * SWD_BUS_RUN: The bus is currently dequeing and executing commands
- * SWD_BUS_STOP: The bus is stopping by clocking at least 8 additional pulses before returning to SWD_BUS_IDLE
+ * SWD_BUS_STOP: The bus is stopping by clocking at least 8 idle cycles before returning to SWD_BUS_IDLE
+ *
+ * The bus only passes through SWD_BUS_INIT when there is no session with the
+ * target: at startup, after an explicit connect command, or after a protocol
+ * error. Otherwise, a newly queued command moves the bus from idle straight
+ * into running.
  */
 typedef enum { SWD_BUS_IDLE, SWD_BUS_INIT, SWD_BUS_RUN, SWD_BUS_STOP } bus_state_t;
 
@@ -70,24 +137,91 @@ typedef enum { PIN_IN, PIN_HIGH, PIN_LOW } pin_mode_t;
 
 typedef struct {
     cmd_type_t command;
+    uint8_t flags;
     swd_result_t* result; //written with the result of the command
     uint8_t request;
     uint32_t data;
-    uint32_t state;
-    uint32_t state_data;
+    uint32_t state; //bits clocked so far, or the transaction handle for the DMA engine
+    uint8_t retries; //parity retries performed so far
+    uint16_t waits; //WAIT retries performed so far
+    uint16_t backoff; //idle cycles before the next WAIT retry
+    uint16_t idle; //idle cycles left before the command starts
+    uint32_t length; //bits in the transfer
+    uint64_t out; //bits left to drive, lsb first
+    uint64_t oe; //bits left to drive: set if the host drives the bit
+    uint64_t in; //bits sampled so far, shifted in from the msb
+    uint32_t* buffer; //words of a block command, or the bits of a sequence
+    uint32_t address; //target address of the next word to start
+    uint32_t next; //index of the next word to start
+    uint32_t count; //words in the block, bits in the sequence, or attempts of a poll
+    uint32_t words; //words finished so far
+    uint8_t step; //mem_step_t of a block command
+    uint32_t mask; //bits of the value a poll compares
+    uint32_t expect; //value the masked bits of a poll must have
+    uint32_t timeout; //core cycles a poll may take, 0 for no limit
+    uint32_t start; //cycle count when a poll started
 } cmd_t;
 
+/**
+ * Queued form of a command. A command only gets the execution state of a
+ * cmd_t once it is dequeued. Block commands and sequences take a second
+ * record for the rest of their operands. A poll takes a second record for
+ * its mask and expected value and a third for its attempts and timeout.
+ */
+typedef struct {
+    uint8_t command; //cmd_type_t
+    uint8_t flags;
+    uint8_t request;
+    uint8_t reserved;
+    uint32_t data; //data to write, the address of a block, or bits in a sequence. The word count of a block in the second record.
+    union {
+        swd_result_t* result; //written with the result of the command
+        uint32_t* buffer; //in the second record: the words of a block or the bits of a sequence
+        uint32_t value; //in the later records of a poll: the expected value, then the timeout in cycles
+    } ref;
+} cmd_record_t;
+
 /**
  * Shared state for the bus
  */
 static struct {
+    swd_engine_t engine;
+    uint32_t clock; //SWD clock frequency in Hz
     bus_state_t state;
     pin_mode_t dio;
+    uint8_t connected; //true while the target is known to be in SWD mode and ready for a request
+    int8_t posted; //result of the last posted AP read of a pipelined read
 } state;
 
-static cmd_t cmd_queue[SWD_QUEUE_LENGTH];
-static uint32_t cmd_in = 0;
-static uint32_t cmd_out = 0;
+static swd_stats_t stats;
+
+static swd_config_t config = {
+    .parity_retries = SWD_DEFAULT_PARITY_RETRIES,
+    .wait_retries = SWD_DEFAULT_WAIT_RETRIES,
+    .wait_idle = SWD_DEFAULT_WAIT_IDLE,
+    .wait_idle_max = SWD_DEFAULT_WAIT_IDLE_MAX
+};
+
+/**
+ * Result for the first AP read of a pipelined read, which returns no data of
+ * its own
+ */
+static swd_result_t posted_result;
+
+/**
+ * Result for the transfers of a block command. Only one block runs at a time.
+ */
+static swd_result_t mem_result;
+
+/**
+ * Command queue. It has one producer and one consumer, each of which only
+ * writes its own index, so neither side masks interrupts.
+ */
+static cmd_record_t cmd_queue[SWD_QUEUE_LENGTH];
+static volatile uint32_t cmd_in = 0; //written by the producer once its entries are filled in
+static uint32_t cmd_fill = 0; //next entry the producer fills in
+static volatile uint32_t cmd_out = 0; //written by the bus interrupt once an entry has been read
+static volatile uint8_t queueing = 0; //true while a producer is adding commands, only set by swd_queue_begin
 
 // bit sequence for initializing an SWD connection
 // transmitted 0th index first, lsb first
@@ -95,12 +229,13 @@ static const uint8_t swd_initseq[] = {
     0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, //56 ones
     0x9e, 0xe7, //swd switchover command
     0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, //56 ones again
+    0x00, //idle cycles so the target leaves the line reset state
 };
 
 // bit sequence for stopping an SWD connection
 // transmitted 0th index first, lsb first
 static const uint8_t swd_stopseq[] = {
-    0xff //we just need 8 ones
+    0x00 //we just need 8 idle cycles. ones would look like a start bit to the target
 };
 
 /**
@@ -108,27 +243,90 @@ static const uint8_t swd_stopseq[] = {
  */
 static uint8_t swd_queue_empty(void);
 /**
- * Returns true if the queue is full
+ * Returns the number of commands that can still be queued
  */
-static uint8_t swd_queue_full(void);
+static uint32_t swd_queue_space(void);
 /**
- * Queues a command
- * @param cmd Command to queue (by copying)
- * @return TRUE if the operation succeeded
+ * Makes the caller the producer until swd_queue_end is called. This fails if
+ * another producer holds the queue, or if there aren't count entries free.
+ * @param count Number of entries the caller is going to fill in
+ * @return TRUE if the caller may fill in count entries
+ */
+static uint8_t swd_queue_begin(uint32_t count);
+/**
+ * Returns the next queue entry to fill in, cleared except for the type and
+ * result of a command. The command isn't queued until swd_queue_push is
+ * called, so nothing has to be copied into the queue.
+ * @param command Type of the command
+ * @param res Written with the result of the command
+ * @return The entry
+ */
+static cmd_record_t* swd_queue_slot(cmd_type_t command, swd_result_t* res);
+/**
+ * Fills in a further entry of a block command, sequence or poll
+ * @param data Word count of a block, unused for a sequence. The mask, then
+ * the attempts of a poll.
+ * @return The entry, whose ref is left for the caller to fill in
+ */
+static cmd_record_t* swd_queue_operands(uint32_t data);
+/**
+ * Queues the entries filled in since the last push
  */
-static int8_t swd_queue_cmd(const cmd_t* cmd);
+static void swd_queue_push(void);
 /**
- * Dequeues a command
+ * Stops being the producer
+ */
+static void swd_queue_end(void);
+/**
+ * Returns the command at the head of the queue without dequeueing it
+ * @return The first entry of the command, or NULL if the queue is empty
+ */
+static const cmd_record_t* swd_queue_peek(void);
+/**
+ * Dequeues a command, unpacking it for execution
  * @param dest Destination to dequeue the command into
  * @return TRUE if the operation succeeded
  */
 static int8_t swd_dequeue_cmd(cmd_t* dest);
 
+/**
+ * Returns true if the target needs a line reset before the command at the
+ * head of the queue can be executed. The queue must not be empty.
+ */
+static uint8_t swd_needs_init(void);
+
+/**
+ * Adds the result of a finished read or write to the bus counters
+ * @param result Result of the command
+ */
+static void swd_count_result(int8_t result);
+
+/**
+ * Sets the period of ftm0 for the FTM engine
+ * @param hz Requested SWD clock frequency
+ * @return SWD clock frequency achieved
+ */
+static uint32_t swd_ftm_set_clock(uint32_t hz);
+
+/**
+ * Writes the result of a finished command and marks it done. For commands of
+ * a pipelined read, an error from the AP read the data belongs to takes the
+ * place of the result.
+ * @param cmd Finished command
+ * @param result Result of the transaction
+ */
+static void swd_complete(cmd_t* cmd, int8_t result);
+
 /**
  * Handles the bus state machine
  */
 static void swd_do_bus(void);
 
+/**
+ * Handles the DMA engine: collects finished batches and starts new ones
+ */
+static void swd_do_dma(void);
+
 /**
  * Handles the current command
  * @return SWD_DONE when the passed command is complete
@@ -136,26 +334,102 @@ static void swd_do_bus(void);
 static uint8_t swd_handle_command(cmd_t* cmd);
 
 /**
- * Handles a read command
+ * Packs the bits of a read or write command into its shift words
+ * @param cmd Command to pack
+ */
+static void swd_pack(cmd_t* cmd);
+
+/**
+ * Makes up the next transfer of a block command
+ * @param cmd Block command
+ * @param transfer Written with the transfer, packed and ready to run
+ * @return True if there was a transfer left to start
+ */
+static uint8_t swd_mem_next(cmd_t* cmd, cmd_t* transfer);
+
+/**
+ * Collects the result of a finished transfer of a block command. The block
+ * is completed once all of its words are done or a transfer fails.
+ * @param cmd Block command
+ * @param transfer Transfer which finished
+ * @return SWD_DONE when the block command is complete
+ */
+static uint8_t swd_mem_collect(cmd_t* cmd, const cmd_t* transfer);
+
+/**
+ * Collects the result of a finished transfer of a poll for swd_mem_collect.
+ * The poll is completed once a value matches, the attempts or time run out,
+ * or a transfer fails.
+ * @param cmd Poll command
+ * @param transfer Transfer which finished
+ * @return SWD_DONE when the poll is complete
+ */
+static uint8_t swd_poll_collect(cmd_t* cmd, const cmd_t* transfer);
+
+/**
+ * Handles a block command using the FTM or SPI engine
+ * @return SWD_DONE when the passed command is complete
+ */
+static uint8_t swd_handle_mem(cmd_t* cmd);
+
+/**
+ * Retries a read which had a parity mismatch, if the retries aren't used up
+ * @param cmd Read command to retry
+ * @return True if the command should be performed again
+ */
+static uint8_t swd_retry_parity(cmd_t* cmd);
+
+/**
+ * Sets up a retry for a command which got a WAIT acknowledgement, if the
+ * retries aren't used up. The idle cycles to clock before the retry are put
+ * in cmd->idle.
+ * @param cmd Command to retry
+ * @return True if the command should be performed again
+ */
+static uint8_t swd_retry_wait(cmd_t* cmd);
+
+/**
+ * Handles a read or write command, one bit per call
+ * @return SWD_DONE when the passed command is complete
+ */
+static uint8_t swd_handle_transfer(cmd_t* cmd);
+
+/**
+ * Handles a connect command
+ * @return SWD_DONE when the passed command is complete
+ */
+static uint8_t swd_handle_connect(cmd_t* cmd);
+
+/**
+ * Handles a sequence command
  * @return SWD_DONE when the passed command is complete
  */
-static uint8_t swd_handle_read(cmd_t* cmd);
+static uint8_t swd_handle_sequence(cmd_t* cmd);
 
 /**
- * Handles a write command
+ * Handles a read or write command using the SPI engine. The whole
+ * transaction is performed in one call.
  * @return SWD_DONE when the passed command is complete
  */
-static uint8_t swd_handle_write(cmd_t* cmd);
+static uint8_t swd_handle_spi(cmd_t* cmd);
+
+/**
+ * Sends the next part of a bit sequence. The FTM engine sends one bit per
+ * call and the SPI engine sends the rest of the sequence.
+ * @param seq Sequence to transmit, 0th index first, lsb first
+ * @param bits Length of the sequence in bits
+ * @param bit Index of the next bit to transmit
+ * @return Number of bits sent
+ */
+static uint32_t swd_send_seq(const uint8_t* seq, uint32_t bits, uint32_t bit);
 
-void swd_init(void)
+void swd_init(swd_engine_t engine)
 {
-    //set up data and clock for GPIO
-    SWD_CLK_MODE;
-    SWD_DIO_MODE;
+    state.engine = engine;
 
-    //data is input for the moment
-    MASK_SET(SWD_GPIO->PDDR, SWD_CLK_MASK);
-    MASK_CLR(SWD_GPIO->PDDR, SWD_DIO_MASK);
+    //the cycle counter times the bus interrupt for the statistics
+    MASK_SET(DEMCR, SWD_DEMCR_TRCENA_MASK);
+    MASK_SET(DWT_CTRL, SWD_DWT_CTRL_CYCCNTENA_MASK);
 
     //set up ftm0 to generate 50% pwm at a relatively high frequency
     SIM_SCGC6 |= SIM_SCGC6_FTM0_MASK;//enable clock
@@ -163,55 +437,278 @@ void swd_init(void)
     FTM0_SC = 0;
     FTM0_CNTIN = 0;
     FTM0_CNT = 0;
-    FTM0_MOD = 2048;
-    FTM0_C0SC = FTM_CnSC_MSB_MASK | FTM_CnSC_ELSB_MASK;
-    FTM0_C0V = FTM0_MOD / 2; //50% duty cycle
 
-    //enable the ftm0 interrupt on the falling edge (channel match) so we can switch the data line
-    FTM0_C0SC |= FTM_CnSC_CHIE_MASK;
+    if (engine == SWD_ENGINE_SPI)
+    {
+        swd_spi_init();
+
+        //ftm0 only ticks the bus state machine, one transaction per overflow
+        FTM0_MOD = SWD_TICK_MOD;
+    }
+    else
+    {
+        //set up data and clock for GPIO
+        SWD_CLK_MODE;
+        SWD_DIO_MODE;
+
+        //data is input for the moment
+        MASK_SET(SWD_GPIO->PDDR, SWD_CLK_MASK);
+        MASK_CLR(SWD_GPIO->PDDR, SWD_DIO_MASK);
+
+        //the clock is now high
+        MASK_SET(SWD_GPIO->PSOR, SWD_CLK_MASK);
+    }
+
+    if (engine == SWD_ENGINE_DMA)
+    {
+        swd_dma_init();
+
+        //ftm0 only ticks swd_do_dma
+        FTM0_MOD = SWD_TICK_MOD;
+    }
+    else if (engine == SWD_ENGINE_FTM)
+    {
+        //the period and duty cycle are set up by swd_set_clock
+        FTM0_C0SC = FTM_CnSC_MSB_MASK | FTM_CnSC_ELSB_MASK;
+
+        //enable the ftm0 interrupt on the falling edge (channel match) so we can switch the data line
+        FTM0_C0SC |= FTM_CnSC_CHIE_MASK;
+    }
     enable_irq(IRQ(INT_FTM0));
 
     //start up the bus timer interrupts. The bus will remain "idle" until a command is queued
-    //the clock is now high
-    MASK_SET(SWD_GPIO->PSOR, SWD_CLK_MASK);
     FTM0_CNT = 0;
     //run the clock (system clock, prescaler 1)
     //enable the ftm0 overflow so we can reset the clock
     FTM0_SC = FTM_SC_TOIE_MASK | FTM_SC_CLKS(1) | FTM_SC_PS(0);
+
+    swd_set_clock(SWD_DEFAULT_CLOCK);
+}
+
+uint32_t swd_set_clock(uint32_t hz)
+{
+    if (!hz)
+        hz = 1;
+
+    //keep the bus from ticking while the engine is reconfigured
+    disable_irq(IRQ(INT_FTM0));
+    switch (state.engine)
+    {
+    case SWD_ENGINE_SPI:
+        state.clock = swd_spi_set_clock(hz);
+        break;
+    case SWD_ENGINE_DMA:
+        state.clock = swd_dma_set_clock(hz);
+        break;
+    default:
+        state.clock = swd_ftm_set_clock(hz);
+        break;
+    }
+    enable_irq(IRQ(INT_FTM0));
+
+    return state.clock;
+}
+
+uint32_t swd_get_clock(void)
+{
+    return state.clock;
+}
+
+void swd_set_config(const swd_config_t* cfg)
+{
+    disable_irq(IRQ(INT_FTM0));
+    config = *cfg;
+    enable_irq(IRQ(INT_FTM0));
+}
+
+void swd_get_config(swd_config_t* dest)
+{
+    *dest = config;
+}
+
+void swd_get_stats(swd_stats_t* dest)
+{
+    disable_irq(IRQ(INT_FTM0));
+    *dest = stats;
+    enable_irq(IRQ(INT_FTM0));
+}
+
+void swd_clear_stats(void)
+{
+    disable_irq(IRQ(INT_FTM0));
+    stats.transactions = 0;
+    stats.wait = 0;
+    stats.fault = 0;
+    stats.protocol = 0;
+    stats.parity = 0;
+    stats.retries = 0;
+    stats.isr_calls = 0;
+    stats.isr_cycles = 0;
+    stats.isr_cycles_max = 0;
+    enable_irq(IRQ(INT_FTM0));
+}
+
+uint8_t swd_parity(uint32_t data)
+{
+    //parallel parity bit calculation: http://www.graphics.stanford.edu/~seander/bithacks.html#ParityParallel
+    data ^= data >> 16;
+    data ^= data >> 8;
+    data ^= data >> 4;
+    data &= 0xf;
+    return (0x6996 >> data) & 1;
 }
 
 int8_t swd_begin_write(uint8_t req, uint32_t data, swd_result_t* res)
 {
-    cmd_t command = {
-        .command = SWD_WRITE,
-        .request = req,
-        .data = data,
-        .result = res
-    };
+    cmd_record_t* command;
+
+    if (!swd_queue_begin(1))
+        return SWD_ERR_BUSY;
+    command = swd_queue_slot(SWD_WRITE, res);
+    command->request = req;
+    command->data = data;
 
-    return swd_queue_cmd(&command);
+    swd_queue_push();
+    swd_queue_end();
+    return SWD_OK;
 }
 
 int8_t swd_begin_read(uint8_t req, swd_result_t* res)
 {
-    cmd_t command = {
-        .command = SWD_READ,
-        .request = req,
-        .result = res
-    };
+    if (!swd_queue_begin(1))
+        return SWD_ERR_BUSY;
+    swd_queue_slot(SWD_READ, res)->request = req;
+
+    swd_queue_push();
+    swd_queue_end();
+    return SWD_OK;
+}
+
+int8_t swd_begin_read_pipelined(uint8_t req, uint32_t count, swd_result_t* res)
+{
+    uint32_t i;
+    cmd_record_t* command;
+
+    if (!(req & SWD_APnDP_MASK) || !(req & SWD_RnW_MASK) || !count || count > SWD_PIPELINE_LENGTH)
+        return SWD_ERR;
+    //the whole run goes in without any other producer's commands in between
+    if (!swd_queue_begin(count + 1))
+        return SWD_ERR_BUSY;
+
+    for (i = 0; i <= count; i++)
+    {
+        //the first AP read returns no data of its own and each read after it carries the one before
+        command = swd_queue_slot(SWD_READ, i ? &res[i - 1] : &posted_result);
+        command->flags = (i ? SWD_CMD_POSTED_DATA : 0) | (i < count ? SWD_CMD_POSTED_READ : 0);
+        //the last AP read is collected without starting another
+        command->request = i < count ? req : SWD_DP_READ_RDBUFF;
+        swd_queue_push();
+    }
+
+    swd_queue_end();
+    return SWD_OK;
+}
+
+int8_t swd_begin_mem_read(uint32_t addr, uint32_t count, uint32_t* buffer, swd_result_t* res)
+{
+    if (!count)
+        return SWD_ERR;
+
+    if (!swd_queue_begin(2))
+        return SWD_ERR_BUSY;
+    swd_queue_slot(SWD_MEM_READ, res)->data = addr & ~0x3;
+    swd_queue_operands(count)->ref.buffer = buffer;
+
+    swd_queue_push();
+    swd_queue_end();
+    return SWD_OK;
+}
+
+int8_t swd_begin_mem_write(uint32_t addr, uint32_t count, const uint32_t* buffer, swd_result_t* res)
+{
+    if (!count)
+        return SWD_ERR;
+
+    if (!swd_queue_begin(2))
+        return SWD_ERR_BUSY;
+    swd_queue_slot(SWD_MEM_WRITE, res)->data = addr & ~0x3;
+    swd_queue_operands(count)->ref.buffer = (uint32_t*)buffer; //only read for writes
+
+    swd_queue_push();
+    swd_queue_end();
+    return SWD_OK;
+}
+
+int8_t swd_begin_mem_poll(uint32_t addr, uint32_t mask, uint32_t expect, uint16_t attempts,
+    uint16_t timeout_ms, swd_result_t* res)
+{
+    uint32_t per_ms = SWD_DWT_PER_MS;
+    uint32_t timeout;
+
+    if (!attempts)
+        return SWD_ERR;
+
+    //the cycle counter wraps after a minute or so, which is as long as a poll can be timed
+    timeout = timeout_ms > 0xffffffff / per_ms ? 0xffffffff : timeout_ms * per_ms;
+
+    if (!swd_queue_begin(3))
+        return SWD_ERR_BUSY;
+    swd_queue_slot(SWD_MEM_POLL, res)->data = addr & ~0x3;
+    swd_queue_operands(mask)->ref.value = expect;
+    swd_queue_operands(attempts)->ref.value = timeout;
+
+    swd_queue_push();
+    swd_queue_end();
+    return SWD_OK;
+}
+
+int8_t swd_connect(swd_result_t* res)
+{
+    if (!swd_queue_begin(1))
+        return SWD_ERR_BUSY;
+    swd_queue_slot(SWD_CONNECT, res);
+
+    swd_queue_push();
+    swd_queue_end();
+    return SWD_OK;
+}
+
+int8_t swd_begin_sequence(const uint8_t* seq, uint32_t bits, swd_result_t* res)
+{
+    if (!bits || bits > SWD_SEQUENCE_MAX_BITS)
+        return SWD_ERR;
+
+    if (!swd_queue_begin(2))
+        return SWD_ERR_BUSY;
+    swd_queue_slot(SWD_SEQUENCE, res)->data = bits;
+    swd_queue_operands(0)->ref.buffer = (uint32_t*)seq; //only read
 
-    return swd_queue_cmd(&command);
+    swd_queue_push();
+    swd_queue_end();
+    return SWD_OK;
 }
 
 void FTM0_IRQHandler(void)
 {
+    uint32_t start = DWT_CYCCNT;
+
     if (FTM0_SC & FTM_SC_TOF_MASK)
     {
         //clock is now high
-        MASK_SET(SWD_GPIO->PSOR, SWD_CLK_MASK);
+        if (state.engine == SWD_ENGINE_FTM)
+        {
+            MASK_SET(SWD_GPIO->PSOR, SWD_CLK_MASK);
+        }
 
         //do the state machine
-        swd_do_bus();
+        if (state.engine == SWD_ENGINE_DMA)
+        {
+            swd_do_dma();
+        }
+        else
+        {
+            swd_do_bus();
+        }
 
         //clear the interrupt flag
         FTM0_SC &= ~FTM_SC_TOF_MASK;
@@ -249,6 +746,12 @@ void FTM0_IRQHandler(void)
         //clear the interrupt flag
         FTM0_C0SC &= ~FTM_CnSC_CHF_MASK;
     }
+
+    start = DWT_CYCCNT - start;
+    stats.isr_calls++;
+    stats.isr_cycles += start;
+    if (start > stats.isr_cycles_max)
+        stats.isr_cycles_max = start;
 }
 
 static uint8_t swd_queue_empty(void)
@@ -256,43 +759,158 @@ static uint8_t swd_queue_empty(void)
     return cmd_in == cmd_out;
 }
 
-static uint8_t swd_queue_full(void)
+static uint32_t swd_queue_space(void)
 {
-    return NEXT_INDEX(SWD_QUEUE_LENGTH - 1, cmd_in) == cmd_out;
+    //the other side only ever makes this larger
+    return (cmd_out + SWD_QUEUE_LENGTH - cmd_in - 1) % SWD_QUEUE_LENGTH;
 }
 
-static int8_t swd_queue_cmd(const cmd_t* cmd)
+static uint8_t swd_queue_begin(uint32_t count)
 {
-    if (swd_queue_full())
-        return SWD_ERR;
+    //the flag is claimed before the space is counted, as one LDREX/STREX, so a
+    //producer which interrupts this one can't take the space it counted
+    if (!__sync_bool_compare_and_swap(&queueing, 0, 1))
+        return FALSE;
+
+    //the bus interrupt only ever frees entries while the flag is held
+    if (swd_queue_space() < count)
+    {
+        queueing = 0;
+        return FALSE;
+    }
 
-    DisableInterrupts;
-    cmd_queue[cmd_in] = *cmd;
-    cmd_in = NEXT_INDEX(SWD_QUEUE_LENGTH - 1,cmd_in);
-    EnableInterrupts;
+    return TRUE;
+}
 
-    return SWD_OK;
+static cmd_record_t* swd_queue_slot(cmd_type_t command, swd_result_t* res)
+{
+    //the bus interrupt doesn't look at this entry until it is pushed
+    cmd_record_t* cmd = &cmd_queue[cmd_fill];
+
+    cmd_fill = NEXT_INDEX(SWD_QUEUE_LENGTH - 1, cmd_fill);
+    cmd->command = command;
+    cmd->flags = 0;
+    cmd->request = 0;
+    cmd->data = 0;
+    cmd->ref.result = res;
+    res->done = 0;
+    res->attempts = 0;
+    return cmd;
 }
 
-static int8_t swd_dequeue_cmd(cmd_t* dest)
+static cmd_record_t* swd_queue_operands(uint32_t data)
+{
+    cmd_record_t* cmd = &cmd_queue[cmd_fill];
+
+    cmd_fill = NEXT_INDEX(SWD_QUEUE_LENGTH - 1, cmd_fill);
+    cmd->data = data;
+    return cmd;
+}
+
+static void swd_queue_push(void)
+{
+    //the entries have to be written before the bus interrupt can see them
+    DataMemoryBarrier;
+    cmd_in = cmd_fill;
+}
+
+static void swd_queue_end(void)
+{
+    queueing = 0;
+}
+
+static const cmd_record_t* swd_queue_peek(void)
 {
     if (swd_queue_empty())
+        return NULL;
+
+    //the entry is only read once the producer has published it
+    DataMemoryBarrier;
+    return &cmd_queue[cmd_out];
+}
+
+static int8_t swd_dequeue_cmd(cmd_t* dest)
+{
+    const cmd_record_t* cmd = swd_queue_peek();
+    const cmd_record_t* operands;
+    uint32_t out;
+
+    if (!cmd)
         return SWD_ERR;
 
-    DisableInterrupts;
-    *dest = cmd_queue[cmd_out];
-    cmd_out = NEXT_INDEX(SWD_QUEUE_LENGTH - 1, cmd_out);
-    EnableInterrupts;
+    *dest = (cmd_t){
+        .command = cmd->command,
+        .flags = cmd->flags,
+        .request = cmd->request,
+        .data = cmd->data,
+        .result = cmd->ref.result
+    };
+    out = NEXT_INDEX(SWD_QUEUE_LENGTH - 1, cmd_out);
+
+    switch (dest->command)
+    {
+    case SWD_READ:
+    case SWD_WRITE:
+        //the DMA engine builds its own bits
+        if (state.engine != SWD_ENGINE_DMA)
+            swd_pack(dest);
+        break;
+    case SWD_MEM_READ:
+    case SWD_MEM_WRITE:
+    case SWD_SEQUENCE:
+        //both entries were pushed together
+        operands = &cmd_queue[out];
+        out = NEXT_INDEX(SWD_QUEUE_LENGTH - 1, out);
+        dest->buffer = operands->ref.buffer;
+        if (dest->command == SWD_SEQUENCE)
+        {
+            dest->count = dest->data;
+        }
+        else
+        {
+            dest->address = dest->data;
+            dest->count = operands->data;
+        }
+        dest->data = 0;
+        break;
+    case SWD_MEM_POLL:
+        //all three entries were pushed together
+        operands = &cmd_queue[out];
+        dest->address = dest->data;
+        dest->mask = operands->data;
+        dest->expect = operands->ref.value;
+        out = NEXT_INDEX(SWD_QUEUE_LENGTH - 1, out);
+        operands = &cmd_queue[out];
+        dest->count = operands->data;
+        dest->timeout = operands->ref.value;
+        out = NEXT_INDEX(SWD_QUEUE_LENGTH - 1, out);
+        dest->data = 0;
+        break;
+    default:
+        break;
+    }
+
+    //the entries have to be read before the producer can reuse them
+    DataMemoryBarrier;
+    cmd_out = out;
 
     return SWD_OK;
 }
 
+static uint8_t swd_needs_init(void)
+{
+    const cmd_record_t* cmd = swd_queue_peek();
+
+    //an explicit connect command performs its own line reset, and a sequence is
+    //sent as it is since it usually is the host's own line reset
+    return !state.connected && cmd->command != SWD_CONNECT && cmd->command != SWD_SEQUENCE;
+}
+
 static void swd_do_bus(void)
 {
     static uint32_t counter = 0; //generic counter for the state
     static cmd_t current_command;
-
-    uint8_t t;
+    uint8_t sequence;
 
     //state actions
     switch (state.state)
@@ -301,28 +919,10 @@ static void swd_do_bus(void)
         state.dio = PIN_IN; //let the data float high
         break;
     case SWD_BUS_INIT:
-        t = 0x01 << (counter & 0x7); //this is the mask for the bit, transmitted LSB first
-        if (swd_initseq[counter >> 3] & t)
-        {
-            state.dio = PIN_HIGH;
-        }
-        else
-        {
-            state.dio = PIN_LOW;
-        }
-        counter++;
+        counter += swd_send_seq(swd_initseq, sizeof(swd_initseq) * 8, counter);
         break;
     case SWD_BUS_STOP:
-        t = 0x01 << (counter & 0x7); //this is the mask for the bit, transmitted LSB first
-        if (swd_stopseq[counter >> 3] & t)
-        {
-            state.dio = PIN_HIGH;
-        }
-        else
-        {
-            state.dio = PIN_LOW;
-        }
-        counter++;
+        counter += swd_send_seq(swd_stopseq, sizeof(swd_stopseq) * 8, counter);
         break;
     default:
         break;
@@ -332,15 +932,57 @@ static void swd_do_bus(void)
     switch (state.state)
     {
     case SWD_BUS_IDLE:
-        if (!swd_queue_empty())
+        if (swd_queue_empty())
+            break;
+        if (swd_needs_init())
         {
             counter = 0;
             state.state = SWD_BUS_INIT;
+            break;
+        }
+        if (swd_dequeue_cmd(&current_command) != SWD_OK)
+            break;
+        //the session is still up, so the command starts on this clock
+        state.state = SWD_BUS_RUN;
+        //fall through
+    case SWD_BUS_RUN:
+        run:
+        if (swd_handle_command(&current_command) == SWD_DONE)
+        {
+            //block commands count each of their transfers
+            if (current_command.command == SWD_READ || current_command.command == SWD_WRITE)
+                swd_count_result(current_command.result->result);
+            sequence = current_command.command == SWD_SEQUENCE;
+
+            if (!swd_queue_empty() && swd_needs_init())
+            {
+                //the session was lost, so the target needs a line reset before anything else
+                counter = 0;
+                state.state = SWD_BUS_INIT;
+            }
+            else if (swd_queue_empty() && sequence)
+            {
+                //the host builds its sequences out of several commands, so no idle cycles go between them
+                state.state = SWD_BUS_IDLE;
+            }
+            else if (swd_queue_empty() || swd_dequeue_cmd(&current_command) != SWD_OK)
+            {
+                //we either have an empty queue or failed to dequeue a new command
+                //we move into the stop state
+                counter = 0;
+                state.state = SWD_BUS_STOP;
+            }
+            else if (sequence)
+            {
+                //a sequence has no clock of its own to finish on, so the next command starts on this one
+                goto run;
+            }
         }
         break;
     case SWD_BUS_INIT:
         if (counter >= sizeof(swd_initseq) * 8)
         {
+            state.connected = 1;
             if (swd_dequeue_cmd(&current_command) == SWD_OK)
             {
                 //if we have finished the init sequence and dequeued a command, initiate run mode
@@ -354,18 +996,6 @@ static void swd_do_bus(void)
             }
         }
         break;
-    case SWD_BUS_RUN:
-        if (swd_handle_command(&current_command) == SWD_DONE)
-        {
-            if (swd_queue_empty() || swd_dequeue_cmd(&current_command) != SWD_OK)
-            {
-                //we either have an empty queue or failed to dequeue a new command
-                //we move into the stop state
-                counter = 0;
-                state.state = SWD_BUS_STOP;
-            }
-        }
-        break;
     case SWD_BUS_STOP:
         if (counter >= sizeof(swd_stopseq) * 8)
         {
@@ -376,215 +1006,586 @@ static void swd_do_bus(void)
     }
 }
 
+static void swd_complete(cmd_t* cmd, int8_t result)
+{
+    int8_t read = result;
+
+    //a parity error only spoils the data, the AP read started by this command still went through
+    if (read == SWD_ERR_PARITY)
+        read = SWD_OK;
+
+    if ((cmd->flags & SWD_CMD_POSTED_DATA) && state.posted != SWD_OK)
+    {
+        //the AP read this data belongs to never happened
+        result = state.posted;
+    }
+    if (cmd->flags & SWD_CMD_POSTED_READ)
+    {
+        state.posted = read;
+    }
+
+    cmd->result->result = result;
+    cmd->result->done = 1;
+}
+
+static void swd_count_result(int8_t result)
+{
+    stats.transactions++;
+    switch (result)
+    {
+    case SWD_ERR_FAULT:
+        stats.fault++;
+        break;
+    case SWD_ERR_BUS:
+        stats.protocol++;
+        break;
+    case SWD_ERR_PARITY:
+        stats.parity++;
+        break;
+    }
+}
+
+static uint32_t swd_ftm_set_clock(uint32_t hz)
+{
+    uint32_t clk = periph_clk_khz * 1000;
+    uint32_t ticks, ps = 0;
+
+    if (hz > clk)
+        hz = clk;
+
+    //round the period up so the clock never ends up faster than requested
+    ticks = (clk + hz - 1) / hz;
+    if (ticks < SWD_FTM_MIN_TICKS)
+        ticks = SWD_FTM_MIN_TICKS;
+
+    //the counter is 16 bits, so the prescaler takes up whatever doesn't fit
+    while (ps < 7 && ((ticks + (1 << ps) - 1) >> ps) > 0x10000)
+        ps++;
+    ticks = (ticks + (1 << ps) - 1) >> ps;
+    if (ticks > 0x10000)
+        ticks = 0x10000;
+
+    FTM0_MOD = ticks - 1;
+    FTM0_C0V = ticks / 2; //50% duty cycle
+    FTM0_SC = (FTM0_SC & ~FTM_SC_PS_MASK) | FTM_SC_PS(ps);
+
+    return clk / (ticks << ps);
+}
+
+static void swd_do_dma(void)
+{
+    static cmd_t batch[SWD_DMA_BATCH_LENGTH];
+    static uint32_t batch_length = 0;
+    static cmd_t block; //block command being run, its transfers can span several batches
+    static uint8_t block_running = 0;
+
+    const cmd_record_t* next;
+    uint32_t i;
+    int8_t result;
+
+    if (swd_dma_busy())
+        return;
+
+    //collect the results of the batch that just finished
+    for (i = 0; i < batch_length; i++)
+    {
+        if (batch[i].command == SWD_CONNECT || batch[i].command == SWD_SEQUENCE)
+        {
+            result = SWD_OK;
+        }
+        else
+        {
+            result = swd_dma_decode(batch[i].state, batch[i].command == SWD_READ, &batch[i].data);
+            batch[i].result->data = batch[i].data;
+        }
+
+        if (result == SWD_ERR_BUS)
+        {
+            //unknown error, the target needs a line reset to recover
+            state.connected = 0;
+        }
+        if (result == SWD_ERR_WAIT)
+            stats.wait++;
+        if (batch[i].command == SWD_READ || batch[i].command == SWD_WRITE)
+            swd_count_result(result);
+
+        swd_complete(&batch[i], result);
+
+        //transfers of a block which already failed are left out
+        if ((batch[i].flags & SWD_CMD_BLOCK) && block_running && swd_mem_collect(&block, &batch[i]) == SWD_DONE)
+            block_running = 0;
+    }
+    batch_length = 0;
+
+    if (!block_running && swd_queue_empty())
+        return;
+
+    //build the next batch. There has to be room for a line reset plus a transaction
+    swd_dma_begin();
+    while (batch_length < SWD_DMA_BATCH_LENGTH &&
+        swd_dma_space() >= sizeof(swd_initseq) * 8 + SWD_DMA_TRANSACTION_BITS)
+    {
+        if (block_running)
+        {
+            //nothing else starts until the block is done
+            if (!swd_mem_next(&block, &batch[batch_length]))
+                break;
+        }
+        else
+        {
+            if (!(next = swd_queue_peek()))
+                break;
+
+            //a sequence always fits in an empty batch
+            if (next->command == SWD_SEQUENCE && swd_dma_space() < next->data)
+                break;
+
+            if (swd_needs_init())
+            {
+                swd_dma_add_seq(swd_initseq, sizeof(swd_initseq) * 8);
+                state.connected = 1;
+            }
+
+            if (swd_dequeue_cmd(&batch[batch_length]) != SWD_OK)
+                break;
+
+            if (batch[batch_length].command == SWD_MEM_READ || batch[batch_length].command == SWD_MEM_WRITE ||
+                batch[batch_length].command == SWD_MEM_POLL)
+            {
+                block = batch[batch_length];
+                block_running = 1;
+                continue;
+            }
+        }
+
+        switch (batch[batch_length].command)
+        {
+        case SWD_READ:
+            batch[batch_length].state = swd_dma_add_read(batch[batch_length].request);
+            break;
+        case SWD_WRITE:
+            batch[batch_length].state = swd_dma_add_write(batch[batch_length].request, batch[batch_length].data);
+            break;
+        case SWD_CONNECT:
+            swd_dma_add_seq(swd_initseq, sizeof(swd_initseq) * 8);
+            state.connected = 1;
+            break;
+        case SWD_SEQUENCE:
+            swd_dma_add_seq((const uint8_t*)batch[batch_length].buffer, batch[batch_length].count);
+            state.connected = 1;
+            break;
+        default:
+            //block commands were taken out above
+            break;
+        }
+        batch_length++;
+    }
+    //no idle cycles after a sequence, as with the other engines
+    if (!batch_length || batch[batch_length - 1].command != SWD_SEQUENCE)
+        swd_dma_add_seq(swd_stopseq, sizeof(swd_stopseq) * 8);
+    swd_dma_start();
+}
+
 static uint8_t swd_handle_command(cmd_t* cmd)
 {
     switch (cmd->command)
     {
     case SWD_READ:
-        return swd_handle_read(cmd);
     case SWD_WRITE:
-        return swd_handle_write(cmd);
+        if (state.engine == SWD_ENGINE_SPI)
+            return swd_handle_spi(cmd);
+        return swd_handle_transfer(cmd);
+    case SWD_CONNECT:
+        return swd_handle_connect(cmd);
+    case SWD_SEQUENCE:
+        return swd_handle_sequence(cmd);
+    case SWD_MEM_READ:
+    case SWD_MEM_WRITE:
+    case SWD_MEM_POLL:
+        return swd_handle_mem(cmd);
     default:
         //invalid command? we are done with it
-        cmd->result->done = 1;
-        cmd->result->result = SWD_ERR_BUS;
+        swd_complete(cmd, SWD_ERR_BUS);
         return SWD_DONE;
     }
 }
 
-static uint8_t swd_handle_read(cmd_t* cmd)
+static uint8_t swd_mem_next(cmd_t* cmd, cmd_t* transfer)
 {
-    uint32_t mask;
+    uint8_t read = cmd->command != SWD_MEM_WRITE;
+    uint8_t poll = cmd->command == SWD_MEM_POLL;
+
+    transfer->flags = SWD_CMD_BLOCK;
+    transfer->result = &mem_result;
+    transfer->retries = 0;
+    transfer->waits = 0;
+    transfer->idle = 0;
 
-    if (cmd->state < SWD_READ_STATE_REQ)
+    switch (cmd->step)
     {
-        //lsb first
-        mask = 0x1 << cmd->state;
-        if (cmd->request & mask)
+    case SWD_MEM_CSW:
+        transfer->command = SWD_WRITE;
+        transfer->request = SWD_AP_WRITE_CSW;
+        //a poll reads the same word every time
+        transfer->data = SWD_CSW_DEFAULT | SWD_CSW_SIZE_32 | (poll ? 0 : SWD_CSW_ADDRINC_SINGLE);
+        cmd->step = SWD_MEM_TAR;
+        cmd->start = DWT_CYCCNT;
+        break;
+    case SWD_MEM_TAR:
+        transfer->command = SWD_WRITE;
+        transfer->request = SWD_AP_WRITE_TAR;
+        transfer->data = cmd->address;
+        cmd->step = SWD_MEM_FIRST;
+        break;
+    case SWD_MEM_FIRST:
+    case SWD_MEM_DRW:
+        if (read)
         {
-            state.dio = PIN_HIGH;
+            transfer->command = SWD_READ;
+            transfer->request = SWD_AP_READ_DRW;
+            transfer->flags |= SWD_CMD_POSTED_READ;
+            //the first read after TAR only starts the pipeline
+            if (cmd->step == SWD_MEM_DRW)
+                transfer->flags |= SWD_CMD_POSTED_DATA | SWD_CMD_WORD;
         }
         else
         {
-            state.dio = PIN_LOW;
+            transfer->command = SWD_WRITE;
+            transfer->request = SWD_AP_WRITE_DRW;
+            transfer->data = cmd->buffer[cmd->next];
+            transfer->flags |= SWD_CMD_WORD;
         }
-        cmd->state++;
-    }
-    else if (cmd->state < SWD_READ_STATE_TM0)
-    {
-        //turnaround
-        state.dio = PIN_IN;
-        cmd->state_data = 0; //prepare to read response
-        cmd->state++;
-    }
-    else if (cmd->state < SWD_READ_STATE_RESP)
-    {
-        //lsb first
-        cmd->state_data |= SWD_DIO_VALUE << (cmd->state - SWD_READ_STATE_TM0);
-        if (cmd->state == 11)
+        cmd->next++;
+        if (!poll)
+            cmd->address += 4;
+
+        if (cmd->next < cmd->count && (poll || (cmd->address & (SWD_MEM_WRAP - 1))))
         {
-            //determine response
-            switch (cmd->state_data)
-            {
-            case SWD_RESP_OK:
-                cmd->data = 0;
-                cmd->state++;
-                break;
-            case SWD_RESP_FAULT:
-                //fault error
-                cmd->result->result = SWD_ERR_FAULT;
-                cmd->result->done = 1;
-                return SWD_DONE;
-            case SWD_RESP_WAIT:
-                //the SWD slave is busy
-                cmd->result->result = SWD_ERR_BUSY;
-                cmd->result->done = 1;
-                return SWD_DONE;
-            default:
-                //unknown error
-                cmd->result->result = SWD_ERR_BUS;
-                cmd->result->done = 1;
-                return SWD_DONE;
-            }
+            cmd->step = SWD_MEM_DRW;
+        }
+        else if (read)
+        {
+            //TAR can't be written again until the last posted read is collected
+            cmd->step = SWD_MEM_RDBUFF;
         }
         else
         {
-            cmd->state++;
+            cmd->step = cmd->next < cmd->count ? SWD_MEM_TAR : SWD_MEM_END;
         }
+        break;
+    case SWD_MEM_RDBUFF:
+        transfer->command = SWD_READ;
+        transfer->request = SWD_DP_READ_RDBUFF;
+        transfer->flags |= SWD_CMD_POSTED_DATA | SWD_CMD_WORD;
+        cmd->step = cmd->next < cmd->count ? SWD_MEM_TAR : SWD_MEM_END;
+        break;
+    default:
+        return 0;
     }
-    else if (cmd->state < SWD_READ_STATE_READ)
+
+    swd_pack(transfer);
+    return 1;
+}
+
+static uint8_t swd_mem_collect(cmd_t* cmd, const cmd_t* transfer)
+{
+    int8_t result = transfer->result->result;
+
+    if (cmd->command == SWD_MEM_POLL)
+        return swd_poll_collect(cmd, transfer);
+
+    if (result == SWD_OK && (transfer->flags & SWD_CMD_WORD))
     {
-        //lsb first
-        cmd->data |= SWD_DIO_VALUE << (cmd->state - SWD_READ_STATE_RESP);
-        cmd->state++;
+        if (cmd->command == SWD_MEM_READ)
+            cmd->buffer[cmd->words] = transfer->data;
+        cmd->words++;
     }
-    else if (cmd->state < SWD_READ_STATE_PARITY)
+
+    if (result == SWD_OK && cmd->words < cmd->count)
+        return !SWD_DONE;
+
+    //finished or failed, either way nothing more is started
+    cmd->step = SWD_MEM_END;
+    cmd->result->data = cmd->words;
+    swd_complete(cmd, result);
+    return SWD_DONE;
+}
+
+static uint8_t swd_poll_collect(cmd_t* cmd, const cmd_t* transfer)
+{
+    int8_t result = transfer->result->result;
+
+    if (result == SWD_OK && (transfer->flags & SWD_CMD_WORD))
     {
-        //TODO: Use the parity bit
-        cmd->result->data = cmd->data;
-        cmd->state++;
+        cmd->data = transfer->data;
+        cmd->words++;
+        if ((cmd->data & cmd->mask) != cmd->expect)
+        {
+            if (cmd->words < cmd->count && (!cmd->timeout || DWT_CYCCNT - cmd->start < cmd->timeout))
+                return !SWD_DONE;
+            result = SWD_ERR_TIMEOUT;
+        }
     }
-    else if (cmd->state < SWD_READ_STATE_TM1)
+    else if (result == SWD_OK)
     {
-        //turnaround
-        state.dio = PIN_HIGH;
-        cmd->result->result = SWD_OK;
-        cmd->result->done = 1;
-        //we are now done
-        return SWD_DONE;
+        return !SWD_DONE;
     }
-    else
+
+    //matched, gave up or failed, either way nothing more is started
+    cmd->step = SWD_MEM_END;
+    cmd->result->data = cmd->data;
+    cmd->result->attempts = cmd->words;
+    swd_complete(cmd, result);
+    return SWD_DONE;
+}
+
+static uint8_t swd_handle_mem(cmd_t* cmd)
+{
+    static cmd_t transfer;
+
+    if (!cmd->state)
     {
-        //wat?
-        cmd->result->result = SWD_ERR_BUS;
-        cmd->result->done = 1;
-        return SWD_DONE;
+        //the first transfer starts on this clock
+        cmd->state = 1;
+        swd_mem_next(cmd, &transfer);
     }
 
-    //if we make it this far, we assume the state machine is not finished
+    if (swd_handle_command(&transfer) != SWD_DONE)
+        return !SWD_DONE;
+
+    swd_count_result(transfer.result->result);
+    if (swd_mem_collect(cmd, &transfer) == SWD_DONE)
+        return SWD_DONE;
+
+    //the next transfer starts on the next clock
+    swd_mem_next(cmd, &transfer);
     return !SWD_DONE;
 }
 
-static uint8_t swd_handle_write(cmd_t* cmd)
+static uint8_t swd_retry_parity(cmd_t* cmd)
 {
-    uint32_t mask, temp;
+    if (cmd->retries >= config.parity_retries)
+        return 0;
 
-    if (cmd->state < SWD_WRITE_STATE_REQ)
+    cmd->retries++;
+    stats.retries++;
+    if (cmd->request & SWD_APnDP_MASK)
     {
-        //lsb first
-        mask = 0x1 << cmd->state;
-        if (cmd->request & mask)
-        {
-            state.dio = PIN_HIGH;
-        }
-        else
-        {
-            state.dio = PIN_LOW;
-        }
-        cmd->state++;
+        //repeating an AP read would do another access, RESEND returns the same data again
+        cmd->request = SWD_DP_READ_RESEND;
     }
-    else if (cmd->state < SWD_WRITE_STATE_TM0)
+    return 1;
+}
+
+static uint8_t swd_retry_wait(cmd_t* cmd)
+{
+    stats.wait++;
+    if (cmd->waits >= config.wait_retries)
+        return 0;
+
+    if (!cmd->waits)
     {
-        //turnaround
-        state.dio = PIN_IN;
-        cmd->state_data = 0; //prepare to read response
-        cmd->state++;
+        cmd->backoff = config.wait_idle;
     }
-    else if (cmd->state < SWD_WRITE_STATE_RESP)
+    else if (cmd->backoff < config.wait_idle_max)
     {
-        //lsb first
-        cmd->state_data |= SWD_DIO_VALUE << (cmd->state - SWD_READ_STATE_TM0);
-        cmd->state++;
+        cmd->backoff = cmd->backoff * 2 > config.wait_idle_max ? config.wait_idle_max : cmd->backoff * 2;
     }
-    else if (cmd->state < SWD_WRITE_STATE_TM1)
+    cmd->waits++;
+    cmd->idle = cmd->backoff;
+    return 1;
+}
+
+static void swd_pack(cmd_t* cmd)
+{
+    cmd->state = 0;
+    cmd->length = SWD_TRANSFER_BITS;
+    cmd->in = 0;
+    if (cmd->command == SWD_READ)
     {
-        //turnaround
-        state.dio = PIN_HIGH;
-        switch (cmd->state_data)
+        cmd->out = cmd->request | (1ULL << (SWD_TRANSFER_BITS - 1));
+        cmd->oe = SWD_READ_OE;
+    }
+    else
+    {
+        cmd->out = cmd->request | ((uint64_t)cmd->data << SWD_WRITE_DATA_BIT) |
+            ((uint64_t)swd_parity(cmd->data) << SWD_WRITE_PARITY_BIT);
+        cmd->oe = SWD_WRITE_OE;
+    }
+}
+
+static uint8_t swd_handle_transfer(cmd_t* cmd)
+{
+    if (cmd->idle)
+    {
+        //backing off after a WAIT
+        cmd->idle--;
+        state.dio = PIN_LOW;
+        return !SWD_DONE;
+    }
+
+    //sample the bit the target is driving (meaningless while the host drives)
+    cmd->in = (cmd->in >> 1) | ((uint64_t)SWD_DIO_VALUE << 63);
+
+    //set up the next bit for the falling edge
+    if (cmd->oe & 1)
+    {
+        state.dio = (cmd->out & 1) ? PIN_HIGH : PIN_LOW;
+    }
+    else
+    {
+        state.dio = PIN_IN;
+    }
+    cmd->out >>= 1;
+    cmd->oe >>= 1;
+    cmd->state++;
+
+    if (cmd->state == SWD_TRANSFER_ACK_BIT + 3)
+    {
+        //the ack is in the top 3 bits
+        switch ((uint32_t)(cmd->in >> 61))
         {
         case SWD_RESP_OK:
-            cmd->data = 0;
-            cmd->state++;
             break;
         case SWD_RESP_FAULT:
-            //fault error
+            //fault error, there is no data phase but we still owe a turnaround
             cmd->result->result = SWD_ERR_FAULT;
-            cmd->result->done = 1;
-            return SWD_DONE;
+            cmd->length = cmd->state + 1;
+            cmd->out = 1;
+            cmd->oe = 1;
+            break;
         case SWD_RESP_WAIT:
-            //the SWD slave is busy
-            cmd->result->result = SWD_ERR_BUSY;
-            cmd->result->done = 1;
-            return SWD_DONE;
+            //the SWD slave is busy, there is no data phase but we still owe a turnaround
+            cmd->result->result = SWD_ERR_WAIT;
+            cmd->length = cmd->state + 1;
+            cmd->out = 1;
+            cmd->oe = 1;
+            break;
         default:
-            //unknown error
-            cmd->result->result = SWD_ERR_BUS;
-            cmd->result->done = 1;
+            //unknown error, the target needs a line reset to recover
+            state.connected = 0;
+            swd_complete(cmd, SWD_ERR_BUS);
             return SWD_DONE;
         }
     }
-    else if (cmd->state < SWD_WRITE_STATE_DATA)
+
+    if (cmd->state < cmd->length)
+        return !SWD_DONE;
+
+    if (cmd->length == SWD_TRANSFER_BITS)
     {
-        //lsb first
-        mask = 1 << (cmd->state - SWD_WRITE_STATE_TM1);
-        if (cmd->data & mask)
-        {
-            state.dio = PIN_HIGH;
-        }
-        else
+        //the whole transfer went through
+        cmd->result->result = SWD_OK;
+        if (cmd->command == SWD_READ)
         {
-            state.dio = PIN_LOW;
+            cmd->data = (uint32_t)(cmd->in >> (SWD_IN_SHIFT + SWD_READ_DATA_BIT));
+            cmd->result->data = cmd->data;
+            if (((cmd->in >> (SWD_IN_SHIFT + SWD_READ_PARITY_BIT)) & 1) != swd_parity(cmd->data))
+            {
+                if (swd_retry_parity(cmd))
+                {
+                    //the retry starts on the next clock
+                    swd_pack(cmd);
+                    return !SWD_DONE;
+                }
+                cmd->result->result = SWD_ERR_PARITY;
+            }
         }
-        cmd->state++;
     }
-    else if (cmd->state < SWD_WRITE_STATE_PARITY)
+    else if (cmd->result->result == SWD_ERR_WAIT && swd_retry_wait(cmd))
     {
-        //parallel parity bit calculation: http://www.graphics.stanford.edu/~seander/bithacks.html#ParityParallel
-        temp = cmd->data;
-        temp ^= temp >> 16;
-        temp ^= temp >> 8;
-        temp ^= temp >> 4;
-        temp &= 0xf;
-        if ((0x6996 >> temp) & 1)
-        {
-            state.dio = PIN_HIGH;
-        }
-        else
+        //the retry starts after the idle cycles
+        swd_pack(cmd);
+        return !SWD_DONE;
+    }
+    swd_complete(cmd, cmd->result->result);
+    return SWD_DONE;
+}
+
+static uint8_t swd_handle_connect(cmd_t* cmd)
+{
+    if (cmd->state < sizeof(swd_initseq) * 8)
+    {
+        cmd->state += swd_send_seq(swd_initseq, sizeof(swd_initseq) * 8, cmd->state);
+        return !SWD_DONE;
+    }
+
+    //the line reset is complete, so we have a session again
+    //this last clock is an idle cycle since the command has to finish on a clock
+    state.dio = PIN_LOW;
+    state.connected = 1;
+    swd_complete(cmd, SWD_OK);
+    return SWD_DONE;
+}
+
+static uint8_t swd_handle_sequence(cmd_t* cmd)
+{
+    if (cmd->state < cmd->count)
+    {
+        cmd->state += swd_send_seq((const uint8_t*)cmd->buffer, cmd->count, cmd->state);
+        return !SWD_DONE;
+    }
+
+    //the line is left at the last bit. This call clocks nothing, see swd_do_bus.
+    //whatever the host sent, it takes care of the session from here on
+    state.connected = 1;
+    swd_complete(cmd, SWD_OK);
+    return SWD_DONE;
+}
+
+static uint8_t swd_handle_spi(cmd_t* cmd)
+{
+    int8_t result;
+
+    if (cmd->command == SWD_READ)
+    {
+        do
         {
-            state.dio = PIN_LOW;
-        }
-        cmd->result->result = SWD_OK;
-        cmd->result->done = 1;
-        return SWD_DONE;
+            result = swd_spi_read(cmd->request, &cmd->data);
+        } while (result == SWD_ERR_PARITY && swd_retry_parity(cmd));
+        cmd->result->data = cmd->data;
     }
     else
     {
-        //wat?
-        cmd->result->result = SWD_ERR_BUS;
-        cmd->result->done = 1;
-        return SWD_DONE;
+        result = swd_spi_write(cmd->request, cmd->data);
     }
 
-    //if we get this far, we assume that the state machine needs to continue
-    return !SWD_DONE;
+    if (result == SWD_ERR_WAIT && swd_retry_wait(cmd))
+    {
+        //back off, the retry happens on the next tick
+        swd_spi_idle(cmd->idle);
+        cmd->idle = 0;
+        return !SWD_DONE;
+    }
+
+    if (result == SWD_ERR_BUS)
+    {
+        //unknown error, the target needs a line reset to recover
+        state.connected = 0;
+    }
+
+    swd_complete(cmd, result);
+    return SWD_DONE;
+}
+
+static uint32_t swd_send_seq(const uint8_t* seq, uint32_t bits, uint32_t bit)
+{
+    uint8_t t;
+
+    if (state.engine == SWD_ENGINE_SPI)
+    {
+        swd_spi_send_seq(seq, bits);
+        return bits - bit;
+    }
+
+    t = 0x01 << (bit & 0x7); //this is the mask for the bit, transmitted LSB first
+    if (seq[bit >> 3] & t)
+    {
+        state.dio = PIN_HIGH;
+    }
+    else
+    {
+        state.dio = PIN_LOW;
+    }
+    return 1;
 }
@@ -0,0 +1,327 @@
+/**
+ * SWD batch interpreter
+ */
+
+#include "arm_cm4.h"
+#include "swd.h"
+#include "swd_batch.h"
+#include "usb_types.h"
+
+//data index of ops which return no data word of their own
+#define SWD_BATCH_NO_DATA 0xffff
+
+typedef enum { SWD_BATCH_IDLE, SWD_BATCH_RUNNING, SWD_BATCH_DONE } batch_state_t;
+
+/**
+ * State of the running batch
+ */
+static struct {
+    batch_state_t state;
+    const uint8_t* ops; //the batch, as bytes
+    uint16_t length; //bytes in the batch
+    uint16_t count; //ops in the batch
+    uint16_t pos; //offset of the next op to start
+    uint16_t next; //index of the next op to start
+    uint16_t finished; //index of the next op to collect
+    uint16_t words; //data words taken by the ops started so far
+    uint16_t total; //data words taken by the whole batch
+    uint16_t failed; //index of the first op that failed
+    uint8_t delaying; //true while a delay op is being timed
+    uint32_t delay_start; //cycle count when the delay started
+    uint32_t delay_cycles;
+    swd_result_t results[USB_BATCH_MAX_OPS];
+    uint16_t data[USB_BATCH_MAX_OPS]; //data word for the result of each op
+    uint8_t polls[USB_BATCH_MAX_OPS]; //true for poll ops, which also return their attempts
+} batch;
+
+/**
+ * Batch result. The header is followed by the op results and the data words.
+ */
+static uint32_t result[USB_BATCH_MAX / 4];
+
+/**
+ * Reads a little endian operand
+ */
+static uint16_t swd_batch_u16(const uint8_t* p);
+static uint32_t swd_batch_u32(const uint8_t* p);
+
+/**
+ * Returns the size of the op at an offset in the batch
+ * @param pos Offset of the op
+ * @param words Written with the number of data words the op returns
+ * @return Size of the op in bytes including its padding, or 0 if it is not
+ * valid or runs past the end of the batch
+ */
+static uint16_t swd_batch_op_size(uint16_t pos, uint16_t* words);
+
+/**
+ * Returns the offset of the first data word in the result, in words
+ */
+static uint16_t swd_batch_data_offset(void);
+
+/**
+ * Finishes the batch: ops which weren't started are skipped and the result
+ * header is filled in
+ */
+static void swd_batch_finish(void);
+
+int8_t swd_batch_begin(const uint32_t* ops, uint16_t length)
+{
+    const batch_header_t* header = (const batch_header_t*)ops;
+    uint16_t i, pos, size, words;
+
+    if (batch.state != SWD_BATCH_IDLE)
+        return SWD_ERR_BUSY;
+
+    batch.ops = (const uint8_t*)ops;
+    batch.pos = sizeof(batch_header_t);
+    batch.next = 0;
+    batch.finished = 0;
+    batch.words = 0;
+    batch.total = 0;
+    batch.failed = USB_BATCH_NO_FAILURE;
+    batch.delaying = 0;
+
+    if (length < sizeof(batch_header_t) || header->version != USB_BATCH_VERSION ||
+        header->length < sizeof(batch_header_t) || header->length > length ||
+        header->count > USB_BATCH_MAX_OPS)
+    {
+        //nothing can be trusted, not even the op count
+        batch.length = 0;
+        batch.count = 0;
+        batch.failed = 0;
+        swd_batch_finish();
+        return SWD_OK;
+    }
+    batch.length = header->length;
+    batch.count = header->count;
+
+    //every op has to make sense and the result has to fit before anything runs
+    for (i = 0, pos = batch.pos; i < batch.count; i++, pos += size)
+    {
+        size = swd_batch_op_size(pos, &words);
+        batch.total += words;
+        if (!size || (swd_batch_data_offset() + batch.total) * 4 > sizeof(result))
+        {
+            //the result carries no data when the batch doesn't run
+            batch.failed = i;
+            batch.total = 0;
+            swd_batch_finish();
+            ((int8_t*)result)[sizeof(batch_result_header_t) + i] = SWD_ERR;
+            return SWD_OK;
+        }
+    }
+
+    for (i = 0; i < batch.total; i++)
+    {
+        result[swd_batch_data_offset() + i] = 0;
+    }
+
+    batch.state = SWD_BATCH_RUNNING;
+    return SWD_OK;
+}
+
+void swd_batch_task(void)
+{
+    const uint8_t* op;
+    swd_result_t* res;
+    int8_t* acks = (int8_t*)result + sizeof(batch_result_header_t);
+    uint32_t* data = &result[swd_batch_data_offset()];
+    uint16_t words;
+    int8_t queued;
+
+    if (batch.state != SWD_BATCH_RUNNING)
+        return;
+
+    //collect finished ops in order
+    while (batch.finished < batch.next && batch.results[batch.finished].done)
+    {
+        res = &batch.results[batch.finished];
+        acks[batch.finished] = res->result;
+        if (batch.data[batch.finished] != SWD_BATCH_NO_DATA)
+            data[batch.data[batch.finished]] = res->data;
+        if (batch.polls[batch.finished])
+            data[batch.data[batch.finished] + 1] = res->attempts;
+        if (res->result != SWD_OK && batch.failed == USB_BATCH_NO_FAILURE)
+            batch.failed = batch.finished;
+        batch.finished++;
+    }
+
+    if (batch.delaying && DWT_CYCCNT - batch.delay_start >= batch.delay_cycles)
+        batch.delaying = 0;
+
+    //start more ops while the swd queue has room
+    while (batch.failed == USB_BATCH_NO_FAILURE && batch.next < batch.count && !batch.delaying)
+    {
+        op = &batch.ops[batch.pos];
+        res = &batch.results[batch.next];
+        batch.data[batch.next] = SWD_BATCH_NO_DATA;
+        batch.polls[batch.next] = 0;
+
+        switch (op[0])
+        {
+        case USB_BATCH_READ:
+            batch.data[batch.next] = batch.words;
+            queued = swd_begin_read(op[1], res);
+            break;
+        case USB_BATCH_WRITE:
+            queued = swd_begin_write(op[1], swd_batch_u32(&op[2]), res);
+            break;
+        case USB_BATCH_READ_BLOCK:
+            //the words go straight into the result
+            queued = swd_begin_mem_read(swd_batch_u32(&op[1]), swd_batch_u16(&op[5]), &data[batch.words], res);
+            break;
+        case USB_BATCH_WRITE_BLOCK:
+            //the words were padded out to a word boundary in the batch
+            queued = swd_begin_mem_write(swd_batch_u32(&op[1]), swd_batch_u16(&op[5]),
+                (const uint32_t*)&batch.ops[(batch.pos + 7 + 3) & ~0x3], res);
+            break;
+        case USB_BATCH_DELAY:
+            if (batch.finished < batch.next)
+                return; //the delay starts once everything before it is done
+            batch.delaying = 1;
+            batch.delay_start = DWT_CYCCNT;
+            batch.delay_cycles = swd_batch_u16(&op[1]) * SWD_DWT_PER_US;
+            res->result = SWD_OK;
+            res->data = 0;
+            res->done = 1;
+            queued = SWD_OK;
+            break;
+        case USB_BATCH_CONNECT:
+            queued = swd_connect(res);
+            break;
+        case USB_BATCH_POLL:
+            batch.data[batch.next] = batch.words;
+            batch.polls[batch.next] = 1;
+            queued = swd_begin_mem_poll(swd_batch_u32(&op[1]), swd_batch_u32(&op[5]), swd_batch_u32(&op[9]),
+                swd_batch_u16(&op[13]), swd_batch_u16(&op[15]), res);
+            break;
+        default:
+            //swd_batch_op_size doesn't let anything else through
+            res->result = SWD_ERR;
+            res->data = 0;
+            res->done = 1;
+            queued = SWD_OK;
+            break;
+        }
+
+        if (queued != SWD_OK)
+            break; //the swd queue is full, try again once it has drained
+
+        batch.pos += swd_batch_op_size(batch.pos, &words);
+        batch.words += words;
+        batch.next++;
+    }
+
+    if (batch.finished == batch.next && !batch.delaying &&
+        (batch.next == batch.count || batch.failed != USB_BATCH_NO_FAILURE))
+    {
+        swd_batch_finish();
+    }
+}
+
+const uint32_t* swd_batch_result(uint16_t* length)
+{
+    if (batch.state != SWD_BATCH_DONE)
+        return NULL;
+
+    *length = ((batch_result_header_t*)result)->length;
+    return result;
+}
+
+void swd_batch_release(void)
+{
+    if (batch.state == SWD_BATCH_DONE)
+        batch.state = SWD_BATCH_IDLE;
+}
+
+static uint16_t swd_batch_u16(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t swd_batch_u32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t swd_batch_op_size(uint16_t pos, uint16_t* words)
+{
+    uint16_t size, count;
+
+    *words = 0;
+    if (pos >= batch.length)
+        return 0;
+
+    switch (batch.ops[pos])
+    {
+    case USB_BATCH_READ:
+        size = 2;
+        *words = 1;
+        break;
+    case USB_BATCH_WRITE:
+        size = 6;
+        break;
+    case USB_BATCH_READ_BLOCK:
+    case USB_BATCH_WRITE_BLOCK:
+        size = 7;
+        if (pos + size > batch.length)
+            return 0;
+        count = swd_batch_u16(&batch.ops[pos + 5]);
+        if (!count)
+            return 0;
+        if (batch.ops[pos] == USB_BATCH_READ_BLOCK)
+        {
+            *words = count;
+        }
+        else
+        {
+            //padding up to a word boundary, then the words
+            size = ((pos + size + 3) & ~0x3) - pos + count * 4;
+        }
+        break;
+    case USB_BATCH_DELAY:
+        size = 3;
+        break;
+    case USB_BATCH_POLL:
+        size = 17;
+        *words = 2;
+        if (pos + size <= batch.length && !swd_batch_u16(&batch.ops[pos + 13]))
+            return 0;
+        break;
+    case USB_BATCH_CONNECT:
+        size = 1;
+        break;
+    default:
+        return 0;
+    }
+
+    if (pos + size > batch.length)
+        return 0;
+    return size;
+}
+
+static uint16_t swd_batch_data_offset(void)
+{
+    return (sizeof(batch_result_header_t) + batch.count + 3) / 4;
+}
+
+static void swd_batch_finish(void)
+{
+    batch_result_header_t* header = (batch_result_header_t*)result;
+    int8_t* acks = (int8_t*)result + sizeof(batch_result_header_t);
+    uint16_t i;
+
+    for (i = batch.next; i < batch.count; i++)
+    {
+        acks[i] = USB_BATCH_SKIPPED;
+    }
+
+    header->version = USB_BATCH_VERSION;
+    header->tag = batch.length ? ((const batch_header_t*)batch.ops)->tag : 0;
+    header->length = (swd_batch_data_offset() + batch.total) * 4;
+    header->count = batch.count;
+    header->failed = batch.failed;
+
+    batch.state = SWD_BATCH_DONE;
+}
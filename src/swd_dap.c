@@ -0,0 +1,547 @@
+/**
+ * CMSIS-DAP command processor
+ */
+
+#include "arm_cm4.h"
+#include "swd.h"
+#include "swd_dap.h"
+#include "swd_tune.h"
+
+//command ids
+#define DAP_INFO               0x00
+#define DAP_HOST_STATUS        0x01
+#define DAP_CONNECT            0x02
+#define DAP_DISCONNECT         0x03
+#define DAP_TRANSFER_CONFIGURE 0x04
+#define DAP_TRANSFER           0x05
+#define DAP_TRANSFER_BLOCK     0x06
+#define DAP_TRANSFER_ABORT     0x07
+#define DAP_WRITE_ABORT        0x08
+#define DAP_DELAY              0x09
+#define DAP_RESET_TARGET       0x0a
+#define DAP_SWJ_CLOCK          0x11
+#define DAP_SWJ_SEQUENCE       0x12
+#define DAP_SWD_CONFIGURE      0x13
+#define DAP_INVALID            0xff
+
+//command status
+#define DAP_OK    0x00
+#define DAP_ERROR 0xff
+
+//DAP_Info ids
+#define DAP_ID_PROTOCOL_VERSION 0x04
+#define DAP_ID_CAPABILITIES     0xf0
+#define DAP_ID_PACKET_COUNT     0xfe
+#define DAP_ID_PACKET_SIZE      0xff
+
+#define DAP_CAP_SWD 0x01
+
+//DAP_Connect ports
+#define DAP_PORT_DEFAULT  0
+#define DAP_PORT_SWD      1
+#define DAP_PORT_DISABLED 0
+
+//transfer request bits. APnDP, RnW and A[3:2] sit one bit below where they are in an swd request
+#define DAP_TRANSFER_APnDP       0x01
+#define DAP_TRANSFER_RnW         0x02
+#define DAP_TRANSFER_REQ_MASK    0x0f
+#define DAP_TRANSFER_MATCH_VALUE 0x10
+#define DAP_TRANSFER_MATCH_MASK  0x20
+
+//transfer acknowledgements
+#define DAP_TRANSFER_OK       0x01
+#define DAP_TRANSFER_WAIT     0x02
+#define DAP_TRANSFER_FAULT    0x04
+#define DAP_TRANSFER_NO_ACK   0x07
+#define DAP_TRANSFER_ERROR    0x08
+#define DAP_TRANSFER_MISMATCH 0x10
+
+//result of a value match read which never matched, next to the swd error codes
+#define SWD_DAP_ERR_MISMATCH -16
+
+//most transfers a command can hold, since each one takes at least a byte
+#define SWD_DAP_MAX_TRANSFERS SWD_DAP_PACKET_SIZE
+
+//most words a response can hold after its header
+#define SWD_DAP_MAX_WORDS ((SWD_DAP_PACKET_SIZE - 4) / 4)
+
+static const char swd_dap_version[] = "2.0.0";
+
+/**
+ * Results of the transfers of the running command
+ */
+static swd_result_t results[SWD_DAP_MAX_TRANSFERS];
+
+/**
+ * True for each transfer whose read data goes into the response
+ */
+static uint8_t returns[SWD_DAP_MAX_TRANSFERS];
+
+/**
+ * Settings from DAP_TransferConfigure and value match reads
+ */
+static struct {
+    uint16_t match_retries; //extra reads made by a value match read before it gives up
+    uint32_t match_mask;
+} dap;
+
+/**
+ * Reads a little endian operand
+ */
+static uint16_t swd_dap_u16(const uint8_t* p);
+static uint32_t swd_dap_u32(const uint8_t* p);
+
+/**
+ * Writes a little endian value
+ */
+static void swd_dap_put32(uint8_t* p, uint32_t value);
+
+/**
+ * Converts the register bits of a transfer request to an swd request byte
+ */
+static uint8_t swd_dap_request(uint8_t req);
+
+/**
+ * Converts an swd result to a transfer acknowledgement
+ */
+static uint8_t swd_dap_ack(int8_t result);
+
+/**
+ * Waits for a queued command to complete
+ */
+static void swd_dap_wait(swd_result_t* res);
+
+/**
+ * Queues a read. AP reads are pipelined so each one collects its own data.
+ * @param req Swd request byte
+ * @param count Number of reads of the same register, at most
+ * SWD_PIPELINE_LENGTH. DP reads are queued one by one.
+ * @param res Array of count results
+ */
+static void swd_dap_queue_read(uint8_t req, uint32_t count, swd_result_t* res);
+
+/**
+ * Queues a write, waiting for room in the swd queue
+ */
+static void swd_dap_queue_write(uint8_t req, uint32_t data, swd_result_t* res);
+
+/**
+ * Returns true if one of the transfers already done has failed
+ * @param checked Index of the first transfer not known to have passed. This
+ * is moved up past the ones which passed.
+ * @param queued Number of transfers queued
+ */
+static uint8_t swd_dap_failed(uint16_t* checked, uint16_t queued);
+
+/**
+ * Reads a register until its value matches under the match mask
+ * @param req Swd request byte for the read
+ * @param value Value to match
+ * @param res Written with the result of the last read. The result is
+ * SWD_DAP_ERR_MISMATCH if the value never matched.
+ */
+static void swd_dap_match(uint8_t req, uint32_t value, swd_result_t* res);
+
+/**
+ * Reads RDBUFF to find out whether the last posted write went through
+ * @return Transfer acknowledgement
+ */
+static uint8_t swd_dap_check_write(void);
+
+static uint16_t swd_dap_info(const uint8_t* request, uint16_t length, uint8_t* response);
+static uint16_t swd_dap_transfer(const uint8_t* request, uint16_t length, uint8_t* response);
+static uint16_t swd_dap_transfer_block(const uint8_t* request, uint16_t length, uint8_t* response);
+
+uint16_t swd_dap_process(const uint8_t* request, uint16_t length, uint8_t* response)
+{
+    swd_config_t config;
+    swd_result_t res;
+    uint32_t cycles, start, bits;
+
+    if (!length)
+        return 0;
+
+    response[0] = request[0];
+    response[1] = DAP_OK;
+
+    switch (request[0])
+    {
+    case DAP_INFO:
+        if (length < 2)
+            break;
+        return swd_dap_info(request, length, response);
+    case DAP_HOST_STATUS:
+    case DAP_DISCONNECT:
+        //there are no status leds and nothing to release
+        return 2;
+    case DAP_CONNECT:
+        if (length < 2)
+            break;
+        response[1] = request[1] == DAP_PORT_DEFAULT || request[1] == DAP_PORT_SWD ?
+            DAP_PORT_SWD : DAP_PORT_DISABLED;
+        return 2;
+    case DAP_TRANSFER_CONFIGURE:
+        if (length < 6)
+            break;
+        //idle cycles after each transfer aren't supported, the bus idles between commands anyway
+        swd_get_config(&config);
+        config.wait_retries = swd_dap_u16(&request[2]);
+        swd_set_config(&config);
+        dap.match_retries = swd_dap_u16(&request[4]);
+        return 2;
+    case DAP_TRANSFER:
+        if (length < 3)
+            break;
+        return swd_dap_transfer(request, length, response);
+    case DAP_TRANSFER_BLOCK:
+        if (length < 5)
+            break;
+        return swd_dap_transfer_block(request, length, response);
+    case DAP_TRANSFER_ABORT:
+        //commands are run to the end before the next one is read, so there is nothing to abort
+        return 0;
+    case DAP_WRITE_ABORT:
+        if (length < 6)
+            break;
+        swd_dap_queue_write(SWD_DP_WRITE_ABORT, swd_dap_u32(&request[2]), &res);
+        swd_dap_wait(&res);
+        response[1] = res.result == SWD_OK ? DAP_OK : DAP_ERROR;
+        return 2;
+    case DAP_DELAY:
+        if (length < 3)
+            break;
+        cycles = swd_dap_u16(&request[1]) * SWD_DWT_PER_US;
+        start = DWT_CYCCNT;
+        while (DWT_CYCCNT - start < cycles);
+        return 2;
+    case DAP_RESET_TARGET:
+        //there is no reset line, so no device specific reset sequence is run
+        response[2] = 0;
+        return 3;
+    case DAP_SWJ_CLOCK:
+        if (length < 5)
+            break;
+        if (!swd_dap_u32(&request[1]))
+            response[1] = DAP_ERROR;
+        else
+        {
+            swd_tune_stop();
+            swd_set_clock(swd_dap_u32(&request[1]));
+        }
+        return 2;
+    case DAP_SWJ_SEQUENCE:
+        if (length < 2)
+            break;
+        bits = request[1] ? request[1] : 256;
+        if (length < 2 + (bits + 7) / 8)
+            break;
+        while (swd_begin_sequence(&request[2], bits, &res) != SWD_OK);
+        swd_dap_wait(&res);
+        return 2;
+    case DAP_SWD_CONFIGURE:
+        if (length < 2)
+            break;
+        //only one turnaround cycle and no data phase on WAIT and FAULT
+        if (request[1])
+            response[1] = DAP_ERROR;
+        return 2;
+    default:
+        break;
+    }
+
+    response[0] = DAP_INVALID;
+    return 1;
+}
+
+static uint16_t swd_dap_info(const uint8_t* request, uint16_t length, uint8_t* response)
+{
+    uint8_t i;
+
+    response[1] = 0;
+    switch (request[1])
+    {
+    case DAP_ID_PROTOCOL_VERSION:
+        for (i = 0; i < sizeof(swd_dap_version); i++)
+        {
+            response[2 + i] = swd_dap_version[i];
+        }
+        response[1] = sizeof(swd_dap_version);
+        break;
+    case DAP_ID_CAPABILITIES:
+        response[2] = DAP_CAP_SWD;
+        response[1] = 1;
+        break;
+    case DAP_ID_PACKET_COUNT:
+        response[2] = SWD_DAP_PACKET_COUNT;
+        response[1] = 1;
+        break;
+    case DAP_ID_PACKET_SIZE:
+        response[2] = SWD_DAP_PACKET_SIZE & 0xff;
+        response[3] = SWD_DAP_PACKET_SIZE >> 8;
+        response[1] = 2;
+        break;
+    default:
+        //the vendor, product and serial number come from the usb strings
+        break;
+    }
+
+    return 2 + response[1];
+}
+
+static uint16_t swd_dap_transfer(const uint8_t* request, uint16_t length, uint8_t* response)
+{
+    uint16_t count = request[2];
+    uint16_t pos = 3, i, n, checked = 0, queued = 0, words = 0;
+    uint8_t req, ack = DAP_TRANSFER_OK, write = 0;
+
+    //queue the transfers without waiting for them, up to a value match read or a failure
+    while (queued < count && queued < SWD_DAP_MAX_TRANSFERS && !swd_dap_failed(&checked, queued))
+    {
+        if (pos >= length)
+            break;
+        req = request[pos];
+        returns[queued] = 0;
+
+        if (req & DAP_TRANSFER_RnW)
+        {
+            if (req & DAP_TRANSFER_MATCH_VALUE)
+            {
+                if (pos + 5 > length)
+                    break;
+                //everything before it has to be done before the reads start
+                for (i = checked; i < queued; i++)
+                {
+                    swd_dap_wait(&results[i]);
+                }
+                if (swd_dap_failed(&checked, queued))
+                    break;
+                swd_dap_match(swd_dap_request(req), swd_dap_u32(&request[pos + 1]), &results[queued]);
+                pos += 5;
+                queued++;
+                write = 0;
+                continue;
+            }
+
+            //reads of the same AP register are pipelined together
+            for (n = 1; n < SWD_PIPELINE_LENGTH && queued + n < count && pos + n < length &&
+                (req & DAP_TRANSFER_APnDP) && request[pos + n] == req; n++);
+            if (words + n > SWD_DAP_MAX_WORDS)
+                break; //the host asked for more than a response can hold
+            swd_dap_queue_read(swd_dap_request(req), n, &results[queued]);
+            for (i = 0; i < n; i++)
+            {
+                returns[queued++] = 1;
+            }
+            words += n;
+            pos += n;
+            write = 0;
+        }
+        else
+        {
+            if (pos + 5 > length)
+                break;
+            if (req & DAP_TRANSFER_MATCH_MASK)
+            {
+                //this only sets the mask for the value match reads after it
+                dap.match_mask = swd_dap_u32(&request[pos + 1]);
+                results[queued].result = SWD_OK;
+                results[queued].done = 1;
+            }
+            else
+            {
+                swd_dap_queue_write(swd_dap_request(req), swd_dap_u32(&request[pos + 1]), &results[queued]);
+                write = 1;
+            }
+            pos += 5;
+            queued++;
+        }
+    }
+
+    //the transfers which passed count, up to the first one that failed
+    words = 0;
+    for (n = 0; n < queued; n++)
+    {
+        swd_dap_wait(&results[n]);
+        if (results[n].result != SWD_OK)
+        {
+            ack = swd_dap_ack(results[n].result);
+            break;
+        }
+        if (returns[n])
+        {
+            swd_dap_put32(&response[3 + words * 4], results[n].data);
+            words++;
+        }
+    }
+    //failures of the transfers after that one don't matter, but they still have to finish
+    for (i = n; i < queued; i++)
+    {
+        swd_dap_wait(&results[i]);
+    }
+
+    if (ack == DAP_TRANSFER_OK && write && n == queued)
+        ack = swd_dap_check_write();
+
+    response[1] = n;
+    response[2] = ack;
+    return 3 + words * 4;
+}
+
+static uint16_t swd_dap_transfer_block(const uint8_t* request, uint16_t length, uint8_t* response)
+{
+    uint16_t count = swd_dap_u16(&request[2]);
+    uint8_t req = swd_dap_request(request[4]);
+    uint16_t i, n, queued = 0, checked = 0;
+    uint8_t read = request[4] & DAP_TRANSFER_RnW;
+    uint8_t ack = DAP_TRANSFER_OK;
+
+    if (read)
+    {
+        if (count > SWD_DAP_MAX_WORDS)
+            count = SWD_DAP_MAX_WORDS; //the host asked for more than a response can hold
+        while (queued < count && !swd_dap_failed(&checked, queued))
+        {
+            n = count - queued;
+            if (n > SWD_PIPELINE_LENGTH)
+                n = SWD_PIPELINE_LENGTH;
+            swd_dap_queue_read(req, n, &results[queued]);
+            queued += n;
+        }
+    }
+    else
+    {
+        if (count > (length - 5) / 4)
+            count = (length - 5) / 4;
+        while (queued < count && !swd_dap_failed(&checked, queued))
+        {
+            swd_dap_queue_write(req, swd_dap_u32(&request[5 + queued * 4]), &results[queued]);
+            queued++;
+        }
+    }
+
+    for (n = 0; n < queued; n++)
+    {
+        swd_dap_wait(&results[n]);
+        if (results[n].result != SWD_OK)
+        {
+            ack = swd_dap_ack(results[n].result);
+            break;
+        }
+        if (read)
+            swd_dap_put32(&response[4 + n * 4], results[n].data);
+    }
+    for (i = n; i < queued; i++)
+    {
+        swd_dap_wait(&results[i]);
+    }
+
+    if (ack == DAP_TRANSFER_OK && !read && n)
+        ack = swd_dap_check_write();
+
+    response[1] = n & 0xff;
+    response[2] = n >> 8;
+    response[3] = ack;
+    return 4 + (read ? n * 4 : 0);
+}
+
+static uint16_t swd_dap_u16(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t swd_dap_u32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void swd_dap_put32(uint8_t* p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static uint8_t swd_dap_request(uint8_t req)
+{
+    return SWD_REQUEST((req & DAP_TRANSFER_REQ_MASK) << 1);
+}
+
+static uint8_t swd_dap_ack(int8_t result)
+{
+    switch (result)
+    {
+    case SWD_OK:
+        return DAP_TRANSFER_OK;
+    case SWD_ERR_WAIT:
+        return DAP_TRANSFER_WAIT;
+    case SWD_ERR_FAULT:
+        return DAP_TRANSFER_FAULT;
+    case SWD_ERR_PARITY:
+        return DAP_TRANSFER_ERROR;
+    case SWD_DAP_ERR_MISMATCH:
+        return DAP_TRANSFER_OK | DAP_TRANSFER_MISMATCH;
+    default:
+        return DAP_TRANSFER_NO_ACK;
+    }
+}
+
+static void swd_dap_wait(swd_result_t* res)
+{
+    //done is written by the swd interrupt
+    while (!((volatile swd_result_t*)res)->done);
+}
+
+static void swd_dap_queue_read(uint8_t req, uint32_t count, swd_result_t* res)
+{
+    uint32_t i;
+
+    if (req & SWD_APnDP_MASK)
+    {
+        while (swd_begin_read_pipelined(req, count, res) != SWD_OK);
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        while (swd_begin_read(req, &res[i]) != SWD_OK);
+    }
+}
+
+static void swd_dap_queue_write(uint8_t req, uint32_t data, swd_result_t* res)
+{
+    while (swd_begin_write(req, data, res) != SWD_OK);
+}
+
+static uint8_t swd_dap_failed(uint16_t* checked, uint16_t queued)
+{
+    for (; *checked < queued && ((volatile swd_result_t*)&results[*checked])->done; (*checked)++)
+    {
+        if (results[*checked].result != SWD_OK)
+            return 1;
+    }
+    return 0;
+}
+
+static void swd_dap_match(uint8_t req, uint32_t value, swd_result_t* res)
+{
+    uint32_t attempts = dap.match_retries + 1;
+
+    while (attempts--)
+    {
+        swd_dap_queue_read(req, 1, res);
+        swd_dap_wait(res);
+        if (res->result != SWD_OK || (res->data & dap.match_mask) == value)
+            return;
+    }
+    res->result = SWD_DAP_ERR_MISMATCH;
+}
+
+static uint8_t swd_dap_check_write(void)
+{
+    swd_result_t res;
+
+    while (swd_begin_read(SWD_DP_READ_RDBUFF, &res) != SWD_OK);
+    swd_dap_wait(&res);
+    return swd_dap_ack(res.result);
+}
@@ -0,0 +1,311 @@
+/**
+ * DMA waveform bit engine for the serial wire debug interface
+ */
+
+/**
+ * How this works:
+ * Each bit is expanded into two steps: the falling edge, where the host
+ * changes the data line, and the rising edge, where the target samples it.
+ * Each step is two bytes in the output buffer: the low byte of PDDR followed
+ * by the low byte of PDOR.
+ *
+ * DMA channel 2 is triggered by PIT2 and writes one step per trigger. Its
+ * destination starts at PDDR and steps back to PDOR, then the minor loop
+ * offset moves it back up to PDDR for the next step.
+ *
+ * DMA channel 3 is triggered by PIT3, which is started right after PIT2 and
+ * so always fires a few bus cycles behind it. It copies the low byte of PDIR
+ * into the sample buffer after every step. The target changes the data line
+ * on the rising edge, so the sample taken after the falling edge of a bit is
+ * the target's value for that bit.
+ *
+ * Both channels clear their own request enable once their major loop
+ * finishes, so the batch is done when channel 3 reports done.
+ */
+
+#include "arm_cm4.h"
+#include "swd.h"
+#include "swd_dma.h"
+
+#define SWD_DMA_CLK_MASK (1<<SWD_CLK_PIN)
+#define SWD_DMA_DIO_MASK (1<<SWD_DIO_PIN)
+
+//DMA mux slots which are always requesting, so the PIT trigger alone paces the channel
+#define SWD_DMA_SOURCE_ALWAYS0 62
+#define SWD_DMA_SOURCE_ALWAYS1 63
+
+//shortest PIT period for one step. The DMA needs about this many bus cycles to
+//make its three port accesses, so this limits the clock to 48MHz / (12 * 2) = 2MHz.
+#define SWD_DMA_MIN_LDVAL 11
+
+//bits kept free when adding transactions so a stop sequence and the final step always fit
+#define SWD_DMA_RESERVED_BITS 9
+
+//offset from PDDR to PDOR, used to walk the channel 2 destination between them
+#define SWD_DMA_DDR_TO_DOR ((int32_t)&SWD_GPIO->PDOR - (int32_t)&SWD_GPIO->PDDR)
+
+/**
+ * Output buffer: {PDDR, PDOR} for each step, two steps per bit, plus a final
+ * step which leaves the clock high and releases the data line
+ */
+static uint8_t swd_dma_out[(SWD_DMA_MAX_BITS * 2 + 1) * 2];
+
+/**
+ * PDIR sample for each step
+ */
+static uint8_t swd_dma_in[SWD_DMA_MAX_BITS * 2 + 1];
+
+/**
+ * Number of bits in the batch being built
+ */
+static uint32_t swd_dma_bits;
+
+/**
+ * PIT period for one step, loaded when the next batch is started. Two steps
+ * per bit: 48MHz / ((23 + 1) * 2) = 1MHz.
+ */
+static uint32_t swd_dma_ldval = 23;
+
+/**
+ * Appends a bit to the batch being built
+ * @param drive True if the host drives the data line for this bit
+ * @param value Value to drive
+ */
+static void swd_dma_bit(uint8_t drive, uint8_t value);
+
+/**
+ * Appends a run of bits to the batch being built
+ * @param drive True if the host drives the data line for these bits
+ * @param value Values to drive, lsb first
+ * @param count Number of bits
+ */
+static void swd_dma_bits_out(uint8_t drive, uint32_t value, uint8_t count);
+
+/**
+ * Returns the value the target put on the data line for a bit
+ * @param bit Index of the bit in the batch
+ */
+static uint8_t swd_dma_sample(uint32_t bit);
+
+void swd_dma_init(void)
+{
+    SIM_SCGC6 |= SIM_SCGC6_DMAMUX_MASK | SIM_SCGC6_PIT_MASK;
+    SIM_SCGC7 |= SIM_SCGC7_DMA_MASK;
+
+    //the pit drives the dma triggers, it doesn't interrupt
+    PIT_MCR = 0x00;
+    PIT_TCTRL2 = 0;
+    PIT_TCTRL3 = 0;
+
+    //minor loop offsets are needed to walk between PDDR and PDOR
+    DMA_CR = DMA_CR_EMLM_MASK;
+
+    DMAMUX_CHCFG2 = 0;
+    DMAMUX_CHCFG3 = 0;
+    DMAMUX_CHCFG2 = DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_TRIG_MASK | DMAMUX_CHCFG_SOURCE(SWD_DMA_SOURCE_ALWAYS0);
+    DMAMUX_CHCFG3 = DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_TRIG_MASK | DMAMUX_CHCFG_SOURCE(SWD_DMA_SOURCE_ALWAYS1);
+
+    swd_dma_bits = 0;
+}
+
+uint32_t swd_dma_set_clock(uint32_t hz)
+{
+    uint32_t clk = periph_clk_khz * 1000;
+
+    if (hz > clk / 2)
+        hz = clk / 2;
+
+    //round the period up so the clock never ends up faster than requested
+    swd_dma_ldval = (clk + hz * 2 - 1) / (hz * 2) - 1;
+    if (swd_dma_ldval < SWD_DMA_MIN_LDVAL)
+        swd_dma_ldval = SWD_DMA_MIN_LDVAL;
+
+    return clk / ((swd_dma_ldval + 1) * 2);
+}
+
+void swd_dma_begin(void)
+{
+    swd_dma_bits = 0;
+}
+
+uint32_t swd_dma_space(void)
+{
+    return SWD_DMA_MAX_BITS - SWD_DMA_RESERVED_BITS - swd_dma_bits;
+}
+
+int8_t swd_dma_add_seq(const uint8_t* seq, uint32_t bits)
+{
+    uint32_t i;
+
+    if (swd_dma_bits + bits > SWD_DMA_MAX_BITS)
+        return SWD_ERR;
+
+    for (i = 0; i < bits; i++)
+    {
+        swd_dma_bit(1, (seq[i >> 3] >> (i & 0x7)) & 1);
+    }
+
+    return SWD_OK;
+}
+
+int16_t swd_dma_add_read(uint8_t req)
+{
+    int16_t handle = swd_dma_bits;
+
+    if (swd_dma_space() < SWD_DMA_TRANSACTION_BITS)
+        return SWD_ERR;
+
+    swd_dma_bits_out(1, req, 8);
+    //turnaround, ack, data, parity, and turnaround all belong to the target
+    swd_dma_bits_out(0, 0, 1 + 3 + 32 + 1 + 1);
+
+    return handle;
+}
+
+int16_t swd_dma_add_write(uint8_t req, uint32_t data)
+{
+    int16_t handle = swd_dma_bits;
+
+    if (swd_dma_space() < SWD_DMA_TRANSACTION_BITS)
+        return SWD_ERR;
+
+    swd_dma_bits_out(1, req, 8);
+    //turnaround, ack, turnaround
+    swd_dma_bits_out(0, 0, 1 + 3 + 1);
+    swd_dma_bits_out(1, data, 32);
+    swd_dma_bit(1, swd_parity(data));
+
+    return handle;
+}
+
+void swd_dma_start(void)
+{
+    uint32_t steps;
+    uint8_t* last = &swd_dma_out[swd_dma_bits * 4];
+
+    //final step: clock stays high and the data line is released
+    last[0] = SWD_DMA_CLK_MASK;
+    last[1] = SWD_DMA_CLK_MASK;
+    steps = swd_dma_bits * 2 + 1;
+
+    PIT_TCTRL2 = 0;
+    PIT_TCTRL3 = 0;
+    PIT_LDVAL2 = swd_dma_ldval;
+    PIT_LDVAL3 = swd_dma_ldval;
+    DMA_CDNE = 2;
+    DMA_CDNE = 3;
+
+    //channel 2: output buffer -> PDDR, PDOR
+    DMA_TCD2_SADDR = (uint32_t)swd_dma_out;
+    DMA_TCD2_SOFF = 1;
+    DMA_TCD2_SLAST = 0;
+    DMA_TCD2_DADDR = (uint32_t)&SWD_GPIO->PDDR;
+    DMA_TCD2_DOFF = SWD_DMA_DDR_TO_DOR;
+    DMA_TCD2_DLASTSGA = 0;
+    DMA_TCD2_ATTR = DMA_ATTR_SSIZE(0) | DMA_ATTR_DSIZE(0);
+    DMA_TCD2_NBYTES_MLOFFYES = DMA_NBYTES_MLOFFYES_DMLOE_MASK |
+        DMA_NBYTES_MLOFFYES_MLOFF(-2 * SWD_DMA_DDR_TO_DOR) | DMA_NBYTES_MLOFFYES_NBYTES(2);
+    DMA_TCD2_CITER_ELINKNO = DMA_CITER_ELINKNO_CITER(steps);
+    DMA_TCD2_BITER_ELINKNO = DMA_BITER_ELINKNO_BITER(steps);
+    DMA_TCD2_CSR = DMA_CSR_DREQ_MASK;
+
+    //channel 3: PDIR -> sample buffer
+    DMA_TCD3_SADDR = (uint32_t)&SWD_GPIO->PDIR;
+    DMA_TCD3_SOFF = 0;
+    DMA_TCD3_SLAST = 0;
+    DMA_TCD3_DADDR = (uint32_t)swd_dma_in;
+    DMA_TCD3_DOFF = 1;
+    DMA_TCD3_DLASTSGA = 0;
+    DMA_TCD3_ATTR = DMA_ATTR_SSIZE(0) | DMA_ATTR_DSIZE(0);
+    DMA_TCD3_NBYTES_MLOFFNO = 1;
+    DMA_TCD3_CITER_ELINKNO = DMA_CITER_ELINKNO_CITER(steps);
+    DMA_TCD3_BITER_ELINKNO = DMA_BITER_ELINKNO_BITER(steps);
+    DMA_TCD3_CSR = DMA_CSR_DREQ_MASK;
+
+    DMA_SERQ = 2;
+    DMA_SERQ = 3;
+
+    //pit3 is started second so the sample always lands after the step
+    PIT_TCTRL2 = PIT_TCTRL_TEN_MASK;
+    PIT_TCTRL3 = PIT_TCTRL_TEN_MASK;
+}
+
+uint8_t swd_dma_busy(void)
+{
+    if (!swd_dma_bits)
+        return 0;
+
+    if (!(DMA_TCD3_CSR & DMA_CSR_DONE_MASK))
+        return 1;
+
+    PIT_TCTRL2 = 0;
+    PIT_TCTRL3 = 0;
+    return 0;
+}
+
+int8_t swd_dma_decode(int16_t handle, uint8_t read, uint32_t* data)
+{
+    uint32_t bit = handle + 8 + 1; //skip the request and turnaround
+    uint32_t i, value;
+    uint8_t ack;
+
+    ack = swd_dma_sample(bit) | (swd_dma_sample(bit + 1) << 1) | (swd_dma_sample(bit + 2) << 2);
+    bit += 3;
+
+    switch (ack)
+    {
+    case SWD_RESP_OK:
+        break;
+    case SWD_RESP_WAIT:
+        return SWD_ERR_WAIT;
+    case SWD_RESP_FAULT:
+        return SWD_ERR_FAULT;
+    default:
+        return SWD_ERR_BUS;
+    }
+
+    if (read)
+    {
+        value = 0;
+        for (i = 0; i < 32; i++)
+        {
+            value |= (uint32_t)swd_dma_sample(bit + i) << i;
+        }
+        *data = value;
+        if (swd_dma_sample(bit + 32) != swd_parity(value))
+            return SWD_ERR_PARITY;
+    }
+
+    return SWD_OK;
+}
+
+static void swd_dma_bit(uint8_t drive, uint8_t value)
+{
+    uint8_t* step = &swd_dma_out[swd_dma_bits * 4];
+    uint8_t ddr = SWD_DMA_CLK_MASK | (drive ? SWD_DMA_DIO_MASK : 0);
+    uint8_t dor = value ? SWD_DMA_DIO_MASK : 0;
+
+    //falling edge
+    step[0] = ddr;
+    step[1] = dor;
+    //rising edge
+    step[2] = ddr;
+    step[3] = dor | SWD_DMA_CLK_MASK;
+
+    swd_dma_bits++;
+}
+
+static void swd_dma_bits_out(uint8_t drive, uint32_t value, uint8_t count)
+{
+    uint8_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        swd_dma_bit(drive, (value >> i) & 1);
+    }
+}
+
+static uint8_t swd_dma_sample(uint32_t bit)
+{
+    return (swd_dma_in[bit * 2] >> SWD_DIO_PIN) & 1;
+}
@@ -0,0 +1,366 @@
+/**
+ * SPI bit engine for the serial wire debug interface
+ */
+
+/**
+ * How this works:
+ * SPI0 is set up as a master with CPOL=1 and CPHA=1, so the clock idles high
+ * like it does for the FTM engine, data is changed on the falling edge and
+ * sampled on the rising edge. Frames are sent lsb first, which matches the
+ * order SWD puts bits on the wire. CTAR0 is set up for 16 bit frames and CTAR1
+ * for 8 bit frames.
+ *
+ * Since the DSPI can't do frames shorter than 4 bits and has no way to
+ * release SOUT, the turnaround and acknowledge bits are bit-banged by
+ * switching the clock and data pins over to GPIO. The target is given the
+ * line by switching SOUT over to a GPIO input.
+ *
+ * A write looks like this:
+ *   request (8 bit frame), trn, ack (bit-banged), trn, data (2x 16 bit
+ *   frames), parity + 7 idle cycles (8 bit frame)
+ *
+ * A read looks like this:
+ *   request (8 bit frame), trn, ack (bit-banged), data (2x 16 bit frames),
+ *   parity, trn (bit-banged)
+ */
+
+#include "arm_cm4.h"
+#include "swd.h"
+#include "swd_spi.h"
+
+#define SWD_SPI_CLK_PIN  1 //pin 14
+#define SWD_SPI_DOUT_PIN 2 //pin 7
+#define SWD_SPI_DIN_PIN  3 //pin 8
+
+#define SWD_SPI_CLK_MASK  (1<<SWD_SPI_CLK_PIN)
+#define SWD_SPI_DOUT_MASK (1<<SWD_SPI_DOUT_PIN)
+#define SWD_SPI_DIN_MASK  (1<<SWD_SPI_DIN_PIN)
+
+#define SWD_SPI_DIN_VALUE ((SWD_GPIO->PDIR & SWD_SPI_DIN_MASK) >> SWD_SPI_DIN_PIN)
+
+#define SWD_SPI_CLK_SPI   PORTD_PCR1=PORT_PCR_MUX(2) | PORT_PCR_DSE_MASK
+#define SWD_SPI_CLK_GPIO  PORTD_PCR1=PORT_PCR_MUX(1) | PORT_PCR_DSE_MASK
+#define SWD_SPI_DOUT_SPI  PORTD_PCR2=PORT_PCR_MUX(2) | PORT_PCR_DSE_MASK
+#define SWD_SPI_DOUT_GPIO PORTD_PCR2=PORT_PCR_MUX(1)
+#define SWD_SPI_DIN_SPI   PORTD_PCR3=(PORT_PCR_MUX(2) | PORT_PCR_PE_MASK | PORT_PCR_PS_MASK)
+#define SWD_SPI_DIN_GPIO  PORTD_PCR3=(PORT_PCR_MUX(1) | PORT_PCR_PE_MASK | PORT_PCR_PS_MASK)
+
+#define SWD_SPI_CTAS_16 0
+#define SWD_SPI_CTAS_8  1
+
+//transfer attributes shared by both frame sizes. The baud rate is set by swd_spi_set_clock.
+#define SWD_SPI_CTAR (SPI_CTAR_CPOL_MASK | SPI_CTAR_CPHA_MASK | SPI_CTAR_LSBFE_MASK)
+
+//core cycles taken by one iteration of the bit-bang delay loop
+#define SWD_SPI_DELAY_CYCLES 4
+
+/**
+ * Baud rate prescaler (PBR) and scaler (BR) values, indexed by field value
+ */
+static const uint8_t swd_spi_pbr[] = { 2, 3, 5, 7 };
+static const uint16_t swd_spi_br[] = {
+    2, 4, 6, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768
+};
+
+/**
+ * Baud rate fields for both CTARs
+ */
+static uint32_t swd_spi_ctar_br = SPI_CTAR_PBR(1) | SPI_CTAR_BR(4);
+
+/**
+ * Busy loop iterations for half of a bit-banged clock period. This should be
+ * about the same as half of an SPI clock period.
+ */
+static uint32_t swd_spi_bitbang_delay = 12;
+
+/**
+ * Waits for half of a bit-banged clock period
+ */
+static void swd_spi_delay(void);
+
+/**
+ * Clocks one bit-banged cycle without sampling the data line
+ */
+static void swd_spi_clock(void);
+
+/**
+ * Clocks one bit-banged cycle, driving the data line
+ * @param value Value to drive
+ */
+static void swd_spi_clock_out(uint8_t value);
+
+/**
+ * Clocks one bit-banged cycle, sampling the data line right before the
+ * rising edge
+ * @return The value of the data line
+ */
+static uint8_t swd_spi_clock_in(void);
+
+/**
+ * Switches the clock and data pins over to GPIO for bit-banging. The data
+ * line is released to the target.
+ */
+static void swd_spi_bitbang(void);
+
+/**
+ * Switches the clock and data pins back over to SPI0
+ * @param drive True if SOUT should drive the data line
+ */
+static void swd_spi_attach(uint8_t drive);
+
+/**
+ * Transmits and receives a single SPI frame
+ * @param ctas SWD_SPI_CTAS_16 or SWD_SPI_CTAS_8
+ * @param data Data to transmit
+ * @return Data received
+ */
+static uint16_t swd_spi_frame(uint8_t ctas, uint16_t data);
+
+/**
+ * Bit-bangs the turnaround and acknowledge bits
+ * @return SWD_OK or an error code
+ */
+static int8_t swd_spi_ack(void);
+
+void swd_spi_init(void)
+{
+    SIM_SCGC6 |= SIM_SCGC6_SPI0_MASK;
+
+    //the gpio state for bit-banging: clock is an output and held high, dout is released
+    MASK_SET(SWD_GPIO->PSOR, SWD_SPI_CLK_MASK);
+    MASK_SET(SWD_GPIO->PDDR, SWD_SPI_CLK_MASK);
+    MASK_CLR(SWD_GPIO->PDDR, SWD_SPI_DOUT_MASK);
+    MASK_CLR(SWD_GPIO->PDDR, SWD_SPI_DIN_MASK);
+
+    //master mode, no fifos, no chip selects
+    SPI0_MCR = SPI_MCR_MSTR_MASK | SPI_MCR_DIS_TXF_MASK | SPI_MCR_DIS_RXF_MASK |
+        SPI_MCR_CLR_TXF_MASK | SPI_MCR_CLR_RXF_MASK | SPI_MCR_HALT_MASK;
+    SPI0_CTAR0 = SWD_SPI_CTAR | swd_spi_ctar_br | SPI_CTAR_FMSZ(15);
+    SPI0_CTAR1 = SWD_SPI_CTAR | swd_spi_ctar_br | SPI_CTAR_FMSZ(7);
+    SPI0_SR = SPI_SR_TCF_MASK | SPI_SR_RFDF_MASK | SPI_SR_EOQF_MASK;
+    MASK_CLR(SPI0_MCR, SPI_MCR_HALT_MASK);
+
+    swd_spi_attach(1);
+}
+
+uint32_t swd_spi_set_clock(uint32_t hz)
+{
+    uint32_t clk = periph_clk_khz * 1000;
+    uint32_t best = 0, rate;
+    uint8_t pbr, br;
+
+    //slowest setting, used if nothing is at or below the requested clock
+    swd_spi_ctar_br = SPI_CTAR_PBR(3) | SPI_CTAR_BR(15);
+
+    for (pbr = 0; pbr < sizeof(swd_spi_pbr); pbr++)
+    {
+        for (br = 0; br < sizeof(swd_spi_br) / sizeof(swd_spi_br[0]); br++)
+        {
+            rate = clk / (swd_spi_pbr[pbr] * swd_spi_br[br]);
+            if (rate <= hz && rate > best)
+            {
+                best = rate;
+                swd_spi_ctar_br = SPI_CTAR_PBR(pbr) | SPI_CTAR_BR(br);
+            }
+        }
+    }
+    if (!best)
+        best = clk / (swd_spi_pbr[3] * swd_spi_br[15]);
+
+    MASK_SET(SPI0_MCR, SPI_MCR_HALT_MASK);
+    SPI0_CTAR0 = SWD_SPI_CTAR | swd_spi_ctar_br | SPI_CTAR_FMSZ(15);
+    SPI0_CTAR1 = SWD_SPI_CTAR | swd_spi_ctar_br | SPI_CTAR_FMSZ(7);
+    MASK_CLR(SPI0_MCR, SPI_MCR_HALT_MASK);
+
+    //bit-banged cycles run at about the same rate
+    swd_spi_bitbang_delay = (core_clk_khz * 1000) / (best * 2 * SWD_SPI_DELAY_CYCLES);
+
+    return best;
+}
+
+void swd_spi_send_seq(const uint8_t* seq, uint32_t bits)
+{
+    uint32_t i;
+
+    swd_spi_attach(1);
+    for (i = 0; i + 16 <= bits; i += 16)
+    {
+        swd_spi_frame(SWD_SPI_CTAS_16, seq[i >> 3] | (seq[(i >> 3) + 1] << 8));
+    }
+    if (i + 8 <= bits)
+    {
+        swd_spi_frame(SWD_SPI_CTAS_8, seq[i >> 3]);
+        i += 8;
+    }
+    if (i < bits)
+    {
+        //frames can't be shorter than 8 bits, so the rest is bit-banged
+        swd_spi_bitbang();
+        for (; i < bits; i++)
+        {
+            swd_spi_clock_out((seq[i >> 3] >> (i & 0x7)) & 0x1);
+        }
+        //released again, as bit-banging the acknowledge expects
+        MASK_CLR(SWD_GPIO->PDDR, SWD_SPI_DOUT_MASK);
+    }
+}
+
+void swd_spi_idle(uint32_t cycles)
+{
+    swd_spi_attach(1);
+    for (; cycles >= 8; cycles -= 8)
+    {
+        swd_spi_frame(SWD_SPI_CTAS_8, 0);
+    }
+    if (cycles)
+    {
+        //frames can't be shorter than 8 bits, so round up
+        swd_spi_frame(SWD_SPI_CTAS_8, 0);
+    }
+}
+
+int8_t swd_spi_read(uint8_t req, uint32_t* data)
+{
+    int8_t result;
+
+    swd_spi_attach(1);
+    swd_spi_frame(SWD_SPI_CTAS_8, req);
+
+    result = swd_spi_ack();
+    if (result != SWD_OK)
+    {
+        //there is no data phase, but we still owe a turnaround
+        swd_spi_clock();
+        return result;
+    }
+
+    //the target is still driving, so dout stays released
+    swd_spi_attach(0);
+    *data = swd_spi_frame(SWD_SPI_CTAS_16, 0);
+    *data |= (uint32_t)swd_spi_frame(SWD_SPI_CTAS_16, 0) << 16;
+
+    swd_spi_bitbang();
+    result = swd_spi_clock_in() == swd_parity(*data) ? SWD_OK : SWD_ERR_PARITY;
+    swd_spi_clock();
+
+    return result;
+}
+
+int8_t swd_spi_write(uint8_t req, uint32_t data)
+{
+    int8_t result;
+
+    swd_spi_attach(1);
+    swd_spi_frame(SWD_SPI_CTAS_8, req);
+
+    result = swd_spi_ack();
+    swd_spi_clock(); //turnaround
+    if (result != SWD_OK)
+        return result;
+
+    swd_spi_attach(1);
+    swd_spi_frame(SWD_SPI_CTAS_16, data);
+    swd_spi_frame(SWD_SPI_CTAS_16, data >> 16);
+
+    //the parity bit is followed by 7 idle cycles to fill out the frame
+    swd_spi_frame(SWD_SPI_CTAS_8, swd_parity(data));
+
+    return SWD_OK;
+}
+
+static void swd_spi_delay(void)
+{
+    volatile uint32_t i;
+    for (i = 0; i < swd_spi_bitbang_delay; i++);
+}
+
+static void swd_spi_clock(void)
+{
+    MASK_SET(SWD_GPIO->PCOR, SWD_SPI_CLK_MASK);
+    swd_spi_delay();
+    MASK_SET(SWD_GPIO->PSOR, SWD_SPI_CLK_MASK);
+    swd_spi_delay();
+}
+
+static void swd_spi_clock_out(uint8_t value)
+{
+    if (value)
+    {
+        MASK_SET(SWD_GPIO->PSOR, SWD_SPI_DOUT_MASK);
+    }
+    else
+    {
+        MASK_SET(SWD_GPIO->PCOR, SWD_SPI_DOUT_MASK);
+    }
+    MASK_SET(SWD_GPIO->PDDR, SWD_SPI_DOUT_MASK);
+    swd_spi_clock();
+}
+
+static uint8_t swd_spi_clock_in(void)
+{
+    uint8_t value;
+
+    MASK_SET(SWD_GPIO->PCOR, SWD_SPI_CLK_MASK);
+    swd_spi_delay();
+    value = SWD_SPI_DIN_VALUE;
+    MASK_SET(SWD_GPIO->PSOR, SWD_SPI_CLK_MASK);
+    swd_spi_delay();
+
+    return value;
+}
+
+static void swd_spi_bitbang(void)
+{
+    SWD_SPI_DOUT_GPIO;
+    SWD_SPI_DIN_GPIO;
+    SWD_SPI_CLK_GPIO;
+}
+
+static void swd_spi_attach(uint8_t drive)
+{
+    SWD_SPI_CLK_SPI;
+    SWD_SPI_DIN_SPI;
+    if (drive)
+    {
+        SWD_SPI_DOUT_SPI;
+    }
+    else
+    {
+        SWD_SPI_DOUT_GPIO;
+    }
+}
+
+static uint16_t swd_spi_frame(uint8_t ctas, uint16_t data)
+{
+    uint16_t value;
+
+    SPI0_PUSHR = SPI_PUSHR_CTAS(ctas) | SPI_PUSHR_TXDATA(data);
+    while (!(SPI0_SR & SPI_SR_TCF_MASK));
+    value = SPI0_POPR;
+    SPI0_SR = SPI_SR_TCF_MASK | SPI_SR_RFDF_MASK;
+
+    return value;
+}
+
+static int8_t swd_spi_ack(void)
+{
+    uint8_t ack;
+
+    swd_spi_bitbang();
+    swd_spi_clock(); //turnaround
+    ack = swd_spi_clock_in();
+    ack |= swd_spi_clock_in() << 1;
+    ack |= swd_spi_clock_in() << 2;
+
+    switch (ack)
+    {
+    case SWD_RESP_OK:
+        return SWD_OK;
+    case SWD_RESP_WAIT:
+        return SWD_ERR_WAIT;
+    case SWD_RESP_FAULT:
+        return SWD_ERR_FAULT;
+    default:
+        return SWD_ERR_BUS;
+    }
+}
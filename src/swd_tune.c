@@ -0,0 +1,408 @@
+/**
+ * SWD clock auto-tuning
+ */
+
+#include "arm_cm4.h"
+#include "swd.h"
+#include "swd_tune.h"
+
+//IDCODE reads at each candidate clock
+#define SWD_TUNE_IDCODE_READS 16
+
+//the search stops once the window is narrower than 1/16th of the slower end
+#define SWD_TUNE_RESOLUTION_SHIFT 4
+
+//the clock is locked in 1/8th below the fastest clock that passed
+#define SWD_TUNE_MARGIN_SHIFT 3
+
+//reads of CTRL/STAT while waiting for the debug power up acknowledgements
+#define SWD_TUNE_POWERUP_POLLS 100
+
+//transactions in each window checked for errors while a clock is locked in
+#define SWD_TUNE_WINDOW 256
+
+//parity errors (including retried ones) and invalid acknowledgements allowed in a window before the clock is stepped down
+#define SWD_TUNE_MAX_ERRORS 2
+
+//the clock is stepped down by 1/4th when there are too many errors
+#define SWD_TUNE_STEP_SHIFT 2
+
+/**
+ * Patterns written to target RAM at each candidate clock
+ */
+static const uint32_t swd_tune_patterns[] = {
+    0x00000000, 0xffffffff, 0xaaaaaaaa, 0x55555555, 0x0f0f0f0f, 0xdeadbeef
+};
+
+/**
+ * True while a run has been requested but not performed
+ */
+static volatile uint8_t pending = 0;
+
+/**
+ * True once swd_tune_stop has been called, until the next run is begun
+ */
+static volatile uint8_t stopped = 0;
+
+/**
+ * Tuning state
+ */
+static struct {
+    uint8_t locked; //true once a run has locked in a clock
+    uint8_t on_connect; //true if connects run the search again, see swd_tune_begin
+    uint32_t min_hz;
+    uint32_t max_hz;
+    uint32_t ram_addr;
+    swd_result_t* result;
+    swd_stats_t window; //bus counters at the start of the current error window
+} tune;
+
+/**
+ * Marks a run as pending
+ * @param res Written once the run is complete
+ */
+static int8_t swd_tune_pend(swd_result_t* res);
+
+/**
+ * Performs a tuning run
+ */
+static void swd_tune_run(void);
+
+/**
+ * Sets the clock unless tuning has been stopped since the run began
+ * @param hz Clock to set
+ * @return True if the clock was set
+ */
+static uint8_t swd_tune_set_clock(uint32_t hz);
+
+/**
+ * Steps the clock down if the error rate over the last window was too high
+ */
+static void swd_tune_watch(void);
+
+/**
+ * Tests the bus at a candidate clock
+ * @param hz Clock to test
+ * @param idcode IDCODE the target should return
+ * @return True if the clock passed
+ */
+static uint8_t swd_tune_check(uint32_t hz, uint32_t idcode);
+
+/**
+ * Starts a new session: line reset, IDCODE, clear errors, and power up the
+ * debug domain. Bank 0 of AP 0 is selected and set up for 32-bit accesses.
+ * @param idcode Destination for the IDCODE
+ * @return SWD_OK or an error code
+ */
+static int8_t swd_tune_connect(uint32_t* idcode);
+
+/**
+ * Reads a word of target memory through the MEM-AP
+ * @return SWD_OK or an error code
+ */
+static int8_t swd_tune_mem_read(uint32_t addr, uint32_t* data);
+
+/**
+ * Writes a word of target memory through the MEM-AP
+ * @return SWD_OK or an error code
+ */
+static int8_t swd_tune_mem_write(uint32_t addr, uint32_t data);
+
+/**
+ * Performs a read and waits for it to complete
+ * @return SWD_OK or an error code
+ */
+static int8_t swd_tune_read(uint8_t req, uint32_t* data);
+
+/**
+ * Performs a write and waits for it to complete
+ * @return SWD_OK or an error code
+ */
+static int8_t swd_tune_write(uint8_t req, uint32_t data);
+
+/**
+ * Waits for a queued command to complete
+ */
+static void swd_tune_wait(swd_result_t* res);
+
+int8_t swd_tune_begin(uint32_t min_hz, uint32_t max_hz, uint32_t ram_addr, uint8_t on_connect, swd_result_t* res)
+{
+    if (pending)
+        return SWD_ERR_BUSY;
+
+    tune.min_hz = min_hz;
+    tune.max_hz = max_hz < min_hz ? min_hz : max_hz;
+    tune.ram_addr = ram_addr & ~0x3;
+    tune.on_connect = on_connect;
+
+    return swd_tune_pend(res);
+}
+
+int8_t swd_tune_begin_connect(swd_result_t* res)
+{
+    if (!tune.on_connect)
+        return swd_connect(res);
+    if (pending)
+        return SWD_ERR_BUSY;
+
+    //the target may be using the RAM word by now, so only the IDCODE is checked
+    tune.ram_addr = 0;
+
+    return swd_tune_pend(res);
+}
+
+void swd_tune_stop(void)
+{
+    tune.on_connect = 0;
+    tune.locked = 0;
+    stopped = 1;
+}
+
+uint8_t swd_tune_busy(void)
+{
+    return pending;
+}
+
+void swd_tune_task(void)
+{
+    if (pending)
+    {
+        swd_tune_run();
+        pending = 0;
+    }
+    else
+    {
+        swd_tune_watch();
+    }
+}
+
+static int8_t swd_tune_pend(swd_result_t* res)
+{
+    tune.result = res;
+    res->done = 0;
+    stopped = 0;
+    pending = 1;
+
+    return SWD_OK;
+}
+
+static void swd_tune_run(void)
+{
+    uint32_t lo, hi, mid, idcode, saved = 0;
+    int8_t result;
+
+    tune.locked = 0;
+
+    //the minimum clock has to work, everything is compared against it
+    result = SWD_ERR;
+    if (!swd_tune_set_clock(tune.min_hz))
+        goto done;
+    result = swd_tune_connect(&idcode);
+    if (result == SWD_OK && tune.ram_addr)
+        result = swd_tune_mem_read(tune.ram_addr, &saved);
+    if (result != SWD_OK)
+        goto done;
+
+    lo = tune.min_hz;
+    hi = tune.max_hz;
+    if (swd_tune_check(hi, idcode))
+    {
+        lo = hi;
+    }
+    while (hi - lo > (lo >> SWD_TUNE_RESOLUTION_SHIFT) && !stopped)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (swd_tune_check(mid, idcode))
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    //back off from the edge, unless tuning was stopped and the clock set meanwhile
+    lo -= lo >> SWD_TUNE_MARGIN_SHIFT;
+    if (lo < tune.min_hz)
+        lo = tune.min_hz;
+    swd_tune_set_clock(lo);
+
+    //the target may have been left locked out by the last candidate
+    result = swd_tune_connect(&idcode);
+    if (result == SWD_OK && tune.ram_addr)
+        result = swd_tune_mem_write(tune.ram_addr, saved);
+
+    done:
+    //a stop from the usb interrupt mustn't be undone by locking in afterwards
+    disable_irq(IRQ(INT_USB0));
+    if (stopped)
+        result = SWD_ERR;
+    tune.locked = result == SWD_OK;
+    enable_irq(IRQ(INT_USB0));
+    swd_get_stats(&tune.window);
+
+    tune.result->data = swd_get_clock();
+    tune.result->result = result;
+    tune.result->done = 1;
+}
+
+static void swd_tune_watch(void)
+{
+    swd_stats_t now;
+    uint32_t errors, hz;
+
+    if (!tune.locked)
+        return;
+
+    swd_get_stats(&now);
+    if (now.transactions < tune.window.transactions)
+    {
+        //the counters were cleared, so start a new window
+        tune.window = now;
+        return;
+    }
+    if (now.transactions - tune.window.transactions < SWD_TUNE_WINDOW)
+        return;
+
+    errors = (now.parity - tune.window.parity) + (now.retries - tune.window.retries) +
+        (now.protocol - tune.window.protocol);
+    if (errors > SWD_TUNE_MAX_ERRORS)
+    {
+        hz = swd_get_clock();
+        hz -= hz >> SWD_TUNE_STEP_SHIFT;
+        if (hz < tune.min_hz)
+            hz = tune.min_hz;
+        swd_tune_set_clock(hz);
+    }
+    tune.window = now;
+}
+
+static uint8_t swd_tune_set_clock(uint32_t hz)
+{
+    uint8_t set;
+
+    //swd_tune_stop is called from the usb interrupt, which sets a clock of its own right after
+    disable_irq(IRQ(INT_USB0));
+    set = !stopped;
+    if (set)
+        swd_set_clock(hz);
+    enable_irq(IRQ(INT_USB0));
+
+    return set;
+}
+
+static uint8_t swd_tune_check(uint32_t hz, uint32_t idcode)
+{
+    swd_stats_t before, after;
+    uint32_t i, data;
+
+    if (!swd_tune_set_clock(hz))
+        return 0;
+    swd_get_stats(&before);
+
+    if (swd_tune_connect(&data) != SWD_OK || data != idcode)
+        return 0;
+
+    for (i = 0; i < SWD_TUNE_IDCODE_READS; i++)
+    {
+        if (swd_tune_read(SWD_DP_READ_IDCODE, &data) != SWD_OK || data != idcode)
+            return 0;
+    }
+
+    for (i = 0; tune.ram_addr && i < sizeof(swd_tune_patterns) / sizeof(swd_tune_patterns[0]); i++)
+    {
+        if (swd_tune_mem_write(tune.ram_addr, swd_tune_patterns[i]) != SWD_OK)
+            return 0;
+        if (swd_tune_mem_read(tune.ram_addr, &data) != SWD_OK || data != swd_tune_patterns[i])
+            return 0;
+    }
+
+    //a parity error which was hidden by a retry still means the clock is too fast
+    swd_get_stats(&after);
+    return after.retries == before.retries;
+}
+
+static int8_t swd_tune_connect(uint32_t* idcode)
+{
+    swd_result_t res;
+    uint32_t i, ctrlstat;
+    int8_t result;
+
+    if (swd_connect(&res) != SWD_OK)
+        return SWD_ERR_BUSY;
+    swd_tune_wait(&res);
+
+    //the first command after a line reset has to be an IDCODE read
+    if ((result = swd_tune_read(SWD_DP_READ_IDCODE, idcode)) != SWD_OK)
+        return result;
+    if ((result = swd_tune_write(SWD_DP_WRITE_ABORT, SWD_ABORT_CLEAR_ALL)) != SWD_OK)
+        return result;
+    if ((result = swd_tune_write(SWD_DP_WRITE_CTRLSTAT, SWD_CTRLSTAT_CSYSPWRUPREQ | SWD_CTRLSTAT_CDBGPWRUPREQ)) != SWD_OK)
+        return result;
+
+    for (i = 0; i < SWD_TUNE_POWERUP_POLLS; i++)
+    {
+        if ((result = swd_tune_read(SWD_DP_READ_CTRLSTAT, &ctrlstat)) != SWD_OK)
+            return result;
+        if ((ctrlstat & (SWD_CTRLSTAT_CSYSPWRUPACK | SWD_CTRLSTAT_CDBGPWRUPACK)) ==
+            (SWD_CTRLSTAT_CSYSPWRUPACK | SWD_CTRLSTAT_CDBGPWRUPACK))
+            break;
+    }
+    if (i == SWD_TUNE_POWERUP_POLLS)
+        return SWD_ERR;
+
+    if ((result = swd_tune_write(SWD_DP_WRITE_SELECT, 0)) != SWD_OK)
+        return result;
+    return swd_tune_write(SWD_AP_WRITE_CSW, SWD_CSW_DEFAULT | SWD_CSW_SIZE_32);
+}
+
+static int8_t swd_tune_mem_read(uint32_t addr, uint32_t* data)
+{
+    int8_t result;
+
+    if ((result = swd_tune_write(SWD_AP_WRITE_TAR, addr)) != SWD_OK)
+        return result;
+    //AP reads are posted, so the data comes from RDBUFF
+    if ((result = swd_tune_read(SWD_AP_READ_DRW, data)) != SWD_OK)
+        return result;
+    return swd_tune_read(SWD_DP_READ_RDBUFF, data);
+}
+
+static int8_t swd_tune_mem_write(uint32_t addr, uint32_t data)
+{
+    int8_t result;
+
+    if ((result = swd_tune_write(SWD_AP_WRITE_TAR, addr)) != SWD_OK)
+        return result;
+    return swd_tune_write(SWD_AP_WRITE_DRW, data);
+}
+
+static int8_t swd_tune_read(uint8_t req, uint32_t* data)
+{
+    swd_result_t res;
+
+    if (swd_begin_read(req, &res) != SWD_OK)
+        return SWD_ERR_BUSY;
+    swd_tune_wait(&res);
+
+    *data = res.data;
+    return res.result;
+}
+
+static int8_t swd_tune_write(uint8_t req, uint32_t data)
+{
+    swd_result_t res;
+
+    if (swd_begin_write(req, data, &res) != SWD_OK)
+        return SWD_ERR_BUSY;
+    swd_tune_wait(&res);
+
+    return res.result;
+}
+
+static void swd_tune_wait(swd_result_t* res)
+{
+    //done is written by the swd interrupt
+    while (!((volatile swd_result_t*)res)->done);
+}
@@ -0,0 +1,301 @@
+/**
+ * SWD program interpreter
+ */
+
+#include "arm_cm4.h"
+#include "swd.h"
+#include "swd_vm.h"
+
+//instruction fields
+#define SWD_VM_OP(I)  ((I) & 0xff)
+#define SWD_VM_A(I)   (((I) >> 8) & 0xf)
+#define SWD_VM_B(I)   (((I) >> 12) & 0xf)
+#define SWD_VM_C(I)   (((I) >> 16) & 0xf)
+#define SWD_VM_D(I)   (((I) >> 20) & 0xf)
+#define SWD_VM_IMM(I) ((I) >> 16)
+
+/**
+ * True while a program has been begun but not run
+ */
+static volatile uint8_t pending = 0;
+
+/**
+ * True once the running program has been told to stop
+ */
+static volatile uint8_t aborted = 0;
+
+/**
+ * Program state
+ */
+static struct {
+    const uint32_t* program;
+    uint16_t length; //instructions in the program
+    uint16_t pc; //index of the next instruction
+    uint32_t r[SWD_VM_REGISTERS];
+    uint16_t stack[SWD_VM_CALL_DEPTH]; //return addresses
+    uint8_t depth; //return addresses on the stack
+    uint32_t* buffer;
+    uint16_t words; //words in the buffer
+    swd_result_t* result;
+} vm;
+
+/**
+ * Runs the pending program until it ends
+ */
+static void swd_vm_run(void);
+
+/**
+ * Performs one instruction
+ * @param inst Instruction to perform. The pc already points past it.
+ * @param result Written with the result of the program if it ends
+ * @return SWD_DONE if the program ended
+ */
+static uint8_t swd_vm_step(uint32_t inst, int8_t* result);
+
+/**
+ * Returns true if a run of words lies within the buffer
+ */
+static uint8_t swd_vm_in_buffer(uint32_t index, uint32_t count);
+
+/**
+ * Waits for a queued command to complete and puts its result and data in
+ * the status and data registers
+ * @param res Result of the command
+ * @param queued Return value of the swd_begin_* call, the command is only
+ * waited for if it is SWD_OK
+ */
+static void swd_vm_wait(swd_result_t* res, int8_t queued);
+
+int8_t swd_vm_begin(const uint32_t* program, uint16_t length, uint16_t entry, const uint32_t* args,
+    uint32_t* buffer, uint16_t words, swd_result_t* res)
+{
+    uint8_t i;
+
+    if (pending)
+        return SWD_ERR_BUSY;
+
+    vm.program = program;
+    vm.length = length > SWD_VM_PROGRAM_WORDS ? SWD_VM_PROGRAM_WORDS : length;
+    vm.pc = entry;
+    for (i = 0; i < SWD_VM_REGISTERS; i++)
+    {
+        vm.r[i] = i < SWD_VM_ARGUMENTS ? args[i] : 0;
+    }
+    vm.depth = 0;
+    vm.buffer = buffer;
+    vm.words = words;
+    vm.result = res;
+    res->done = 0;
+    aborted = 0;
+    pending = 1;
+
+    return SWD_OK;
+}
+
+void swd_vm_abort(void)
+{
+    aborted = 1;
+}
+
+const uint32_t* swd_vm_registers(void)
+{
+    return vm.r;
+}
+
+void swd_vm_task(void)
+{
+    if (pending)
+    {
+        swd_vm_run();
+        pending = 0;
+    }
+}
+
+static void swd_vm_run(void)
+{
+    uint16_t pc;
+    int8_t result = SWD_OK;
+
+    while (1)
+    {
+        pc = vm.pc;
+        if (aborted || pc >= vm.length)
+        {
+            result = SWD_ERR;
+            vm.r[0] = pc;
+            break;
+        }
+
+        vm.pc++;
+        if (swd_vm_step(vm.program[pc], &result) == SWD_DONE)
+        {
+            //an invalid instruction reports where it was
+            if (result == SWD_ERR && SWD_VM_OP(vm.program[pc]) != SWD_VM_EXIT)
+                vm.r[0] = pc;
+            break;
+        }
+    }
+
+    vm.result->data = vm.r[0];
+    vm.result->result = result;
+    vm.result->done = 1;
+}
+
+static uint8_t swd_vm_step(uint32_t inst, int8_t* result)
+{
+    uint32_t* a = &vm.r[SWD_VM_A(inst)];
+    uint32_t b = vm.r[SWD_VM_B(inst)];
+    uint32_t c = vm.r[SWD_VM_C(inst)];
+    uint16_t imm = SWD_VM_IMM(inst);
+    uint32_t start, cycles;
+    swd_result_t res;
+
+    switch (SWD_VM_OP(inst))
+    {
+    case SWD_VM_HALT:
+        *result = SWD_OK;
+        return SWD_DONE;
+    case SWD_VM_EXIT:
+        *result = (int8_t)*a;
+        return SWD_DONE;
+    case SWD_VM_JMP:
+        vm.pc = imm;
+        break;
+    case SWD_VM_JZ:
+        if (!*a)
+            vm.pc = imm;
+        break;
+    case SWD_VM_JNZ:
+        if (*a)
+            vm.pc = imm;
+        break;
+    case SWD_VM_JEQ:
+        if (*a == b)
+            vm.pc = imm;
+        break;
+    case SWD_VM_JNE:
+        if (*a != b)
+            vm.pc = imm;
+        break;
+    case SWD_VM_JLO:
+        if (*a < b)
+            vm.pc = imm;
+        break;
+    case SWD_VM_DJNZ:
+        if (--*a)
+            vm.pc = imm;
+        break;
+    case SWD_VM_CALL:
+        if (vm.depth >= SWD_VM_CALL_DEPTH)
+            goto invalid;
+        vm.stack[vm.depth++] = vm.pc;
+        vm.pc = imm;
+        break;
+    case SWD_VM_RET:
+        if (!vm.depth)
+            goto invalid;
+        vm.pc = vm.stack[--vm.depth];
+        break;
+    case SWD_VM_LDI:
+        *a = imm;
+        break;
+    case SWD_VM_LDIH:
+        *a = (*a & 0xffff) | ((uint32_t)imm << 16);
+        break;
+    case SWD_VM_MOV:
+        *a = b;
+        break;
+    case SWD_VM_ADDI:
+        *a = b + (int16_t)imm;
+        break;
+    case SWD_VM_ADD:
+        *a = b + c;
+        break;
+    case SWD_VM_SUB:
+        *a = b - c;
+        break;
+    case SWD_VM_AND:
+        *a = b & c;
+        break;
+    case SWD_VM_OR:
+        *a = b | c;
+        break;
+    case SWD_VM_XOR:
+        *a = b ^ c;
+        break;
+    case SWD_VM_SHL:
+        *a = c < 32 ? b << c : 0;
+        break;
+    case SWD_VM_SHR:
+        *a = c < 32 ? b >> c : 0;
+        break;
+    case SWD_VM_LDW:
+        if (!swd_vm_in_buffer(b + imm, 1))
+            goto invalid;
+        *a = vm.buffer[b + imm];
+        break;
+    case SWD_VM_STW:
+        if (!swd_vm_in_buffer(b + imm, 1))
+            goto invalid;
+        vm.buffer[b + imm] = *a;
+        break;
+    case SWD_VM_READ:
+        swd_vm_wait(&res, swd_begin_read(imm, &res));
+        *a = res.data;
+        break;
+    case SWD_VM_WRITE:
+        swd_vm_wait(&res, swd_begin_write(imm, *a, &res));
+        break;
+    case SWD_VM_MREAD:
+    case SWD_VM_MWRITE:
+        if (!swd_vm_in_buffer(c, b))
+            goto invalid;
+        if (SWD_VM_OP(inst) == SWD_VM_MREAD)
+            swd_vm_wait(&res, swd_begin_mem_read(*a, b, &vm.buffer[c], &res));
+        else
+            swd_vm_wait(&res, swd_begin_mem_write(*a, b, &vm.buffer[c], &res));
+        break;
+    case SWD_VM_POLL:
+        swd_vm_wait(&res, swd_begin_mem_poll(*a, b, c, vm.r[SWD_VM_D(inst)] & 0xffff,
+            vm.r[SWD_VM_D(inst)] >> 16, &res));
+        break;
+    case SWD_VM_CONNECT:
+        swd_vm_wait(&res, swd_connect(&res));
+        break;
+    case SWD_VM_DELAY:
+        start = DWT_CYCCNT;
+        cycles = imm * SWD_DWT_PER_US;
+        while (DWT_CYCCNT - start < cycles && !aborted);
+        break;
+    default:
+        goto invalid;
+    }
+
+    return !SWD_DONE;
+
+invalid:
+    *result = SWD_ERR;
+    return SWD_DONE;
+}
+
+static uint8_t swd_vm_in_buffer(uint32_t index, uint32_t count)
+{
+    return index < vm.words && count <= vm.words - index;
+}
+
+static void swd_vm_wait(swd_result_t* res, int8_t queued)
+{
+    if (queued == SWD_OK)
+    {
+        //done is written by the swd interrupt
+        while (!((volatile swd_result_t*)res)->done);
+    }
+    else
+    {
+        res->result = queued;
+        res->data = 0;
+    }
+
+    vm.r[SWD_VM_STATUS] = (int32_t)res->result;
+    vm.r[SWD_VM_DATA] = res->data;
+}
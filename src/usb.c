@@ -1,6 +1,10 @@
 #include "usb.h"
 #include "arm_cm4.h"
 #include "swd.h"
+#include "swd_tune.h"
+#include "swd_batch.h"
+#include "swd_vm.h"
+#include "swd_dap.h"
 #include "usb_types.h"
 
 #define PID_OUT   0x1
@@ -10,6 +14,12 @@
 
 #define ENDP0_SIZE 64
 
+#ifdef USB_CMSIS_DAP
+#define USB_DATA_ENDPOINTS 2 //CMSIS-DAP hosts expect nothing but the bulk pair on the interface
+#else
+#define USB_DATA_ENDPOINTS 3 //bulk OUT, bulk IN and notifications
+#endif
+
 typedef struct {
     union {
         struct {
@@ -52,6 +62,15 @@ typedef struct {
     uint8_t iInterface;
 } int_descriptor_t;
 
+typedef struct {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bEndpointAddress;
+    uint8_t bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t bInterval;
+} __attribute__((packed)) ep_descriptor_t;
+
 typedef struct {
     uint8_t bLength;
     uint8_t bDescriptorType;
@@ -61,8 +80,9 @@ typedef struct {
     uint8_t iConfiguration;
     uint8_t bmAttributes;
     uint8_t bMaxPower;
-    int_descriptor_t interfaces[];
-} cfg_descriptor_t;
+    int_descriptor_t interface;
+    ep_descriptor_t endpoints[USB_DATA_ENDPOINTS];
+} __attribute__((packed)) cfg_descriptor_t;
 
 typedef struct {
     uint8_t bLength;
@@ -113,20 +133,123 @@ typedef struct {
 /**
  * Buffer descriptor table, aligned to a 512-byte boundary (see linker file)
  */
-__attribute__ ((section(".usbdescriptortable"), used))
+__attribute__ ((section(".usbdescriptortable"), aligned(512), used))
 static bdt_t table[(USB_N_ENDPOINTS + 1)*4]; //max endpoints is 15 + 1 control
 
 /**
  * Endpoint 0 receive buffers (2x64 bytes)
  */
-static uint8_t endp0_rx[2][ENDP0_SIZE];
+static uint8_t endp0_rx[2][ENDP0_SIZE] __attribute__ ((aligned(4)));
+
+#define USB_RING_SKIP 0x100 //tag of ring entries which are never reported
+
+/**
+ * Completion ring. Begin requests append commands at the head and the swd
+ * module writes their results in place, so the commands of a pipelined read
+ * must be next to each other and a run which would wrap around starts over
+ * at the first entry instead, skipping the ones at the end. Done commands are
+ * taken from the tail in the order they were begun and handed to the host as
+ * completion_t records.
+ */
+static struct {
+    swd_result_t results[USB_RING_LENGTH];
+    uint16_t tags[USB_RING_LENGTH]; //wIndex each command was begun with, or USB_RING_SKIP
+    uint16_t head; //entries appended, the next one goes at head % USB_RING_LENGTH
+    uint16_t tail; //entries taken out
+    uint16_t sequence; //records handed to the host since the configuration was set
+} ring;
+
+/**
+ * Notification endpoint state
+ */
+static struct {
+    completion_t records[2][USB_NOTIFY_SIZE / sizeof(completion_t)]; //ping-pong packets
+    uint8_t odd; //next tx buffer descriptor to use
+    uint8_t busy[2]; //true while a tx buffer descriptor is waiting to be sent
+} notify;
 
-#define N_COMMAND_RESULTS 256
+/**
+ * Holds the records of a read completions request while they are being sent
+ */
+static completion_t completions[ENDP0_SIZE / sizeof(completion_t)];
 
 /**
- * Holds the current transaction results, indexed by request index
+ * Batch being received from the bulk OUT endpoint. The USB module writes each
+ * packet straight into its place here and the batch is run from here, so no
+ * buffer descriptor points at it again until its result has been sent. The
+ * IN endpoint sends straight from the batch result. In CMSIS-DAP mode this
+ * holds the command being processed.
  */
-static swd_result_t results[N_COMMAND_RESULTS];
+static uint32_t batch_rx[USB_BATCH_MAX / 4];
+
+#ifdef USB_CMSIS_DAP
+/**
+ * Response to the last CMSIS-DAP command
+ */
+static struct {
+    uint8_t done; //true once the response is ready to send
+    uint16_t length;
+    uint8_t response[SWD_DAP_PACKET_SIZE];
+} dap;
+#endif
+
+/**
+ * Bulk endpoint state
+ */
+static struct {
+    uint16_t rx_length; //bytes of the batch received so far
+    uint8_t rx_odd; //next rx buffer descriptor the usb module will use
+    uint8_t running; //true from when a batch begins until its result has been sent
+    uint8_t discard; //true if the running batch was sent before a usb reset, so its result is thrown away
+    const uint8_t* tx; //result being sent, NULL if none
+    uint16_t tx_pos; //bytes of the result handed to the usb module
+    uint16_t tx_length;
+    uint8_t tx_zlp; //true if a zero length packet still has to end the result
+    uint8_t tx_odd; //next tx buffer descriptor to use
+    uint8_t tx_busy[2]; //true while a tx buffer descriptor is waiting to be sent
+} bulk;
+
+/**
+ * Holds the words of MEM-AP block requests
+ */
+static uint32_t block[USB_BLOCK_WORDS];
+
+/**
+ * Holds the instructions of programs
+ */
+static uint32_t program[USB_PROGRAM_WORDS];
+
+/**
+ * Completion ring entry of the last block request or program to use the
+ * block buffer
+ */
+static uint16_t block_owner;
+
+/**
+ * Returns true while a block request or a program is using the block buffer.
+ * The program buffer is in use whenever a program is.
+ */
+static uint8_t usb_block_busy(void)
+{
+    //the entry is only taken out of the ring once it is done
+    return (uint16_t)(block_owner - ring.tail) < (uint16_t)(ring.head - ring.tail) &&
+        !ring.results[block_owner % USB_RING_LENGTH].done;
+}
+
+/**
+ * Holds the SWD clock frequency while it is being sent to the host
+ */
+static uint32_t clock_hz;
+
+/**
+ * Holds the bus statistics while they are being sent to the host
+ */
+static swd_stats_t stats;
+
+/**
+ * Holds the bus configuration while it is being sent to the host
+ */
+static swd_config_t config;
 
 /**
  * Device descriptor
@@ -159,24 +282,54 @@ static dev_descriptor_t dev_descriptor = {
 static cfg_descriptor_t cfg_descriptor = {
     .bLength = 9,
     .bDescriptorType = 2,
-    .wTotalLength = 18,
+    .wTotalLength = sizeof(cfg_descriptor_t),
     .bNumInterfaces = 1,
     .bConfigurationValue = 1,
     .iConfiguration = 0,
     .bmAttributes = 0x80,
     .bMaxPower = 250,
-    .interfaces = {
+    .interface = {
+        .bLength = 9,
+        .bDescriptorType = 4,
+        .bInterfaceNumber = 0,
+        .bAlternateSetting = 0,
+        .bNumEndpoints = USB_DATA_ENDPOINTS,
+        .bInterfaceClass = 0xff,
+        .bInterfaceSubClass = 0x0,
+        .bInterfaceProtocol = 0x0,
+#ifdef USB_CMSIS_DAP
+        .iInterface = 3, //hosts find the probe by this string
+#else
+        .iInterface = 0,
+#endif
+    },
+    .endpoints = {
         {
-            .bLength = 9,
-            .bDescriptorType = 4,
-            .bInterfaceNumber = 0,
-            .bAlternateSetting = 0,
-            .bNumEndpoints = 0,
-            .bInterfaceClass = 0xff,
-            .bInterfaceSubClass = 0x0,
-            .bInterfaceProtocol = 0x0,
-            .iInterface = 0,
-        }
+            .bLength = 7,
+            .bDescriptorType = 5,
+            .bEndpointAddress = USB_BULK_OUT_ENDPOINT,
+            .bmAttributes = 0x02, //bulk
+            .wMaxPacketSize = USB_BULK_SIZE,
+            .bInterval = 0,
+        },
+        {
+            .bLength = 7,
+            .bDescriptorType = 5,
+            .bEndpointAddress = 0x80 | USB_BULK_IN_ENDPOINT,
+            .bmAttributes = 0x02, //bulk
+            .wMaxPacketSize = USB_BULK_SIZE,
+            .bInterval = 0,
+        },
+#ifndef USB_CMSIS_DAP
+        {
+            .bLength = 7,
+            .bDescriptorType = 5,
+            .bEndpointAddress = 0x80 | USB_NOTIFY_ENDPOINT,
+            .bmAttributes = 0x03, //interrupt
+            .wMaxPacketSize = USB_NOTIFY_SIZE,
+            .bInterval = 1, //every frame
+        },
+#endif
     }
 };
 
@@ -192,18 +345,37 @@ static str_descriptor_t manuf_descriptor = {
     .wString = {'k','e','v','i', 'n', 'c', 'u', 'z', 'n', 'e', 'r', '.', 'c', 'o', 'm'}
 };
 
+#ifdef USB_CMSIS_DAP
+static str_descriptor_t product_descriptor = {
+    .bLength = 2 + 21 * 2,
+    .bDescriptorType = 3,
+    .wString = {'S', 'W', 'D', ' ', 'A', 'd', 'a', 'p', 't', 'o', 'r', ' ', 'C', 'M', 'S', 'I', 'S', '-', 'D', 'A', 'P'}
+};
+
+static str_descriptor_t interface_descriptor = {
+    .bLength = 2 + 12 * 2,
+    .bDescriptorType = 3,
+    .wString = {'C', 'M', 'S', 'I', 'S', '-', 'D', 'A', 'P', ' ', 'v', '2'}
+};
+#else
 static str_descriptor_t product_descriptor = {
     .bLength = 2 + 11 * 2,
     .bDescriptorType = 3,
     .wString = {'S', 'W', 'D', ' ', 'A', 'd', 'a', 'p', 't', 'o', 'r'}
 };
+#endif
 
 static const descriptor_entry_t descriptors[] = {
     { 0x0100, 0x0000, &dev_descriptor, sizeof(dev_descriptor) },
-    { 0x0200, 0x0000, &cfg_descriptor, 18 },
+    { 0x0200, 0x0000, &cfg_descriptor, sizeof(cfg_descriptor) },
     { 0x0300, 0x0000, &lang_descriptor, 4 },
     { 0x0301, 0x0409, &manuf_descriptor, 32 },
+#ifdef USB_CMSIS_DAP
+    { 0x0302, 0x0409, &product_descriptor, 44 },
+    { 0x0303, 0x0409, &interface_descriptor, 26 },
+#else
     { 0x0302, 0x0409, &product_descriptor, 24 },
+#endif
     { 0x0000, 0x0000, NULL, 0 }
 };
 
@@ -217,6 +389,327 @@ static void usb_endp0_transmit(const void* data, uint8_t length)
     endp0_data ^= 1;
 }
 
+static uint8_t endp0_rx_odd; //receive buffer descriptor the data stage goes to
+
+/**
+ * Receives the data stage of the setup being handled straight into a buffer
+ * rather than endp0_rx. The endpoint is frozen until the setup is handled,
+ * so the descriptor can be taken back from the usb module and pointed
+ * elsewhere. It is pointed back at endp0_rx once the data is in.
+ */
+static void usb_endp0_receive(void* data, uint16_t length)
+{
+    bdt_t* bdt = &table[BDT_INDEX(0, RX, endp0_rx_odd)];
+
+    bdt->desc = 0;
+    bdt->addr = data;
+    bdt->desc = BDT_DESC(length, 1);
+}
+
+/**
+ * Gives the next bulk OUT buffer descriptor to the usb module, pointing at
+ * the end of what has been received of the batch. Only one is given at a
+ * time, so the host is held off while a batch runs.
+ */
+static void usb_bulk_arm(void)
+{
+    bdt_t* bdt = &table[BDT_INDEX(USB_BULK_OUT_ENDPOINT, RX, bulk.rx_odd)];
+
+    //even buffers always carry DATA0 and odd buffers DATA1, since both alternate
+    bdt->addr = (uint8_t*)batch_rx + bulk.rx_length;
+    bdt->desc = BDT_DESC(USB_BULK_SIZE, bulk.rx_odd);
+}
+
+/**
+ * Resets the bulk endpoints to their first buffers and DATA0. The result of a
+ * batch which is still running is thrown away.
+ */
+static void usb_bulk_reset(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < 2; i++)
+    {
+        table[BDT_INDEX(USB_BULK_OUT_ENDPOINT, RX, i)].desc = 0;
+        table[BDT_INDEX(USB_BULK_IN_ENDPOINT, TX, i)].desc = 0;
+        bulk.tx_busy[i] = 0;
+    }
+    bulk.discard = bulk.running;
+    bulk.rx_length = 0;
+    bulk.rx_odd = 0;
+    bulk.tx = NULL;
+    bulk.tx_odd = 0;
+
+    //a running batch still needs its buffer, so receiving starts once it is done
+    if (!bulk.running)
+        usb_bulk_arm();
+
+    USB0_ENDPT1 = USB_ENDPT_EPRXEN_MASK | USB_ENDPT_EPHSHK_MASK;
+    USB0_ENDPT2 = USB_ENDPT_EPTXEN_MASK | USB_ENDPT_EPHSHK_MASK;
+}
+
+/**
+ * Handles a packet which the USB module has written into the batch, and
+ * begins the batch once all of it is here. Until then, the next buffer
+ * descriptor is pointed at the rest of the batch.
+ * @param length Bytes in the packet
+ */
+static void usb_bulk_receive(uint8_t length)
+{
+#ifndef USB_CMSIS_DAP
+    const batch_header_t* header = (const batch_header_t*)batch_rx;
+#endif
+
+    bulk.rx_length += length;
+    bulk.rx_odd ^= 1;
+
+#ifdef USB_CMSIS_DAP
+    //each packet is a command of its own, which usb_task runs
+    bulk.running = 1;
+#else
+    //a short packet ends the transfer even if the header says otherwise
+    if (length < USB_BULK_SIZE || bulk.rx_length == sizeof(batch_rx) ||
+        (bulk.rx_length >= sizeof(batch_header_t) && bulk.rx_length >= header->length))
+    {
+        swd_batch_begin(batch_rx, bulk.rx_length);
+        bulk.rx_length = 0;
+        bulk.running = 1;
+        return;
+    }
+    usb_bulk_arm();
+#endif
+}
+
+/**
+ * Sends the result of the last batch once it has finished, straight from the
+ * result buffer. The batch is released once the whole result has been sent.
+ */
+static void usb_bulk_send(void)
+{
+    bdt_t* bdt;
+    uint16_t length;
+
+    if (!bulk.running)
+        return;
+
+    if (!bulk.tx)
+    {
+#ifdef USB_CMSIS_DAP
+        if (!dap.done)
+            return;
+        bulk.tx = dap.response;
+        bulk.tx_length = dap.length;
+        //the host reads every response with a buffer of one packet, so nothing follows a full one
+        bulk.tx_zlp = 0;
+#else
+        bulk.tx = (const uint8_t*)swd_batch_result(&bulk.tx_length);
+        if (!bulk.tx)
+            return;
+        //a full last packet doesn't end the transfer, so it needs a zero length packet after it
+        bulk.tx_zlp = !(bulk.tx_length % USB_BULK_SIZE);
+#endif
+        bulk.tx_pos = 0;
+        if (bulk.discard)
+            bulk.tx_length = bulk.tx_pos;
+    }
+
+    while ((bulk.tx_pos < bulk.tx_length || bulk.tx_zlp) && !bulk.tx_busy[bulk.tx_odd] && !bulk.discard)
+    {
+        length = bulk.tx_length - bulk.tx_pos;
+        if (length > USB_BULK_SIZE)
+            length = USB_BULK_SIZE;
+        if (!length)
+            bulk.tx_zlp = 0;
+
+        bdt = &table[BDT_INDEX(USB_BULK_IN_ENDPOINT, TX, bulk.tx_odd)];
+        bdt->addr = (void*)(bulk.tx + bulk.tx_pos);
+        bdt->desc = BDT_DESC(length, bulk.tx_odd);
+        bulk.tx_busy[bulk.tx_odd] = 1;
+        bulk.tx_odd ^= 1;
+        bulk.tx_pos += length;
+    }
+
+    if ((bulk.tx_pos < bulk.tx_length || bulk.tx_zlp || bulk.tx_busy[0] || bulk.tx_busy[1]) && !bulk.discard)
+        return;
+
+    //the whole result is out, so the next batch can come in
+#ifdef USB_CMSIS_DAP
+    dap.done = 0;
+    bulk.rx_length = 0;
+#else
+    swd_batch_release();
+#endif
+    bulk.tx = NULL;
+    bulk.running = 0;
+    bulk.discard = 0;
+    usb_bulk_arm();
+}
+
+/**
+ * Resets the notification endpoint and the completion ring. Commands which
+ * are still in the ring are never reported and record sequence numbers start
+ * over.
+ */
+static void usb_notify_reset(void)
+{
+    uint32_t i;
+
+    //the swd module may still be writing results, so the entries stay in use
+    for (i = 0; i < USB_RING_LENGTH; i++)
+    {
+        ring.tags[i] = USB_RING_SKIP;
+    }
+    ring.sequence = 0;
+    for (i = 0; i < 2; i++)
+    {
+        table[BDT_INDEX(USB_NOTIFY_ENDPOINT, TX, i)].desc = 0;
+        notify.busy[i] = 0;
+    }
+    notify.odd = 0;
+
+#ifndef USB_CMSIS_DAP
+    USB0_ENDPT3 = USB_ENDPT_EPTXEN_MASK | USB_ENDPT_EPHSHK_MASK;
+#endif
+}
+
+/**
+ * Returns the number of entries to skip at the end of the ring before
+ * appending a run of commands, so the run doesn't wrap around
+ * @param count Number of commands in the run
+ */
+static uint16_t usb_ring_gap(uint16_t count)
+{
+    uint16_t pos = ring.head % USB_RING_LENGTH;
+
+    return pos + count > USB_RING_LENGTH ? USB_RING_LENGTH - pos : 0;
+}
+
+/**
+ * Returns true if a run of commands can be appended to the completion ring.
+ * None can while a clock tuning run has the bus.
+ * @param count Number of commands in the run
+ */
+static uint8_t usb_ring_room(uint16_t count)
+{
+    uint16_t used = ring.head - ring.tail;
+
+    if (swd_tune_busy())
+        return 0;
+
+    //an empty ring can start over anywhere, see usb_ring_append
+    return used + (used ? usb_ring_gap(count) : 0) + count <= USB_RING_LENGTH;
+}
+
+/**
+ * Appends a run of commands to the completion ring. There must be room.
+ * @param tag wIndex of the request which begins the commands
+ * @param count Number of commands in the run
+ * @return Results for the commands, next to each other
+ */
+static swd_result_t* usb_ring_append(uint16_t tag, uint16_t count)
+{
+    swd_result_t* res;
+    uint16_t gap = usb_ring_gap(count);
+
+    if (ring.head == ring.tail)
+    {
+        //nothing to report, so the skipped entries don't have to wait in the ring
+        ring.head += gap;
+        ring.tail = ring.head;
+        gap = 0;
+    }
+
+    for (; gap; gap--, ring.head++)
+    {
+        ring.tags[ring.head % USB_RING_LENGTH] = USB_RING_SKIP;
+        ring.results[ring.head % USB_RING_LENGTH].done = 1;
+    }
+
+    res = &ring.results[ring.head % USB_RING_LENGTH];
+    for (; count; count--, ring.head++)
+    {
+        ring.tags[ring.head % USB_RING_LENGTH] = tag;
+        ring.results[ring.head % USB_RING_LENGTH].done = 1;
+    }
+    return res;
+}
+
+/**
+ * Records the outcome of beginning a run of commands. If the swd module
+ * refused them, they complete right away with its error.
+ * @param res Results of the commands
+ * @param count Number of commands in the run
+ * @param result Return value of the begin function
+ */
+static void usb_ring_begun(swd_result_t* res, uint16_t count, int8_t result)
+{
+    if (result == SWD_OK)
+        return;
+
+    for (; count; count--, res++)
+    {
+        res->result = result;
+        res->data = 0;
+        res->done = 1;
+    }
+}
+
+/**
+ * Takes done commands out of the completion ring, oldest first, stopping at
+ * the first one which isn't done
+ * @param records Destination for the completion records
+ * @param max Maximum number of records
+ * @return Number of records written
+ */
+static uint8_t usb_ring_take(completion_t* records, uint8_t max)
+{
+    swd_result_t* res;
+    uint16_t tag;
+    uint8_t n = 0;
+
+    while (ring.tail != ring.head && n < max)
+    {
+        res = &ring.results[ring.tail % USB_RING_LENGTH];
+        tag = ring.tags[ring.tail % USB_RING_LENGTH];
+        if (!res->done)
+            break;
+
+        ring.tail++;
+        if (tag == USB_RING_SKIP)
+            continue;
+
+        records[n].sequence = ring.sequence++;
+        records[n].tag = tag;
+        records[n].result = res->result;
+        records[n].data = res->data;
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * Sends records for done commands, if a packet is free
+ */
+static void usb_notify_send(void)
+{
+    completion_t* records = notify.records[notify.odd];
+    uint8_t n;
+
+    if (notify.busy[notify.odd])
+        return;
+
+    n = usb_ring_take(records, USB_NOTIFY_SIZE / sizeof(completion_t));
+    if (!n)
+        return;
+
+    //even buffers always carry DATA0 and odd buffers DATA1, since both alternate
+    table[BDT_INDEX(USB_NOTIFY_ENDPOINT, TX, notify.odd)].addr = records;
+    table[BDT_INDEX(USB_NOTIFY_ENDPOINT, TX, notify.odd)].desc = BDT_DESC(n * sizeof(completion_t), notify.odd);
+    notify.busy[notify.odd] = 1;
+    notify.odd ^= 1;
+}
+
 /**
  * Endpoint 0 setup handler
  */
@@ -225,13 +718,18 @@ static void usb_endp0_handle_setup(setup_t* packet)
     const descriptor_entry_t* entry;
     const uint8_t* data = NULL;
     uint8_t data_length = 0;
+    swd_result_t* res;
+    uint16_t i;
 
     switch(packet->wRequestAndType)
     {
     case 0x0500: //set address (wait for IN packet)
         break;
     case 0x0900: //set configuration
-        //we only have one configuration at this time
+        //we only have one configuration at this time, but the bulk endpoints start over
+        usb_bulk_reset();
+        usb_notify_reset();
+        swd_vm_abort();
         break;
     case 0x0680: //get descriptor
     case 0x0681:
@@ -257,22 +755,114 @@ static void usb_endp0_handle_setup(setup_t* packet)
         GPIOC_PCOR=(1<<5);
         break;
     case USB_SWD_BEGIN_READ: //begins a read request
-        //is the command slot this indexes still in use?
-        if (packet->wIndex >= (N_COMMAND_RESULTS) || !results[packet->wIndex].done)
+        //is there room in the completion ring?
+        if (packet->wIndex > 0xff || !usb_ring_room(1))
             goto stall;
         //wait for OUT
         break;
     case USB_SWD_BEGIN_WRITE: //begins a write request
-        //is the command slot this indexes still in use?
-        if (packet->wIndex >= (N_COMMAND_RESULTS) || !results[packet->wIndex].done)
+        //is there room in the completion ring?
+        if (packet->wIndex > 0xff || !usb_ring_room(1))
+            goto stall;
+        //wait for OUT
+        break;
+    case USB_SWD_BEGIN_READ_PIPELINED: //begins a pipelined AP read request
+        //is there room in the completion ring for every read?
+        if (!packet->wValue || packet->wValue > SWD_PIPELINE_LENGTH ||
+            packet->wIndex > 0xff || !usb_ring_room(packet->wValue))
             goto stall;
         //wait for OUT
         break;
-    case USB_SWD_READ_STATUS: //reads the status of a command
-        if (packet->wIndex >= (N_COMMAND_RESULTS))
+    case USB_SWD_BEGIN_MEM_READ: //begins a MEM-AP block read request
+    case USB_SWD_BEGIN_MEM_WRITE: //begins a MEM-AP block write request
+        //is there room in the completion ring and is the block buffer free?
+        if (packet->wIndex > 0xff || !usb_ring_room(1) || usb_block_busy())
+            goto stall;
+        //wait for OUT
+        break;
+    case USB_SWD_WRITE_BLOCK: //writes part of the block buffer
+        if (usb_block_busy() || packet->wLength > ENDP0_SIZE ||
+            packet->wValue * 4 + packet->wLength > sizeof(block))
+            goto stall;
+        //wait for OUT, which goes right into the buffer
+        if (packet->wLength)
+            usb_endp0_receive(&block[packet->wValue], packet->wLength);
+        break;
+    case USB_SWD_READ_BLOCK: //reads part of the block buffer
+        if (usb_block_busy() || packet->wValue >= USB_BLOCK_WORDS)
+            goto stall;
+        data = (void*)&block[packet->wValue];
+        if (USB_BLOCK_WORDS - packet->wValue < ENDP0_SIZE / 4)
+            data_length = (USB_BLOCK_WORDS - packet->wValue) * 4;
+        else
+            data_length = ENDP0_SIZE;
+        break;
+    case USB_SWD_WRITE_PROGRAM: //writes part of the program buffer
+        if (usb_block_busy() || packet->wLength > ENDP0_SIZE ||
+            packet->wValue * 4 + packet->wLength > sizeof(program))
             goto stall;
-        data = (void*)&results[packet->wIndex];
-        data_length = sizeof(results[packet->wIndex]);
+        //wait for OUT, which goes right into the buffer
+        if (packet->wLength)
+            usb_endp0_receive(&program[packet->wValue], packet->wLength);
+        break;
+    case USB_SWD_BEGIN_PROGRAM: //begins a program request
+        //is there room in the completion ring and are the buffers free?
+        if (packet->wIndex > 0xff || packet->wValue >= USB_PROGRAM_WORDS ||
+            packet->wLength != sizeof(program_req_t) || !usb_ring_room(1) || usb_block_busy())
+            goto stall;
+        //wait for OUT
+        break;
+    case USB_SWD_READ_REGISTERS: //reads the registers of the last program
+        if (usb_block_busy())
+            goto stall;
+        data = (const void*)swd_vm_registers();
+        data_length = SWD_VM_REGISTERS * 4;
+        break;
+    case USB_SWD_CONNECT: //begins a connect request
+        //is there room in the completion ring?
+        if (packet->wIndex > 0xff || !usb_ring_room(1))
+            goto stall;
+        //there is no data stage, so this can be queued right away
+        res = usb_ring_append(packet->wIndex, 1);
+        usb_ring_begun(res, 1, swd_tune_begin_connect(res));
+        break;
+    case USB_SWD_SET_CLOCK: //sets the swd clock frequency
+        //wait for OUT
+        break;
+    case USB_SWD_GET_CLOCK: //reads the achieved swd clock frequency
+        clock_hz = swd_get_clock();
+        data = (void*)&clock_hz;
+        data_length = sizeof(clock_hz);
+        break;
+    case USB_SWD_TUNE: //begins a clock tuning request
+        //is there room in the completion ring?
+        if (packet->wIndex > 0xff || packet->wLength != sizeof(tune_req_t) || !usb_ring_room(1))
+            goto stall;
+        //wait for OUT
+        break;
+    case USB_SWD_CLEAR_STATS: //clears the bus statistics
+        swd_clear_stats();
+        break;
+    case USB_SWD_READ_STATS: //reads the bus statistics
+        swd_get_stats(&stats);
+        data = (void*)&stats;
+        data_length = sizeof(stats);
+        break;
+    case USB_SWD_SET_CONFIG: //sets the bus configuration
+        //wait for OUT
+        break;
+    case USB_SWD_GET_CONFIG: //reads the bus configuration
+        swd_get_config(&config);
+        data = (void*)&config;
+        data_length = sizeof(config);
+        break;
+    case USB_SWD_READ_COMPLETIONS: //takes records for done commands out of the completion ring
+        //only as many as the host asked for, so none are lost
+        i = packet->wLength / sizeof(completion_t);
+        if (i > ENDP0_SIZE / sizeof(completion_t))
+            i = ENDP0_SIZE / sizeof(completion_t);
+        data = (void*)completions;
+        data_length = usb_ring_take(completions, i) * sizeof(completion_t);
         break;
     default:
         goto stall;
@@ -297,11 +887,19 @@ void usb_endp0_handler(uint8_t stat)
 {
     static setup_t last_setup;
 
-    read_req_t read_req;
-    write_req_t write_req;
+    //requests are used straight from the receive buffer, which is given back afterwards
+    const read_req_t* read_req;
+    const write_req_t* write_req;
+    const clock_req_t* clock_req;
+    const tune_req_t* tune_req;
+    const mem_req_t* mem_req;
+    const program_req_t* program_req;
+    swd_result_t* res;
+    uint32_t count;
 
     //determine which bdt we are looking at here
-    bdt_t* bdt = &table[BDT_INDEX(0, (stat & USB_STAT_TX_MASK) >> USB_STAT_TX_SHIFT, (stat & USB_STAT_ODD_MASK) >> USB_STAT_ODD_SHIFT)];
+    uint8_t odd = (stat & USB_STAT_ODD_MASK) >> USB_STAT_ODD_SHIFT;
+    bdt_t* bdt = &table[BDT_INDEX(0, (stat & USB_STAT_TX_MASK) >> USB_STAT_TX_SHIFT, odd)];
 
     switch (BDT_PID(bdt->desc))
     {
@@ -309,8 +907,11 @@ void usb_endp0_handler(uint8_t stat)
         //extract the setup token
 		last_setup = *((setup_t*)(bdt->addr));
 
-		//we are now done with the buffer
+		//we are now done with the buffer. It may have been pointed elsewhere
+		//for a data stage the host gave up on.
+        bdt->addr = endp0_rx[odd];
         bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
+        endp0_rx_odd = odd ^ 1;
 
         //clear any pending IN stuff
         table[BDT_INDEX(0, TX, EVEN)].desc = 0;
@@ -335,13 +936,66 @@ void usb_endp0_handler(uint8_t stat)
         switch (last_setup.wRequestAndType)
         {
         case USB_SWD_BEGIN_READ:
-            read_req = *((read_req_t*)(bdt->addr));
-            swd_begin_read(read_req.request, &results[last_setup.wIndex]);
+            read_req = bdt->addr;
+            res = usb_ring_append(last_setup.wIndex, 1);
+            usb_ring_begun(res, 1, swd_begin_read(read_req->request, res));
+            bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
+            break;
+        case USB_SWD_BEGIN_READ_PIPELINED:
+            read_req = bdt->addr;
+            res = usb_ring_append(last_setup.wIndex, last_setup.wValue);
+            usb_ring_begun(res, last_setup.wValue, swd_begin_read_pipelined(read_req->request, last_setup.wValue, res));
             bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
             break;
         case USB_SWD_BEGIN_WRITE:
-            write_req = *((write_req_t*)(bdt->addr));
-            swd_begin_write(write_req.request, write_req.data, &results[last_setup.wIndex]);
+            write_req = bdt->addr;
+            res = usb_ring_append(last_setup.wIndex, 1);
+            usb_ring_begun(res, 1, swd_begin_write(write_req->request, write_req->data, res));
+            bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
+            break;
+        case USB_SWD_BEGIN_MEM_READ:
+        case USB_SWD_BEGIN_MEM_WRITE:
+            mem_req = bdt->addr;
+            count = mem_req->count > USB_BLOCK_WORDS ? USB_BLOCK_WORDS : mem_req->count;
+            res = usb_ring_append(last_setup.wIndex, 1);
+            block_owner = ring.head - 1;
+            if (last_setup.wRequestAndType == USB_SWD_BEGIN_MEM_READ)
+                usb_ring_begun(res, 1, swd_begin_mem_read(mem_req->addr, count, block, res));
+            else
+                usb_ring_begun(res, 1, swd_begin_mem_write(mem_req->addr, count, block, res));
+            bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
+            break;
+        case USB_SWD_WRITE_BLOCK:
+        case USB_SWD_WRITE_PROGRAM:
+            //the data is already in place, see usb_endp0_receive
+            bdt->addr = endp0_rx[odd];
+            bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
+            break;
+        case USB_SWD_BEGIN_PROGRAM:
+            program_req = bdt->addr;
+            res = usb_ring_append(last_setup.wIndex, 1);
+            block_owner = ring.head - 1;
+            count = program_req->length > USB_PROGRAM_WORDS ? USB_PROGRAM_WORDS : program_req->length;
+            usb_ring_begun(res, 1, swd_vm_begin(program, count, last_setup.wValue, program_req->args,
+                block, USB_BLOCK_WORDS, res));
+            bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
+            break;
+        case USB_SWD_SET_CLOCK:
+            clock_req = bdt->addr;
+            //the host has picked the clock itself
+            swd_tune_stop();
+            swd_set_clock(clock_req->hz);
+            bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
+            break;
+        case USB_SWD_SET_CONFIG:
+            swd_set_config(bdt->addr);
+            bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
+            break;
+        case USB_SWD_TUNE:
+            tune_req = bdt->addr;
+            res = usb_ring_append(last_setup.wIndex, 1);
+            usb_ring_begun(res, 1, swd_tune_begin(tune_req->min_hz, tune_req->max_hz, tune_req->ram_addr,
+                tune_req->flags & USB_TUNE_ON_CONNECT, res));
             bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
             break;
         default:
@@ -376,15 +1030,40 @@ static void (*handlers[16])(uint8_t) = {
     usb_endp15_handler,
 };
 
+/**
+ * Bulk OUT endpoint handler
+ */
+void usb_endp1_handler(uint8_t stat)
+{
+    bdt_t* bdt = &table[BDT_INDEX(USB_BULK_OUT_ENDPOINT, RX, (stat & USB_STAT_ODD_MASK) >> USB_STAT_ODD_SHIFT)];
+
+    usb_bulk_receive((bdt->desc >> BDT_BC_SHIFT) & 0x3ff);
+}
+
+/**
+ * Bulk IN endpoint handler
+ */
+void usb_endp2_handler(uint8_t stat)
+{
+    bulk.tx_busy[(stat & USB_STAT_ODD_MASK) >> USB_STAT_ODD_SHIFT] = 0;
+    usb_bulk_send();
+}
+
+/**
+ * Notification endpoint handler
+ */
+void usb_endp3_handler(uint8_t stat)
+{
+    notify.busy[(stat & USB_STAT_ODD_MASK) >> USB_STAT_ODD_SHIFT] = 0;
+    usb_notify_send();
+}
+
 /**
  * Default handler for USB endpoints that does nothing
  */
 static void usb_endp_default_handler(uint8_t stat) { }
 
 //weak aliases as "defaults" for the usb endpoint handlers
-void usb_endp1_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
-void usb_endp2_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
-void usb_endp3_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
 void usb_endp4_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
 void usb_endp5_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
 void usb_endp6_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
@@ -398,15 +1077,31 @@ void usb_endp13_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_ha
 void usb_endp14_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
 void usb_endp15_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
 
-void usb_init(void)
+void usb_task(void)
 {
-    uint32_t i;
-
-    //reset the command statuses
-    for (i = 0; i < N_COMMAND_RESULTS; i++)
+#ifdef USB_CMSIS_DAP
+    //the interrupt leaves a running command alone, and commands block on the
+    //swd queue, so they are processed with the usb interrupt enabled
+    if (bulk.running && !dap.done)
     {
-        results[i].done = 1;
+        dap.length = swd_dap_process((const uint8_t*)batch_rx, bulk.rx_length, dap.response);
+        dap.done = 1;
     }
+#endif
+
+    //the usb interrupt uses the same state
+    disable_irq(IRQ(INT_USB0));
+#ifndef USB_CMSIS_DAP
+    swd_batch_task();
+#endif
+    usb_bulk_send();
+    usb_notify_send();
+    enable_irq(IRQ(INT_USB0));
+}
+
+void usb_init(void)
+{
+    uint32_t i;
 
     //reset the buffer descriptors
     for (i = 0; i < (USB_N_ENDPOINTS + 1) * 4; i++)
@@ -470,6 +1165,9 @@ void USBOTG_IRQHandler(void)
         table[BDT_INDEX(0, TX, EVEN)].desc = 0;
         table[BDT_INDEX(0, TX, ODD)].desc = 0;
 
+        usb_bulk_reset();
+        usb_notify_reset();
+
         //initialize endpoint0 to 0x0d (41.5.23)
         //transmit, recieve, and handshake
         USB0_ENDPT0 = USB_ENDPT_EPRXEN_MASK | USB_ENDPT_EPTXEN_MASK | USB_ENDPT_EPHSHK_MASK;